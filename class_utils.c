@@ -0,0 +1,192 @@
+/*
+ This file implements the batch frame classifier declared in class_utils.h.
+ */
+
+#include "class_utils.h"
+#include "ether_utils.h"
+#include "mac_utils.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define CLASS_LOAD_LEN 16            ///< Bytes the vector paths load from each frame
+#define CLASS_HASH_LO 0x7f4a7c15U    ///< The two halves of the multiplier of mac_hash()
+#define CLASS_HASH_HI 0x9e3779b9U
+#define ETHERTYPE_QINQ 0x88a8        ///< 802.1ad service tag
+
+/*
+ Fills in the EtherType and tag of a frame of 'len' bytes.
+ */
+static inline void class_tag(const uint8_t *frame, uint32_t len, struct frame_class_t *out)
+{
+  uint16_t type = ((uint16_t)frame[12] << 8) | frame[13];
+  out->tci = 0;
+  if ((type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) && len >= ETHER_HDR_LEN + 4)
+  {
+    out->tci = ((uint16_t)frame[14] << 8) | frame[15];
+    type = ((uint16_t)frame[16] << 8) | frame[17];
+  }
+  out->ethertype = type;
+}
+
+static inline uint8_t class_action(uint64_t dst, bool broadcast)
+{
+  return (uint8_t)(((dst >> 40) & 1) + broadcast);
+}
+
+static void class_scalar(const uint8_t *frame, uint32_t len, struct frame_class_t *out)
+{
+  if (len < ETHER_HDR_LEN)
+  {
+    memset(out, 0, sizeof(*out));
+    out->action = FRAME_ACTION_SHORT;
+    return;
+  }
+  out->dst = mac_to_u64(frame);
+  out->src = mac_to_u64(frame + ETH_ALEN);
+  out->dst_hash = mac_hash(out->dst);
+  out->src_hash = mac_hash(out->src);
+  out->action = class_action(out->dst, mac_is_broadcast(out->dst));
+  class_tag(frame, len, out);
+}
+
+#if defined(__x86_64__)
+
+/*
+ Returns the mac_hash() of each 64-bit lane of 'x' in the low half of the
+ lane: bits 32 to 63 of x * C, from the three partial products that reach
+ them (the fourth only affects bits 64 and up).
+ */
+__attribute__((target("avx2"))) static inline __m256i class_hash4(__m256i x)
+{
+  const __m256i lo = _mm256_set1_epi64x(CLASS_HASH_LO);
+  const __m256i hi = _mm256_set1_epi64x(CLASS_HASH_HI);
+  __m256i ll = _mm256_mul_epu32(x, lo);
+  __m256i hl = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), lo);
+  __m256i lh = _mm256_mul_epu32(x, hi);
+  return _mm256_add_epi64(_mm256_srli_epi64(ll, 32), _mm256_add_epi64(hl, lh));
+}
+
+/*
+ Loads the headers of two frames, one per 128-bit lane, and turns each into
+ its destination and source MAC as packed 64-bit words.
+ */
+__attribute__((target("avx2"))) static inline __m256i class_load2(const uint8_t *a, const uint8_t *b)
+{
+  // Per lane: bytes 5..0 (destination) and 11..6 (source), most significant first, zero-extended
+  const __m256i order = _mm256_setr_epi8(5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1,
+                                         5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1);
+  __m256i headers = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)a)),
+                                            _mm_loadu_si128((const __m128i *)b), 1);
+  return _mm256_shuffle_epi8(headers, order);
+}
+
+/*
+ Classifies four frames per step for as long as at least four remain.
+ Returns the number of frames classified.
+ */
+__attribute__((target("avx2"))) static unsigned int class_avx2(const uint8_t *const *frames, const uint32_t *lens,
+                                                              unsigned int count, struct frame_class_t *out)
+{
+  const __m256i broadcast = _mm256_set1_epi64x(MAC_BROADCAST);
+  unsigned int i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    if (lens[i] < CLASS_LOAD_LEN || lens[i + 1] < CLASS_LOAD_LEN || lens[i + 2] < CLASS_LOAD_LEN ||
+        lens[i + 3] < CLASS_LOAD_LEN)
+    {
+      for (unsigned int j = i; j < i + 4; j++)
+      {
+        class_scalar(frames[j], lens[j], &out[j]);  // Too short to load 16 bytes from safely
+      }
+      continue;
+    }
+
+    // Lanes: destination and source of frame i, then of i + 1; likewise for i + 2 and i + 3
+    __m256i macs01 = class_load2(frames[i], frames[i + 1]);
+    __m256i macs23 = class_load2(frames[i + 2], frames[i + 3]);
+    uint64_t macs[8], hashes[8], broadcasts[8];
+    _mm256_storeu_si256((__m256i *)&macs[0], macs01);
+    _mm256_storeu_si256((__m256i *)&macs[4], macs23);
+    _mm256_storeu_si256((__m256i *)&hashes[0], class_hash4(macs01));
+    _mm256_storeu_si256((__m256i *)&hashes[4], class_hash4(macs23));
+    _mm256_storeu_si256((__m256i *)&broadcasts[0], _mm256_cmpeq_epi64(macs01, broadcast));
+    _mm256_storeu_si256((__m256i *)&broadcasts[4], _mm256_cmpeq_epi64(macs23, broadcast));
+
+    for (unsigned int j = 0; j < 4; j++)
+    {
+      struct frame_class_t *class = &out[i + j];
+      class->dst = macs[2 * j];
+      class->src = macs[2 * j + 1];
+      class->dst_hash = (uint32_t)hashes[2 * j];
+      class->src_hash = (uint32_t)hashes[2 * j + 1];
+      class->action = class_action(class->dst, broadcasts[2 * j] & 1);
+      class_tag(frames[i + j], lens[i + j], class);
+    }
+  }
+  return i;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+/*
+ Classifies one frame per step, both of its MACs in one register. Returns
+ the number of frames classified.
+ */
+static unsigned int class_neon(const uint8_t *const *frames, const uint32_t *lens, unsigned int count,
+                               struct frame_class_t *out)
+{
+  // Bytes 5..0 (destination) and 11..6 (source), most significant first; out-of-range indices give 0
+  const uint8x16_t order = {5, 4, 3, 2, 1, 0, 255, 255, 11, 10, 9, 8, 7, 6, 255, 255};
+  const uint32x2_t lo = vdup_n_u32(CLASS_HASH_LO);
+  const uint32x2_t hi = vdup_n_u32(CLASS_HASH_HI);
+  const uint64x2_t broadcast = vdupq_n_u64(MAC_BROADCAST);
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (lens[i] < CLASS_LOAD_LEN)
+    {
+      class_scalar(frames[i], lens[i], &out[i]);
+      continue;
+    }
+    uint64x2_t macs = vreinterpretq_u64_u8(vqtbl1q_u8(vld1q_u8(frames[i]), order));
+
+    // Bits 32 to 63 of mac * C, as in class_hash4()
+    uint32x2_t low = vmovn_u64(macs);
+    uint32x2_t high = vshrn_n_u64(macs, 32);
+    uint64x2_t hashes = vaddq_u64(vshrq_n_u64(vmull_u32(low, lo), 32),
+                                  vaddq_u64(vmull_u32(high, lo), vmull_u32(low, hi)));
+    uint64x2_t broadcasts = vceqq_u64(macs, broadcast);
+
+    struct frame_class_t *class = &out[i];
+    class->dst = vgetq_lane_u64(macs, 0);
+    class->src = vgetq_lane_u64(macs, 1);
+    class->dst_hash = (uint32_t)vgetq_lane_u64(hashes, 0);
+    class->src_hash = (uint32_t)vgetq_lane_u64(hashes, 1);
+    class->action = class_action(class->dst, vgetq_lane_u64(broadcasts, 0) & 1);
+    class_tag(frames[i], lens[i], class);
+  }
+  return count;
+}
+
+#endif
+
+void frame_classify(const uint8_t *const *frames, const uint32_t *lens, unsigned int count,
+                    struct frame_class_t *out)
+{
+  unsigned int done = 0;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+  {
+    done = class_avx2(frames, lens, count, out);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  done = class_neon(frames, lens, count, out);
+#endif
+  for (unsigned int i = done; i < count; i++)
+  {
+    class_scalar(frames[i], lens[i], &out[i]);
+  }
+}
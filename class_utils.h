@@ -0,0 +1,52 @@
+/*
+ This header declares the batch frame classifier: one pass over the Ethernet
+ headers of a whole batch that extracts what switching needs from each
+ frame (both MACs, packed as by mac_to_u64(), their mac_hash() values, the
+ EtherType and any VLAN tag) and sums it up in an action code. The switch
+ then runs its table lookups as a tight loop over plain records, with the
+ table slots of the whole batch prefetched ahead.
+
+ On x86-64 CPUs with AVX2, detected at run time since the build targets the
+ baseline instruction set, four headers are handled per step: a byte
+ shuffle turns two headers per 256-bit register into four byte-swapped
+ MACs, which are hashed with three 32-bit multiplies per lane and compared
+ with the broadcast address at once. On AArch64, NEON does the same for the
+ two MACs of one header per register. Everywhere else, and for the frames
+ left over at the end of a batch, a scalar loop computes the same results.
+ */
+
+#ifndef _CLASS_UTILS_H
+#define _CLASS_UTILS_H
+
+#include <stdint.h>
+
+/*
+ The action a frame's destination calls for. The values are chosen so that
+ action = I/G bit + (destination == broadcast).
+ */
+enum frame_action_t
+{
+  FRAME_ACTION_UNICAST,     ///< Look the destination up
+  FRAME_ACTION_MULTICAST,   ///< A group address other than broadcast
+  FRAME_ACTION_BROADCAST,
+  FRAME_ACTION_SHORT,       ///< Shorter than an Ethernet header; no other field is set
+};
+
+struct frame_class_t
+{
+  uint64_t dst;         ///< Destination MAC, packed as by mac_to_u64()
+  uint64_t src;         ///< Source MAC
+  uint32_t dst_hash;    ///< mac_hash() of dst
+  uint32_t src_hash;    ///< mac_hash() of src
+  uint16_t ethertype;   ///< EtherType, that of the payload if the frame carries an 802.1Q or 802.1ad tag
+  uint16_t tci;         ///< Tag control information (priority and VLAN ID) of that tag, 0 if untagged
+  uint8_t action;       ///< enum frame_action_t
+};
+
+/*
+ Classifies the 'count' frames 'frames[i]' of 'lens[i]' bytes into 'out[i]'.
+ */
+void frame_classify(const uint8_t *const *frames, const uint32_t *lens, unsigned int count,
+                    struct frame_class_t *out);
+
+#endif
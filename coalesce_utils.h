@@ -0,0 +1,108 @@
+/*
+ This header declares frame coalescing (vport -C): several small datagrams
+ travel in one UDP datagram as length-prefixed records,
+
+   | magic (2) | length (2, big-endian) | datagram ... | length (2) | datagram ... | ...
+
+ where each datagram is exactly what would otherwise have been sent on its
+ own (port tag, offload header and all). A bundle never exceeds
+ COALESCE_MAX_PAYLOAD, the UDP payload of a full-sized packet on a standard
+ Ethernet path, so coalescing never causes fragmentation. In encrypted mode
+ the bundle is sealed as a whole. As with the other magics, ff:54 would
+ otherwise start a frame for a group address no station uses.
+ */
+
+#ifndef _COALESCE_UTILS_H
+#define _COALESCE_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define COALESCE_MAGIC0 0xff
+#define COALESCE_MAGIC1 0x54
+#define COALESCE_HDR_LEN 2          ///< Bundle magic
+#define COALESCE_REC_HDR_LEN 2      ///< Record length
+#define COALESCE_MAX_PAYLOAD 1472   ///< 1500-byte IPv4 MTU minus IP and UDP headers
+
+static inline bool coalesce_is_bundle(const char *data, size_t len)
+{
+  return len >= COALESCE_HDR_LEN && (uint8_t)data[0] == COALESCE_MAGIC0 && (uint8_t)data[1] == COALESCE_MAGIC1;
+}
+
+/*
+ Returns true if a datagram of 'len' bytes can be added to a bundle using
+ 'used' of 'limit' bytes.
+ */
+static inline bool coalesce_fits(size_t used, size_t len, size_t limit)
+{
+  return used + COALESCE_REC_HDR_LEN + len <= limit;
+}
+
+/*
+ Starts an empty bundle at 'bundle' and returns its size.
+ */
+static inline size_t coalesce_start(char *bundle)
+{
+  bundle[0] = (char)COALESCE_MAGIC0;
+  bundle[1] = (char)COALESCE_MAGIC1;
+  return COALESCE_HDR_LEN;
+}
+
+/*
+ Appends the data described by 'iov' as one record to a bundle of 'used'
+ bytes and returns its new size.
+ */
+static inline size_t coalesce_append(char *bundle, size_t used, const struct iovec *iov, int iovcnt)
+{
+  char *data = bundle + used + COALESCE_REC_HDR_LEN;
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++)
+  {
+    memcpy(data + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  bundle[used] = (char)(len >> 8);
+  bundle[used + 1] = (char)(len & 0xff);
+  return used + COALESCE_REC_HDR_LEN + len;
+}
+
+/*
+ Turns the 'len' bytes at 'bundle' into a bundle holding them as its only
+ record, moving them up by COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN bytes.
+ Returns the size of the bundle.
+ */
+static inline size_t coalesce_wrap(char *bundle, size_t len)
+{
+  memmove(bundle + COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN, bundle, len);
+  coalesce_start(bundle);
+  bundle[COALESCE_HDR_LEN] = (char)(len >> 8);
+  bundle[COALESCE_HDR_LEN + 1] = (char)(len & 0xff);
+  return COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN + len;
+}
+
+/*
+ Steps through the records of a bundle of 'len' bytes: '*offset' starts at 0
+ and is advanced past each record returned. Returns NULL at the end of the
+ bundle or at a record that overruns it.
+ */
+static inline char *coalesce_next(char *bundle, size_t len, size_t *offset, int *recordsz)
+{
+  size_t pos = *offset ? *offset : COALESCE_HDR_LEN;
+  if (pos + COALESCE_REC_HDR_LEN > len)
+  {
+    return NULL;
+  }
+  size_t size = ((size_t)(uint8_t)bundle[pos] << 8) | (uint8_t)bundle[pos + 1];
+  if (size == 0 || pos + COALESCE_REC_HDR_LEN + size > len)
+  {
+    return NULL;
+  }
+  *offset = pos + COALESCE_REC_HDR_LEN + size;
+  *recordsz = (int)size;
+  return bundle + pos + COALESCE_REC_HDR_LEN;
+}
+
+#endif
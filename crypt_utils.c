@@ -0,0 +1,356 @@
+/*
+ This file implements the tunnel encryption declared in crypt_utils.h.
+ */
+
+#include "crypt_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+#include <ctype.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/random.h>
+#include <openssl/kdf.h>
+
+#define CRYPT_NONCE_LEN 12
+#define CRYPT_HKDF_SALT "vport tunnel v1"
+
+static const EVP_CIPHER *crypt_evp_cipher(uint8_t cipher)
+{
+  switch (cipher)
+  {
+  case CRYPT_AES_256_GCM:
+    return EVP_aes_256_gcm();
+  case CRYPT_CHACHA20_POLY1305:
+    return EVP_chacha20_poly1305();
+  default:
+    return NULL;
+  }
+}
+
+/*
+ AES-GCM is only fast with AES-NI and PCLMULQDQ; without them ChaCha20-Poly1305
+ (vectorized with SSSE3/AVX2) is several times quicker.
+ */
+static uint8_t crypt_default_cipher(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul"))
+  {
+    return CRYPT_AES_256_GCM;
+  }
+#endif
+  return CRYPT_CHACHA20_POLY1305;
+}
+
+/*
+ Derives the key of a session: HKDF-SHA256 of the pre-shared key, with the
+ cipher and session ID as context so that no two sessions share a key.
+ */
+static void crypt_derive(const struct crypt_key_t *key, uint8_t cipher, const uint8_t *session, uint8_t *out)
+{
+  uint8_t info[1 + CRYPT_SESSION_LEN];
+  info[0] = cipher;
+  memcpy(info + 1, session, CRYPT_SESSION_LEN);
+
+  size_t outlen = CRYPT_KEY_LEN;
+  EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+  if (pctx == NULL || EVP_PKEY_derive_init(pctx) <= 0 || EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0 ||
+      EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *)CRYPT_HKDF_SALT, sizeof(CRYPT_HKDF_SALT) - 1) <= 0 ||
+      EVP_PKEY_CTX_set1_hkdf_key(pctx, key->psk, CRYPT_KEY_LEN) <= 0 ||
+      EVP_PKEY_CTX_add1_hkdf_info(pctx, info, sizeof(info)) <= 0 || EVP_PKEY_derive(pctx, out, &outlen) <= 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to derive session key\n");
+  }
+  EVP_PKEY_CTX_free(pctx);
+}
+
+static EVP_CIPHER_CTX *crypt_ctx_new(void)
+{
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (ctx == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate cipher context\n");
+  }
+  return ctx;
+}
+
+static inline void crypt_nonce(uint8_t *nonce, uint64_t counter_be)
+{
+  memset(nonce, 0, CRYPT_NONCE_LEN - sizeof(counter_be));
+  memcpy(nonce + CRYPT_NONCE_LEN - sizeof(counter_be), &counter_be, sizeof(counter_be));
+}
+
+static int crypt_hex_digit(int c)
+{
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+void crypt_key_load(struct crypt_key_t *key, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to open %s: %s\n", path, strerror(errno));
+  }
+  char hex[2 * CRYPT_KEY_LEN + 1];
+  unsigned int ndigits = 0;
+  int c;
+  while ((c = fgetc(file)) != EOF && ndigits < sizeof(hex))
+  {
+    if (isxdigit(c))
+    {
+      hex[ndigits++] = c;
+    }
+    else if (!isspace(c))
+    {
+      break;
+    }
+  }
+  fclose(file);
+  if (ndigits != 2 * CRYPT_KEY_LEN || (c != EOF && !isspace(c)))
+  {
+    ERROR_PRINT_THEN_EXIT("%s: expected a %d-byte key as %d hex digits\n", path, CRYPT_KEY_LEN, 2 * CRYPT_KEY_LEN);
+  }
+  for (unsigned int i = 0; i < CRYPT_KEY_LEN; i++)
+  {
+    key->psk[i] = crypt_hex_digit(hex[2 * i]) << 4 | crypt_hex_digit(hex[2 * i + 1]);
+  }
+}
+
+void crypt_tx_init(struct crypt_tx_t *tx, const struct crypt_key_t *key)
+{
+  if (getrandom(tx->session, CRYPT_SESSION_LEN, 0) != CRYPT_SESSION_LEN)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to getrandom: %s\n", strerror(errno));
+  }
+  tx->cipher = crypt_default_cipher();
+  tx->counter = 0;
+
+  uint8_t session_key[CRYPT_KEY_LEN];
+  crypt_derive(key, tx->cipher, tx->session, session_key);
+  tx->ctx = crypt_ctx_new();
+  if (EVP_EncryptInit_ex(tx->ctx, crypt_evp_cipher(tx->cipher), NULL, session_key, NULL) != 1)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to set up %s\n", crypt_cipher_name(tx->cipher));
+  }
+  memset(session_key, 0, sizeof(session_key));
+}
+
+void crypt_rx_init(struct crypt_rx_t *rx, const struct crypt_key_t *key, uint32_t nsessions)
+{
+  rx->key = key;
+  rx->mask = nsessions / CRYPT_WAYS - 1;
+  rx->sessions = calloc(nsessions, sizeof(*rx->sessions));
+  rx->marks = calloc(nsessions * CRYPT_MARKS, sizeof(*rx->marks));
+  if (rx->sessions == NULL || rx->marks == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  rx->tick = 0;
+  rx->scratch = crypt_ctx_new();
+  memset(rx->buckets, 0, sizeof(rx->buckets));  // A zero stamp fills every bucket on first use
+}
+
+size_t crypt_seal(struct crypt_tx_t *tx, char *out, const struct iovec *iov, int iovcnt)
+{
+  struct crypt_hdr_t *hdr = (struct crypt_hdr_t *)out;
+  uint8_t *ciphertext = (uint8_t *)out + CRYPT_HDR_LEN;
+  uint8_t nonce[CRYPT_NONCE_LEN];
+  int n;
+
+  uint64_t counter_be = htobe64(tx->counter++);
+  crypt_nonce(nonce, counter_be);
+  struct crypt_hdr_t header = {.magic = {CRYPT_MAGIC0, CRYPT_MAGIC1}, .cipher = tx->cipher, .counter = counter_be};
+  memcpy(header.session, tx->session, CRYPT_SESSION_LEN);
+
+  EVP_EncryptInit_ex(tx->ctx, NULL, NULL, NULL, nonce);
+  EVP_EncryptUpdate(tx->ctx, NULL, &n, (const uint8_t *)&header, CRYPT_HDR_LEN);  // Authenticated, not encrypted
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++)
+  {
+    EVP_EncryptUpdate(tx->ctx, ciphertext + len, &n, iov[i].iov_base, iov[i].iov_len);
+    len += n;
+  }
+  EVP_EncryptFinal_ex(tx->ctx, ciphertext + len, &n);
+  len += n;
+  EVP_CIPHER_CTX_ctrl(tx->ctx, EVP_CTRL_AEAD_GET_TAG, CRYPT_TAG_LEN, ciphertext + len);
+  memcpy(hdr, &header, CRYPT_HDR_LEN);
+  return CRYPT_HDR_LEN + len + CRYPT_TAG_LEN;
+}
+
+/*
+ Returns true if 'counter' is newer than anything in the session's window,
+ or inside it and not seen yet.
+ */
+static inline bool crypt_replay_ok(const struct crypt_session_t *s, uint64_t counter)
+{
+  return counter > s->top || (s->top - counter < CRYPT_REPLAY_WINDOW && !(s->window & (1ULL << (s->top - counter))));
+}
+
+static inline void crypt_replay_mark(struct crypt_session_t *s, uint64_t counter)
+{
+  if (counter > s->top)
+  {
+    uint64_t shift = counter - s->top;
+    s->window = shift >= CRYPT_REPLAY_WINDOW ? 1 : (s->window << shift) | 1;
+    s->top = counter;
+  }
+  else
+  {
+    s->window |= 1ULL << (s->top - counter);
+  }
+}
+
+static bool crypt_decrypt(EVP_CIPHER_CTX *ctx, char *datagram, size_t len)
+{
+  const struct crypt_hdr_t *hdr = (const struct crypt_hdr_t *)datagram;
+  uint8_t *ciphertext = (uint8_t *)datagram + CRYPT_HDR_LEN;
+  size_t textlen = len - CRYPT_OVERHEAD;
+  uint8_t nonce[CRYPT_NONCE_LEN];
+  int n;
+
+  crypt_nonce(nonce, hdr->counter);
+  return EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1 &&
+         EVP_DecryptUpdate(ctx, NULL, &n, (const uint8_t *)hdr, CRYPT_HDR_LEN) == 1 &&
+         EVP_DecryptUpdate(ctx, ciphertext, &n, ciphertext, textlen) == 1 &&
+         EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CRYPT_TAG_LEN, ciphertext + textlen) == 1 &&
+         EVP_DecryptFinal_ex(ctx, ciphertext + n, &n) == 1;
+}
+
+/*
+ Takes a token from the bucket of 'source' for trying an unknown session.
+ Returns false if it has none left.
+ */
+static bool crypt_throttle_ok(struct crypt_rx_t *rx, uint32_t source)
+{
+  struct crypt_bucket_t *bucket = &rx->buckets[(source * 0x9e3779b1U) >> 24];
+  _Static_assert(CRYPT_SOURCES == 256, "the bucket index takes the top 8 bits of the hash");
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  uint64_t earned = (now - bucket->stamp) * CRYPT_NEW_RATE / 1000;
+  if (earned > 0)
+  {
+    bucket->tokens = earned >= CRYPT_NEW_BURST - bucket->tokens ? CRYPT_NEW_BURST : bucket->tokens + earned;
+    bucket->stamp = now;
+  }
+  if (bucket->tokens == 0)
+  {
+    return false;
+  }
+  bucket->tokens--;
+  return true;
+}
+
+static inline bool crypt_same(uint8_t cipher, const uint8_t *session, const struct crypt_hdr_t *hdr)
+{
+  return cipher == hdr->cipher && memcmp(session, hdr->session, CRYPT_SESSION_LEN) == 0;
+}
+
+/*
+ Leaves the mark of the session 's', about to be pushed out, in its set of
+ 'marks', in place of the oldest mark there.
+ */
+static void crypt_mark(struct crypt_rx_t *rx, struct crypt_mark_t *marks, const struct crypt_session_t *s)
+{
+  struct crypt_mark_t *mark = &marks[0];
+  for (unsigned int i = 0; i < CRYPT_WAYS * CRYPT_MARKS && mark->used; i++)
+  {
+    if (!marks[i].used || marks[i].made_at < mark->made_at)
+    {
+      mark = &marks[i];
+    }
+  }
+  mark->used = true;
+  mark->cipher = s->cipher;
+  memcpy(mark->session, s->session, CRYPT_SESSION_LEN);
+  mark->top = s->top;
+  mark->made_at = rx->tick;
+}
+
+int crypt_open(struct crypt_rx_t *rx, char *datagram, size_t len, uint32_t source)
+{
+  const struct crypt_hdr_t *hdr = (const struct crypt_hdr_t *)datagram;
+  const EVP_CIPHER *cipher = len >= CRYPT_OVERHEAD ? crypt_evp_cipher(hdr->cipher) : NULL;
+  if (cipher == NULL)
+  {
+    return -1;
+  }
+
+  uint64_t id;
+  memcpy(&id, hdr->session, sizeof(id));
+  uint32_t set = (uint32_t)((id * 0x9e3779b97f4a7c15ULL) >> 32) & rx->mask;
+  struct crypt_session_t *sessions = &rx->sessions[set * CRYPT_WAYS];
+  uint64_t counter = be64toh(hdr->counter);
+
+  // The least recently used session of the set is the one a new session pushes out
+  struct crypt_session_t *victim = &sessions[0];
+  for (unsigned int i = 0; i < CRYPT_WAYS; i++)
+  {
+    struct crypt_session_t *s = &sessions[i];
+    if (s->used && crypt_same(s->cipher, s->session, hdr))
+    {
+      if (!crypt_replay_ok(s, counter) || !crypt_decrypt(s->ctx, datagram, len))
+      {
+        return -1;
+      }
+      crypt_replay_mark(s, counter);
+      s->used_at = ++rx->tick;
+      return len - CRYPT_OVERHEAD;
+    }
+    if (victim->used && (!s->used || s->used_at < victim->used_at))
+    {
+      victim = s;
+    }
+  }
+
+  // A session that was pushed out comes back only with a counter past its mark
+  struct crypt_mark_t *marks = &rx->marks[set * CRYPT_WAYS * CRYPT_MARKS];
+  struct crypt_mark_t *mark = NULL;
+  for (unsigned int i = 0; i < CRYPT_WAYS * CRYPT_MARKS && mark == NULL; i++)
+  {
+    if (marks[i].used && crypt_same(marks[i].cipher, marks[i].session, hdr))
+    {
+      mark = &marks[i];
+    }
+  }
+  if ((mark != NULL && counter <= mark->top) || !crypt_throttle_ok(rx, source))
+  {
+    return -1;
+  }
+
+  // New session: only a datagram that authenticates under its key may take a slot
+  uint8_t session_key[CRYPT_KEY_LEN];
+  crypt_derive(rx->key, hdr->cipher, hdr->session, session_key);
+  bool ok = EVP_DecryptInit_ex(rx->scratch, cipher, NULL, session_key, NULL) == 1 &&
+            crypt_decrypt(rx->scratch, datagram, len);
+  memset(session_key, 0, sizeof(session_key));
+  if (!ok)
+  {
+    return -1;
+  }
+
+  uint64_t window = 1;
+  if (mark != NULL)
+  {
+    // Everything up to the mark counts as seen
+    uint64_t shift = counter - mark->top;
+    window = shift >= CRYPT_REPLAY_WINDOW ? 1 : (~0ULL << shift) | 1;
+    mark->used = false;
+  }
+  if (victim->used)
+  {
+    crypt_mark(rx, marks, victim);
+  }
+  EVP_CIPHER_CTX *evicted = victim->ctx;
+  victim->ctx = rx->scratch;
+  rx->scratch = evicted != NULL ? evicted : crypt_ctx_new();
+  victim->used = true;
+  victim->cipher = hdr->cipher;
+  memcpy(victim->session, hdr->session, CRYPT_SESSION_LEN);
+  victim->top = counter;
+  victim->window = window;
+  victim->used_at = ++rx->tick;
+  return len - CRYPT_OVERHEAD;
+}
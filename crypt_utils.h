@@ -0,0 +1,173 @@
+/*
+ This header declares the encrypted tunnel mode (-k). With a pre-shared key,
+ every datagram between VPorts and the VSwitch is sealed with an AEAD cipher
+ and wrapped as a whole, port tag and offload header included:
+
+   | magic (2) | cipher | flags | session (8) | counter (8) | ciphertext ... | tag (16) |
+
+ The first 20 bytes are authenticated along with the payload. Each sending
+ thread picks a random session ID at startup, and its key is derived from the
+ pre-shared key and that ID with HKDF-SHA256, so every sender (VPort queue,
+ daemon port, VSwitch worker) encrypts under a key of its own and only has to
+ count up its 64-bit counter to keep nonces unique. Receivers derive the key
+ of a session the first time a datagram from it authenticates, keep the
+ cipher contexts of recent sessions, and reject datagrams whose counter was
+ already seen or lies more than CRYPT_REPLAY_WINDOW behind the newest one.
+ A session pushed out of the cache leaves its newest counter behind, and
+ comes back only with a newer one, so its old datagrams cannot be replayed
+ by pushing it out on purpose. Deriving a key costs far more than checking
+ a tag, so each source may try only a few unknown sessions per second.
+
+ AES-256-GCM is used where the CPU has AES-NI and carry-less multiply,
+ ChaCha20-Poly1305 elsewhere; receivers accept either. Both come from OpenSSL,
+ which picks its AES-NI/VAES or AVX2 code paths at run time. Like the other
+ magics, ff:53 would otherwise start a frame for a group address no station
+ uses.
+ */
+
+#ifndef _CRYPT_UTILS_H
+#define _CRYPT_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
+
+#define CRYPT_MAGIC0 0xff
+#define CRYPT_MAGIC1 0x53
+#define CRYPT_AES_256_GCM 1
+#define CRYPT_CHACHA20_POLY1305 2
+#define CRYPT_KEY_LEN 32
+#define CRYPT_SESSION_LEN 8
+#define CRYPT_TAG_LEN 16
+#define CRYPT_REPLAY_WINDOW 64     ///< Counters tracked behind the newest one of a session
+#define CRYPT_DEFAULT_SESSIONS 64  ///< Receive sessions cached by a VPort thread, a power of two
+#define CRYPT_WAYS 4               ///< Sessions per set of the receive cache
+#define CRYPT_MARKS 4              ///< High-water marks of pushed-out sessions kept per cached session
+#define CRYPT_SOURCES 256          ///< Buckets the sources of unknown sessions are hashed to
+#define CRYPT_NEW_BURST 32         ///< Unknown sessions one source may try back to back
+#define CRYPT_NEW_RATE 128         ///< Unknown sessions one source may try per second beyond the burst
+
+struct crypt_hdr_t
+{
+  uint8_t magic[2];                    ///< CRYPT_MAGIC0, CRYPT_MAGIC1
+  uint8_t cipher;                      ///< CRYPT_AES_256_GCM or CRYPT_CHACHA20_POLY1305
+  uint8_t flags;                       ///< Reserved, 0
+  uint8_t session[CRYPT_SESSION_LEN];  ///< Random ID of the sender's session
+  uint64_t counter;                    ///< Per-session datagram counter (the nonce), big-endian
+} __attribute__((packed));
+
+#define CRYPT_HDR_LEN sizeof(struct crypt_hdr_t)
+#define CRYPT_OVERHEAD (CRYPT_HDR_LEN + CRYPT_TAG_LEN)
+_Static_assert(CRYPT_HDR_LEN == 20, "crypt_hdr_t must have no padding");
+
+struct crypt_key_t
+{
+  uint8_t psk[CRYPT_KEY_LEN];  ///< Pre-shared key, the same on every end of the tunnel
+};
+
+/*
+ Sending side of one session. Used by a single thread.
+ */
+struct crypt_tx_t
+{
+  EVP_CIPHER_CTX *ctx;                 ///< Keyed once; only the nonce changes per datagram
+  uint8_t cipher;
+  uint8_t session[CRYPT_SESSION_LEN];
+  uint64_t counter;                    ///< Counter of the next datagram
+};
+
+struct crypt_session_t
+{
+  EVP_CIPHER_CTX *ctx;                 ///< Keyed for this session, NULL until first used
+  bool used;
+  uint8_t cipher;
+  uint8_t session[CRYPT_SESSION_LEN];
+  uint64_t top;                        ///< Highest counter accepted
+  uint64_t window;                     ///< Bit i set: counter top - i was accepted
+  uint64_t used_at;                    ///< Value of the receiver's tick when last accepted, for LRU
+};
+
+/*
+ What is left of a session pushed out of the cache: the newest counter it
+ got, below which it is never taken back.
+ */
+struct crypt_mark_t
+{
+  bool used;
+  uint8_t cipher;
+  uint8_t session[CRYPT_SESSION_LEN];
+  uint64_t top;
+  uint64_t made_at;                    ///< Receiver's tick when pushed out; the oldest mark of a set goes first
+};
+
+struct crypt_bucket_t
+{
+  uint64_t stamp;                      ///< Milliseconds, when tokens were last added
+  uint32_t tokens;
+};
+
+/*
+ Receiving side: the sessions one thread has seen, CRYPT_WAYS-way
+ set-associative by session ID with the least recently used session of a
+ set pushed out first, and the marks of the sessions pushed out, arranged
+ the same way. A session whose mark was pushed out too authenticates again
+ from scratch.
+ */
+struct crypt_rx_t
+{
+  const struct crypt_key_t *key;
+  struct crypt_session_t *sessions;    ///< (mask + 1) * CRYPT_WAYS entries
+  struct crypt_mark_t *marks;          ///< (mask + 1) * CRYPT_WAYS * CRYPT_MARKS entries
+  uint32_t mask;                       ///< Sets of the cache, minus one
+  uint64_t tick;                       ///< Counts accepted datagrams
+  EVP_CIPHER_CTX *scratch;             ///< Tries the key of an unknown session before it is cached
+  struct crypt_bucket_t buckets[CRYPT_SOURCES];  ///< Token buckets for unknown sessions, per source
+};
+
+/*
+ Reads a 32-byte key written as 64 hex digits (e.g. by "openssl rand -hex 32")
+ from 'path'. Exits on failure.
+ */
+void crypt_key_load(struct crypt_key_t *key, const char *path);
+
+/*
+ Starts a sending session with a fresh random ID.
+ */
+void crypt_tx_init(struct crypt_tx_t *tx, const struct crypt_key_t *key);
+
+/*
+ Sets up a receiving side caching 'nsessions' (a power of two, at least
+ CRYPT_WAYS) sessions.
+ */
+void crypt_rx_init(struct crypt_rx_t *rx, const struct crypt_key_t *key, uint32_t nsessions);
+
+static inline bool crypt_is_sealed(const char *data, size_t len)
+{
+  return len >= CRYPT_OVERHEAD && (uint8_t)data[0] == CRYPT_MAGIC0 && (uint8_t)data[1] == CRYPT_MAGIC1;
+}
+
+static inline const char *crypt_cipher_name(uint8_t cipher)
+{
+  return cipher == CRYPT_AES_256_GCM ? "aes-256-gcm" : "chacha20-poly1305";
+}
+
+/*
+ Seals the data described by 'iov' into 'out', which must have room for the
+ data plus CRYPT_OVERHEAD, and returns the size of the sealed datagram. The
+ data may already lie at out + CRYPT_HDR_LEN (a single iovec), in which case
+ it is encrypted in place.
+ */
+size_t crypt_seal(struct crypt_tx_t *tx, char *out, const struct iovec *iov, int iovcnt);
+
+/*
+ Authenticates and decrypts a sealed datagram in place. 'source' is the IPv4
+ address the datagram came from (0 if unknown), which unknown sessions are
+ rate-limited by. Returns the size of the plaintext, which starts at
+ datagram + CRYPT_HDR_LEN, or -1 if the datagram is forged, corrupted,
+ replayed or throttled.
+ */
+int crypt_open(struct crypt_rx_t *rx, char *datagram, size_t len, uint32_t source);
+
+#endif
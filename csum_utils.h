@@ -0,0 +1,56 @@
+/*
+ This header provides the Internet (ones' complement) checksum used by IPv4,
+ TCP, UDP and ICMPv6. Sums are accumulated over big-endian 16-bit words so
+ the result is independent of host byte order.
+ */
+
+#ifndef _CSUM_UTILS_H
+#define _CSUM_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ Adds 'len' bytes at 'data' to a running 32-bit checksum accumulator.
+ An odd trailing byte is padded with zero, as RFC 1071 requires.
+ */
+static inline uint32_t csum_add(uint32_t sum, const void *data, size_t len)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t i;
+
+  for (i = 0; i + 1 < len; i += 2)
+  {
+    sum += ((uint32_t)bytes[i] << 8) | bytes[i + 1];
+  }
+  if (i < len)
+  {
+    sum += (uint32_t)bytes[i] << 8;
+  }
+  return sum;
+}
+
+/*
+ Folds an accumulator into 16 bits and returns its complement, i.e. the value
+ to store in a checksum field (in host order; convert with htons()).
+ */
+static inline uint16_t csum_fold(uint32_t sum)
+{
+  while (sum >> 16)
+  {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return (uint16_t)~sum;
+}
+
+/*
+ Stores a host-order checksum value at 'field' in network byte order.
+ */
+static inline void csum_store(void *field, uint16_t csum)
+{
+  uint8_t *bytes = (uint8_t *)field;
+  bytes[0] = csum >> 8;
+  bytes[1] = csum & 0xff;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ This header provides helpers for working with Ethernet addresses in the
+ datapath. MAC addresses are packed into the low 48 bits of a uint64_t so
+ they can be compared, hashed and stored without any string formatting.
+ */
+
+#ifndef _ETHER_UTILS_H
+#define _ETHER_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ethernet.h>   // Ethernet protocol definitions
+
+#define MAC_BROADCAST 0xffffffffffffULL  ///< ff:ff:ff:ff:ff:ff packed into 48 bits
+
+/*
+ Packs a 6-byte MAC address into a uint64_t in network (big-endian) order,
+ so that printing it with "%012llx" gives the usual textual form.
+ */
+static inline uint64_t mac_to_u64(const uint8_t *mac)
+{
+  return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24) |
+         ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+/*
+ Unpacks a 48-bit MAC address back into its 6-byte wire representation.
+ */
+static inline void mac_from_u64(uint64_t packed, uint8_t *mac)
+{
+  for (int i = 5; i >= 0; i--)
+  {
+    mac[i] = packed & 0xff;
+    packed >>= 8;
+  }
+}
+
+// The I/G bit (least significant bit of the first octet) marks group addresses
+static inline bool mac_is_multicast(uint64_t mac)
+{
+  return (mac >> 40) & 0x01;
+}
+
+static inline bool mac_is_broadcast(uint64_t mac)
+{
+  return mac == MAC_BROADCAST;
+}
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ This file implements the keepalive helpers declared in health_utils.h.
+ */
+
+#include "health_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define HEALTH_MAX_RTT 10000000000ULL  ///< Round trips longer than 10 s are taken for a clock mix-up
+
+void health_init(struct health_t *health, const struct sockaddr_in *addrs, unsigned int nswitches,
+                 unsigned int interval_ms)
+{
+  uint64_t now = health_clock();
+  for (unsigned int i = 0; i < nswitches; i++)
+  {
+    health->switches[i].addr = addrs[i];
+    atomic_init(&health->switches[i].replied, now);  // Every switch gets the dead window to answer
+    atomic_init(&health->switches[i].rtt, 0);
+    atomic_init(&health->switches[i].up, true);
+    health->switches[i].answering = 0;
+  }
+  health->nswitches = nswitches;
+  health->interval = interval_ms * 1000000ULL;
+  atomic_init(&health->active, 0);
+  atomic_init(&health->failovers, 0);
+  health->seq = 0;
+}
+
+int health_parse_switches(const char *list, int port, struct sockaddr_in *addrs, int count)
+{
+  const char *item = list;
+  while (*item != '\0')
+  {
+    size_t len = strcspn(item, ",");
+    char ip[INET_ADDRSTRLEN] = "";
+    const char *colon = memchr(item, ':', len);
+    size_t iplen = colon != NULL ? (size_t)(colon - item) : len;
+    if (count == HEALTH_MAX_SWITCHES || iplen >= sizeof(ip))
+    {
+      return -1;
+    }
+    memcpy(ip, item, iplen);
+
+    struct sockaddr_in *addr = &addrs[count];
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(colon != NULL ? atoi(colon + 1) : port);
+    if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1 || addr->sin_port == 0)
+    {
+      return -1;
+    }
+    count++;
+    item += len + (item[len] == ',');
+  }
+  return count;
+}
+
+void health_probe_set(struct health_t *health, struct health_probe_t *probe, uint64_t now)
+{
+  p2p_set_header((char *)probe, HEALTH_MSG_PROBE);
+  probe->seq = health->seq++;
+  probe->sent = now;
+}
+
+/*
+ Returns the index of the switch at 'from', or -1 if there is none.
+ */
+static int health_find(const struct health_t *health, const struct sockaddr_in *from)
+{
+  for (unsigned int i = 0; i < health->nswitches; i++)
+  {
+    const struct sockaddr_in *addr = &health->switches[i].addr;
+    if (addr->sin_addr.s_addr == from->sin_addr.s_addr && addr->sin_port == from->sin_port)
+    {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+bool health_is_switch(const struct health_t *health, const struct sockaddr_in *from)
+{
+  return health_find(health, from) >= 0;
+}
+
+bool health_reply(struct health_t *health, const struct sockaddr_in *from, const struct health_probe_t *probe,
+                  uint64_t now)
+{
+  int index = health_find(health, from);
+  if (index < 0)
+  {
+    return false;
+  }
+  struct health_switch_t *s = &health->switches[index];
+  atomic_store_explicit(&s->replied, now, memory_order_relaxed);
+
+  // Smoothed like TCP's SRTT, with a gain of 1/8
+  uint64_t sample = now - probe->sent;
+  if (probe->sent <= now && sample < HEALTH_MAX_RTT)
+  {
+    int64_t rtt = atomic_load_explicit(&s->rtt, memory_order_relaxed);
+    rtt = rtt == 0 ? (int64_t)sample : rtt + ((int64_t)sample - rtt) / 8;
+    atomic_store_explicit(&s->rtt, rtt, memory_order_relaxed);
+  }
+  return true;
+}
+
+bool health_check(struct health_t *health, uint64_t now)
+{
+  uint64_t dead = HEALTH_DEAD_PROBES * health->interval;
+  unsigned int first_up = health->nswitches;
+  for (unsigned int i = 0; i < health->nswitches; i++)
+  {
+    struct health_switch_t *s = &health->switches[i];
+    // Signed, as a down thread may have stamped the reply with a slightly later clock
+    bool answered = (int64_t)(now - atomic_load_explicit(&s->replied, memory_order_relaxed)) <= (int64_t)dead;
+    bool up = atomic_load_explicit(&s->up, memory_order_relaxed);
+    if (up && !answered)
+    {
+      up = false;
+      fprintf(stderr, "VSwitch %s:%d stopped answering keepalives\n", inet_ntoa(s->addr.sin_addr),
+              ntohs(s->addr.sin_port));
+    }
+    else if (!up && !answered)
+    {
+      s->answering = 0;
+    }
+    else if (!up && s->answering == 0)
+    {
+      s->answering = now;
+    }
+    else if (!up && now - s->answering >= HEALTH_UP_PROBES * health->interval)
+    {
+      up = true;
+      s->answering = 0;
+      fprintf(stderr, "VSwitch %s:%d answers keepalives again\n", inet_ntoa(s->addr.sin_addr),
+              ntohs(s->addr.sin_port));
+    }
+    atomic_store_explicit(&s->up, up, memory_order_relaxed);
+    if (up && first_up == health->nswitches)
+    {
+      first_up = i;
+    }
+  }
+
+  // With no switch up, traffic stays where it is: it has nowhere better to go
+  uint32_t active = atomic_load_explicit(&health->active, memory_order_relaxed);
+  if (first_up == health->nswitches || first_up == active)
+  {
+    return false;
+  }
+  const struct health_switch_t *to = &health->switches[first_up];
+  fprintf(stderr, "moving traffic to VSwitch %s:%d (RTT %.3f ms)\n", inet_ntoa(to->addr.sin_addr),
+          ntohs(to->addr.sin_port), atomic_load_explicit(&to->rtt, memory_order_relaxed) / 1e6);
+  atomic_store_explicit(&health->active, first_up, memory_order_release);
+  atomic_fetch_add_explicit(&health->failovers, 1, memory_order_relaxed);
+  return true;
+}
@@ -0,0 +1,146 @@
+/*
+ This header declares the keepalives between VPorts and the VSwitch (vport
+ -K), and the VPort's view of the switches it may send to: the one given on
+ the command line and any standbys (vport -F).
+
+ A VPort with keepalives probes every switch of its list once per interval,
+ and each switch echoes the probe straight back:
+
+   | magic (2) | HEALTH_MSG_PROBE or HEALTH_MSG_REPLY | flags | sequence (4) | timestamp (8) |
+
+ Probes and replies are control messages framed as in p2p_utils.h, so they
+ cross the tunnel with the wire header and sealed like any other datagram,
+ and like hints the replies come back without a wire header. Sequence
+ number and timestamp are the VPort's own and return unchanged: the reply
+ yields the round-trip time, and the switch keeps nothing per probe but the
+ time it last heard from the VPort.
+
+ A switch that has not answered for HEALTH_DEAD_PROBES intervals is down;
+ one that answers again is taken back once it has kept answering for
+ HEALTH_UP_PROBES intervals, so a flapping switch does not drag its VPorts
+ along. Traffic goes to the first switch of the list that is up. Every VPort
+ given the same list picks the same one, so the VPorts that fled a primary
+ meet again on it once it is back. With no switch up, a VPort stays where it
+ is.
+
+ The list never changes once the VPort runs. Replies are recorded by
+ whichever down thread receives them, only the VPort's health thread judges
+ them, and the up threads follow the switch it picks through one atomic
+ index: nothing on the data path takes a lock.
+
+ A VSwitch forgets the MACs of a VPort that probed it and then fell silent
+ (vswitch -K), so frames for them are flooded to wherever they live now
+ instead of going to an endpoint that is gone. The switch does not know the
+ VPort's interval, so the two -K flags have to agree: vswitch -K seconds
+ must span at least HEALTH_DEAD_PROBES intervals of every VPort, or the
+ switch forgets, floods and learns a healthy VPort again with every probe.
+ vport -K is capped so that it does with the default.
+ */
+
+#ifndef _HEALTH_UTILS_H
+#define _HEALTH_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "p2p_utils.h"
+
+#define HEALTH_MSG_PROBE 3              ///< P2P control message type: keepalive from a VPort
+#define HEALTH_MSG_REPLY 4              ///< P2P control message type: the probe, echoed by the VSwitch
+#define HEALTH_MAX_SWITCHES 8           ///< Switches of one VPort, the primary included
+#define HEALTH_DEFAULT_INTERVAL_MS 100  ///< Milliseconds between probes unless overridden with -K
+#define HEALTH_DEAD_PROBES 3            ///< Intervals without a reply after which a switch is down
+#define HEALTH_UP_PROBES 3              ///< Intervals a switch that is down must keep answering to be up again
+#define HEALTH_PEER_TIMEOUT 3           ///< VSwitch: seconds of silence after which a probing VPort is forgotten
+/// Upper bound accepted for vport -K: a VSwitch with the default -K hears HEALTH_DEAD_PROBES probes before it gives up
+#define HEALTH_MAX_INTERVAL_MS (HEALTH_PEER_TIMEOUT * 1000 / HEALTH_DEAD_PROBES)
+
+struct health_probe_t
+{
+  uint8_t magic[2];         ///< P2P_MAGIC0, P2P_MAGIC1
+  uint8_t type;             ///< HEALTH_MSG_PROBE or HEALTH_MSG_REPLY
+  uint8_t flags;            ///< Reserved, 0
+  uint32_t seq;             ///< Probe number, opaque to the VSwitch
+  uint64_t sent;            ///< Time the probe was sent, opaque to the VSwitch
+} __attribute__((packed));
+
+#define HEALTH_PROBE_LEN sizeof(struct health_probe_t)
+_Static_assert(HEALTH_PROBE_LEN == 16, "health_probe_t must have no padding");
+
+struct health_switch_t
+{
+  struct sockaddr_in addr;       ///< Never changes once the VPort runs
+  _Atomic uint64_t replied;      ///< Time of the last reply (or of startup, as a grace period)
+  _Atomic uint64_t rtt;          ///< Smoothed round-trip time in nanoseconds, 0 before the first reply
+  _Atomic bool up;
+  uint64_t answering;            ///< Health thread: since when a switch that is down answers, 0 if it does not
+};
+
+struct health_t
+{
+  struct health_switch_t switches[HEALTH_MAX_SWITCHES];
+  unsigned int nswitches;
+  uint64_t interval;             ///< Nanoseconds between probes
+  _Atomic uint32_t active;       ///< Index of the switch traffic goes to
+  _Atomic uint64_t failovers;    ///< Times traffic moved to another switch
+  uint32_t seq;                  ///< Health thread: number of the next probe
+};
+
+/*
+ Monotonic time in nanoseconds, the clock of every health timestamp.
+ */
+static inline uint64_t health_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool health_is_probe(const char *data, size_t len, uint8_t type)
+{
+  return len >= HEALTH_PROBE_LEN && p2p_msg_type(data) == type;
+}
+
+/*
+ Sets up the list of the 'nswitches' switches 'addrs', the first being the
+ primary, probed every 'interval_ms' milliseconds. All of them start out up,
+ so traffic flows to the primary at once.
+ */
+void health_init(struct health_t *health, const struct sockaddr_in *addrs, unsigned int nswitches,
+                 unsigned int interval_ms);
+
+/*
+ Parses a comma-separated list of IPv4 addresses, each with an optional
+ ":port" ('port' otherwise), appending the switches to 'addrs', which holds
+ 'count' of them already. Returns the new count, or -1 if the list is
+ malformed or too long.
+ */
+int health_parse_switches(const char *list, int port, struct sockaddr_in *addrs, int count);
+
+/*
+ Builds the next probe, sent at time 'now'.
+ */
+void health_probe_set(struct health_t *health, struct health_probe_t *probe, uint64_t now);
+
+/*
+ Records the reply 'probe' that arrived from 'from' at time 'now'. Returns
+ false if 'from' is not one of the switches.
+ */
+bool health_reply(struct health_t *health, const struct sockaddr_in *from, const struct health_probe_t *probe,
+                  uint64_t now);
+
+/*
+ Judges every switch at time 'now' and picks the one traffic goes to.
+ Health thread only. Returns true if that changed.
+ */
+bool health_check(struct health_t *health, uint64_t now);
+
+/*
+ Returns true if 'from' is one of the switches.
+ */
+bool health_is_switch(const struct health_t *health, const struct sockaddr_in *from);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ This file implements the trace ring registry and the background thread that
+ turns binary frame records into the familiar one-line-per-frame log output.
+ */
+
+#include "log_utils.h"
+#include "sys_utils.h"
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define TRACE_DRAIN_INTERVAL_NS 1000000   ///< Drain thread wakes up every millisecond
+
+int log_level = LOG_ERROR;
+__thread struct trace_ring_t *trace_thread_ring = NULL;
+
+static _Atomic(struct trace_ring_t *) trace_rings = NULL;  ///< Head of the ring registry
+
+struct trace_ring_t *trace_ring_create(void)
+{
+  struct trace_ring_t *ring = aligned_alloc(64, sizeof(*ring));
+  struct trace_record_t *records = calloc(TRACE_RING_SIZE, sizeof(*records));
+  if (ring == NULL || records == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate trace ring: %s\n", strerror(errno));
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->dropped, 0);
+  ring->records = records;
+
+  // Push onto the registry; rings are never removed, so a lock-free push is all we need
+  ring->next = atomic_load(&trace_rings);
+  while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring))
+  {
+  }
+
+  trace_thread_ring = ring;
+  return ring;
+}
+
+static void trace_print(const struct trace_record_t *rec)
+{
+  static const char *const prefixes[] = {
+    [TRACE_TAP_TO_VSWITCH] = "[VPort] Sent to VSwitch:",
+    [TRACE_VSWITCH_TO_TAP] = "[VPort] Forward to TAP device:",
+    [TRACE_VSWITCH_RX] = "[VSwitch]",
+  };
+  char peer[64] = "";
+  if (rec->peer_ip != 0)
+  {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->peer_ip, ip, sizeof(ip));
+    snprintf(peer, sizeof(peer), " vport_addr<%s:%d>", ip, ntohs(rec->peer_port));
+  }
+
+  printf("%llu.%06llu %s%s"
+         " dhost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Destination MAC
+         " shost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Source MAC
+         " type<%04x>"                                 // EtherType
+         " datasz=<%u> queue=<%u>\n",
+         (unsigned long long)(rec->ts_ns / 1000000000ULL), (unsigned long long)(rec->ts_ns % 1000000000ULL) / 1000,
+         prefixes[rec->dir], peer,
+         rec->dst[0], rec->dst[1], rec->dst[2], rec->dst[3], rec->dst[4], rec->dst[5],
+         rec->src[0], rec->src[1], rec->src[2], rec->src[3], rec->src[4], rec->src[5],
+         ntohs(rec->ether_type), rec->size, rec->queue);
+}
+
+static void *trace_drain(void *arg)
+{
+  (void)arg;
+  struct timespec interval = {.tv_sec = 0, .tv_nsec = TRACE_DRAIN_INTERVAL_NS};
+
+  while (true)
+  {
+    bool idle = true;
+    for (struct trace_ring_t *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next)
+    {
+      uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      idle = idle && tail == head;
+      for (; tail != head; tail++)
+      {
+        trace_print(&ring->records[tail & (TRACE_RING_SIZE - 1)]);
+      }
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+      uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+      if (dropped > 0)
+      {
+        printf("[Trace] %llu frame records dropped\n", (unsigned long long)dropped);
+      }
+    }
+
+    fflush(stdout);
+    if (idle)
+    {
+      nanosleep(&interval, NULL);
+    }
+  }
+  return NULL;
+}
+
+void trace_start(void)
+{
+  pthread_t drainer;
+  if (pthread_create(&drainer, NULL, trace_drain, NULL) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+  }
+  pthread_detach(drainer);
+}
@@ -0,0 +1,112 @@
+/*
+ This header provides logging for the datapath. Messages are filtered by a
+ global log level that defaults to errors only. Per-frame logging never
+ formats text on the forwarding threads: each thread appends compact binary
+ records to its own single-producer/single-consumer trace ring, and a
+ background thread drains all rings and prints them.
+ */
+
+#ifndef _LOG_UTILS_H
+#define _LOG_UTILS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define LOG_ERROR 0    ///< Default: only errors, which always go to stderr
+#define LOG_INFO 1     ///< Control-plane events such as MAC learning
+#define LOG_FRAMES 2   ///< Additionally trace every frame through the trace rings
+
+#define TRACE_RING_SIZE 4096   ///< Records per thread; must be a power of two
+
+extern int log_level;
+
+#define LOG_PRINT(level, msg...) \
+  do                             \
+  {                              \
+    if (log_level >= (level))    \
+      printf(msg);               \
+  } while (0)
+
+enum trace_dir_t
+{
+  TRACE_TAP_TO_VSWITCH,   ///< VPort read a frame from its TAP and sent it out
+  TRACE_VSWITCH_TO_TAP,   ///< VPort received a frame and wrote it to its TAP
+  TRACE_VSWITCH_RX,       ///< VSwitch received a frame from a VPort
+};
+
+struct trace_record_t
+{
+  uint64_t ts_ns;          ///< CLOCK_REALTIME timestamp in nanoseconds
+  uint8_t dst[6];          ///< Destination MAC
+  uint8_t src[6];          ///< Source MAC
+  uint16_t ether_type;     ///< EtherType in network byte order
+  uint8_t dir;             ///< enum trace_dir_t
+  uint8_t queue;           ///< TAP queue or worker index
+  uint32_t size;           ///< Frame size in bytes
+  uint32_t peer_ip;        ///< Remote UDP endpoint (network byte order), if any
+  uint16_t peer_port;      ///< Remote UDP port (network byte order), if any
+};
+
+struct trace_ring_t
+{
+  _Alignas(64) _Atomic uint64_t head;  ///< Next slot to write; only the owning thread stores it
+  _Alignas(64) _Atomic uint64_t tail;  ///< Next slot to read; only the drain thread stores it
+  _Atomic uint64_t dropped;            ///< Records lost because the ring was full
+  struct trace_record_t *records;      ///< TRACE_RING_SIZE slots
+  struct trace_ring_t *next;           ///< Registry of all rings, walked by the drain thread
+};
+
+/*
+ Returns the calling thread's trace ring, creating and registering it on first use.
+ */
+struct trace_ring_t *trace_ring_create(void);
+
+/*
+ Starts the background thread that drains every registered ring to stdout.
+ */
+void trace_start(void);
+
+extern __thread struct trace_ring_t *trace_thread_ring;
+
+/*
+ Appends a record for one frame to the calling thread's ring. Wait-free: if
+ the drain thread has fallen behind, the record is counted and dropped.
+ */
+static inline void trace_frame(uint8_t dir, uint8_t queue, const void *ether_data, uint32_t size,
+                               const struct sockaddr_in *peer)
+{
+  struct trace_ring_t *ring = trace_thread_ring;
+  if (ring == NULL)
+  {
+    ring = trace_ring_create();
+  }
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE)
+  {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct trace_record_t *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec->ts_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+  memcpy(rec->dst, ether_data, 12);  // Destination and source MAC are adjacent
+  memcpy(&rec->ether_type, (const uint8_t *)ether_data + 12, 2);
+  rec->dir = dir;
+  rec->queue = queue;
+  rec->size = size;
+  rec->peer_ip = peer ? peer->sin_addr.s_addr : 0;
+  rec->peer_port = peer ? peer->sin_port : 0;
+
+  // Publish the record to the drain thread
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif
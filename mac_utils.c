@@ -0,0 +1,342 @@
+/*
+ This file implements the MAC learning table declared in mac_utils.h.
+ */
+
+#include "mac_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+
+#define MAC_ENTRY_USED (1ULL << 63)   ///< Set on every stored key so that MAC 0 stays usable
+
+/*
+ Allocates an array of 'nslots' (a power of two) free slots.
+ */
+static struct mac_slots_t *mac_slots_new(uint32_t nslots, struct mac_slots_t *smaller)
+{
+  struct mac_slots_t *slots = aligned_alloc(64, sizeof(*slots) + nslots * sizeof(slots->entries[0]));
+  if (slots == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate MAC table: %s\n", strerror(errno));
+  }
+  for (uint32_t i = 0; i < nslots; i++)
+  {
+    atomic_init(&slots->entries[i].key, 0);
+    atomic_init(&slots->entries[i].peer, 0);
+    atomic_init(&slots->entries[i].seen, 0);
+  }
+  slots->mask = nslots - 1;
+  slots->smaller = smaller;
+  return slots;
+}
+
+void mac_table_init(struct mac_table_t *table, uint32_t max_entries,
+                    void (*changed)(void *ctx, uint64_t mac, uint32_t old_peer, uint32_t new_peer), void *ctx)
+{
+  if (max_entries < MAC_TABLE_MIN_ENTRIES)
+  {
+    max_entries = MAC_TABLE_MIN_ENTRIES;
+  }
+
+  // Keep the table at most half full so probe sequences stay short
+  uint32_t max_slots = 1;
+  while (max_slots < max_entries * 2)
+  {
+    max_slots <<= 1;
+  }
+
+  atomic_init(&table->slots, mac_slots_new(2 * MAC_TABLE_MIN_ENTRIES, NULL));
+  table->max_slots = max_slots;
+  table->max_entries = max_entries;
+  atomic_init(&table->size, 0);
+  atomic_init(&table->seq, 0);
+  table->sweep = 0;
+  pthread_mutex_init(&table->lock, NULL);
+  table->changed = changed;
+  table->ctx = ctx;
+}
+
+/*
+ Returns the slot of 'slots' holding 'mac', whose mac_hash() is 'hash', or
+ the free slot that ends its probe sequence.
+ */
+static uint32_t mac_table_slot(const struct mac_slots_t *slots, uint64_t mac, uint32_t hash)
+{
+  uint64_t stored = mac | MAC_ENTRY_USED;
+  uint32_t slot = hash & slots->mask;
+  uint64_t key;
+
+  while ((key = atomic_load_explicit(&slots->entries[slot].key, memory_order_relaxed)) != 0 && key != stored)
+  {
+    slot = (slot + 1) & slots->mask;
+  }
+  return slot;
+}
+
+static inline struct mac_slots_t *mac_table_slots(const struct mac_table_t *table)
+{
+  return atomic_load_explicit(&table->slots, memory_order_relaxed);
+}
+
+static inline void mac_table_seq_begin(struct mac_table_t *table)
+{
+  atomic_store_explicit(&table->seq, atomic_load_explicit(&table->seq, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void mac_table_write_begin(struct mac_table_t *table)
+{
+  pthread_mutex_lock(&table->lock);
+  mac_table_seq_begin(table);
+}
+
+static inline void mac_table_write_end(struct mac_table_t *table)
+{
+  atomic_store_explicit(&table->seq, atomic_load_explicit(&table->seq, memory_order_relaxed) + 1,
+                        memory_order_release);
+  pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ Finds 'mac' outside the write section. Returns its entry, or NULL if absent.
+ */
+static struct mac_entry_t *mac_table_find(struct mac_table_t *table, uint64_t mac, uint32_t hash, uint32_t *peer)
+{
+  while (true)
+  {
+    uint32_t seq = atomic_load_explicit(&table->seq, memory_order_acquire);
+    if (seq & 1)
+    {
+      continue;  // A writer is busy; its section is short
+    }
+
+    struct mac_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_acquire);
+    struct mac_entry_t *entry = &slots->entries[mac_table_slot(slots, mac, hash)];
+    bool found = atomic_load_explicit(&entry->key, memory_order_relaxed) != 0;
+    uint32_t value = atomic_load_explicit(&entry->peer, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&table->seq, memory_order_relaxed) == seq)
+    {
+      *peer = value;
+      return found ? entry : NULL;
+    }
+  }
+}
+
+/*
+ Moves the table to an array twice the size if one more entry would fill the
+ current one more than half. Must be called with the writer lock held,
+ outside the sequence section.
+ */
+static void mac_table_reserve(struct mac_table_t *table)
+{
+  struct mac_slots_t *slots = mac_table_slots(table);
+  uint32_t nslots = slots->mask + 1;
+  if (nslots >= table->max_slots || 2 * (atomic_load_explicit(&table->size, memory_order_relaxed) + 1) <= nslots)
+  {
+    return;
+  }
+
+  // Timestamps bumped on the old array meanwhile are lost, and bumped again by the next frame
+  struct mac_slots_t *bigger = mac_slots_new(2 * nslots, slots);
+  for (uint32_t i = 0; i < nslots; i++)
+  {
+    const struct mac_entry_t *from = &slots->entries[i];
+    uint64_t key = atomic_load_explicit(&from->key, memory_order_relaxed);
+    if (key != 0)
+    {
+      struct mac_entry_t *to = &bigger->entries[mac_table_slot(bigger, key & ~MAC_ENTRY_USED,
+                                                               mac_hash(key & ~MAC_ENTRY_USED))];
+      atomic_store_explicit(&to->key, key, memory_order_relaxed);
+      atomic_store_explicit(&to->peer, atomic_load_explicit(&from->peer, memory_order_relaxed), memory_order_relaxed);
+      atomic_store_explicit(&to->seen, atomic_load_explicit(&from->seen, memory_order_relaxed), memory_order_relaxed);
+    }
+  }
+  mac_table_seq_begin(table);
+  atomic_store_explicit(&table->slots, bigger, memory_order_release);
+  atomic_store_explicit(&table->seq, atomic_load_explicit(&table->seq, memory_order_relaxed) + 1,
+                        memory_order_release);
+}
+
+bool mac_table_lookup(struct mac_table_t *table, uint64_t mac, uint32_t *peer)
+{
+  return mac_table_find(table, mac, mac_hash(mac), peer) != NULL;
+}
+
+bool mac_table_lookup_hashed(struct mac_table_t *table, uint64_t mac, uint32_t hash, uint32_t *peer)
+{
+  return mac_table_find(table, mac, hash, peer) != NULL;
+}
+
+bool mac_table_touch(struct mac_table_t *table, uint64_t mac, uint32_t now)
+{
+  uint32_t peer;
+  struct mac_entry_t *entry = mac_table_find(table, mac, mac_hash(mac), &peer);
+  if (entry == NULL)
+  {
+    return false;
+  }
+  if (atomic_load_explicit(&entry->seen, memory_order_relaxed) != now)
+  {
+    atomic_store_explicit(&entry->seen, now, memory_order_relaxed);
+  }
+  return true;
+}
+
+enum mac_learn_t mac_table_learn(struct mac_table_t *table, uint64_t mac, uint32_t peer, uint32_t now)
+{
+  return mac_table_learn_hashed(table, mac, mac_hash(mac), peer, now);
+}
+
+enum mac_learn_t mac_table_learn_hashed(struct mac_table_t *table, uint64_t mac, uint32_t hash, uint32_t peer,
+                                        uint32_t now)
+{
+  // Fast path: the entry is already right, only its timestamp may need a bump.
+  // Writing only when the value changes keeps the cache line shared between cores.
+  // (A stale slot from a concurrent removal at worst refreshes a neighbour.)
+  uint32_t current;
+  struct mac_entry_t *entry = mac_table_find(table, mac, hash, &current);
+  if (entry != NULL && current == peer)
+  {
+    if (atomic_load_explicit(&entry->seen, memory_order_relaxed) != now)
+    {
+      atomic_store_explicit(&entry->seen, now, memory_order_relaxed);
+    }
+    return MAC_LEARN_KNOWN;
+  }
+
+  enum mac_learn_t result;
+  pthread_mutex_lock(&table->lock);
+  mac_table_reserve(table);
+  mac_table_seq_begin(table);
+  struct mac_slots_t *slots = mac_table_slots(table);
+  entry = &slots->entries[mac_table_slot(slots, mac, hash)];
+  if (atomic_load_explicit(&entry->key, memory_order_relaxed) != 0)
+  {
+    current = atomic_load_explicit(&entry->peer, memory_order_relaxed);
+    result = current == peer ? MAC_LEARN_KNOWN : MAC_LEARN_MOVED;
+  }
+  else if (atomic_load_explicit(&table->size, memory_order_relaxed) >= table->max_entries)
+  {
+    mac_table_write_end(table);
+    return MAC_LEARN_FULL;
+  }
+  else
+  {
+    atomic_store_explicit(&entry->key, mac | MAC_ENTRY_USED, memory_order_relaxed);
+    atomic_store_explicit(&table->size, atomic_load_explicit(&table->size, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    current = MAC_PEER_NONE;
+    result = MAC_LEARN_NEW;
+  }
+  atomic_store_explicit(&entry->peer, peer, memory_order_relaxed);
+  atomic_store_explicit(&entry->seen, now, memory_order_relaxed);
+  if (result != MAC_LEARN_KNOWN)
+  {
+    table->changed(table->ctx, mac, current, peer);
+  }
+  mac_table_write_end(table);
+  return result;
+}
+
+/*
+ Empties 'slot' and shifts later entries of the probe run back into the gap,
+ so that no lookup ever stops early at a hole (no tombstones needed).
+ Must be called inside the write section.
+ */
+static void mac_table_remove_slot(struct mac_table_t *table, uint32_t slot)
+{
+  struct mac_slots_t *slots = mac_table_slots(table);
+  uint32_t hole = slot;
+  uint32_t next = (slot + 1) & slots->mask;
+  uint64_t key;
+
+  while ((key = atomic_load_explicit(&slots->entries[next].key, memory_order_relaxed)) != 0)
+  {
+    uint32_t home = mac_hash(key & ~MAC_ENTRY_USED) & slots->mask;
+    // The entry may fill the hole if the hole lies between its home slot and its current slot
+    if (((next - home) & slots->mask) >= ((next - hole) & slots->mask))
+    {
+      struct mac_entry_t *from = &slots->entries[next];
+      struct mac_entry_t *to = &slots->entries[hole];
+      atomic_store_explicit(&to->key, key, memory_order_relaxed);
+      atomic_store_explicit(&to->peer, atomic_load_explicit(&from->peer, memory_order_relaxed), memory_order_relaxed);
+      atomic_store_explicit(&to->seen, atomic_load_explicit(&from->seen, memory_order_relaxed), memory_order_relaxed);
+      hole = next;
+    }
+    next = (next + 1) & slots->mask;
+  }
+  atomic_store_explicit(&slots->entries[hole].key, 0, memory_order_relaxed);
+  atomic_store_explicit(&table->size, atomic_load_explicit(&table->size, memory_order_relaxed) - 1,
+                        memory_order_relaxed);
+}
+
+uint32_t mac_table_age(struct mac_table_t *table, uint32_t now, uint32_t max_age, uint32_t budget)
+{
+  uint32_t removed = 0;
+
+  mac_table_write_begin(table);
+  struct mac_slots_t *slots = mac_table_slots(table);
+  for (uint32_t n = 0; n < budget && n <= slots->mask; n++)
+  {
+    uint32_t slot = table->sweep & slots->mask;
+    struct mac_entry_t *entry = &slots->entries[slot];
+    uint64_t key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+
+    // Signed, as another thread may have stamped the entry with a slightly later clock
+    int32_t age = (int32_t)(now - atomic_load_explicit(&entry->seen, memory_order_relaxed));
+    if (key != 0 && age > (int32_t)max_age)
+    {
+      table->changed(table->ctx, key & ~MAC_ENTRY_USED, atomic_load_explicit(&entry->peer, memory_order_relaxed),
+                     MAC_PEER_NONE);
+      mac_table_remove_slot(table, slot);
+      removed++;
+      continue;  // Another entry may have shifted into this slot
+    }
+    table->sweep++;
+  }
+  mac_table_write_end(table);
+  return removed;
+}
+
+uint32_t mac_table_forget_peer(struct mac_table_t *table, uint32_t peer)
+{
+  uint32_t removed = 0;
+
+  mac_table_write_begin(table);
+  struct mac_slots_t *slots = mac_table_slots(table);
+  for (uint32_t slot = 0; slot <= slots->mask;)
+  {
+    struct mac_entry_t *entry = &slots->entries[slot];
+    uint64_t key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+    if (key != 0 && atomic_load_explicit(&entry->peer, memory_order_relaxed) == peer)
+    {
+      table->changed(table->ctx, key & ~MAC_ENTRY_USED, peer, MAC_PEER_NONE);
+      mac_table_remove_slot(table, slot);
+      removed++;
+      continue;  // Another entry may have shifted into this slot
+    }
+    slot++;
+  }
+  mac_table_write_end(table);
+  return removed;
+}
+
+void mac_table_walk(struct mac_table_t *table, void (*visit)(void *ctx, uint64_t mac, uint32_t peer, uint32_t seen),
+                    void *ctx)
+{
+  pthread_mutex_lock(&table->lock);
+  struct mac_slots_t *slots = mac_table_slots(table);
+  for (uint32_t slot = 0; slot <= slots->mask; slot++)
+  {
+    struct mac_entry_t *entry = &slots->entries[slot];
+    uint64_t key = atomic_load_explicit(&entry->key, memory_order_relaxed);
+    if (key != 0)
+    {
+      visit(ctx, key & ~MAC_ENTRY_USED, atomic_load_explicit(&entry->peer, memory_order_relaxed),
+            atomic_load_explicit(&entry->seen, memory_order_relaxed));
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+}
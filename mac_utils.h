@@ -0,0 +1,152 @@
+/*
+ This header declares the VSwitch MAC learning table: packed MAC address ->
+ peer index, with a last-seen timestamp per entry for aging.
+
+ The table is open-addressed (linear probing) over an array of 16-byte
+ entries. It starts small and doubles whenever it would become more than
+ half full, up to the size its hard entry limit needs, so a network with a
+ handful of hosts costs a few kilobytes. Lookups take no lock: updates are
+ made under a writer mutex inside a sequence-lock section, and readers retry
+ the rare lookup that overlapped one. A hit on an entry that is already
+ correct only refreshes its timestamp, so steady traffic never enters the
+ write section. The bigger array is filled under the writer mutex but
+ outside the sequence section, which only covers the switch to it; the
+ smaller arrays are kept, as a lookup may still be on one, and together
+ take less room than the current one.
+
+ Every change (an entry added, moved to another peer or aged out) is reported
+ to a callback inside the write section, so the owner can keep per-peer state
+ consistent with the table even when several threads learn at once.
+ */
+
+#ifndef _MAC_UTILS_H
+#define _MAC_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MAC_TABLE_MIN_ENTRIES 64
+#define MAC_PEER_NONE UINT32_MAX   ///< Passed to the change callback for "no peer"
+
+enum mac_learn_t
+{
+  MAC_LEARN_KNOWN,   ///< The entry already pointed at the peer
+  MAC_LEARN_NEW,     ///< A new entry was added
+  MAC_LEARN_MOVED,   ///< The MAC moved from another peer
+  MAC_LEARN_FULL,    ///< The table is at its entry limit; nothing was learned
+};
+
+struct mac_entry_t
+{
+  _Atomic uint64_t key;    ///< MAC with MAC_ENTRY_USED set, 0 if the slot is free
+  _Atomic uint32_t peer;   ///< Index of the peer the MAC lives behind
+  _Atomic uint32_t seen;   ///< Time the MAC was last seen as a source
+};
+
+struct mac_slots_t
+{
+  uint32_t mask;                        ///< Slots, minus one
+  struct mac_slots_t *smaller;          ///< The array this one replaced, NULL for the first
+  _Alignas(64) struct mac_entry_t entries[];  ///< mask + 1 slots, at most half of them used
+};
+
+struct mac_table_t
+{
+  _Atomic(struct mac_slots_t *) slots;  ///< Current slot array
+  uint32_t max_slots;           ///< Slots the entry limit needs; the array grows no further
+  uint32_t max_entries;         ///< Hard limit on the number of entries
+  _Atomic uint32_t size;        ///< Number of entries
+  _Atomic uint32_t seq;         ///< Odd while a writer is changing the table
+  uint32_t sweep;               ///< Next slot for mac_table_age() to look at
+  pthread_mutex_t lock;         ///< Serializes writers
+  void (*changed)(void *ctx, uint64_t mac, uint32_t old_peer, uint32_t new_peer);  ///< Change callback
+  void *ctx;                    ///< Passed to 'changed'
+};
+
+/*
+ Returns the hash that places 'mac' in a table. Batch classification
+ (class_utils.h) computes the same value for many MACs at once.
+ */
+static inline uint32_t mac_hash(uint64_t mac)
+{
+  // Fibonacci hashing: multiply by 2^64 / phi and keep the high bits
+  return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/*
+ Creates a table that holds up to 'max_entries' MACs. 'changed' is called,
+ with the writer lock held, whenever a MAC is added (old_peer is
+ MAC_PEER_NONE), moves between peers, or is removed (new_peer is
+ MAC_PEER_NONE).
+ */
+void mac_table_init(struct mac_table_t *table, uint32_t max_entries,
+                    void (*changed)(void *ctx, uint64_t mac, uint32_t old_peer, uint32_t new_peer), void *ctx);
+
+/*
+ Looks up 'mac' without taking any lock. Returns true and stores the peer in
+ 'peer' if the MAC is known.
+ */
+bool mac_table_lookup(struct mac_table_t *table, uint64_t mac, uint32_t *peer);
+
+/*
+ Records that 'mac' was seen behind 'peer' at time 'now'.
+ */
+enum mac_learn_t mac_table_learn(struct mac_table_t *table, uint64_t mac, uint32_t peer, uint32_t now);
+
+/*
+ Refreshes the timestamp of 'mac' to 'now' without taking any lock, e.g.
+ for a MAC seen where the table's owner does not learn. Returns false if the
+ MAC is not in the table.
+ */
+bool mac_table_touch(struct mac_table_t *table, uint64_t mac, uint32_t now);
+
+/*
+ mac_table_lookup() and mac_table_learn() for a MAC whose mac_hash() the
+ caller already has.
+ */
+bool mac_table_lookup_hashed(struct mac_table_t *table, uint64_t mac, uint32_t hash, uint32_t *peer);
+enum mac_learn_t mac_table_learn_hashed(struct mac_table_t *table, uint64_t mac, uint32_t hash, uint32_t peer,
+                                        uint32_t now);
+
+/*
+ Starts loading the slot where the probe for a MAC with hash 'hash' begins,
+ so that a batch can overlap the cache misses of its lookups.
+ */
+static inline void mac_table_prefetch(const struct mac_table_t *table, uint32_t hash)
+{
+  const struct mac_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+  __builtin_prefetch(&slots->entries[hash & slots->mask]);
+}
+
+/*
+ Returns the number of slots the table has now.
+ */
+static inline uint32_t mac_table_capacity(const struct mac_table_t *table)
+{
+  return atomic_load_explicit(&table->slots, memory_order_relaxed)->mask + 1;
+}
+
+/*
+ Removes entries not seen for more than 'max_age', looking at no more than
+ 'budget' slots so that the sweep can be spread over many calls.
+ Returns the number of entries removed.
+ */
+uint32_t mac_table_age(struct mac_table_t *table, uint32_t now, uint32_t max_age, uint32_t budget);
+
+/*
+ Removes every entry that points at 'peer', e.g. a VPort that went away.
+ Returns the number of entries removed.
+ */
+uint32_t mac_table_forget_peer(struct mac_table_t *table, uint32_t peer);
+
+/*
+ Calls 'visit' for every entry. Holds the writer lock but stays out of the
+ sequence section, so the entries do not change meanwhile while lookups go
+ on undisturbed. 'visit' must not use the table.
+ */
+void mac_table_walk(struct mac_table_t *table, void (*visit)(void *ctx, uint64_t mac, uint32_t peer, uint32_t seen),
+                    void *ctx);
+
+#endif
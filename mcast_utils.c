@@ -0,0 +1,463 @@
+/*
+ This file implements the IGMP/MLD snooping table declared in mcast_utils.h.
+ */
+
+#include "mcast_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+#include <net/ethernet.h>
+
+#define MCAST_GROUP_USED (1ULL << 63)   ///< Set on every stored key
+
+// IGMP message types (RFC 2236, RFC 3376)
+#define IGMP_QUERY 0x11
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_V2_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+
+// MLD message types (RFC 2710, RFC 3810)
+#define MLD_QUERY 130
+#define MLD_V1_REPORT 131
+#define MLD_V1_DONE 132
+#define MLD_V2_REPORT 143
+
+// IGMPv3/MLDv2 group record types
+#define MCAST_MODE_IS_INCLUDE 1
+#define MCAST_MODE_IS_EXCLUDE 2
+#define MCAST_CHANGE_TO_INCLUDE 3
+#define MCAST_CHANGE_TO_EXCLUDE 4
+#define MCAST_ALLOW_NEW_SOURCES 5
+
+static inline uint32_t mcast_hash(uint64_t mac)
+{
+  // Fibonacci hashing: multiply by 2^64 / phi and keep the high bits
+  return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static inline uint16_t mcast_read16(const uint8_t *p)
+{
+  return ((uint16_t)p[0] << 8) | p[1];
+}
+
+// Group MACs: 01:00:5e plus the low 23 bits of an IPv4 group, 33:33 plus the low 32 bits of an IPv6 one
+static inline uint64_t mcast_ipv4_mac(const uint8_t *group)
+{
+  return 0x01005e000000ULL | ((uint64_t)(group[1] & 0x7f) << 16) | ((uint64_t)group[2] << 8) | group[3];
+}
+
+static inline uint64_t mcast_ipv6_mac(const uint8_t *group)
+{
+  return 0x333300000000ULL | ((uint64_t)group[12] << 24) | ((uint64_t)group[13] << 16) |
+         ((uint64_t)group[14] << 8) | group[15];
+}
+
+void mcast_table_init(struct mcast_table_t *table)
+{
+  uint32_t slots = MCAST_MAX_GROUPS * 2;
+  table->groups = calloc(slots, sizeof(*table->groups));
+  if (table->groups == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate multicast table: %s\n", strerror(errno));
+  }
+  table->mask = slots - 1;
+  table->ngroups = 0;
+  atomic_init(&table->seq, 0);
+  pthread_mutex_init(&table->lock, NULL);
+}
+
+/*
+ Returns the slot holding 'mac', or the free slot that ends its probe sequence.
+ */
+static uint32_t mcast_slot(const struct mcast_table_t *table, uint64_t mac)
+{
+  uint64_t stored = mac | MCAST_GROUP_USED;
+  uint32_t slot = mcast_hash(mac) & table->mask;
+  uint64_t key;
+
+  while ((key = atomic_load_explicit(&table->groups[slot].key, memory_order_relaxed)) != 0 && key != stored)
+  {
+    slot = (slot + 1) & table->mask;
+  }
+  return slot;
+}
+
+static inline void mcast_write_begin(struct mcast_table_t *table)
+{
+  pthread_mutex_lock(&table->lock);
+  atomic_store_explicit(&table->seq, atomic_load_explicit(&table->seq, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static inline void mcast_write_end(struct mcast_table_t *table)
+{
+  atomic_store_explicit(&table->seq, atomic_load_explicit(&table->seq, memory_order_relaxed) + 1,
+                        memory_order_release);
+  pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ Empties 'slot' and shifts later groups of the probe run back into the gap
+ (see mac_table_remove_slot()). Must be called inside the write section.
+ */
+static void mcast_remove_slot(struct mcast_table_t *table, uint32_t slot)
+{
+  uint32_t hole = slot;
+  uint32_t next = (slot + 1) & table->mask;
+  uint64_t key;
+
+  while ((key = atomic_load_explicit(&table->groups[next].key, memory_order_relaxed)) != 0)
+  {
+    uint32_t home = mcast_hash(key & ~MCAST_GROUP_USED) & table->mask;
+    if (((next - home) & table->mask) >= ((next - hole) & table->mask))
+    {
+      struct mcast_group_t *from = &table->groups[next];
+      struct mcast_group_t *to = &table->groups[hole];
+      uint32_t n = atomic_load_explicit(&from->nmembers, memory_order_relaxed);
+      atomic_store_explicit(&to->key, key, memory_order_relaxed);
+      atomic_store_explicit(&to->nmembers, n, memory_order_relaxed);
+      for (uint32_t i = 0; i < MCAST_MAX_MEMBERS; i++)
+      {
+        atomic_store_explicit(&to->members[i], atomic_load_explicit(&from->members[i], memory_order_relaxed),
+                              memory_order_relaxed);
+        to->expires[i] = from->expires[i];
+      }
+      to->overflow_expires = from->overflow_expires;
+      hole = next;
+    }
+    next = (next + 1) & table->mask;
+  }
+  atomic_store_explicit(&table->groups[hole].key, 0, memory_order_relaxed);
+  table->ngroups--;
+}
+
+/*
+ Removes member 'i' of the group in 'slot', and the group once it is empty.
+ Returns true if the group itself was removed.
+ */
+static bool mcast_remove_member(struct mcast_table_t *table, uint32_t slot, uint32_t i)
+{
+  struct mcast_group_t *group = &table->groups[slot];
+  uint32_t n = atomic_load_explicit(&group->nmembers, memory_order_relaxed) - 1;
+  if (n == 0)
+  {
+    mcast_remove_slot(table, slot);
+    return true;
+  }
+  atomic_store_explicit(&group->members[i], atomic_load_explicit(&group->members[n], memory_order_relaxed),
+                        memory_order_relaxed);
+  group->expires[i] = group->expires[n];
+  atomic_store_explicit(&group->nmembers, n, memory_order_relaxed);
+  return false;
+}
+
+static void mcast_join(struct mcast_table_t *table, uint64_t mac, uint32_t peer, uint32_t now)
+{
+  if (mcast_is_control_group(mac))
+  {
+    return;  // Always flooded, so there is nothing to track
+  }
+
+  mcast_write_begin(table);
+  uint32_t slot = mcast_slot(table, mac);
+  struct mcast_group_t *group = &table->groups[slot];
+  uint32_t expires = now + MCAST_MEMBERSHIP_TIMEOUT;
+
+  if (atomic_load_explicit(&group->key, memory_order_relaxed) == 0)
+  {
+    if (table->ngroups >= MCAST_MAX_GROUPS)
+    {
+      mcast_write_end(table);
+      return;  // Out of space: the group stays unsnooped and flooded
+    }
+    atomic_store_explicit(&group->key, mac | MCAST_GROUP_USED, memory_order_relaxed);
+    atomic_store_explicit(&group->nmembers, 0, memory_order_relaxed);
+    table->ngroups++;
+  }
+
+  uint32_t n = atomic_load_explicit(&group->nmembers, memory_order_relaxed);
+  if (n == MCAST_OVERFLOW)
+  {
+    group->overflow_expires = expires;
+    mcast_write_end(table);
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (atomic_load_explicit(&group->members[i], memory_order_relaxed) == peer)
+    {
+      group->expires[i] = expires;
+      mcast_write_end(table);
+      return;
+    }
+  }
+  if (n < MCAST_MAX_MEMBERS)
+  {
+    atomic_store_explicit(&group->members[n], peer, memory_order_relaxed);
+    group->expires[n] = expires;
+    atomic_store_explicit(&group->nmembers, n + 1, memory_order_relaxed);
+  }
+  else
+  {
+    // Too many members to list: flood the group until it has been quiet for a full interval
+    atomic_store_explicit(&group->nmembers, MCAST_OVERFLOW, memory_order_relaxed);
+    group->overflow_expires = expires;
+  }
+  mcast_write_end(table);
+}
+
+static void mcast_leave(struct mcast_table_t *table, uint64_t mac, uint32_t peer)
+{
+  mcast_write_begin(table);
+  uint32_t slot = mcast_slot(table, mac);
+  struct mcast_group_t *group = &table->groups[slot];
+  if (atomic_load_explicit(&group->key, memory_order_relaxed) != 0)
+  {
+    uint32_t n = atomic_load_explicit(&group->nmembers, memory_order_relaxed);
+    for (uint32_t i = 0; n != MCAST_OVERFLOW && i < n; i++)
+    {
+      if (atomic_load_explicit(&group->members[i], memory_order_relaxed) == peer)
+      {
+        mcast_remove_member(table, slot, i);
+        break;
+      }
+    }
+  }
+  mcast_write_end(table);
+}
+
+/*
+ Applies one IGMPv3/MLDv2 group record. Excluding sources (or including
+ some) means the VPort wants the group; including none means it left.
+ */
+static void mcast_record(struct mcast_table_t *table, uint64_t mac, uint8_t type, uint16_t nsrcs, uint32_t peer,
+                         uint32_t now)
+{
+  switch (type)
+  {
+  case MCAST_MODE_IS_EXCLUDE:
+  case MCAST_CHANGE_TO_EXCLUDE:
+    mcast_join(table, mac, peer, now);
+    break;
+  case MCAST_MODE_IS_INCLUDE:
+  case MCAST_CHANGE_TO_INCLUDE:
+  case MCAST_ALLOW_NEW_SOURCES:
+    if (nsrcs > 0)
+    {
+      mcast_join(table, mac, peer, now);
+    }
+    else if (type != MCAST_ALLOW_NEW_SOURCES)
+    {
+      mcast_leave(table, mac, peer);
+    }
+    break;
+  default:
+    break;  // BLOCK_OLD_SOURCES keeps the group
+  }
+}
+
+static enum mcast_snoop_t mcast_snoop_igmp(struct mcast_table_t *table, const uint8_t *ip, size_t len,
+                                           uint32_t peer, uint32_t now)
+{
+  if (len < 20 || ip[9] != 2)  // IPPROTO_IGMP
+  {
+    return MCAST_SNOOP_NONE;
+  }
+  size_t ihl = (ip[0] & 0x0f) * 4;
+  size_t total = mcast_read16(ip + 2);
+  if (ihl < 20 || total > len || total < ihl + 8)
+  {
+    return MCAST_SNOOP_NONE;
+  }
+  const uint8_t *igmp = ip + ihl;
+  size_t igmplen = total - ihl;
+
+  switch (igmp[0])
+  {
+  case IGMP_QUERY:
+    return MCAST_SNOOP_QUERY;
+  case IGMP_V1_REPORT:
+  case IGMP_V2_REPORT:
+    mcast_join(table, mcast_ipv4_mac(igmp + 4), peer, now);
+    return MCAST_SNOOP_REPORT;
+  case IGMP_V2_LEAVE:
+    mcast_leave(table, mcast_ipv4_mac(igmp + 4), peer);
+    return MCAST_SNOOP_REPORT;
+  case IGMP_V3_REPORT:
+    break;
+  default:
+    return MCAST_SNOOP_NONE;
+  }
+
+  // IGMPv3: | type | reserved | checksum (2) | reserved (2) | records (2) | records... |
+  uint16_t nrecords = mcast_read16(igmp + 6);
+  size_t off = 8;
+  for (uint16_t r = 0; r < nrecords && off + 8 <= igmplen; r++)
+  {
+    const uint8_t *rec = igmp + off;
+    uint16_t nsrcs = mcast_read16(rec + 2);
+    off += 8 + 4 * (size_t)nsrcs + 4 * (size_t)rec[1];
+    if (off > igmplen)
+    {
+      break;
+    }
+    mcast_record(table, mcast_ipv4_mac(rec + 4), rec[0], nsrcs, peer, now);
+  }
+  return MCAST_SNOOP_REPORT;
+}
+
+static enum mcast_snoop_t mcast_snoop_mld(struct mcast_table_t *table, const uint8_t *ip6, size_t len,
+                                          uint32_t peer, uint32_t now)
+{
+  if (len < 40)
+  {
+    return MCAST_SNOOP_NONE;
+  }
+  size_t end = 40 + mcast_read16(ip6 + 4);
+  if (end > len)
+  {
+    return MCAST_SNOOP_NONE;
+  }
+
+  // MLD travels behind a hop-by-hop options header carrying the router alert
+  uint8_t next = ip6[6];
+  size_t off = 40;
+  while ((next == 0 || next == 60) && off + 8 <= end)  // Hop-by-hop or destination options
+  {
+    next = ip6[off];
+    off += (ip6[off + 1] + 1) * 8;
+  }
+  if (next != 58 || off + 8 > end)  // IPPROTO_ICMPV6
+  {
+    return MCAST_SNOOP_NONE;
+  }
+  const uint8_t *icmp = ip6 + off;
+  size_t icmplen = end - off;
+
+  switch (icmp[0])
+  {
+  case MLD_QUERY:
+    return MCAST_SNOOP_QUERY;
+  case MLD_V1_REPORT:
+  case MLD_V1_DONE:
+    if (icmplen < 24)
+    {
+      return MCAST_SNOOP_NONE;
+    }
+    if (icmp[0] == MLD_V1_REPORT)
+    {
+      mcast_join(table, mcast_ipv6_mac(icmp + 8), peer, now);
+    }
+    else
+    {
+      mcast_leave(table, mcast_ipv6_mac(icmp + 8), peer);
+    }
+    return MCAST_SNOOP_REPORT;
+  case MLD_V2_REPORT:
+    break;
+  default:
+    return MCAST_SNOOP_NONE;  // Neighbour discovery and other ICMPv6
+  }
+
+  // MLDv2: | type | reserved | checksum (2) | reserved (2) | records (2) | records... |
+  uint16_t nrecords = mcast_read16(icmp + 6);
+  size_t roff = 8;
+  for (uint16_t r = 0; r < nrecords && roff + 20 <= icmplen; r++)
+  {
+    const uint8_t *rec = icmp + roff;
+    uint16_t nsrcs = mcast_read16(rec + 2);
+    roff += 20 + 16 * (size_t)nsrcs + 4 * (size_t)rec[1];
+    if (roff > icmplen)
+    {
+      break;
+    }
+    mcast_record(table, mcast_ipv6_mac(rec + 4), rec[0], nsrcs, peer, now);
+  }
+  return MCAST_SNOOP_REPORT;
+}
+
+enum mcast_snoop_t mcast_snoop(struct mcast_table_t *table, const uint8_t *frame, size_t len, uint32_t peer,
+                               uint32_t now)
+{
+  if (len < ETHER_HDR_LEN)
+  {
+    return MCAST_SNOOP_NONE;
+  }
+  uint16_t type = mcast_read16(frame + 12);
+  if (type == ETHERTYPE_IP)
+  {
+    return mcast_snoop_igmp(table, frame + ETHER_HDR_LEN, len - ETHER_HDR_LEN, peer, now);
+  }
+  if (type == ETHERTYPE_IPV6)
+  {
+    return mcast_snoop_mld(table, frame + ETHER_HDR_LEN, len - ETHER_HDR_LEN, peer, now);
+  }
+  return MCAST_SNOOP_NONE;
+}
+
+int mcast_lookup(struct mcast_table_t *table, uint64_t group, uint32_t *members)
+{
+  while (true)
+  {
+    uint32_t seq = atomic_load_explicit(&table->seq, memory_order_acquire);
+    if (seq & 1)
+    {
+      continue;  // A writer is busy; its section is short
+    }
+
+    const struct mcast_group_t *entry = &table->groups[mcast_slot(table, group)];
+    int n = -1;
+    if (atomic_load_explicit(&entry->key, memory_order_relaxed) != 0)
+    {
+      uint32_t nmembers = atomic_load_explicit(&entry->nmembers, memory_order_relaxed);
+      if (nmembers <= MCAST_MAX_MEMBERS)
+      {
+        n = (int)nmembers;
+        for (int i = 0; i < n; i++)
+        {
+          members[i] = atomic_load_explicit(&entry->members[i], memory_order_relaxed);
+        }
+      }
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&table->seq, memory_order_relaxed) == seq)
+    {
+      return n;
+    }
+  }
+}
+
+void mcast_table_age(struct mcast_table_t *table, uint32_t now)
+{
+  mcast_write_begin(table);
+  for (uint32_t slot = 0; slot <= table->mask; slot++)
+  {
+    struct mcast_group_t *group = &table->groups[slot];
+    if (atomic_load_explicit(&group->key, memory_order_relaxed) == 0)
+    {
+      continue;
+    }
+
+    uint32_t n = atomic_load_explicit(&group->nmembers, memory_order_relaxed);
+    if (n == MCAST_OVERFLOW)
+    {
+      if ((int32_t)(now - group->overflow_expires) > 0)
+      {
+        mcast_remove_slot(table, slot);
+        slot--;  // Another group may have shifted into this slot
+      }
+      continue;
+    }
+    for (uint32_t i = n; i-- > 0;)
+    {
+      if ((int32_t)(now - group->expires[i]) > 0 && mcast_remove_member(table, slot, i))
+      {
+        slot--;  // The group is gone and another may have shifted into its slot
+        break;
+      }
+    }
+  }
+  mcast_write_end(table);
+}
@@ -0,0 +1,87 @@
+/*
+ This header declares the VSwitch's multicast snooping: it watches IGMP
+ (IPv4) and MLD (IPv6) membership reports to learn which VPorts subscribe to
+ which multicast group, so that group traffic only goes to subscribers.
+
+ Groups are tracked by their Ethernet address (01:00:5e:xx:xx:xx for IPv4,
+ 33:33:xx:xx:xx:xx for IPv6), which is what the switch sees on every frame;
+ IP groups sharing an address share a member list. As on Linux bridges,
+ frames for groups nobody reported yet are flooded, as are the link-local
+ control groups (224.0.0.x, ff02::x) that hosts never report, so IPv6
+ neighbour discovery and mDNS work from the first frame. Members expire
+ unless they report again within MCAST_MEMBERSHIP_TIMEOUT.
+
+ The table has the same concurrency model as the MAC table (mac_utils.h):
+ lookups take no lock and retry if they overlapped a writer, and writers
+ serialize on a mutex.
+ */
+
+#ifndef _MCAST_UTILS_H
+#define _MCAST_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MCAST_MAX_GROUPS 1024          ///< Groups snooped at once; others are flooded
+#define MCAST_MAX_MEMBERS 16           ///< VPorts tracked per group; a larger group is flooded
+#define MCAST_MEMBERSHIP_TIMEOUT 260   ///< Group membership interval for the default IGMP/MLD timers
+#define MCAST_OVERFLOW UINT32_MAX      ///< nmembers of a group with too many members to track
+
+enum mcast_snoop_t
+{
+  MCAST_SNOOP_NONE,     ///< Not an IGMP/MLD message
+  MCAST_SNOOP_QUERY,    ///< A membership query: its sender is a multicast router
+  MCAST_SNOOP_REPORT,   ///< A membership report or leave, already applied to the table
+};
+
+struct mcast_group_t
+{
+  _Atomic uint64_t key;                         ///< Group MAC with MCAST_GROUP_USED set, 0 if the slot is free
+  _Atomic uint32_t nmembers;                    ///< Entries used in members, or MCAST_OVERFLOW
+  _Atomic uint32_t members[MCAST_MAX_MEMBERS];  ///< Subscribed peers
+  uint32_t expires[MCAST_MAX_MEMBERS];          ///< When each membership lapses (writers only)
+  uint32_t overflow_expires;                    ///< When an overflowed group lapses (writers only)
+};
+
+struct mcast_table_t
+{
+  struct mcast_group_t *groups;   ///< mask + 1 slots, at most half of them used
+  uint32_t mask;
+  uint32_t ngroups;               ///< Number of groups (writers only)
+  _Atomic uint32_t seq;           ///< Odd while a writer is changing the table
+  pthread_mutex_t lock;           ///< Serializes writers
+};
+
+void mcast_table_init(struct mcast_table_t *table);
+
+/*
+ Returns true for the link-local control groups that are always flooded.
+ */
+static inline bool mcast_is_control_group(uint64_t mac)
+{
+  return (mac >> 8) == 0x01005e0000ULL || (mac >> 8) == 0x3333000000ULL;
+}
+
+/*
+ Inspects a multicast Ethernet frame received from 'peer'. Membership reports
+ and leaves update the table; see mcast_snoop_t for the result.
+ */
+enum mcast_snoop_t mcast_snoop(struct mcast_table_t *table, const uint8_t *frame, size_t len, uint32_t peer,
+                               uint32_t now);
+
+/*
+ Copies the members of 'group' into 'members' (MCAST_MAX_MEMBERS entries) and
+ returns their number, or returns -1 if the group is not snooped and must be
+ flooded.
+ */
+int mcast_lookup(struct mcast_table_t *table, uint64_t group, uint32_t *members);
+
+/*
+ Drops memberships that lapsed before 'now', and groups left without members.
+ */
+void mcast_table_age(struct mcast_table_t *table, uint32_t now);
+
+#endif
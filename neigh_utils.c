@@ -0,0 +1,298 @@
+/*
+ This file implements the neighbour table and ARP/ND proxy declared in
+ neigh_utils.h.
+ */
+
+#include "neigh_utils.h"
+#include "ether_utils.h"
+#include "csum_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+
+#define ARP_LEN 28                 ///< Ethernet/IPv4 ARP packet
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+#define ND_NEIGHBOR_SOLICIT 135
+#define ND_NEIGHBOR_ADVERT 136
+#define ND_OPT_SOURCE_LINKADDR 1
+#define ND_OPT_TARGET_LINKADDR 2
+#define ND_NA_FLAG_SOLICITED 0x40
+#define ND_NA_FLAG_OVERRIDE 0x20
+#define ND_MIN_LEN 24              ///< ICMPv6 header, flags and target address
+#define IPV6_HDR_LEN 40
+#define ETHER_MIN_FRAME 60         ///< Shortest frame on the wire, without FCS
+
+static inline uint16_t neigh_read16(const uint8_t *p)
+{
+  return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline void neigh_write16(uint8_t *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+static inline void neigh_split(const uint8_t *ip, uint64_t *hi, uint64_t *lo)
+{
+  memcpy(hi, ip, sizeof(*hi));
+  memcpy(lo, ip + 8, sizeof(*lo));
+}
+
+static inline uint32_t neigh_hash(uint64_t hi, uint64_t lo)
+{
+  // Fibonacci hashing: multiply by 2^64 / phi and keep the high bits
+  return (uint32_t)(((hi * 31 + lo) * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// IPv4 addresses live in the table as ::ffff:a.b.c.d
+static inline void neigh_map_ipv4(const uint8_t *ipv4, uint8_t *ip)
+{
+  memset(ip, 0, 10);
+  ip[10] = 0xff;
+  ip[11] = 0xff;
+  memcpy(ip + 12, ipv4, 4);
+}
+
+void neigh_table_init(struct neigh_table_t *table)
+{
+  uint32_t slots = NEIGH_MAX_ENTRIES * 2;
+  table->entries = calloc(slots, sizeof(*table->entries));
+  if (table->entries == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate neighbour table: %s\n", strerror(errno));
+  }
+  table->mask = slots - 1;
+  table->size = 0;
+  pthread_mutex_init(&table->lock, NULL);
+}
+
+bool neigh_lookup(struct neigh_table_t *table, const uint8_t *ip, uint64_t *mac)
+{
+  uint64_t hi, lo;
+  neigh_split(ip, &hi, &lo);
+
+  for (uint32_t slot = neigh_hash(hi, lo) & table->mask;; slot = (slot + 1) & table->mask)
+  {
+    struct neigh_entry_t *entry = &table->entries[slot];
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+    uint64_t entry_hi = atomic_load_explicit(&entry->hi, memory_order_relaxed);
+    uint64_t entry_lo = atomic_load_explicit(&entry->lo, memory_order_relaxed);
+    uint64_t entry_mac = atomic_load_explicit(&entry->mac, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if ((seq & 1) || atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+    {
+      return false;  // Being written: flooding the request is always safe
+    }
+    if (entry_hi == 0 && entry_lo == 0)
+    {
+      return false;
+    }
+    if (entry_hi == hi && entry_lo == lo)
+    {
+      *mac = entry_mac;
+      return true;
+    }
+  }
+}
+
+static void neigh_learn(struct neigh_table_t *table, const uint8_t *ip, uint64_t mac)
+{
+  uint64_t known;
+  if (mac == 0 || mac_is_multicast(mac) || (neigh_lookup(table, ip, &known) && known == mac))
+  {
+    return;  // Nothing new: steady traffic never takes the lock
+  }
+
+  uint64_t hi, lo;
+  neigh_split(ip, &hi, &lo);
+  pthread_mutex_lock(&table->lock);
+  uint32_t slot = neigh_hash(hi, lo) & table->mask;
+  struct neigh_entry_t *entry;
+  while (true)
+  {
+    entry = &table->entries[slot];
+    uint64_t entry_hi = atomic_load_explicit(&entry->hi, memory_order_relaxed);
+    uint64_t entry_lo = atomic_load_explicit(&entry->lo, memory_order_relaxed);
+    if ((entry_hi == hi && entry_lo == lo) || (entry_hi == 0 && entry_lo == 0))
+    {
+      break;
+    }
+    slot = (slot + 1) & table->mask;
+  }
+
+  bool fresh = atomic_load_explicit(&entry->hi, memory_order_relaxed) == 0 &&
+               atomic_load_explicit(&entry->lo, memory_order_relaxed) == 0;
+  if (!fresh || table->size < NEIGH_MAX_ENTRIES)
+  {
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->hi, hi, memory_order_relaxed);
+    atomic_store_explicit(&entry->lo, lo, memory_order_relaxed);
+    atomic_store_explicit(&entry->mac, mac, memory_order_relaxed);
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+    table->size += fresh;
+  }
+  pthread_mutex_unlock(&table->lock);
+}
+
+static enum neigh_request_t neigh_snoop_arp(struct neigh_table_t *table, const uint8_t *frame, size_t len,
+                                            uint8_t *target)
+{
+  const uint8_t *arp = frame + ETHER_HDR_LEN;
+  if (len < ETHER_HDR_LEN + ARP_LEN || neigh_read16(arp) != 1 || neigh_read16(arp + 2) != ETHERTYPE_IP ||
+      arp[4] != ETH_ALEN || arp[5] != 4)
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  uint16_t op = neigh_read16(arp + 6);
+  const uint8_t *sha = arp + 8, *spa = arp + 14, *tpa = arp + 24;
+  bool probe = memcmp(spa, "\0\0\0\0", 4) == 0;  // Duplicate address detection (RFC 5227)
+
+  uint8_t ip[NEIGH_IP_LEN];
+  if (!probe && (op == ARP_REQUEST || op == ARP_REPLY))
+  {
+    neigh_map_ipv4(spa, ip);
+    neigh_learn(table, ip, mac_to_u64(sha));
+  }
+
+  // Gratuitous ARP (sender == target) announces rather than asks
+  if (op != ARP_REQUEST || probe || memcmp(spa, tpa, 4) == 0 || !mac_is_broadcast(mac_to_u64(frame)))
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  neigh_map_ipv4(tpa, target);
+  return NEIGH_ARP_REQUEST;
+}
+
+/*
+ Returns the link-layer address option of type 'type' in the options of a
+ neighbour discovery message, or NULL.
+ */
+static const uint8_t *neigh_find_option(const uint8_t *opts, size_t len, uint8_t type)
+{
+  while (len >= 8 && opts[1] != 0 && (size_t)opts[1] * 8 <= len)
+  {
+    if (opts[0] == type)
+    {
+      return opts + 2;
+    }
+    len -= opts[1] * 8;
+    opts += opts[1] * 8;
+  }
+  return NULL;
+}
+
+static enum neigh_request_t neigh_snoop_nd(struct neigh_table_t *table, const uint8_t *frame, size_t len,
+                                           uint8_t *target)
+{
+  const uint8_t *ip6 = frame + ETHER_HDR_LEN;
+  // Neighbour discovery is ICMPv6 right behind the IPv6 header, with a hop limit of 255
+  if (len < ETHER_HDR_LEN + IPV6_HDR_LEN + ND_MIN_LEN || ip6[6] != 58 || ip6[7] != 255)
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  const uint8_t *icmp = ip6 + IPV6_HDR_LEN;
+  size_t icmplen = neigh_read16(ip6 + 4);
+  if (icmplen < ND_MIN_LEN || ETHER_HDR_LEN + IPV6_HDR_LEN + icmplen > len || icmp[1] != 0 ||
+      (icmp[0] != ND_NEIGHBOR_SOLICIT && icmp[0] != ND_NEIGHBOR_ADVERT))
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  const uint8_t *src = ip6 + 8, *dst = ip6 + 24;
+  static const uint8_t unspecified[NEIGH_IP_LEN];
+
+  if (icmp[0] == ND_NEIGHBOR_ADVERT)
+  {
+    const uint8_t *tlla = neigh_find_option(icmp + ND_MIN_LEN, icmplen - ND_MIN_LEN, ND_OPT_TARGET_LINKADDR);
+    neigh_learn(table, icmp + 8, mac_to_u64(tlla ? tlla : frame + ETH_ALEN));
+    return NEIGH_NO_REQUEST;
+  }
+
+  // Solicitations from the unspecified address are duplicate address detection: never answer those
+  if (memcmp(src, unspecified, NEIGH_IP_LEN) == 0)
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  const uint8_t *slla = neigh_find_option(icmp + ND_MIN_LEN, icmplen - ND_MIN_LEN, ND_OPT_SOURCE_LINKADDR);
+  if (slla != NULL)
+  {
+    neigh_learn(table, src, mac_to_u64(slla));
+  }
+  if (dst[0] != 0xff)
+  {
+    return NEIGH_NO_REQUEST;  // Unicast solicitations (reachability checks) go to the target
+  }
+  memcpy(target, icmp + 8, NEIGH_IP_LEN);
+  return NEIGH_SOLICIT;
+}
+
+enum neigh_request_t neigh_snoop(struct neigh_table_t *table, const uint8_t *frame, size_t len, uint8_t *target)
+{
+  if (len < ETHER_HDR_LEN)
+  {
+    return NEIGH_NO_REQUEST;
+  }
+  uint16_t type = neigh_read16(frame + 12);
+  if (type == ETHERTYPE_ARP)
+  {
+    return neigh_snoop_arp(table, frame, len, target);
+  }
+  if (type == ETHERTYPE_IPV6)
+  {
+    return neigh_snoop_nd(table, frame, len, target);
+  }
+  return NEIGH_NO_REQUEST;
+}
+
+size_t neigh_build_reply(enum neigh_request_t kind, const uint8_t *frame, const uint8_t *target,
+                         uint64_t target_mac, uint8_t *reply)
+{
+  // Ethernet: back to the requester, from the target
+  memcpy(reply, frame + ETH_ALEN, ETH_ALEN);
+  mac_from_u64(target_mac, reply + ETH_ALEN);
+
+  if (kind == NEIGH_ARP_REQUEST)
+  {
+    const uint8_t *req = frame + ETHER_HDR_LEN;
+    uint8_t *arp = reply + ETHER_HDR_LEN;
+    neigh_write16(reply + 12, ETHERTYPE_ARP);
+    memcpy(arp, req, 6);                     // Hardware/protocol types and lengths
+    neigh_write16(arp + 6, ARP_REPLY);
+    mac_from_u64(target_mac, arp + 8);       // Sender: the target
+    memcpy(arp + 14, target + 12, 4);
+    memcpy(arp + 18, req + 8, ETH_ALEN + 4); // Target: the requester's hardware and protocol address
+    memset(arp + ARP_LEN, 0, ETHER_MIN_FRAME - ETHER_HDR_LEN - ARP_LEN);
+    return ETHER_MIN_FRAME;
+  }
+
+  // Neighbour advertisement: IPv6 header, ICMPv6 header, flags, target, target link-layer address option
+  const uint8_t *req = frame + ETHER_HDR_LEN;
+  uint8_t *ip6 = reply + ETHER_HDR_LEN;
+  uint8_t *icmp = ip6 + IPV6_HDR_LEN;
+  size_t icmplen = ND_MIN_LEN + 8;
+  neigh_write16(reply + 12, ETHERTYPE_IPV6);
+  memset(ip6, 0, 4);
+  ip6[0] = 0x60;
+  neigh_write16(ip6 + 4, icmplen);
+  ip6[6] = 58;
+  ip6[7] = 255;
+  memcpy(ip6 + 8, target, NEIGH_IP_LEN);
+  memcpy(ip6 + 24, req + 8, NEIGH_IP_LEN);   // The solicitation's source
+
+  memset(icmp, 0, icmplen);
+  icmp[0] = ND_NEIGHBOR_ADVERT;
+  icmp[4] = ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE;
+  memcpy(icmp + 8, target, NEIGH_IP_LEN);
+  icmp[24] = ND_OPT_TARGET_LINKADDR;
+  icmp[25] = 1;
+  mac_from_u64(target_mac, icmp + 26);
+
+  // ICMPv6 checksum over the pseudo-header (addresses, length, next header) and the message
+  uint32_t sum = csum_add(0, ip6 + 8, 2 * NEIGH_IP_LEN);
+  sum += icmplen + 58;
+  sum = csum_add(sum, icmp, icmplen);
+  csum_store(icmp + 2, csum_fold(sum));
+  return ETHER_HDR_LEN + IPV6_HDR_LEN + icmplen;
+}
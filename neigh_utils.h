@@ -0,0 +1,74 @@
+/*
+ This header declares the VSwitch's neighbour table and ARP/ND proxy. The
+ switch snoops the IP-to-MAC bindings that ARP packets and IPv6 neighbour
+ solicitations/advertisements carry as they pass through, and answers ARP
+ requests and neighbour solicitations for known addresses itself, so they
+ no longer have to be flooded to every VPort.
+
+ Addresses are kept as 16 bytes, IPv4 ones mapped to ::ffff:a.b.c.d. The
+ table is open-addressed with a hard capacity and is never shrunk; bindings
+ are only used while their MAC is still in the MAC table, so entries for
+ hosts that went away fall back to flooding on their own. Each entry has its
+ own sequence count: lookups take no lock and treat an entry that changed
+ under them as a miss, and writers serialize on a mutex.
+ */
+
+#ifndef _NEIGH_UTILS_H
+#define _NEIGH_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define NEIGH_MAX_ENTRIES 16384   ///< IP addresses tracked at once; others are resolved by flooding
+#define NEIGH_IP_LEN 16
+#define NEIGH_REPLY_MAX 86        ///< Largest reply neigh_build_reply() produces (a neighbour advertisement)
+
+enum neigh_request_t
+{
+  NEIGH_NO_REQUEST,   ///< Nothing to answer (bindings it carried were learned)
+  NEIGH_ARP_REQUEST,  ///< Broadcast ARP request
+  NEIGH_SOLICIT,      ///< Multicast IPv6 neighbour solicitation
+};
+
+struct neigh_entry_t
+{
+  _Atomic uint32_t seq;   ///< Odd while the entry is being written
+  _Atomic uint64_t hi;    ///< First 8 bytes of the address; hi == lo == 0 marks a free slot
+  _Atomic uint64_t lo;    ///< Last 8 bytes of the address
+  _Atomic uint64_t mac;   ///< Packed MAC the address lives at
+};
+
+struct neigh_table_t
+{
+  struct neigh_entry_t *entries;  ///< mask + 1 slots, at most half of them used
+  uint32_t mask;
+  uint32_t size;                  ///< Number of entries (writers only)
+  pthread_mutex_t lock;           ///< Serializes writers
+};
+
+void neigh_table_init(struct neigh_table_t *table);
+
+/*
+ Looks up the MAC of 'ip' without taking any lock.
+ */
+bool neigh_lookup(struct neigh_table_t *table, const uint8_t *ip, uint64_t *mac);
+
+/*
+ Learns the bindings carried by an Ethernet frame (ARP, neighbour
+ solicitations and advertisements) and tells whether it is a request the
+ switch could answer, storing the wanted address in 'target'.
+ */
+enum neigh_request_t neigh_snoop(struct neigh_table_t *table, const uint8_t *frame, size_t len, uint8_t *target);
+
+/*
+ Builds the answer to request 'frame' (of kind 'kind', as returned by
+ neigh_snoop()) on behalf of 'target_mac' into 'reply', which must hold
+ NEIGH_REPLY_MAX bytes. Returns the length of the reply frame.
+ */
+size_t neigh_build_reply(enum neigh_request_t kind, const uint8_t *frame, const uint8_t *target,
+                         uint64_t target_mac, uint8_t *reply);
+
+#endif
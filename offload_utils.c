@@ -0,0 +1,153 @@
+/*
+ This file implements checksum completion and TCP segmentation for frames
+ carrying a virtio_net_hdr, for delivery to peers that run without offloads.
+ */
+
+#include "offload_utils.h"
+#include "csum_utils.h"
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+bool offload_needs_segmentation(const struct virtio_net_hdr *vnet)
+{
+  return (vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_NONE;
+}
+
+void offload_complete_csum(uint8_t *frame, size_t len, struct virtio_net_hdr *vnet)
+{
+  if (!(vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+  {
+    return;
+  }
+
+  size_t start = le16toh(vnet->csum_start);
+  size_t field = start + le16toh(vnet->csum_offset);
+  if (field + 2 > len)
+  {
+    return;  // Bogus offsets, leave the frame alone
+  }
+
+  // The field already holds the pseudo-header sum; fold in the rest of the packet
+  csum_store(frame + field, csum_fold(csum_add(0, frame + start, len - start)));
+  vnet->flags &= ~VIRTIO_NET_HDR_F_NEEDS_CSUM;
+}
+
+int offload_segment(const uint8_t *frame, size_t len, const struct virtio_net_hdr *vnet,
+                    uint8_t *out, size_t outsz, struct iovec *segs, int maxsegs)
+{
+  uint8_t gso_type = vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+  if (gso_type != VIRTIO_NET_HDR_GSO_TCPV4 && gso_type != VIRTIO_NET_HDR_GSO_TCPV6)
+  {
+    return -1;
+  }
+  bool ipv4 = gso_type == VIRTIO_NET_HDR_GSO_TCPV4;
+
+  // Locate the L3 header (skipping one 802.1Q tag) and the TCP header
+  size_t l3 = ETHER_HDR_LEN;
+  if (len >= l3 && frame[12] == 0x81 && frame[13] == 0x00)
+  {
+    l3 += 4;
+  }
+  // The sender's header is not to be trusted: every segment gets its IP header rewritten in place, so the
+  // headers copied into it must hold all of that header
+  if (l3 + (ipv4 ? 20 : 40) > len)
+  {
+    return -1;
+  }
+  size_t ihl = ipv4 ? (frame[l3] & 0x0f) * 4 : 40;
+  if (ihl < 20)
+  {
+    return -1;
+  }
+  size_t l4;
+  if (vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+  {
+    l4 = le16toh(vnet->csum_start);  // Accounts for IPv4 options and IPv6 extension headers
+  }
+  else
+  {
+    l4 = l3 + ihl;
+  }
+  if (l4 < l3 + ihl || l4 + 20 > len)
+  {
+    return -1;
+  }
+  size_t tcp_hlen = (frame[l4 + 12] >> 4) * 4;
+  size_t hdr_len = l4 + tcp_hlen;
+  size_t mss = le16toh(vnet->gso_size);
+  if (tcp_hlen < 20 || hdr_len >= len || mss == 0)
+  {
+    return -1;
+  }
+
+  size_t payload = len - hdr_len;
+  int nsegs = (payload + mss - 1) / mss;
+  if (nsegs > maxsegs || payload + (size_t)nsegs * hdr_len > outsz)
+  {
+    return -1;
+  }
+
+  uint32_t seq;
+  memcpy(&seq, frame + l4 + 4, sizeof(seq));
+  seq = ntohl(seq);
+  uint16_t ip_id = ipv4 ? (frame[l3 + 4] << 8) | frame[l3 + 5] : 0;
+
+  uint8_t *seg = out;
+  for (int i = 0; i < nsegs; i++)
+  {
+    size_t off = (size_t)i * mss;
+    size_t chunk = payload - off < mss ? payload - off : mss;
+    size_t l4_len = tcp_hlen + chunk;
+
+    memcpy(seg, frame, hdr_len);
+    memcpy(seg + hdr_len, frame + hdr_len + off, chunk);
+
+    // Fix up the IP header and build the pseudo-header sum
+    uint32_t sum;
+    if (ipv4)
+    {
+      uint8_t *iph = seg + l3;
+      uint16_t tot_len = htons(l4 - l3 + l4_len);
+      uint16_t id = htons(ip_id + i);
+      memcpy(iph + 2, &tot_len, 2);
+      memcpy(iph + 4, &id, 2);
+      iph[10] = iph[11] = 0;
+      csum_store(iph + 10, csum_fold(csum_add(0, iph, ihl)));
+      sum = csum_add(0, iph + 12, 8) + IPPROTO_TCP + l4_len;
+    }
+    else
+    {
+      uint8_t *ip6h = seg + l3;
+      uint16_t payload_len = htons(l4 - l3 - 40 + l4_len);
+      memcpy(ip6h + 4, &payload_len, 2);
+      sum = csum_add(0, ip6h + 8, 32) + IPPROTO_TCP + (l4_len >> 16) + (l4_len & 0xffff);
+    }
+
+    // Fix up the TCP header: sequence number, per-segment flags and checksum
+    uint8_t *tcph = seg + l4;
+    uint32_t seg_seq = htonl(seq + off);
+    memcpy(tcph + 4, &seg_seq, 4);
+    if (i != nsegs - 1)
+    {
+      tcph[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);  // Only the last segment finishes the write
+    }
+    if (i != 0)
+    {
+      tcph[13] &= ~TCP_FLAG_CWR;                   // Only the first segment reduces the window
+    }
+    tcph[16] = tcph[17] = 0;
+    csum_store(tcph + 16, csum_fold(csum_add(sum, tcph, l4_len)));
+
+    segs[i].iov_base = seg;
+    segs[i].iov_len = hdr_len + chunk;
+    seg += hdr_len + chunk;
+  }
+
+  return nsegs;
+}
@@ -0,0 +1,78 @@
+/*
+ This header declares the offload encapsulation used when a VPort runs its TAP
+ with IFF_VNET_HDR. Every frame read from such a TAP is preceded by a
+ virtio_net_hdr describing pending segmentation (TSO/GSO) and checksum work,
+ and frames may be up to 64 KB "super-frames". Instead of doing that work at
+ the sender, the header travels across the tunnel:
+
+   | magic (2) | virtio_net_hdr (10) | Ethernet frame ... |
+
+ Peers in offload mode write the header and frame straight back into their
+ TAP (the receiving kernel finishes the job, often for free); everyone else
+ gets ordinary MTU-sized frames produced by offload_segment().
+ */
+
+#ifndef _OFFLOAD_UTILS_H
+#define _OFFLOAD_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/virtio_net.h>
+
+// Marker bytes in front of every encapsulated frame. A datagram starting with
+// ff:56 would otherwise be a frame for a group address no station uses, so the
+// marker never collides with plain Ethernet traffic in practice.
+#define OFFLOAD_MAGIC0 0xff
+#define OFFLOAD_MAGIC1 0x56
+#define OFFLOAD_MAGIC_LEN 2
+
+#define OFFLOAD_MAX_DATAGRAM 65536      ///< Buffer size that fits any UDP datagram
+#define OFFLOAD_MAX_UDP_PAYLOAD 65507   ///< Largest IPv4 UDP payload
+#define OFFLOAD_GSO_MAX_SIZE 64000      ///< TAP gso_max_size that keeps super-frames within one datagram
+#define OFFLOAD_MAX_SEGS 64             ///< Upper bound on segments produced from one super-frame
+
+struct offload_hdr_t
+{
+  uint8_t magic[OFFLOAD_MAGIC_LEN];  ///< OFFLOAD_MAGIC0, OFFLOAD_MAGIC1
+  struct virtio_net_hdr vnet;        ///< Exactly as read from the TAP (little-endian fields)
+};
+
+#define OFFLOAD_HDR_LEN sizeof(struct offload_hdr_t)
+_Static_assert(OFFLOAD_HDR_LEN == 12, "offload_hdr_t must have no padding");
+
+static inline bool offload_is_encapsulated(const char *data, size_t len)
+{
+  return len >= OFFLOAD_HDR_LEN && (uint8_t)data[0] == OFFLOAD_MAGIC0 && (uint8_t)data[1] == OFFLOAD_MAGIC1;
+}
+
+static inline void offload_set_magic(char *datagram)
+{
+  datagram[0] = (char)OFFLOAD_MAGIC0;
+  datagram[1] = (char)OFFLOAD_MAGIC1;
+}
+
+/*
+ Returns true if the frame still needs segmentation (a GSO super-frame).
+ */
+bool offload_needs_segmentation(const struct virtio_net_hdr *vnet);
+
+/*
+ Finishes a partial checksum requested with VIRTIO_NET_HDR_F_NEEDS_CSUM and
+ clears the flag, so the frame can be delivered to a peer without offloads.
+ */
+void offload_complete_csum(uint8_t *frame, size_t len, struct virtio_net_hdr *vnet);
+
+/*
+ Splits a TCPv4/TCPv6 super-frame into gso_size segments with complete IP and
+ TCP checksums. The segments are written back to back into 'out' and
+ described by 'segs'.
+
+ @return number of segments, or -1 if the frame cannot be segmented (unknown
+         GSO type, malformed headers, or 'out'/'segs' too small)
+ */
+int offload_segment(const uint8_t *frame, size_t len, const struct virtio_net_hdr *vnet,
+                    uint8_t *out, size_t outsz, struct iovec *segs, int maxsegs);
+
+#endif
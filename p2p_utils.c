@@ -0,0 +1,79 @@
+/*
+ This file implements the peer-to-peer path helpers declared in p2p_utils.h.
+ */
+
+#include "p2p_utils.h"
+#include "ether_utils.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+static inline uint32_t p2p_slot(uint64_t mac)
+{
+  // Fibonacci hashing: multiply by 2^64 / phi and keep the high bits
+  return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 32) & (P2P_CACHE_SIZE - 1);
+}
+
+void p2p_hint_set(struct p2p_hint_t *hint, uint64_t mac, const struct sockaddr_in *addr, uint16_t ttl)
+{
+  p2p_set_header((char *)hint, P2P_MSG_HINT);
+  mac_from_u64(mac, hint->mac);
+  hint->ttl = htons(ttl);
+  hint->addr = addr->sin_addr.s_addr;
+  hint->port = addr->sin_port;
+}
+
+void p2p_cache_init(struct p2p_cache_t *cache)
+{
+  for (unsigned int i = 0; i < P2P_CACHE_SIZE; i++)
+  {
+    atomic_init(&cache->entries[i].seq, 0);
+    atomic_init(&cache->entries[i].expires, 0);
+    atomic_init(&cache->entries[i].mac, 0);
+    atomic_init(&cache->entries[i].endpoint, 0);
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  atomic_init(&cache->hello_sent, 0);
+}
+
+void p2p_cache_put(struct p2p_cache_t *cache, const struct p2p_hint_t *hint, uint32_t now)
+{
+  uint64_t mac = mac_to_u64(hint->mac);
+  struct p2p_cache_entry_t *entry = &cache->entries[p2p_slot(mac)];
+
+  // A newer hint for another MAC simply takes over the slot
+  pthread_mutex_lock(&cache->lock);
+  uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&entry->mac, mac, memory_order_relaxed);
+  atomic_store_explicit(&entry->endpoint, ((uint64_t)hint->addr << 16) | hint->port, memory_order_relaxed);
+  atomic_store_explicit(&entry->expires, now + ntohs(hint->ttl), memory_order_relaxed);
+  atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+bool p2p_cache_lookup(struct p2p_cache_t *cache, uint64_t mac, uint32_t now, struct sockaddr_in *addr)
+{
+  struct p2p_cache_entry_t *entry = &cache->entries[p2p_slot(mac)];
+
+  uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+  uint64_t stored = atomic_load_explicit(&entry->mac, memory_order_relaxed);
+  uint64_t endpoint = atomic_load_explicit(&entry->endpoint, memory_order_relaxed);
+  // Signed, so a path stored with a slightly later clock than 'now' still counts
+  int32_t remaining = (int32_t)(atomic_load_explicit(&entry->expires, memory_order_relaxed) - now);
+  atomic_thread_fence(memory_order_acquire);
+  if ((seq & 1) || atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+  {
+    return false;
+  }
+  if (stored != mac || mac == 0 || remaining <= 0)
+  {
+    return false;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = (uint32_t)(endpoint >> 16);
+  addr->sin_port = (uint16_t)(endpoint & 0xffff);
+  return true;
+}
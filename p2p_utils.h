@@ -0,0 +1,123 @@
+/*
+ This header declares the control messages that let VPorts send unicast
+ frames straight to each other instead of hairpinning through the VSwitch,
+ and the VPort-side cache of the direct paths learned from them.
+
+ A VPort started with -p tells the VSwitch that it takes part by sending a
+ hello now and then while it has traffic:
+
+   | magic (2) | P2P_MSG_HELLO | flags |
+
+ When the VSwitch forwards a unicast frame between two such VPorts, it tells
+ the sender where the destination MAC lives (at most once a second per
+ sender and MAC):
+
+   | magic (2) | P2P_MSG_HINT | flags | MAC (6) | TTL (2) | IPv4 (4) | UDP port (2) |
+
+ The sender then addresses frames for that MAC to the peer VPort directly
+ until the hint's TTL runs out; the next frame goes through the VSwitch
+ again, which refreshes its MAC table and renews the hint. Broadcasts and
+ frames for unknown MACs always go through the VSwitch. Like the offload and
+ port tag magics, ff:51 would otherwise start a frame for a group address no
+ station uses.
+ */
+
+#ifndef _P2P_UTILS_H
+#define _P2P_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#define P2P_MAGIC0 0xff
+#define P2P_MAGIC1 0x51
+#define P2P_MSG_HELLO 1
+#define P2P_MSG_HINT 2
+#define P2P_HELLO_LEN 4
+#define P2P_HELLO_INTERVAL 10    ///< Seconds between hellos from a VPort with traffic
+#define P2P_HELLO_TIMEOUT 30     ///< Seconds after a hello that the VSwitch still sends hints to a VPort
+#define P2P_HINT_TTL 10          ///< Seconds a VPort uses a direct path before asking the VSwitch again
+#define P2P_CACHE_SIZE 256       ///< Direct-mapped VPort cache entries, a power of two
+
+struct p2p_hint_t
+{
+  uint8_t magic[2];         ///< P2P_MAGIC0, P2P_MAGIC1
+  uint8_t type;             ///< P2P_MSG_HINT
+  uint8_t flags;            ///< Reserved, 0
+  uint8_t mac[ETH_ALEN];    ///< Destination MAC
+  uint16_t ttl;             ///< Seconds the path may be used, network byte order
+  uint32_t addr;            ///< IPv4 address of the VPort behind 'mac', network byte order
+  uint16_t port;            ///< UDP port of that VPort, network byte order
+} __attribute__((packed));
+
+struct p2p_cache_entry_t
+{
+  _Atomic uint32_t seq;       ///< Odd while the entry is being written
+  _Atomic uint32_t expires;   ///< Time after which the path is no longer used
+  _Atomic uint64_t mac;       ///< Packed MAC, 0 if the entry is unused
+  _Atomic uint64_t endpoint;  ///< IPv4 address << 16 | UDP port, both in network byte order
+};
+
+/*
+ Direct paths of one VPort, shared by all of its queues: hints are stored by
+ whichever thread receives them and read without locking by the senders.
+ */
+struct p2p_cache_t
+{
+  struct p2p_cache_entry_t entries[P2P_CACHE_SIZE];
+  pthread_mutex_t lock;           ///< Serializes writers
+  _Atomic uint32_t hello_sent;    ///< Time of the last hello, 0 if none was sent yet
+};
+
+static inline bool p2p_is_msg(const char *data, size_t len)
+{
+  return len >= P2P_HELLO_LEN && (uint8_t)data[0] == P2P_MAGIC0 && (uint8_t)data[1] == P2P_MAGIC1;
+}
+
+static inline uint8_t p2p_msg_type(const char *data)
+{
+  return (uint8_t)data[2];
+}
+
+static inline void p2p_set_header(char *data, uint8_t type)
+{
+  data[0] = (char)P2P_MAGIC0;
+  data[1] = (char)P2P_MAGIC1;
+  data[2] = (char)type;
+  data[3] = 0;
+}
+
+/*
+ Coarse monotonic time in seconds, the clock of every P2P timestamp.
+ */
+static inline uint32_t p2p_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)ts.tv_sec;
+}
+
+/*
+ Builds the hint telling a VPort that 'mac' lives behind 'addr'.
+ */
+void p2p_hint_set(struct p2p_hint_t *hint, uint64_t mac, const struct sockaddr_in *addr, uint16_t ttl);
+
+void p2p_cache_init(struct p2p_cache_t *cache);
+
+/*
+ Records the direct path announced by 'hint', received at time 'now'.
+ */
+void p2p_cache_put(struct p2p_cache_t *cache, const struct p2p_hint_t *hint, uint32_t now);
+
+/*
+ Looks up a direct path to 'mac'. Returns true and fills in 'addr' if one is
+ known and has not expired; a lookup that races a writer simply misses.
+ */
+bool p2p_cache_lookup(struct p2p_cache_t *cache, uint64_t mac, uint32_t now, struct sockaddr_in *addr);
+
+#endif
@@ -0,0 +1,457 @@
+/*
+ This file implements the packet ring underlay declared in packet_utils.h:
+ the TPACKET_V3 rings and their filters, the outer headers and the next hop
+ lookup.
+ */
+
+#include "packet_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <net/route.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>   // Ethernet protocol definitions
+#include <linux/filter.h>   // Classic BPF for both filters
+#include "csum_utils.h"
+
+#define PACKET_RX_FRAME_SIZE 2048   ///< Only sizes the ring; TPACKET_V3 packs packets of any size into a block
+#define PACKET_TX_BLOCK_SIZE 65536
+#define PACKET_IPV4_LEN 20
+#define PACKET_UDP_LEN 8
+#define PACKET_TTL 64
+
+#define PACKET_TX_DATA (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))  ///< Where a TX frame's packet starts
+
+static int packet_ring_filter(struct packet_ring_t *ring)
+{
+  // Packet sockets run filters with the packet positioned at the Ethernet header
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),       // 0: A = packet type
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_HOST, 0, 12),               // 1: not for this host: drop
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                                // 2: A = EtherType
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 10),              // 3: not IPv4: drop
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),                                // 4: A = IP protocol
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 8),                // 5: not UDP: drop
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                                // 6: A = flags and fragment offset
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 6, 0),                    // 7: a fragment: drop
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 30),                                // 8: A = destination address
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(ring->path.src.sin_addr.s_addr), 0, 4),  // 9: not ours: drop
+    BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, ETHER_HDR_LEN),                    // 10: X = IP header length
+    BPF_STMT(BPF_LD | BPF_H | BPF_IND, ETHER_HDR_LEN + 2),                 // 11: A = UDP destination port
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(ring->path.src.sin_port), 0, 1),  // 12: not ours: drop
+    BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),                                 // 13: the whole packet
+    BPF_STMT(BPF_RET | BPF_K, 0),                                          // 14: drop
+  };
+  struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+  return setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/*
+ Reads the MAC address and MTU of the interface, and the address the kernel
+ sends from towards the VSwitch.
+ */
+static int packet_read_iface(struct packet_ring_t *ring)
+{
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  memcpy(ifr.ifr_name, ring->ifname, PACKET_IFNAMSIZ);
+  if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0)
+  {
+    return -1;
+  }
+  memcpy(ring->path.src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+  if (ioctl(ring->fd, SIOCGIFMTU, &ifr) < 0)
+  {
+    return -1;
+  }
+  ring->mtu = ifr.ifr_mtu;
+
+  // Connecting a UDP socket sends nothing but picks the source address
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in src;
+  socklen_t len = sizeof(src);
+  if (fd < 0 || connect(fd, (const struct sockaddr *)&ring->path.dst, sizeof(ring->path.dst)) < 0 ||
+      getsockname(fd, (struct sockaddr *)&src, &len) < 0)
+  {
+    int saved = errno;
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    errno = saved;
+    return -1;
+  }
+  close(fd);
+  ring->path.src.sin_addr = src.sin_addr;
+  return 0;
+}
+
+int packet_ring_open(struct packet_ring_t *ring, const char *ifname, uint16_t port, const struct sockaddr_in *dst)
+{
+  memset(ring, 0, sizeof(*ring));
+  strncpy(ring->ifname, ifname, PACKET_IFNAMSIZ - 1);
+  ring->path.src.sin_family = AF_INET;
+  ring->path.src.sin_port = port;
+  ring->path.dst = *dst;
+  if ((ring->ifindex = if_nametoindex(ifname)) == 0)
+  {
+    return -1;
+  }
+
+  // Protocol 0: nothing is received until the socket is bound, with the filter in place
+  if ((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+  {
+    return -1;
+  }
+  int version = TPACKET_V3;
+  int one = 1;
+  if (packet_read_iface(ring) < 0 || packet_ring_filter(ring) < 0 ||
+      setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+  {
+    goto fail;
+  }
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0)
+  {
+    fprintf(stderr, "fail to setsockopt PACKET_QDISC_BYPASS: %s\n", strerror(errno));
+  }
+
+  struct tpacket_req3 rx_req = {
+    .tp_block_size = PACKET_RX_BLOCK_SIZE,
+    .tp_block_nr = PACKET_RX_BLOCKS,
+    .tp_frame_size = PACKET_RX_FRAME_SIZE,
+    .tp_frame_nr = PACKET_RX_BLOCK_SIZE / PACKET_RX_FRAME_SIZE * PACKET_RX_BLOCKS,
+    .tp_retire_blk_tov = PACKET_RX_RETIRE_MS,
+  };
+
+  // TX frames are fixed-size slots that hold the largest packet of the interface
+  size_t frame_size = PACKET_RX_FRAME_SIZE;
+  while (frame_size < PACKET_TX_DATA + ETHER_HDR_LEN + ring->mtu)
+  {
+    frame_size *= 2;
+  }
+  size_t block_size = frame_size > PACKET_TX_BLOCK_SIZE ? frame_size : PACKET_TX_BLOCK_SIZE;
+  size_t per_block = block_size / frame_size;
+  size_t blocks = (PACKET_TX_FRAMES + per_block - 1) / per_block;
+  struct tpacket_req3 tx_req = {
+    .tp_block_size = block_size,
+    .tp_block_nr = blocks,
+    .tp_frame_size = frame_size,
+    .tp_frame_nr = blocks * per_block,
+  };
+  ring->tx_frame_size = frame_size;
+  ring->tx_frames = blocks * per_block;
+  if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) < 0 ||
+      setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) < 0)
+  {
+    goto fail;
+  }
+
+  ring->mapsz = (size_t)PACKET_RX_BLOCK_SIZE * PACKET_RX_BLOCKS + block_size * blocks;
+  if ((ring->map = mmap(NULL, ring->mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0)) == MAP_FAILED)
+  {
+    ring->map = NULL;
+    goto fail;
+  }
+
+  struct sockaddr_ll addr = {.sll_family = AF_PACKET, .sll_protocol = htons(ETH_P_IP), .sll_ifindex = ring->ifindex};
+  if (bind(ring->fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    goto fail;
+  }
+  return 0;
+
+fail:;
+  int saved = errno;
+  if (ring->map != NULL)
+  {
+    munmap(ring->map, ring->mapsz);
+  }
+  close(ring->fd);
+  errno = saved;
+  return -1;
+}
+
+/*
+ Returns the gateway of the most specific route to 'dst' through the ring's
+ interface, 'dst' itself for a directly connected one, or INADDR_ANY if no
+ route goes there.
+ */
+static in_addr_t packet_next_hop(const struct packet_ring_t *ring, in_addr_t dst)
+{
+  FILE *routes = fopen("/proc/net/route", "r");
+  if (routes == NULL)
+  {
+    return INADDR_ANY;
+  }
+
+  // Addresses are printed as the hexadecimal value of the network-order word
+  char line[256];
+  in_addr_t next_hop = INADDR_ANY;
+  int best = -1;
+  while (fgets(line, sizeof(line), routes) != NULL)
+  {
+    char iface[IFNAMSIZ + 1];
+    unsigned int dest, gateway, flags, mask;
+    if (sscanf(line, "%16s %x %x %x %*d %*d %*d %x", iface, &dest, &gateway, &flags, &mask) != 5 ||
+        strcmp(iface, ring->ifname) != 0 || !(flags & RTF_UP) || (dst & mask) != dest)
+    {
+      continue;  // The header line does not parse either
+    }
+    int prefix = __builtin_popcount(mask);
+    if (prefix > best)
+    {
+      best = prefix;
+      next_hop = (flags & RTF_GATEWAY) ? gateway : dst;
+    }
+  }
+  fclose(routes);
+  return next_hop;
+}
+
+/*
+ Looks up the MAC address of 'addr' on the ring's interface in the kernel's
+ neighbour table. Returns false unless a complete entry exists.
+ */
+static bool packet_neighbour(const struct packet_ring_t *ring, in_addr_t addr, uint8_t *mac)
+{
+  FILE *arp = fopen("/proc/net/arp", "r");
+  if (arp == NULL)
+  {
+    return false;
+  }
+  char line[256];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), arp) != NULL)
+  {
+    char ip[INET_ADDRSTRLEN], dev[IFNAMSIZ + 1];
+    unsigned int type, flags;
+    struct in_addr entry;
+    if (sscanf(line, "%15s %x %x %hhx:%hhx:%hhx:%hhx:%hhx:%hhx %*s %16s", ip, &type, &flags, &mac[0], &mac[1],
+               &mac[2], &mac[3], &mac[4], &mac[5], dev) != 10)
+    {
+      continue;
+    }
+    found = inet_pton(AF_INET, ip, &entry) == 1 && entry.s_addr == addr && (flags & ATF_COM) &&
+            strcmp(dev, ring->ifname) == 0;
+  }
+  fclose(arp);
+  return found;
+}
+
+bool packet_path_resolve(struct packet_ring_t *ring)
+{
+  in_addr_t next_hop = packet_next_hop(ring, ring->path.dst.sin_addr.s_addr);
+  ring->path.resolved = next_hop != INADDR_ANY && packet_neighbour(ring, next_hop, ring->path.dst_mac);
+  return ring->path.resolved;
+}
+
+int packet_socket_filter(struct packet_ring_t *ring, int sockfd)
+{
+  // UDP sockets run filters with the packet positioned at the UDP header
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),                                      // A = UDP length
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ring->mtu - PACKET_IPV4_LEN, 0, 1),     // Fits one packet: drop
+    BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static inline struct tpacket_block_desc *packet_rx_block(const struct packet_ring_t *ring, unsigned int block)
+{
+  return (struct tpacket_block_desc *)(ring->map + (size_t)block * PACKET_RX_BLOCK_SIZE);
+}
+
+bool packet_rx_next(struct packet_ring_t *ring, char **datagram, int *datagramsz, struct sockaddr_in *from)
+{
+  while (true)
+  {
+    if (ring->rx_left == 0)
+    {
+      // Give the block read to the end back to the kernel, then see if the next one is ready
+      if (ring->rx_held)
+      {
+        __atomic_store_n(&packet_rx_block(ring, ring->rx_block)->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                         __ATOMIC_RELEASE);
+        ring->rx_block = (ring->rx_block + 1) % PACKET_RX_BLOCKS;
+        ring->rx_held = false;
+      }
+      struct tpacket_block_desc *block = packet_rx_block(ring, ring->rx_block);
+      if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+      {
+        return false;
+      }
+      ring->rx_held = true;
+      ring->rx_left = block->hdr.bh1.num_pkts;
+      ring->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+      continue;
+    }
+
+    struct tpacket3_hdr *pkt = ring->rx_pkt;
+    ring->rx_left--;
+    ring->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)pkt + pkt->tp_next_offset);
+
+    // The filter let through only unfragmented IPv4/UDP, but not necessarily all of it
+    uint8_t *packet = (uint8_t *)pkt + pkt->tp_mac;
+    uint32_t len = pkt->tp_snaplen;
+    if (len != pkt->tp_len || len < ETHER_HDR_LEN + PACKET_IPV4_LEN + PACKET_UDP_LEN)
+    {
+      continue;
+    }
+    uint8_t *ip = packet + ETHER_HDR_LEN;
+    uint32_t ip_hdr_len = (ip[0] & 0x0f) * 4;
+    uint8_t *udp = ip + ip_hdr_len;
+    uint32_t udp_len = ((uint32_t)udp[4] << 8) | udp[5];
+    if (ip_hdr_len < PACKET_IPV4_LEN || udp_len < PACKET_UDP_LEN ||
+        ETHER_HDR_LEN + ip_hdr_len + udp_len > len)
+    {
+      continue;
+    }
+    memset(from, 0, sizeof(*from));
+    from->sin_family = AF_INET;
+    memcpy(&from->sin_addr.s_addr, ip + 12, 4);
+    memcpy(&from->sin_port, udp, 2);
+    *datagram = (char *)udp + PACKET_UDP_LEN;
+    *datagramsz = udp_len - PACKET_UDP_LEN;
+    return true;
+  }
+}
+
+static inline struct tpacket3_hdr *packet_tx_frame(const struct packet_ring_t *ring, unsigned int frame)
+{
+  return (struct tpacket3_hdr *)(ring->map + (size_t)PACKET_RX_BLOCK_SIZE * PACKET_RX_BLOCKS +
+                                 (size_t)frame * ring->tx_frame_size);
+}
+
+static inline bool packet_tx_free(struct tpacket3_hdr *hdr)
+{
+  uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+  return status == TP_STATUS_AVAILABLE || (status & TP_STATUS_WRONG_FORMAT);
+}
+
+/*
+ Writes the outer headers for a datagram of 'len' bytes: the addresses of
+ the path, DF set, and no UDP checksum, as the kernel sends tunnel datagrams
+ too when the device does not compute it.
+ */
+static void packet_write_headers(const struct packet_path_t *path, uint8_t *packet, size_t len)
+{
+  memcpy(packet, path->dst_mac, ETH_ALEN);
+  memcpy(packet + ETH_ALEN, path->src_mac, ETH_ALEN);
+  packet[12] = ETHERTYPE_IP >> 8;
+  packet[13] = ETHERTYPE_IP & 0xff;
+
+  uint8_t *ip = packet + ETHER_HDR_LEN;
+  size_t ip_len = PACKET_IPV4_LEN + PACKET_UDP_LEN + len;
+  memset(ip, 0, PACKET_IPV4_LEN);
+  ip[0] = 0x45;
+  ip[2] = ip_len >> 8;
+  ip[3] = ip_len & 0xff;
+  ip[6] = 0x40;  // DF; the ID may stay 0 (RFC 6864)
+  ip[8] = PACKET_TTL;
+  ip[9] = IPPROTO_UDP;
+  memcpy(ip + 12, &path->src.sin_addr.s_addr, 4);
+  memcpy(ip + 16, &path->dst.sin_addr.s_addr, 4);
+  csum_store(ip + 10, csum_fold(csum_add(0, ip, PACKET_IPV4_LEN)));
+
+  uint8_t *udp = ip + PACKET_IPV4_LEN;
+  size_t udp_len = PACKET_UDP_LEN + len;
+  memcpy(udp, &path->src.sin_port, 2);
+  memcpy(udp + 2, &path->dst.sin_port, 2);
+  udp[4] = udp_len >> 8;
+  udp[5] = udp_len & 0xff;
+  udp[6] = udp[7] = 0;
+}
+
+bool packet_tx_queue(struct packet_ring_t *ring, const struct iovec *iov, size_t iovcnt, size_t len)
+{
+  struct tpacket3_hdr *hdr = packet_tx_frame(ring, ring->tx_head);
+  if (!packet_tx_free(hdr))
+  {
+    // Kick what is queued and wait until the kernel has sent it, which frees this frame too. If the kernel
+    // refuses, the frames stay pending for packet_tx_kick() to take back.
+    ssize_t sent;
+    while ((sent = send(ring->fd, NULL, 0, 0)) < 0 && errno == EINTR)
+    {
+    }
+    if (sent >= 0)
+    {
+      ring->tx_pending = 0;
+    }
+    if (!packet_tx_free(hdr))
+    {
+      return false;
+    }
+  }
+
+  uint8_t *packet = (uint8_t *)hdr + PACKET_TX_DATA;
+  packet_write_headers(&ring->path, packet, len);
+  uint8_t *data = packet + PACKET_HDR_LEN;
+  for (size_t i = 0; i < iovcnt; i++)
+  {
+    memcpy(data, iov[i].iov_base, iov[i].iov_len);
+    data += iov[i].iov_len;
+  }
+  hdr->tp_len = PACKET_HDR_LEN + len;
+  hdr->tp_next_offset = 0;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  ring->tx_head = (ring->tx_head + 1) % ring->tx_frames;
+  ring->tx_pending++;
+  return true;
+}
+
+/*
+ Takes the frames a failed send left waiting back out of the TX ring, so
+ they never go out with a later kick. The kernel sends in order and stops at
+ the frame it refused, so they are the last of the 'pending' frames before
+ tx_head, and tx_head moves back to where the kernel will look next. Returns
+ their number.
+ */
+static unsigned int packet_tx_reclaim(struct packet_ring_t *ring, unsigned int pending)
+{
+  unsigned int reclaimed = 0;
+  while (reclaimed < pending)
+  {
+    unsigned int frame = (ring->tx_head + ring->tx_frames - 1) % ring->tx_frames;
+    struct tpacket3_hdr *hdr = packet_tx_frame(ring, frame);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_SEND_REQUEST)
+    {
+      break;
+    }
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELEASE);
+    ring->tx_head = frame;
+    reclaimed++;
+  }
+  return reclaimed;
+}
+
+unsigned int packet_tx_kick(struct packet_ring_t *ring)
+{
+  unsigned int pending = ring->tx_pending;
+  if (pending == 0)
+  {
+    return 0;
+  }
+  ring->tx_pending = 0;
+  ssize_t sent;
+  while ((sent = send(ring->fd, NULL, 0, MSG_DONTWAIT)) < 0 && errno == EINTR)
+  {
+  }
+  if (sent >= 0)
+  {
+    return 0;
+  }
+  int error = errno;
+  unsigned int refused = packet_tx_reclaim(ring, pending);
+  errno = error;
+  return refused;
+}
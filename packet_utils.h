@@ -0,0 +1,119 @@
+/*
+ This header declares the packet ring underlay (vport -U): the VPort's
+ datagrams to and from the VSwitch travel through a PACKET_MMAP (TPACKET_V3)
+ socket bound to one interface instead of the kernel's UDP stack. The VPort
+ writes the outer Ethernet, IPv4 and UDP headers itself, right in front of
+ the datagram, as it copies that into a TX ring frame, and reads the
+ datagrams it receives where the kernel put them in the RX ring. A batch
+ takes one system call to kick the TX ring, and none at all to receive
+ while the RX ring has blocks ready.
+
+ The RX ring only takes what a classic BPF filter lets through: unfragmented
+ IPv4/UDP for the VPort's own port. The ordinary UDP socket stays open for
+ everything else: datagrams the ring cannot carry (larger than the interface
+ MTU, or to a peer VPort with -p) go out through it, and it receives the
+ datagrams that arrived in fragments, which only the kernel can reassemble.
+ A second filter on that socket drops the rest, which the ring has already
+ delivered. So every tunnel datagram must arrive through the given
+ interface, and a datagram fragmented by the path although it would have
+ fit the interface MTU is lost.
+
+ The outer headers need the next hop: the gateway of the route towards the
+ VSwitch through the interface (/proc/net/route), or the VSwitch itself,
+ and its MAC address from the kernel's neighbour table (/proc/net/arp).
+ Until the neighbour is known, or when the route goes elsewhere, the VPort
+ keeps sending through the UDP socket, which also makes the kernel resolve
+ it.
+ */
+
+#ifndef _PACKET_UTILS_H
+#define _PACKET_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+
+#define PACKET_IFNAMSIZ 16            ///< IFNAMSIZ, which comes from either of two headers that clash
+#define PACKET_HDR_LEN 42             ///< Outer Ethernet (14), IPv4 (20) and UDP (8) headers
+#define PACKET_RX_BLOCK_SIZE (1 << 18)  ///< Bytes per RX ring block
+#define PACKET_RX_BLOCKS 16
+#define PACKET_RX_RETIRE_MS 1         ///< A block that is not full goes to the VPort after this long
+#define PACKET_TX_FRAMES 512          ///< Frames in the TX ring, at least
+
+/*
+ Where the ring sends: the addresses that go into the outer headers.
+ */
+struct packet_path_t
+{
+  bool resolved;                 ///< The next hop is known; until then nothing goes out through the ring
+  uint8_t src_mac[6];            ///< MAC address of the interface
+  uint8_t dst_mac[6];            ///< MAC address of the next hop
+  struct sockaddr_in src;        ///< Address and port the VPort sends from
+  struct sockaddr_in dst;        ///< The VSwitch
+};
+
+struct packet_ring_t
+{
+  int fd;                        ///< AF_PACKET socket bound to the interface
+  char ifname[PACKET_IFNAMSIZ];
+  int ifindex;
+  unsigned int mtu;              ///< MTU of the interface
+  uint8_t *map;                  ///< RX blocks followed by TX frames
+  size_t mapsz;
+  size_t tx_frame_size;
+  unsigned int tx_frames;
+  unsigned int rx_block;         ///< Block being read, or next to be filled
+  unsigned int rx_left;          ///< Packets of that block not read yet, 0 if it is not being read
+  struct tpacket3_hdr *rx_pkt;   ///< Next packet to read in it
+  bool rx_held;                  ///< The block still belongs to the VPort, as the last packet read lies in it
+  unsigned int tx_head;          ///< Next TX frame to fill
+  unsigned int tx_pending;       ///< Frames filled since the last kick
+  struct packet_path_t path;
+};
+
+/*
+ Opens the rings on interface 'ifname' for datagrams between UDP port 'port'
+ (network byte order) of the address the kernel would send from and the
+ VSwitch at 'dst'. The path is left unresolved. Returns 0 on success, or -1
+ with errno set (e.g. EPERM without CAP_NET_RAW).
+ */
+int packet_ring_open(struct packet_ring_t *ring, const char *ifname, uint16_t port, const struct sockaddr_in *dst);
+
+/*
+ Looks up the next hop towards the VSwitch again, as routes and neighbours
+ change. Returns true if the path is resolved.
+ */
+bool packet_path_resolve(struct packet_ring_t *ring);
+
+/*
+ Attaches the filter that leaves 'sockfd', the VPort's UDP socket, only the
+ datagrams the ring cannot have received: those longer than the interface
+ MTU allows for one IPv4 packet. Returns 0 on success, or -1 with errno set.
+ */
+int packet_socket_filter(struct packet_ring_t *ring, int sockfd);
+
+/*
+ Returns the next received datagram as '*datagram' and '*datagramsz', in
+ place in the RX ring, with its sender in 'from', or false if none is ready.
+ The datagram stays valid, and may be modified, until the next call.
+ */
+bool packet_rx_next(struct packet_ring_t *ring, char **datagram, int *datagramsz, struct sockaddr_in *from);
+
+/*
+ Queues the datagram held by 'iov' ('iovcnt' entries, 'len' bytes in all) in
+ the next TX frame behind freshly built outer headers. Returns false if the
+ TX ring is full even after waiting for the frames already kicked.
+ */
+bool packet_tx_queue(struct packet_ring_t *ring, const struct iovec *iov, size_t iovcnt, size_t len);
+
+/*
+ Hands every queued TX frame to the kernel. Returns the number of them it
+ refused (with errno set), which are taken back out of the ring and never go
+ out, or 0 if it took them all.
+ */
+unsigned int packet_tx_kick(struct packet_ring_t *ring);
+
+#endif
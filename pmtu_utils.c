@@ -0,0 +1,116 @@
+/*
+ This file implements the ICMP errors declared in pmtu_utils.h.
+ */
+
+#include "pmtu_utils.h"
+#include "csum_utils.h"
+#include <stdbool.h>
+#include <string.h>
+#include <net/ethernet.h>   // Ethernet protocol definitions
+
+#define IPV4_HDR_LEN 20
+#define IPV4_F_DF 0x40             ///< Don't-fragment bit, in the first byte of the flags/offset field
+#define IPV4_MIN_MTU 68
+#define IPV4_ERROR_MAX 576         ///< Largest ICMP error an IPv4 router sends (RFC 1812)
+#define IPV6_HDR_LEN 40
+#define IPV6_MIN_MTU 1280
+#define ICMP_HDR_LEN 8
+#define ICMP_DEST_UNREACH 3
+#define ICMP_FRAG_NEEDED 4
+#define ICMPV6_PACKET_TOO_BIG 2
+#define ICMPV6_INFO_MIN 128        ///< ICMPv6 types below this are errors
+#define IPPROTO_ICMP_NUM 1
+#define IPPROTO_ICMPV6_NUM 58
+
+static inline void pmtu_write16(uint8_t *p, uint16_t value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+static bool pmtu_is_icmp_error(uint8_t type)
+{
+  return type == 3 || type == 4 || type == 5 || type == 11 || type == 12;
+}
+
+size_t pmtu_build_too_big(const uint8_t *frame, size_t framesz, uint32_t mtu, uint8_t *reply)
+{
+  if (framesz < ETHER_HDR_LEN + IPV4_HDR_LEN || (frame[0] & 0x01))
+  {
+    return 0;  // Nothing to answer, or a group address: errors are never sent for those
+  }
+  const uint8_t *ip = frame + ETHER_HDR_LEN;
+  size_t iplen = framesz - ETHER_HDR_LEN;
+  uint16_t type = ((uint16_t)frame[12] << 8) | frame[13];
+
+  // Ethernet: back to the sender, from where it was sending to
+  memcpy(reply, frame + ETH_ALEN, ETH_ALEN);
+  memcpy(reply + ETH_ALEN, frame, ETH_ALEN);
+  pmtu_write16(reply + 12, type);
+  uint8_t *out = reply + ETHER_HDR_LEN;
+
+  if (type == ETHERTYPE_IP && (ip[0] >> 4) == 4)
+  {
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    if (!(ip[6] & IPV4_F_DF) || mtu < IPV4_MIN_MTU || ihl < IPV4_HDR_LEN || iplen < ihl + 1 ||
+        (ip[9] == IPPROTO_ICMP_NUM && pmtu_is_icmp_error(ip[ihl])))
+    {
+      return 0;
+    }
+
+    // Quote as much of the packet as fits, IP header first
+    size_t room = IPV4_ERROR_MAX - IPV4_HDR_LEN - ICMP_HDR_LEN;
+    size_t quoted = iplen < room ? iplen : room;
+    size_t total = IPV4_HDR_LEN + ICMP_HDR_LEN + quoted;
+    memset(out, 0, IPV4_HDR_LEN + ICMP_HDR_LEN);
+    out[0] = 0x45;
+    pmtu_write16(out + 2, total);
+    out[8] = 64;
+    out[9] = IPPROTO_ICMP_NUM;
+    memcpy(out + 12, ip + 16, 4);  // Source: the packet's destination
+    memcpy(out + 16, ip + 12, 4);
+    csum_store(out + 10, csum_fold(csum_add(0, out, IPV4_HDR_LEN)));
+
+    uint8_t *icmp = out + IPV4_HDR_LEN;
+    icmp[0] = ICMP_DEST_UNREACH;
+    icmp[1] = ICMP_FRAG_NEEDED;
+    pmtu_write16(icmp + 6, mtu > UINT16_MAX ? UINT16_MAX : mtu);
+    memcpy(icmp + ICMP_HDR_LEN, ip, quoted);
+    csum_store(icmp + 2, csum_fold(csum_add(0, icmp, ICMP_HDR_LEN + quoted)));
+    return ETHER_HDR_LEN + total;
+  }
+
+  if (type == ETHERTYPE_IPV6 && (ip[0] >> 4) == 6 && iplen >= IPV6_HDR_LEN + 1)
+  {
+    if (mtu < IPV6_MIN_MTU || (ip[6] == IPPROTO_ICMPV6_NUM && ip[IPV6_HDR_LEN] < ICMPV6_INFO_MIN))
+    {
+      return 0;
+    }
+
+    size_t room = IPV6_MIN_MTU - IPV6_HDR_LEN - ICMP_HDR_LEN;
+    size_t quoted = iplen < room ? iplen : room;
+    size_t icmplen = ICMP_HDR_LEN + quoted;
+    memset(out, 0, IPV6_HDR_LEN + ICMP_HDR_LEN);
+    out[0] = 0x60;
+    pmtu_write16(out + 4, icmplen);
+    out[6] = IPPROTO_ICMPV6_NUM;
+    out[7] = 64;
+    memcpy(out + 8, ip + 24, 16);  // Source: the packet's destination
+    memcpy(out + 24, ip + 8, 16);
+
+    uint8_t *icmp = out + IPV6_HDR_LEN;
+    icmp[0] = ICMPV6_PACKET_TOO_BIG;
+    icmp[4] = mtu >> 24;
+    icmp[5] = (mtu >> 16) & 0xff;
+    pmtu_write16(icmp + 6, mtu & 0xffff);
+    memcpy(icmp + ICMP_HDR_LEN, ip, quoted);
+
+    // ICMPv6 checksum over the pseudo-header (addresses, length, next header) and the message
+    uint32_t sum = csum_add(0, out + 8, 32);
+    sum += icmplen + IPPROTO_ICMPV6_NUM;
+    sum = csum_add(sum, icmp, icmplen);
+    csum_store(icmp + 2, csum_fold(sum));
+    return ETHER_HDR_LEN + IPV6_HDR_LEN + icmplen;
+  }
+  return 0;
+}
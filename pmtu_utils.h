@@ -0,0 +1,40 @@
+/*
+ This header declares the VPort's path MTU handling. Every frame read from
+ the TAP crosses the tunnel in one UDP datagram, and the tunnel sockets set
+ DF on every datagram that fits the path MTU the kernel knows towards its
+ destination (IP_PMTUDISC_WANT, see udp_pmtu_discover()), which the kernel
+ learns from the ICMP "fragmentation needed" messages of the underlay. A
+ jumbo frame thus crosses in one piece wherever the underlay carries it.
+
+ The VPort reads that path MTU back every PMTU_CHECK_INTERVAL seconds while
+ large frames flow (udp_path_mtu()). A frame that would no longer fit is
+ not fragmented if its sender can do better: IPv4 packets with DF set and
+ IPv6 packets are dropped, and the sender gets the ICMP error a router on
+ the path would have sent, from the address it was writing to, with the MTU
+ the tunnel carries; it then sends smaller packets, as it would over any
+ narrow link. Other frames are sent anyway and fragmented by the kernel.
+ */
+
+#ifndef _PMTU_UTILS_H
+#define _PMTU_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PMTU_CHECK_INTERVAL 5       ///< Seconds between two reads of the path MTU
+#define PMTU_UDP_OVERHEAD 28        ///< IPv4 and UDP headers in front of every tunnel datagram
+#define PMTU_MIN_CHECKED 576        ///< Datagrams up to this size fit any IPv4 path and are never checked
+#define PMTU_REPLY_MAX (14 + 1280)  ///< Largest error pmtu_build_too_big() produces (IPv6 minimum MTU)
+
+/*
+ Builds, into 'reply', the ICMP error that tells the sender of the Ethernet
+ frame 'frame' ('framesz' bytes) that its packet does not fit a link of
+ 'mtu' bytes: "fragmentation needed" for an IPv4 packet with DF set, "packet
+ too big" for an IPv6 packet. Returns its length, or 0 if the frame should
+ be sent anyway: it carries something else, is addressed to a group, is an
+ ICMP error itself, or could not shrink to 'mtu' bytes (IPv4 below 68, IPv6
+ below 1280).
+ */
+size_t pmtu_build_too_big(const uint8_t *frame, size_t framesz, uint32_t mtu, uint8_t *reply);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ This file implements the frame buffer pool declared in pool_utils.h.
+ */
+
+#include "pool_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+#include <sys/mman.h>
+
+#define FRAME_POOL_HUGEPAGE_SIZE (2UL << 20)
+
+int frame_pool_options = 0;
+
+void frame_pool_init(struct frame_pool_t *pool, uint32_t nframes, size_t bufsz, int options)
+{
+  pool->bufsz = bufsz;
+  pool->stride = (bufsz + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+  pool->nframes = nframes;
+  pool->hugepages = false;
+
+  // Anonymous mappings are page aligned, so every buffer is cache-line aligned.
+  // MAP_POPULATE faults the pool in now rather than on the first packets.
+  size_t size = pool->stride * nframes;
+  pool->base = MAP_FAILED;
+  if (options & FRAME_POOL_HUGEPAGES)
+  {
+    pool->mapsz = (size + FRAME_POOL_HUGEPAGE_SIZE - 1) & ~(FRAME_POOL_HUGEPAGE_SIZE - 1);
+    pool->base = mmap(NULL, pool->mapsz, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (pool->base == MAP_FAILED)
+    {
+      fprintf(stderr, "fail to map huge pages, using normal pages: %s\n", strerror(errno));
+    }
+    pool->hugepages = pool->base != MAP_FAILED;
+  }
+  if (pool->base == MAP_FAILED)
+  {
+    pool->mapsz = size;
+    pool->base = mmap(NULL, pool->mapsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  }
+
+  pool->descs = calloc(nframes, sizeof(*pool->descs));
+  pool->free_stack = calloc(nframes, sizeof(*pool->free_stack));
+  if (pool->base == MAP_FAILED || pool->descs == NULL || pool->free_stack == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate frame pool: %s\n", strerror(errno));
+  }
+
+  // Stack the buffers so that the lowest addresses are handed out first
+  for (uint32_t i = 0; i < nframes; i++)
+  {
+    pool->descs[i].data = pool->base + i * pool->stride;
+    pool->descs[i].index = i;
+    pool->free_stack[i] = nframes - 1 - i;
+  }
+  pool->nfree = nframes;
+}
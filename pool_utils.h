@@ -0,0 +1,85 @@
+/*
+ This header declares a preallocated pool of fixed-size frame buffers. Every
+ buffer starts on a cache line and is described by a frame_desc_t that
+ carries the buffer pointer, the length of the frame in it and per-stage
+ metadata, so a frame can be handed from one stage to the next (RX ring,
+ switching, TX ring) by passing the descriptor instead of copying bytes.
+
+ Descriptors are reference counted: a stage that keeps a frame takes a
+ reference, and the buffer returns to the pool when the last one is put.
+ A pool belongs to one thread; it does no locking.
+ */
+
+#ifndef _POOL_UTILS_H
+#define _POOL_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FRAME_ALIGN 64              ///< Frame buffers start on a cache line
+#define FRAME_POOL_HUGEPAGES 0x1    ///< Back the pool with 2 MB huge pages if the system has them
+
+extern int frame_pool_options;      ///< FRAME_POOL_* flags applied by pools created without explicit options
+
+struct frame_desc_t
+{
+  char *data;          ///< Frame buffer, FRAME_ALIGN aligned
+  uint32_t len;        ///< Bytes of valid data in the buffer
+  uint32_t index;      ///< Position of the buffer in its pool
+  uint32_t refs;       ///< Number of stages holding the frame
+  uint32_t meta;       ///< Free for the current owner (e.g. peer or queue index)
+};
+
+struct frame_pool_t
+{
+  char *base;                  ///< nframes * stride bytes of buffer storage
+  size_t mapsz;                ///< Size of the mapping behind 'base'
+  size_t bufsz;                ///< Usable size of each buffer
+  size_t stride;               ///< Distance between buffers (bufsz rounded up to FRAME_ALIGN)
+  uint32_t nframes;            ///< Number of buffers
+  uint32_t nfree;              ///< Number of entries on the free stack
+  uint32_t *free_stack;        ///< Indices of free buffers; the most recently freed (cache-hot) is on top
+  struct frame_desc_t *descs;  ///< One descriptor per buffer
+  bool hugepages;              ///< The mapping uses huge pages
+};
+
+/*
+ Allocates 'nframes' buffers of at least 'bufsz' bytes. 'options' is a set of
+ FRAME_POOL_* flags; huge pages fall back to normal pages when unavailable.
+ */
+void frame_pool_init(struct frame_pool_t *pool, uint32_t nframes, size_t bufsz, int options);
+
+/*
+ Takes a free buffer with one reference, or returns NULL if none is left.
+ */
+static inline struct frame_desc_t *frame_alloc(struct frame_pool_t *pool)
+{
+  if (pool->nfree == 0)
+  {
+    return NULL;
+  }
+  struct frame_desc_t *desc = &pool->descs[pool->free_stack[--pool->nfree]];
+  desc->len = 0;
+  desc->refs = 1;
+  desc->meta = 0;
+  return desc;
+}
+
+static inline void frame_ref(struct frame_desc_t *desc)
+{
+  desc->refs++;
+}
+
+/*
+ Drops one reference and returns the buffer to the pool with the last one.
+ */
+static inline void frame_put(struct frame_pool_t *pool, struct frame_desc_t *desc)
+{
+  if (--desc->refs == 0)
+  {
+    pool->free_stack[pool->nfree++] = desc->index;
+  }
+}
+
+#endif
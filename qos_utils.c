@@ -0,0 +1,131 @@
+/*
+ This file implements the classifier and scheduler declared in qos_utils.h.
+ */
+
+#include "qos_utils.h"
+#include <string.h>
+#include <net/ethernet.h>   // Ethernet protocol definitions
+
+#define QOS_VLAN_TAG_LEN 4
+#define DSCP_LE 1      ///< Lower effort (RFC 8622)
+#define DSCP_CS1 8
+#define DSCP_CS4 32
+#define DSCP_VOICE_ADMIT 44
+#define DSCP_EF 46
+#define DSCP_CS6 48
+
+static const uint8_t qos_pcp_classes[8] = {
+  QOS_CLASS_BEST_EFFORT, QOS_CLASS_BULK, QOS_CLASS_BULK, QOS_CLASS_BEST_EFFORT,
+  QOS_CLASS_INTERACTIVE, QOS_CLASS_INTERACTIVE, QOS_CLASS_CONTROL, QOS_CLASS_CONTROL,
+};
+
+static const uint32_t qos_weights[QOS_CLASSES] = {8, 4, 2, 1};
+
+static enum qos_class_t qos_dscp_class(uint8_t dscp)
+{
+  if (dscp >= DSCP_CS6 || dscp == DSCP_EF || dscp == DSCP_VOICE_ADMIT)
+  {
+    return QOS_CLASS_CONTROL;
+  }
+  if (dscp >= DSCP_CS4)
+  {
+    return QOS_CLASS_INTERACTIVE;
+  }
+  if (dscp == DSCP_CS1 || dscp == DSCP_LE)
+  {
+    return QOS_CLASS_BULK;
+  }
+  return QOS_CLASS_BEST_EFFORT;
+}
+
+enum qos_class_t qos_classify(const uint8_t *frame, size_t len)
+{
+  if (len < ETHER_HDR_LEN + 2)
+  {
+    return QOS_CLASS_BEST_EFFORT;
+  }
+  uint16_t type = ((uint16_t)frame[12] << 8) | frame[13];
+  if (type == ETHERTYPE_VLAN)
+  {
+    return qos_pcp_classes[frame[14] >> 5];  // The priority of the tag decides, whatever it carries
+  }
+
+  const uint8_t *ip = frame + ETHER_HDR_LEN;
+  if (type == ETHERTYPE_IP && (ip[0] >> 4) == 4)
+  {
+    return qos_dscp_class(ip[1] >> 2);
+  }
+  if (type == ETHERTYPE_IPV6 && (ip[0] >> 4) == 6)
+  {
+    return qos_dscp_class(((ip[0] & 0x0f) << 2) | (ip[1] >> 6));
+  }
+  return QOS_CLASS_BEST_EFFORT;
+}
+
+static inline size_t qos_msg_len(const struct msghdr *msg)
+{
+  size_t len = 0;
+  for (size_t j = 0; j < msg->msg_iovlen; j++)
+  {
+    len += msg->msg_iov[j].iov_len;
+  }
+  return len;
+}
+
+void qos_order(const struct mmsghdr *msgs, const uint8_t *classes, unsigned int count, struct mmsghdr *out)
+{
+  if (count > QOS_MAX_BATCH)
+  {
+    memcpy(out, msgs, count * sizeof(*msgs));
+    return;
+  }
+
+  // One queue per class, as runs of message indices in 'queued'
+  uint16_t queued[QOS_MAX_BATCH];
+  unsigned int head[QOS_CLASSES];
+  unsigned int tail[QOS_CLASSES] = {0};
+  for (unsigned int i = 0; i < count; i++)
+  {
+    tail[classes[i]]++;
+  }
+  for (unsigned int c = 0, start = 0; c < QOS_CLASSES; c++)
+  {
+    head[c] = start;
+    start += tail[c];
+    tail[c] = head[c];
+  }
+  for (unsigned int i = 0; i < count; i++)
+  {
+    queued[tail[classes[i]]++] = (uint16_t)i;
+  }
+
+  size_t deficit[QOS_CLASSES] = {0};
+  unsigned int sent = 0;
+  while (sent < count)
+  {
+    for (unsigned int c = 0; c < QOS_CLASSES; c++)
+    {
+      if (head[c] == tail[c])
+      {
+        continue;
+      }
+      deficit[c] += QOS_QUANTUM * qos_weights[c];
+      while (head[c] < tail[c])
+      {
+        const struct mmsghdr *msg = &msgs[queued[head[c]]];
+        size_t len = qos_msg_len(&msg->msg_hdr);
+        if (len > deficit[c])
+        {
+          break;
+        }
+        deficit[c] -= len;
+        out[sent++] = *msg;
+        head[c]++;
+      }
+      if (head[c] == tail[c])
+      {
+        deficit[c] = 0;  // An empty queue keeps no credit for later
+      }
+    }
+  }
+}
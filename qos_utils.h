@@ -0,0 +1,111 @@
+/*
+ This header declares the quality of service tools that VPorts (vport -r,
+ -P) and the VSwitch (vswitch -r, -P) share.
+
+ Token buckets count bytes and refill from a CLOCK_MONOTONIC timestamp the
+ caller reads once per batch, up to QOS_BURST_NS worth of the rate (at
+ least QOS_MIN_BURST bytes, so a super-frame always fits). A bucket belongs
+ to one thread and is never locked. qos_police() refuses what exceeds the
+ rate; qos_shape() lets it through and tells the caller how long to wait,
+ so the traffic behind it backs up into the TAP queue instead.
+
+ Priority queueing sorts the datagrams of a send batch into QOS_CLASSES
+ classes by the 802.1p priority of a VLAN tag or, for untagged IP, the DSCP,
+ and sends them in deficit round robin order: each round, a class may send
+ up to its quantum in bytes, which is larger for the higher classes, before
+ the next one gets its turn. Datagrams of one class keep their order, so no
+ flow is reordered, while a short, latency-sensitive packet no longer waits
+ behind the bulk transfer that filled the rest of the batch.
+ */
+
+#ifndef _QOS_UTILS_H
+#define _QOS_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "udp_utils.h"
+
+#define QOS_CLASSES 4                 ///< Priority classes; class 0 is served first
+#define QOS_QUANTUM 1514              ///< Bytes a class of weight 1 sends per round
+#define QOS_BURST_NS 100000000ULL     ///< A bucket holds this much of its rate (100 ms)
+#define QOS_MIN_BURST 65536           ///< Smallest bucket, in bytes
+#define QOS_MAX_BATCH 4096            ///< Largest batch qos_order() sorts; larger ones go out as they are
+
+enum qos_class_t
+{
+  QOS_CLASS_CONTROL,      ///< Network control and voice: 802.1p 6-7, DSCP CS6, CS7, EF, VOICE-ADMIT
+  QOS_CLASS_INTERACTIVE,  ///< Video and interactive traffic: 802.1p 4-5, DSCP CS4, AF4x, CS5
+  QOS_CLASS_BEST_EFFORT,  ///< Everything else, including frames that are neither tagged nor IP
+  QOS_CLASS_BULK,         ///< Background traffic: 802.1p 1-2, DSCP CS1 and LE
+};
+
+struct qos_bucket_t
+{
+  int64_t tokens;   ///< Bytes that may still pass; negative while a shaper is in debt
+  uint64_t stamp;   ///< Time of the last refill, CLOCK_MONOTONIC nanoseconds
+};
+
+/*
+ Returns the priority class of the Ethernet frame 'frame' of 'len' bytes.
+ */
+enum qos_class_t qos_classify(const uint8_t *frame, size_t len);
+
+/*
+ Sets 'out' to the 'count' messages of 'msgs' in deficit round robin order
+ of their classes ('classes[i]' for 'msgs[i]'). The messages are copied, so
+ their iovecs and addresses stay where they are.
+ */
+void qos_order(const struct mmsghdr *msgs, const uint8_t *classes, unsigned int count, struct mmsghdr *out);
+
+/*
+ Returns the number of bytes a bucket for 'rate' bytes per second holds.
+ */
+static inline int64_t qos_burst(uint64_t rate)
+{
+  uint64_t burst = rate * QOS_BURST_NS / 1000000000ULL;
+  return burst > QOS_MIN_BURST ? (int64_t)burst : QOS_MIN_BURST;
+}
+
+static inline void qos_refill(struct qos_bucket_t *bucket, uint64_t rate, uint64_t now)
+{
+  int64_t burst = qos_burst(rate);
+  uint64_t elapsed = now - bucket->stamp;
+  bucket->stamp = now;
+  if (elapsed >= 1000000000ULL)
+  {
+    bucket->tokens = burst;  // Idle for a second or more: full, and no overflow below
+    return;
+  }
+  int64_t tokens = bucket->tokens + (int64_t)(rate * elapsed / 1000000000ULL);
+  bucket->tokens = tokens < burst ? tokens : burst;
+}
+
+/*
+ Takes 'bytes' from a bucket that refills at 'rate' bytes per second, as of
+ 'now'. Returns false, taking nothing, if the bucket does not hold that much.
+ */
+static inline bool qos_police(struct qos_bucket_t *bucket, uint64_t rate, size_t bytes, uint64_t now)
+{
+  qos_refill(bucket, rate, now);
+  if (bucket->tokens < (int64_t)bytes)
+  {
+    return false;
+  }
+  bucket->tokens -= bytes;
+  return true;
+}
+
+/*
+ Takes 'bytes' that were just sent from a bucket that refills at 'rate'
+ bytes per second, as of 'now', and returns how many nanoseconds the sender
+ has to wait before the bucket is out of debt again.
+ */
+static inline uint64_t qos_shape(struct qos_bucket_t *bucket, uint64_t rate, size_t bytes, uint64_t now)
+{
+  qos_refill(bucket, rate, now);
+  bucket->tokens -= bytes;
+  return bucket->tokens < 0 ? (uint64_t)-bucket->tokens * 1000000000ULL / rate : 0;
+}
+
+#endif
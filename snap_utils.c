@@ -0,0 +1,120 @@
+/*
+ This file implements the MAC table snapshot declared in snap_utils.h.
+ */
+
+#include "snap_utils.h"
+#include "sys_utils.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool snap_save(const char *path, const struct snap_entry_t *entries, uint32_t count)
+{
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+  {
+    fprintf(stderr, "fail to save snapshot: path too long\n");
+    return false;
+  }
+  size_t size = sizeof(struct snap_hdr_t) + (size_t)count * sizeof(struct snap_entry_t);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0)
+  {
+    fprintf(stderr, "fail to save snapshot %s: %s\n", tmp, strerror(errno));
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return false;
+  }
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    fprintf(stderr, "fail to mmap snapshot %s: %s\n", tmp, strerror(errno));
+    return false;
+  }
+
+  struct snap_hdr_t hdr = {.magic = SNAP_MAGIC, .version = htole16(SNAP_VERSION),
+                           .entry_size = htole16(sizeof(struct snap_entry_t)), .count = htole32(count),
+                           .reserved = 0};
+  memcpy(map, &hdr, sizeof(hdr));
+  struct snap_entry_t *out = (struct snap_entry_t *)(map + sizeof(hdr));
+  for (uint32_t i = 0; i < count; i++)
+  {
+    struct snap_entry_t entry = entries[i];
+    entry.port_id = htole16(entry.port_id);
+    entry.sender = htole32(entry.sender);
+    entry.age = htole32(entry.age);
+    entry.net_id = htole16(entry.net_id);
+    memcpy(&out[i], &entry, sizeof(entry));
+  }
+
+  bool saved = msync(map, size, MS_SYNC) == 0 && rename(tmp, path) == 0;
+  if (!saved)
+  {
+    fprintf(stderr, "fail to save snapshot %s: %s\n", path, strerror(errno));
+  }
+  munmap(map, size);
+  return saved;
+}
+
+const struct snap_entry_t *snap_load(const char *path, uint32_t *count, size_t *mapsz)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno != ENOENT)
+    {
+      fprintf(stderr, "fail to open snapshot %s: %s\n", path, strerror(errno));
+    }
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snap_hdr_t))
+  {
+    fprintf(stderr, "ignored snapshot %s: too short\n", path);
+    close(fd);
+    return NULL;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    fprintf(stderr, "fail to mmap snapshot %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct snap_hdr_t hdr;
+  memcpy(&hdr, map, sizeof(hdr));
+  *count = le32toh(hdr.count);
+  if (memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) != 0 || le16toh(hdr.version) != SNAP_VERSION ||
+      le16toh(hdr.entry_size) != sizeof(struct snap_entry_t) ||
+      (size_t)st.st_size != sizeof(hdr) + (size_t)*count * sizeof(struct snap_entry_t))
+  {
+    fprintf(stderr, "ignored snapshot %s: not a version %d snapshot\n", path, SNAP_VERSION);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  *mapsz = st.st_size;
+  return (const struct snap_entry_t *)(map + sizeof(hdr));
+}
+
+void snap_unload(const struct snap_entry_t *entries, size_t mapsz)
+{
+  munmap((char *)entries - sizeof(struct snap_hdr_t), mapsz);
+}
+
+struct snap_entry_t snap_entry_host(const struct snap_entry_t *entry)
+{
+  struct snap_entry_t host;
+  memcpy(&host, entry, sizeof(host));
+  host.port_id = le16toh(host.port_id);
+  host.sender = le32toh(host.sender);
+  host.age = le32toh(host.age);
+  host.net_id = le16toh(host.net_id);
+  return host;
+}
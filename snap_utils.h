@@ -0,0 +1,81 @@
+/*
+ This header declares the MAC table snapshot (vswitch -f), which lets a
+ restarted VSwitch forward unicast right away instead of discarding it until
+ every host has spoken again. The file is a header followed by fixed-size
+ entries, in little-endian byte order except for the fields copied from the
+ wire:
+
+   | magic "VSMT" | version (2) | entry size (2) | count (4) | reserved (4) | entry ... |
+
+ Each entry is one learned MAC with the VPort endpoint it lives behind, that
+ endpoint's properties, the network the MAC belongs to, and how long ago it
+ was last seen. vswitch.py reads and writes the same format, keeping the
+ entries it understands (no port ID, no wire header, the default network).
+ Snapshots are written to a temporary file through a shared mapping and
+ renamed into place, so a reader never sees half of one, and read back
+ through a private read-only mapping.
+ */
+
+#ifndef _SNAP_UTILS_H
+#define _SNAP_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SNAP_MAGIC "VSMT"
+#define SNAP_VERSION 2
+#define SNAP_F_WIRE 0x01       ///< The VPort sends the wire header; 'sender' identifies it
+#define SNAP_F_OFFLOAD 0x02    ///< The VPort sends (and accepts) offload-encapsulated frames
+#define SNAP_F_COALESCE 0x04   ///< The VPort sends (and so accepts) bundles
+
+struct snap_hdr_t
+{
+  char magic[4];       ///< SNAP_MAGIC
+  uint16_t version;    ///< SNAP_VERSION
+  uint16_t entry_size; ///< sizeof(struct snap_entry_t)
+  uint32_t count;      ///< Number of entries that follow
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct snap_entry_t
+{
+  uint8_t mac[6];      ///< Learned MAC, as on the wire
+  uint16_t port_id;    ///< Daemon port ID, 0 for a standalone VPort
+  uint8_t ip[4];       ///< IPv4 address of the VPort endpoint, as on the wire
+  uint8_t port[2];     ///< UDP port of the VPort endpoint, as on the wire
+  uint8_t flags;       ///< SNAP_F_*
+  uint8_t reserved;
+  uint32_t sender;     ///< Wire header sender ID, 0 without SNAP_F_WIRE
+  uint32_t age;        ///< Seconds since the MAC was last seen as a source, when saved
+  uint16_t net_id;     ///< Network of the MAC (wire header), 0 for the default one
+  uint16_t reserved2;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct snap_hdr_t) == 16, "snap_hdr_t must have no padding");
+_Static_assert(sizeof(struct snap_entry_t) == 28, "snap_entry_t must have no padding");
+
+/*
+ Writes 'count' entries (whose multi-byte fields are in host byte order) to
+ 'path', replacing the previous snapshot in one rename. Returns false, after
+ printing why, if the snapshot could not be written.
+ */
+bool snap_save(const char *path, const struct snap_entry_t *entries, uint32_t count);
+
+/*
+ Maps the snapshot at 'path' and returns its entries, with 'count' set to
+ their number and 'mapsz' to the size of the mapping, or NULL if there is no
+ valid snapshot (printing why, unless the file does not exist). The entries
+ are in file byte order; snap_entry_host() converts one. The mapping stays
+ until snap_unload().
+ */
+const struct snap_entry_t *snap_load(const char *path, uint32_t *count, size_t *mapsz);
+
+void snap_unload(const struct snap_entry_t *entries, size_t mapsz);
+
+/*
+ Returns a mapped entry with its multi-byte fields in host byte order.
+ */
+struct snap_entry_t snap_entry_host(const struct snap_entry_t *entry);
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ This file implements the stats block registry and the metrics endpoint
+ declared in stats_utils.h.
+ */
+
+#include "stats_utils.h"
+#include "sys_utils.h"
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define STATS_REQUEST_MAX 4096   ///< Bytes of an HTTP request read before answering anyway
+
+struct stats_endpoint_t
+{
+  int listenfd;
+  const char *prefix;
+  void (*extra)(FILE *out, void *ctx);
+  void *ctx;
+};
+
+/*
+ The sum of the blocks with the same labels, as of a scrape or dump.
+ */
+struct stats_set_t
+{
+  const char *labels;
+  uint64_t counters[STATS_COUNTERS];
+  uint64_t counts[STATS_STAGES][STATS_HIST_BUCKETS];  ///< Only filled in with timing on
+  uint64_t sums[STATS_STAGES];
+  uint64_t totals[STATS_STAGES];
+};
+
+static const char *const stats_stage_names[STATS_STAGES] = {
+  [STATS_STAGE_TAP_READ] = "tap_read",
+  [STATS_STAGE_SEND] = "send",
+  [STATS_STAGE_SWITCH] = "switch",
+  [STATS_STAGE_TAP_WRITE] = "tap_write",
+};
+
+static _Atomic(struct stats_t *) stats_blocks = NULL;  ///< Head of the block registry
+bool stats_timing = false;                          ///< New blocks get stage histograms
+static double stats_ticks_per_sec = 1e9;            ///< Clock rate of stats_clock()
+
+struct stats_t *stats_create(const char *labels)
+{
+  struct stats_t *stats = aligned_alloc(64, sizeof(*stats));
+  if (stats == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate stats block: %s\n", strerror(errno));
+  }
+  for (int i = 0; i < STATS_COUNTERS; i++)
+  {
+    atomic_init(&stats->counters[i], 0);
+  }
+  snprintf(stats->labels, sizeof(stats->labels), "%s", labels);
+  stats->hists = NULL;
+  if (stats_timing && (stats->hists = aligned_alloc(64, STATS_STAGES * sizeof(*stats->hists))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate stage histograms: %s\n", strerror(errno));
+  }
+  for (int stage = 0; stats->hists != NULL && stage < STATS_STAGES; stage++)
+  {
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+      atomic_init(&stats->hists[stage].counts[i], 0);
+    }
+    atomic_init(&stats->hists[stage].sum, 0);
+  }
+
+  // Push onto the registry; blocks are never removed, so a lock-free push is all we need
+  stats->next = atomic_load(&stats_blocks);
+  while (!atomic_compare_exchange_weak(&stats_blocks, &stats->next, stats))
+  {
+  }
+  return stats;
+}
+
+/*
+ Writes one series, joining the block's labels and an optional reason.
+ */
+static void stats_write_series(FILE *out, const char *prefix, const char *name, const char *labels,
+                               const char *reason, uint64_t value)
+{
+  char reason_label[32] = "";
+  if (reason)
+  {
+    snprintf(reason_label, sizeof(reason_label), "%sreason=\"%s\"", labels[0] ? "," : "", reason);
+  }
+  if (labels[0] || reason)
+  {
+    fprintf(out, "%s_%s{%s%s} %llu\n", prefix, name, labels, reason_label, (unsigned long long)value);
+  }
+  else
+  {
+    fprintf(out, "%s_%s %llu\n", prefix, name, (unsigned long long)value);
+  }
+}
+
+/*
+ Sums the blocks with the same labels into sets, in registration order of
+ their first block. Returns the number of sets and stores them in '*sets',
+ to be freed by the caller, or returns 0 if they cannot be allocated.
+ */
+static unsigned int stats_collect(struct stats_set_t **sets)
+{
+  unsigned int nblocks = 0;
+  for (struct stats_t *stats = atomic_load(&stats_blocks); stats != NULL; stats = stats->next)
+  {
+    nblocks++;
+  }
+  if (nblocks == 0 || (*sets = calloc(nblocks, sizeof(**sets))) == NULL)
+  {
+    return 0;
+  }
+
+  unsigned int nsets = 0;
+  for (struct stats_t *stats = atomic_load(&stats_blocks); stats != NULL; stats = stats->next)
+  {
+    struct stats_set_t *set = *sets;
+    while (set < *sets + nsets && strcmp(set->labels, stats->labels) != 0)
+    {
+      set++;
+    }
+    if (set == *sets + nsets)
+    {
+      set->labels = stats->labels;
+      nsets++;
+    }
+    for (int i = 0; i < STATS_COUNTERS; i++)
+    {
+      set->counters[i] += atomic_load_explicit(&stats->counters[i], memory_order_relaxed);
+    }
+    for (int stage = 0; stats->hists != NULL && stage < STATS_STAGES; stage++)
+    {
+      for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+      {
+        uint64_t count = atomic_load_explicit(&stats->hists[stage].counts[i], memory_order_relaxed);
+        set->counts[stage][i] += count;
+        set->totals[stage] += count;
+      }
+      set->sums[stage] += atomic_load_explicit(&stats->hists[stage].sum, memory_order_relaxed);
+    }
+  }
+  return nsets;
+}
+
+/*
+ Returns the smallest tick count of histogram bucket 'index'.
+ */
+static uint64_t stats_hist_lower(unsigned int index)
+{
+  if (index < STATS_HIST_SUB)
+  {
+    return index;
+  }
+  unsigned int msb = index / STATS_HIST_SUB + 2;
+  return (uint64_t)(STATS_HIST_SUB + index % STATS_HIST_SUB) << (msb - 3);
+}
+
+/*
+ Returns the upper bound, in seconds, of the bucket that holds the sample of
+ rank 'fraction' of a stage.
+ */
+static double stats_hist_percentile(const struct stats_set_t *set, int stage, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * set->totals[stage] + 0.5);
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < STATS_HIST_BUCKETS; i++)
+  {
+    seen += set->counts[stage][i];
+    if (seen >= rank && seen > 0)
+    {
+      return stats_hist_lower(i + 1 < STATS_HIST_BUCKETS ? i + 1 : i) / stats_ticks_per_sec;
+    }
+  }
+  return 0;
+}
+
+/*
+ Writes the stage histograms as Prometheus histograms in seconds, with one
+ bucket per power of two of ticks up to the longest sample.
+ */
+static void stats_write_hists(FILE *out, const char *prefix, const struct stats_set_t *sets, unsigned int nsets)
+{
+  if (!stats_timing)
+  {
+    return;
+  }
+  fprintf(out, "# HELP %s_stage_seconds Time spent in each datapath stage\n# TYPE %s_stage_seconds histogram\n",
+          prefix, prefix);
+  for (unsigned int s = 0; s < nsets; s++)
+  {
+    const struct stats_set_t *set = &sets[s];
+    const char *sep = set->labels[0] ? "," : "";
+    for (int stage = 0; stage < STATS_STAGES; stage++)
+    {
+      if (set->totals[stage] == 0)
+      {
+        continue;
+      }
+      uint64_t seen = 0;
+      for (unsigned int i = STATS_HIST_SUB - 1; seen < set->totals[stage] && i < STATS_HIST_BUCKETS;
+           i += STATS_HIST_SUB)
+      {
+        for (unsigned int j = i + 1 - STATS_HIST_SUB; j <= i; j++)
+        {
+          seen += set->counts[stage][j];
+        }
+        fprintf(out, "%s_stage_seconds_bucket{%s%sstage=\"%s\",le=\"%.9g\"} %llu\n", prefix, set->labels, sep,
+                stats_stage_names[stage], stats_hist_lower(i + 1) / stats_ticks_per_sec, (unsigned long long)seen);
+      }
+      fprintf(out, "%s_stage_seconds_bucket{%s%sstage=\"%s\",le=\"+Inf\"} %llu\n", prefix, set->labels, sep,
+              stats_stage_names[stage], (unsigned long long)set->totals[stage]);
+      fprintf(out, "%s_stage_seconds_sum{%s%sstage=\"%s\"} %.9g\n", prefix, set->labels, sep,
+              stats_stage_names[stage], set->sums[stage] / stats_ticks_per_sec);
+      fprintf(out, "%s_stage_seconds_count{%s%sstage=\"%s\"} %llu\n", prefix, set->labels, sep,
+              stats_stage_names[stage], (unsigned long long)set->totals[stage]);
+    }
+  }
+}
+
+/*
+ Sums the blocks with the same labels and writes every counter and
+ histogram.
+ */
+static void stats_write(FILE *out, const char *prefix)
+{
+  static const struct
+  {
+    const char *name;
+    const char *reason;  ///< Drop reason, NULL for the counters of their own
+    const char *help;
+  } counters[STATS_COUNTERS] = {
+    [STATS_RX_FRAMES] = {"rx_frames_total", NULL, "Frames received from the tunnel"},
+    [STATS_RX_BYTES] = {"rx_bytes_total", NULL, "Ethernet bytes received from the tunnel"},
+    [STATS_TX_FRAMES] = {"tx_frames_total", NULL, "Frames sent into the tunnel"},
+    [STATS_TX_BYTES] = {"tx_bytes_total", NULL, "Ethernet bytes sent into the tunnel"},
+    [STATS_FLOODED] = {"flooded_total", NULL, "Frames flooded to all VPorts or to a multicast group"},
+    [STATS_FLOODED_UNKNOWN] = {"unknown_unicast_flooded_total", NULL, "Unicast frames for unlearned MACs flooded"},
+    [STATS_DROP_SHORT] = {"dropped_total", "short", NULL},
+    [STATS_DROP_OVERSIZE] = {"dropped_total", "oversize", NULL},
+    [STATS_DROP_SEND] = {"dropped_total", "send", NULL},
+    [STATS_DROP_UNKNOWN_DST] = {"dropped_total", "unknown_dst", NULL},
+    [STATS_DROP_AUTH] = {"dropped_total", "auth", NULL},
+    [STATS_DROP_UNKNOWN_PORT] = {"dropped_total", "unknown_port", NULL},
+    [STATS_DROP_RATE] = {"dropped_total", "rate_limited", NULL},
+    [STATS_DROP_MALFORMED] = {"dropped_total", "malformed", NULL},
+  };
+
+  struct stats_set_t *sets = NULL;
+  unsigned int nsets = stats_collect(&sets);
+
+  for (int i = 0; i < STATS_COUNTERS; i++)
+  {
+    if (counters[i].reason == NULL || i == STATS_DROP_SHORT)
+    {
+      fprintf(out, "# HELP %s_%s %s\n# TYPE %s_%s counter\n", prefix, counters[i].name,
+              counters[i].help ? counters[i].help : "Frames dropped, by reason", prefix, counters[i].name);
+    }
+    if (counters[i].reason)
+    {
+      continue;  // Drops are written together below
+    }
+    for (unsigned int set = 0; set < nsets; set++)
+    {
+      stats_write_series(out, prefix, counters[i].name, sets[set].labels, NULL, sets[set].counters[i]);
+    }
+  }
+  for (unsigned int set = 0; set < nsets; set++)
+  {
+    for (int i = STATS_DROP_SHORT; i < STATS_COUNTERS; i++)
+    {
+      stats_write_series(out, prefix, counters[i].name, sets[set].labels, counters[i].reason,
+                         sets[set].counters[i]);
+    }
+  }
+  stats_write_hists(out, prefix, sets, nsets);
+  free(sets);
+}
+
+static void stats_send_all(int fd, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    // A scraper that hung up early must not raise SIGPIPE, which would end the whole process
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      return;  // The scraper went away
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/*
+ Answers one connection: the request is read (up to its blank line) and
+ ignored, since every path gets the same metrics.
+ */
+static void stats_answer(struct stats_endpoint_t *endpoint, int fd)
+{
+  struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char request[STATS_REQUEST_MAX + 1];
+  size_t got = 0;
+  while (got < STATS_REQUEST_MAX)
+  {
+    ssize_t n = read(fd, request + got, STATS_REQUEST_MAX - got);
+    if (n <= 0)
+    {
+      break;
+    }
+    got += n;
+    request[got] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+    {
+      break;
+    }
+  }
+
+  char *body = NULL;
+  size_t bodysz = 0;
+  FILE *out = open_memstream(&body, &bodysz);
+  if (out == NULL)
+  {
+    return;
+  }
+  stats_write(out, endpoint->prefix);
+  if (endpoint->extra)
+  {
+    endpoint->extra(out, endpoint->ctx);
+  }
+  fclose(out);
+
+  char header[160];
+  int headersz = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                  "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodysz);
+  stats_send_all(fd, header, headersz);
+  stats_send_all(fd, body, bodysz);
+  free(body);
+}
+
+static void *stats_endpoint_thread(void *arg)
+{
+  struct stats_endpoint_t *endpoint = arg;
+  while (true)
+  {
+    int fd = accept(endpoint->listenfd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno != EINTR && errno != ECONNABORTED)
+      {
+        fprintf(stderr, "fail to accept metrics connection: %s\n", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    stats_answer(endpoint, fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+void stats_serve(const char *addr, const char *prefix, void (*extra)(FILE *out, void *ctx), void *ctx)
+{
+  struct stats_endpoint_t *endpoint = malloc(sizeof(*endpoint));
+  if (endpoint == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+  }
+  endpoint->prefix = prefix;
+  endpoint->extra = extra;
+  endpoint->ctx = ctx;
+
+  if (strchr(addr, '/') != NULL)
+  {
+    struct sockaddr_un un = {.sun_family = AF_UNIX};
+    if (strlen(addr) >= sizeof(un.sun_path))
+    {
+      ERROR_PRINT_THEN_EXIT("metrics socket path too long: %s\n", addr);
+    }
+    strcpy(un.sun_path, addr);
+    unlink(addr);  // Left over from an earlier run
+    if ((endpoint->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(endpoint->listenfd, (struct sockaddr *)&un, sizeof(un)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to bind metrics socket %s: %s\n", addr, strerror(errno));
+    }
+  }
+  else
+  {
+    struct sockaddr_in in = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    if (colon != NULL)
+    {
+      char ip[INET_ADDRSTRLEN] = "";
+      if ((size_t)(colon - addr) < sizeof(ip))
+      {
+        memcpy(ip, addr, colon - addr);
+      }
+      if (inet_pton(AF_INET, ip, &in.sin_addr) != 1)
+      {
+        ERROR_PRINT_THEN_EXIT("bad metrics address: %s (expected [ip:]port or a socket path)\n", addr);
+      }
+      port = colon + 1;
+    }
+    in.sin_port = htons(atoi(port));
+    int one = 1;
+    if ((endpoint->listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(endpoint->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(endpoint->listenfd, (struct sockaddr *)&in, sizeof(in)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to bind metrics address %s: %s\n", addr, strerror(errno));
+    }
+  }
+  if (listen(endpoint->listenfd, 16) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to listen: %s\n", strerror(errno));
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_endpoint_thread, endpoint) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+  }
+  pthread_detach(thread);
+}
+
+/*
+ Prints the percentiles of every stage that has samples, once per SIGUSR1.
+ */
+static void *stats_dump_thread(void *arg)
+{
+  sigset_t *signals = arg;
+  while (true)
+  {
+    int sig;
+    if (sigwait(signals, &sig) != 0)
+    {
+      continue;
+    }
+    struct stats_set_t *sets = NULL;
+    unsigned int nsets = stats_collect(&sets);
+    for (unsigned int s = 0; s < nsets; s++)
+    {
+      for (int stage = 0; stage < STATS_STAGES; stage++)
+      {
+        const struct stats_set_t *set = &sets[s];
+        if (set->totals[stage] == 0)
+        {
+          continue;
+        }
+        fprintf(stderr, "[Stats] {%s} %s: %llu samples, mean %.2f us, p50 %.2f us, p99 %.2f us, p99.9 %.2f us, "
+                "max %.2f us\n", set->labels, stats_stage_names[stage], (unsigned long long)set->totals[stage],
+                set->sums[stage] / stats_ticks_per_sec / set->totals[stage] * 1e6,
+                stats_hist_percentile(set, stage, 0.5) * 1e6, stats_hist_percentile(set, stage, 0.99) * 1e6,
+                stats_hist_percentile(set, stage, 0.999) * 1e6, stats_hist_percentile(set, stage, 1) * 1e6);
+      }
+    }
+    free(sets);
+  }
+  return NULL;
+}
+
+void stats_timing_start(void)
+{
+  stats_timing = true;
+
+#if defined(__x86_64__) || defined(__i386__)
+  // Count TSC ticks over a short sleep; the TSC of any CPU this runs on is invariant
+  struct timespec t0, t1, pause = {.tv_sec = 0, .tv_nsec = 20000000};
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t c0 = stats_clock();
+  nanosleep(&pause, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t c1 = stats_clock();
+  stats_ticks_per_sec = (c1 - c0) / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+#endif
+
+  // SIGUSR1 stays blocked in every thread, so only sigwait() ever takes it
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_sigmask: %s\n", strerror(errno));
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_dump_thread, &signals) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,175 @@
+/*
+ This header declares the datapath counters and the metrics endpoint that
+ exposes them. Every forwarding thread counts into stats blocks of its own:
+ each block fills whole cache lines and only its owner writes it, with a
+ relaxed load and store rather than a locked add, so counting never bounces
+ a cache line between cores. Blocks are registered once and only read when
+ the endpoint is scraped; blocks with the same labels (the up and down
+ threads of a VPort queue, or the workers of a daemon port) are summed then.
+
+ The endpoint (-M on vport and vswitch) listens on a TCP address or a Unix
+ socket and answers every HTTP request with all counters in the Prometheus
+ text format.
+
+ With -T, every block also gets a histogram per datapath stage (reading the
+ TAP, sending a batch, switching a datagram, writing the TAP). A stage is
+ timed with the TSC, two reads of it per stage boundary, into log-linear
+ buckets of ticks (8 per power of two, so within 12%) that only the owning
+ thread writes. Histograms are converted to seconds when scraped, and a
+ SIGUSR1 prints their percentiles to stderr.
+ */
+
+#ifndef _STATS_UTILS_H
+#define _STATS_UTILS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define STATS_LABELS_LEN 64   ///< Room for the labels of a block, e.g. port="tapa",queue="0"
+#define STATS_HIST_SUB 8      ///< Histogram buckets per power of two
+#define STATS_HIST_BUCKETS (40 * STATS_HIST_SUB)  ///< Up to 2^42 ticks; longer stages land in the last bucket
+
+enum stats_counter_t
+{
+  STATS_RX_FRAMES,          ///< Frames received from the tunnel (VPort: written to the TAP)
+  STATS_RX_BYTES,
+  STATS_TX_FRAMES,          ///< Frames sent into the tunnel (VPort: read from the TAP)
+  STATS_TX_BYTES,
+  STATS_FLOODED,            ///< Frames flooded to every VPort or to a multicast group's subscribers
+  STATS_FLOODED_UNKNOWN,    ///< VSwitch: unicast frames for unlearned MACs among them
+  STATS_DROP_SHORT,         ///< Frames too short to hold an Ethernet header
+  STATS_DROP_OVERSIZE,      ///< Truncated datagrams and super-frames that could not be segmented
+  STATS_DROP_SEND,          ///< sendmmsg/write failures and size mismatches
+  STATS_DROP_UNKNOWN_DST,   ///< Unicast frames for unlearned MACs beyond the flood limit
+  STATS_DROP_AUTH,          ///< Datagrams that did not authenticate (-k)
+  STATS_DROP_UNKNOWN_PORT,  ///< Datagrams for a port ID or network that does not exist here, or VPorts that cannot be tracked
+  STATS_DROP_RATE,          ///< VSwitch: datagrams over the rate limit of their VPort (-r)
+  STATS_DROP_MALFORMED,     ///< VPort: guest frames (-V) whose descriptors point outside guest memory or are not readable
+  STATS_COUNTERS
+};
+
+enum stats_stage_t
+{
+  STATS_STAGE_TAP_READ,     ///< One read() from the TAP that returned a frame
+  STATS_STAGE_SEND,         ///< Coalescing, sealing and sending a batch of datagrams
+  STATS_STAGE_SWITCH,       ///< VSwitch: opening, classifying (with its batch), learning, looking up and queueing one frame
+  STATS_STAGE_TAP_WRITE,    ///< One write() of a frame to the TAP
+  STATS_STAGES
+};
+
+struct stats_hist_t
+{
+  _Atomic uint64_t counts[STATS_HIST_BUCKETS];
+  _Atomic uint64_t sum;     ///< Total ticks
+};
+
+struct stats_t
+{
+  _Alignas(64) _Atomic uint64_t counters[STATS_COUNTERS];
+  char labels[STATS_LABELS_LEN];  ///< Prometheus labels without braces, may be empty
+  struct stats_hist_t *hists;     ///< STATS_STAGES stage histograms, NULL unless timing is on
+  struct stats_t *next;           ///< Registry of all blocks, walked by the endpoint
+};
+
+/*
+ Allocates and registers a zeroed block with the given labels.
+ */
+struct stats_t *stats_create(const char *labels);
+
+extern bool stats_timing;  ///< Stage timing is on, see stats_timing_start()
+
+/*
+ Turns stage timing on for the blocks created from now on: calibrates the
+ TSC and starts a thread that dumps the histograms on SIGUSR1. Must be
+ called before any other thread is started, so that all of them inherit the
+ blocked signal.
+ */
+void stats_timing_start(void);
+
+/*
+ Adds 'n' to a counter only the calling thread writes: readers may see the
+ old value for a while, but never a torn one.
+ */
+static inline void stats_counter_add(_Atomic uint64_t *counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/*
+ Adds 'n' to a counter. Must only be called by the thread that owns 'stats'.
+ */
+static inline void stats_add(struct stats_t *stats, enum stats_counter_t counter, uint64_t n)
+{
+  stats_counter_add(&stats->counters[counter], n);
+}
+
+static inline void stats_inc(struct stats_t *stats, enum stats_counter_t counter)
+{
+  stats_add(stats, counter, 1);
+}
+
+/*
+ Returns the current time in ticks: the TSC where there is one, otherwise
+ nanoseconds.
+ */
+static inline uint64_t stats_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ Returns the start time of a stage to pass to stats_time(), without reading
+ the clock if 'stats' does not time stages.
+ */
+static inline uint64_t stats_start(const struct stats_t *stats)
+{
+  return stats->hists ? stats_clock() : 0;
+}
+
+static inline unsigned int stats_hist_index(uint64_t ticks)
+{
+  if (ticks < STATS_HIST_SUB)
+  {
+    return (unsigned int)ticks;
+  }
+  unsigned int msb = 63 - __builtin_clzll(ticks);
+  unsigned int index = (msb - 2) * STATS_HIST_SUB + ((ticks >> (msb - 3)) & (STATS_HIST_SUB - 1));
+  return index < STATS_HIST_BUCKETS ? index : STATS_HIST_BUCKETS - 1;
+}
+
+/*
+ Records a stage that began at 'start'. Must only be called by the thread
+ that owns 'stats'.
+ */
+static inline void stats_time(struct stats_t *stats, enum stats_stage_t stage, uint64_t start)
+{
+  if (stats->hists)
+  {
+    uint64_t ticks = stats_clock() - start;
+    struct stats_hist_t *hist = &stats->hists[stage];
+    stats_counter_add(&hist->counts[stats_hist_index(ticks)], 1);
+    stats_counter_add(&hist->sum, ticks);
+  }
+}
+
+/*
+ Starts the metrics endpoint on 'addr': "[ip:]port" (the IP defaults to
+ 127.0.0.1) or the path of a Unix socket. Metric names start with 'prefix'.
+ 'extra', if not NULL, appends program-specific metrics to each scrape.
+ Exits if the address cannot be bound.
+ */
+void stats_serve(const char *addr, const char *prefix, void (*extra)(FILE *out, void *ctx), void *ctx);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ This header declares the port tag that lets one UDP endpoint carry traffic
+ for many VPorts. A VPort daemon (vport -c) serves all of its TAP devices
+ from one socket and puts a tag in front of every datagram, both ways:
+
+   | magic (2) | port ID (2, big-endian) | [offload_hdr_t] | Ethernet frame ... |
+
+ The VSwitch treats each (UDP endpoint, port ID) pair as a separate VPort.
+ Like the offload magic, ff:50 would otherwise start a frame for a group
+ address no station uses. Datagrams without a tag are from standalone VPorts.
+ */
+
+#ifndef _TAG_UTILS_H
+#define _TAG_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PORT_TAG_MAGIC0 0xff
+#define PORT_TAG_MAGIC1 0x50
+#define PORT_TAG_LEN 4
+#define PORT_TAG_MIN_ID 1        ///< Port ID 0 is reserved for standalone (untagged) VPorts
+#define PORT_TAG_MAX_ID 0x7fff   ///< Port IDs fit in 15 bits so (endpoint, ID) packs into a 63-bit key
+
+static inline bool port_tag_present(const char *data, size_t len)
+{
+  return len >= PORT_TAG_LEN && (uint8_t)data[0] == PORT_TAG_MAGIC0 && (uint8_t)data[1] == PORT_TAG_MAGIC1;
+}
+
+static inline uint16_t port_tag_id(const char *data)
+{
+  return ((uint16_t)(uint8_t)data[2] << 8) | (uint8_t)data[3];
+}
+
+static inline void port_tag_set(char *data, uint16_t port_id)
+{
+  data[0] = (char)PORT_TAG_MAGIC0;
+  data[1] = (char)PORT_TAG_MAGIC1;
+  data[2] = (char)(port_id >> 8);
+  data[3] = (char)(port_id & 0xff);
+}
+
+#endif
@@ -1,62 +1,238 @@
-/* 
- This file implements TAP device creation and management functions.
- TAP devices are virtual network interfaces that operate at the Ethernet
- frame level, allowing userspace programs to send and receive raw Ethernet frames.
-*/
-
-#include "tap_utils.h"
-
-/*
- This function performs the following operations:
- 1. Opens the TUN/TAP clone device (/dev/net/tun)
- 2. Configures it as a TAP device (Ethernet frames, no packet info)
- 3. Assigns a name to the device
- 4. Returns the file descriptor for reading/writing Ethernet frames
- 
- @note This function requires root privileges to create network interfaces
- */
-
-int tap_alloc(char *dev)
-{
-  struct ifreq ifr;  // Interface request structure for ioctl operations
-  int fd, err;
-
-  // Open the TUN/TAP clone device - this is the entry point for creating virtual interfaces
-  if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
-  {
-    return fd;  // Return the error code from open()
-  }
-
-  /* Configure interface request structure:
-    
-   Flags explanation:
-   - IFF_TUN: Creates a TUN device (Layer 3 - IP packets, no Ethernet headers)
-   - IFF_TAP: Creates a TAP device (Layer 2 - Ethernet frames with headers)
-   - IFF_NO_PI: Do not prepend packet information to frames
-   
-   We use IFF_TAP because we want to work with complete Ethernet frames
-   including MAC addresses for our virtual switch implementation.
-   */
-  memset(&ifr, 0, sizeof(ifr));           // Clear the structure
-  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;    // Set TAP mode without packet info
-
-  // If a specific device name is requested, copy it to the interface request
-  if (*dev)
-  {
-    strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-  }
-
-  // Create the TAP interface using ioctl system call
-  // TUNSETIFF: Set the interface type and configuration
-  if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0)
-  {
-    close(fd);  // Clean up file descriptor on error
-    return err; // Return the error code
-  }
-
-  // Copy the actual assigned device name back to the caller
-  // (In case the kernel assigned a different name than requested)
-  strcpy(dev, ifr.ifr_name);
-  
-  return fd;  // Return the file descriptor for the TAP device
-}
\ No newline at end of file
+/* 
+ This file implements TAP device creation and management functions.
+ TAP devices are virtual network interfaces that operate at the Ethernet
+ frame level, allowing userspace programs to send and receive raw Ethernet frames.
+*/
+
+#include "tap_utils.h"
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>    // rtnetlink request for gso_max_size
+#include <linux/rtnetlink.h>
+
+/*
+ This function performs the following operations:
+ 1. Opens the TUN/TAP clone device (/dev/net/tun)
+ 2. Configures it as a TAP device (Ethernet frames, no packet info)
+ 3. Assigns a name to the device
+ 4. Returns the file descriptor for reading/writing Ethernet frames
+ 
+ @note This function requires root privileges to create network interfaces
+ */
+
+int tap_alloc(char *dev)
+{
+  struct ifreq ifr;  // Interface request structure for ioctl operations
+  int fd, err;
+
+  // Open the TUN/TAP clone device - this is the entry point for creating virtual interfaces
+  if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
+  {
+    return fd;  // Return the error code from open()
+  }
+
+  /* Configure interface request structure:
+    
+   Flags explanation:
+   - IFF_TUN: Creates a TUN device (Layer 3 - IP packets, no Ethernet headers)
+   - IFF_TAP: Creates a TAP device (Layer 2 - Ethernet frames with headers)
+   - IFF_NO_PI: Do not prepend packet information to frames
+   
+   We use IFF_TAP because we want to work with complete Ethernet frames
+   including MAC addresses for our virtual switch implementation.
+   */
+  memset(&ifr, 0, sizeof(ifr));           // Clear the structure
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;    // Set TAP mode without packet info
+
+  // If a specific device name is requested, copy it to the interface request
+  if (*dev)
+  {
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+  }
+
+  // Create the TAP interface using ioctl system call
+  // TUNSETIFF: Set the interface type and configuration
+  if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0)
+  {
+    close(fd);  // Clean up file descriptor on error
+    return err; // Return the error code
+  }
+
+  // Copy the actual assigned device name back to the caller
+  // (In case the kernel assigned a different name than requested)
+  strcpy(dev, ifr.ifr_name);
+  
+  return fd;  // Return the file descriptor for the TAP device
+}
+
+/*
+ This function creates (or attaches to) a TAP device and opens 'queues' file
+ descriptors on it. With more than one queue the device is created with
+ IFF_MULTI_QUEUE: each descriptor is an independent kernel TX/RX queue of the
+ same interface, so frames can be read and written by different threads in
+ parallel, and the kernel spreads outgoing flows across the queues by flow hash.
+
+ With TAP_OPT_VNET_HDR every frame read or written is preceded by a struct
+ virtio_net_hdr, and the device advertises checksum and TCP segmentation
+ offload. The kernel then hands us unsegmented super-frames with partial
+ checksums instead of doing that work before read() returns.
+
+ @return 0 on success (fds[0..queues-1] are filled in), negative on error
+ @note This function requires root privileges to create network interfaces
+ */
+int tap_alloc_mq(char *dev, int queues, int *fds, int options)
+{
+  struct ifreq ifr;  // Interface request structure for ioctl operations
+  int i, err;
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (queues > 1)
+  {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;  // Every open() attaches one more queue
+  }
+  if (options & TAP_OPT_VNET_HDR)
+  {
+    ifr.ifr_flags |= IFF_VNET_HDR;     // Frames carry a virtio_net_hdr in both directions
+  }
+
+  if (*dev)
+  {
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ);
+  }
+
+  for (i = 0; i < queues; i++)
+  {
+    if ((fds[i] = open("/dev/net/tun", O_RDWR)) < 0)
+    {
+      err = fds[i];
+      goto fail;
+    }
+
+    // The first TUNSETIFF creates the interface, later ones join it as extra queues
+    if ((err = ioctl(fds[i], TUNSETIFF, (void *)&ifr)) < 0)
+    {
+      close(fds[i]);
+      goto fail;
+    }
+
+    if (options & TAP_OPT_VNET_HDR)
+    {
+      // Use the basic 10-byte header, and let the kernel skip checksumming and
+      // segmentation of TCP over IPv4/IPv6 for frames it sends to us
+      int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+      unsigned int offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+      if ((err = ioctl(fds[i], TUNSETVNETHDRSZ, &vnet_hdr_sz)) < 0 ||
+          (err = ioctl(fds[i], TUNSETOFFLOAD, offloads)) < 0)
+      {
+        close(fds[i]);
+        goto fail;
+      }
+    }
+  }
+
+  // Copy the actual assigned device name back to the caller
+  strcpy(dev, ifr.ifr_name);
+
+  return 0;
+
+fail:
+  // Release the queues opened so far; closing the last one removes the interface
+  while (--i >= 0)
+  {
+    close(fds[i]);
+  }
+  return err;
+}
+
+/*
+ This function sends an RTM_NEWLINK request carrying IFLA_GSO_MAX_SIZE over
+ rtnetlink (the equivalent of "ip link set {dev} gso_max_size {size}") and
+ waits for the kernel's acknowledgement.
+ */
+int tap_set_gso_max_size(const char *dev, unsigned int size)
+{
+  struct
+  {
+    struct nlmsghdr nlh;
+    struct ifinfomsg ifi;
+    char attrs[RTA_SPACE(sizeof(uint32_t))];
+  } req;
+  int fd, err;
+
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi)) + RTA_SPACE(sizeof(uint32_t));
+  req.nlh.nlmsg_type = RTM_NEWLINK;
+  req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  req.ifi.ifi_family = AF_UNSPEC;
+
+  struct rtattr *rta = (struct rtattr *)req.attrs;
+  rta->rta_type = IFLA_GSO_MAX_SIZE;
+  rta->rta_len = RTA_LENGTH(sizeof(uint32_t));
+  memcpy(RTA_DATA(rta), &size, sizeof(uint32_t));
+
+  if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0)
+  {
+    return fd;
+  }
+
+  // Resolve the interface index (SIOCGIFINDEX works on any socket)
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+  if ((err = ioctl(fd, SIOCGIFINDEX, &ifr)) < 0)
+  {
+    close(fd);
+    return err;
+  }
+  req.ifi.ifi_index = ifr.ifr_ifindex;
+
+  if ((err = send(fd, &req, req.nlh.nlmsg_len, 0)) < 0)
+  {
+    close(fd);
+    return err;
+  }
+
+  // The acknowledgement is an NLMSG_ERROR message whose error field is 0 on success
+  char reply[256];
+  int replysz = recv(fd, reply, sizeof(reply), 0);
+  close(fd);
+  struct nlmsghdr *ack = (struct nlmsghdr *)reply;
+  if (replysz < (int)NLMSG_LENGTH(sizeof(struct nlmsgerr)) || ack->nlmsg_type != NLMSG_ERROR)
+  {
+    return -1;
+  }
+  struct nlmsgerr *nlerr = (struct nlmsgerr *)NLMSG_DATA(ack);
+  if (nlerr->error != 0)
+  {
+    errno = -nlerr->error;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ This function sets the MTU with SIOCSIFMTU (the equivalent of "ip link set
+ {dev} mtu {mtu}"). Returns 0 on success, or -1 with errno set: EINVAL if
+ the MTU is below 68 or above what the device allows, ENODEV if there is no
+ such device, EPERM without CAP_NET_ADMIN, or whatever socket() failed with.
+ */
+int tap_set_mtu(const char *dev, unsigned int mtu)
+{
+  struct ifreq ifr;
+  int fd, err;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+  ifr.ifr_mtu = (int)mtu;
+
+  // SIOCSIFMTU works on any socket of the interface's namespace
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+  {
+    return fd;
+  }
+  err = ioctl(fd, SIOCSIFMTU, &ifr);
+  close(fd);
+  return err;
+}
@@ -1,24 +1,63 @@
-/*
- This header declares functions for creating and managing TAP (network tap)
- devices on Linux systems. TAP devices create virtual Ethernet interfaces
- that can be used to inject/capture network traffic at the data link layer.
- */
-
-#ifndef __TUNTAP_H
-#define __TUNTAP_H
-
-#include <linux/if.h>       // Network interface structures and constants
-#include <linux/if_tun.h>   // TUN/TAP device specific structures and constants
-#include <fcntl.h>          // File control operations
-#include <string.h>         // String manipulation functions
-#include <sys/ioctl.h>      // I/O control operations
-#include <unistd.h>         // POSIX system calls
-
-/*
- This function creates a new TAP device and returns its file descriptor.
- The device name can be specified in the 'dev' parameter, or if empty,
- the kernel will assign a name automatically.
- */
-int tap_alloc(char *dev);
-
+/*
+ This header declares functions for creating and managing TAP (network tap)
+ devices on Linux systems. TAP devices create virtual Ethernet interfaces
+ that can be used to inject/capture network traffic at the data link layer.
+ */
+
+#ifndef __TUNTAP_H
+#define __TUNTAP_H
+
+#include <linux/if.h>       // Network interface structures and constants
+#include <linux/if_tun.h>   // TUN/TAP device specific structures and constants
+#include <fcntl.h>          // File control operations
+#include <string.h>         // String manipulation functions
+#include <sys/ioctl.h>      // I/O control operations
+#include <unistd.h>         // POSIX system calls
+#include <linux/virtio_net.h> // virtio_net_hdr prepended to frames with TAP_OPT_VNET_HDR
+#include <linux/if_ether.h> // ETH_HLEN
+
+#define TAP_DEFAULT_MTU 1500   ///< MTU of a TAP device unless overridden (vport -m)
+#define TAP_MIN_MTU 68         ///< Smallest MTU IPv4 allows
+#define TAP_MAX_MTU 9000       ///< Largest MTU accepted for a TAP device (jumbo frames)
+#define TAP_VLAN_TAG_LEN 4
+
+/*
+ Largest frame a TAP device with MTU 'mtu' hands over or accepts: the
+ payload, the Ethernet header and up to two VLAN tags (802.1ad).
+ */
+static inline size_t tap_frame_len(unsigned int mtu)
+{
+  return mtu + ETH_HLEN + 2 * TAP_VLAN_TAG_LEN;
+}
+
+/*
+ This function creates a new TAP device and returns its file descriptor.
+ The device name can be specified in the 'dev' parameter, or if empty,
+ the kernel will assign a name automatically.
+ */
+int tap_alloc(char *dev);
+
+#define TAP_OPT_VNET_HDR 0x1   ///< Prefix frames with a virtio_net_hdr and enable checksum/TSO offloads
+
+/*
+ This function creates a TAP device with 'queues' queues (IFF_MULTI_QUEUE when
+ more than one) and stores one file descriptor per queue in 'fds'. 'options'
+ is a combination of TAP_OPT_* flags. Returns 0 on success, negative on error.
+ */
+int tap_alloc_mq(char *dev, int queues, int *fds, int options);
+
+/*
+ This function caps the size of GSO super-frames the kernel hands to the TAP
+ device, so a whole super-frame fits in one UDP datagram. Returns 0 on
+ success, negative on error.
+ */
+int tap_set_gso_max_size(const char *dev, unsigned int size);
+
+/*
+ This function sets the MTU of the TAP device, which is what its frames are
+ sized for. Returns 0 on success, or -1 with errno set (e.g. EINVAL for an
+ MTU the device does not accept).
+ */
+int tap_set_mtu(const char *dev, unsigned int mtu);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+/*
+ This file implements the batched UDP I/O helpers declared in udp_utils.h.
+ */
+
+#include "udp_utils.h"
+#include "sys_utils.h"
+#include "log_utils.h"
+#include <string.h>
+#include <unistd.h>
+
+void mmsg_ring_init(struct mmsg_ring_t *ring, unsigned int capacity, size_t bufsz, unsigned int spare)
+{
+  ring->capacity = capacity;
+  ring->count = 0;
+  ring->bufsz = bufsz;
+  ring->msgs = calloc(capacity, sizeof(*ring->msgs));
+  ring->iovs = calloc(capacity, sizeof(*ring->iovs));
+  ring->addrs = calloc(capacity, sizeof(*ring->addrs));
+  ring->frames = bufsz ? calloc(capacity, sizeof(*ring->frames)) : NULL;  // Send-only rings reference external buffers
+  if (ring->msgs == NULL || ring->iovs == NULL || ring->addrs == NULL || (bufsz && ring->frames == NULL))
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate mmsg ring: %s\n", strerror(errno));
+  }
+
+  memset(&ring->pool, 0, sizeof(ring->pool));
+  if (bufsz)
+  {
+    // Slot i starts out with buffer i, so the initial buffers are contiguous
+    frame_pool_init(&ring->pool, capacity + spare, bufsz, frame_pool_options);
+    for (unsigned int i = 0; i < capacity; i++)
+    {
+      ring->frames[i] = frame_alloc(&ring->pool);
+    }
+  }
+  mmsg_ring_reset(ring);
+}
+
+bool mmsg_ring_recycle(struct mmsg_ring_t *ring)
+{
+  for (unsigned int i = 0; i < ring->capacity; i++)
+  {
+    if (ring->frames[i]->refs > 1)
+    {
+      struct frame_desc_t *fresh = frame_alloc(&ring->pool);
+      if (fresh == NULL)
+      {
+        return false;
+      }
+      frame_put(&ring->pool, ring->frames[i]);  // The other holders keep the old buffer alive
+      ring->frames[i] = fresh;
+    }
+  }
+  return true;
+}
+
+void mmsg_ring_reset(struct mmsg_ring_t *ring)
+{
+  for (unsigned int i = 0; i < ring->capacity; i++)
+  {
+    ring->iovs[i].iov_base = mmsg_ring_buf(ring, i);
+    ring->iovs[i].iov_len = ring->bufsz;
+    ring->msgs[i].msg_hdr.msg_name = &ring->addrs[i];
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof(ring->addrs[i]);
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_control = NULL;
+    ring->msgs[i].msg_hdr.msg_controllen = 0;
+    ring->msgs[i].msg_hdr.msg_flags = 0;
+    ring->msgs[i].msg_len = 0;
+  }
+  ring->count = 0;
+}
+
+struct frame_desc_t *mmsg_ring_frame(const struct mmsg_ring_t *ring, unsigned int slot)
+{
+  ring->frames[slot]->len = ring->msgs[slot].msg_len;
+  return ring->frames[slot];
+}
+
+int mmsg_ring_flush(struct mmsg_ring_t *ring, int sockfd)
+{
+  int sent = mmsg_send(sockfd, ring->msgs, ring->count);
+  ring->count = 0;
+  return sent;
+}
+
+int mmsg_send(int sockfd, struct mmsghdr *msgs, unsigned int count)
+{
+  unsigned int sent = 0;
+  unsigned int short_sent = 0;
+
+  while (sent < count)
+  {
+    int n = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      // Drop the remainder of the batch rather than spinning on a persistent error; callers count it
+      LOG_PRINT(LOG_FRAMES, "Failed to sendmmsg: %s, dropped %u frames\n", strerror(errno), count - sent);
+      break;
+    }
+
+    // Verify that every datagram in this chunk was sent in full
+    for (int i = 0; i < n; i++)
+    {
+      const struct mmsghdr *msg = &msgs[sent + i];
+      size_t len = 0;
+      for (size_t j = 0; j < msg->msg_hdr.msg_iovlen; j++)
+      {
+        len += msg->msg_hdr.msg_iov[j].iov_len;
+      }
+      if (msg->msg_len != len)
+      {
+        LOG_PRINT(LOG_FRAMES, "sendto size mismatch: ether_datasz=%d, sendsz=%d\n", (int)len, (int)msg->msg_len);
+        short_sent++;
+      }
+    }
+    sent += n;
+  }
+  return sent - short_sent;
+}
+
+void udp_busy_poll(int sockfd, unsigned int usecs)
+{
+  int value = (int)usecs;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) < 0)
+  {
+    fprintf(stderr, "fail to set SO_BUSY_POLL: %s\n", strerror(errno));
+  }
+}
+
+void udp_pmtu_discover(int sockfd)
+{
+  int value = IP_PMTUDISC_WANT;
+  if (setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) < 0)
+  {
+    fprintf(stderr, "fail to set IP_MTU_DISCOVER: %s\n", strerror(errno));
+  }
+}
+
+int udp_path_mtu(const struct sockaddr_in *dst)
+{
+  // IP_MTU needs a connected socket; connecting a UDP socket sends nothing
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  int mtu = -1;
+  socklen_t len = sizeof(mtu);
+  if (connect(fd, (const struct sockaddr *)dst, sizeof(*dst)) < 0 ||
+      getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+  {
+    mtu = -1;
+  }
+  close(fd);
+  return mtu;
+}
@@ -0,0 +1,99 @@
+/*
+ This header declares helpers for batched UDP I/O. A mmsg_ring_t is a
+ preallocated array of mmsghdr/iovec/address slots, each backed by its own
+ frame buffer, so that up to 'capacity' datagrams can be received with one
+ recvmmsg() or sent with one sendmmsg() without any per-frame allocation.
+
+ The frame buffers come from the ring's frame pool (pool_utils.h). Another
+ stage may keep a received frame by taking a reference to the slot's
+ descriptor; mmsg_ring_recycle() then gives the slot a fresh buffer instead
+ of overwriting one that is still in use.
+ */
+
+#ifndef _UDP_UTILS_H
+#define _UDP_UTILS_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "pool_utils.h"
+
+struct mmsg_ring_t
+{
+  unsigned int capacity;       ///< Number of slots (maximum datagrams per syscall)
+  unsigned int count;          ///< Number of slots currently filled
+  size_t bufsz;                ///< Size of each slot's frame buffer
+  struct mmsghdr *msgs;        ///< Message headers passed to recvmmsg/sendmmsg
+  struct iovec *iovs;          ///< One iovec per slot, initially pointing at the slot's buffer
+  struct sockaddr_in *addrs;   ///< Peer address storage for each slot
+  struct frame_pool_t pool;    ///< Frame buffers: one per slot plus the spares
+  struct frame_desc_t **frames;  ///< Frame attached to each slot, NULL for send-only rings
+};
+
+/*
+ Allocates the slots of a ring. Every slot's msghdr is wired to its iovec and
+ address, and every iovec to its own 'bufsz' bytes of buffer space. 'spare'
+ extra buffers let slots be recycled while other stages hold their frames.
+ With 'bufsz' 0 the ring is send-only and its iovecs are set by the caller.
+ */
+void mmsg_ring_init(struct mmsg_ring_t *ring, unsigned int capacity, size_t bufsz, unsigned int spare);
+
+/*
+ Resets every slot so it can be handed to recvmmsg() again.
+ */
+void mmsg_ring_reset(struct mmsg_ring_t *ring);
+
+/*
+ Before the slots are reused, swaps a fresh buffer into every slot whose frame
+ is still referenced by another stage. Returns false if the pool ran out of
+ spares; the remaining slots then keep their frames.
+ */
+bool mmsg_ring_recycle(struct mmsg_ring_t *ring);
+
+/*
+ Sends the first 'ring->count' slots with as few sendmmsg() calls as possible
+ and empties the ring. Returns the number of datagrams that were sent in full.
+ */
+int mmsg_ring_flush(struct mmsg_ring_t *ring, int sockfd);
+
+/*
+ Sends 'count' prepared messages with as few sendmmsg() calls as possible,
+ as mmsg_ring_flush() does for a ring. Returns the number that were sent in
+ full.
+ */
+int mmsg_send(int sockfd, struct mmsghdr *msgs, unsigned int count);
+
+/*
+ Busy-poll mode: asks the kernel to poll the device queue for up to 'usecs'
+ microseconds when a receive on 'sockfd' finds nothing queued (SO_BUSY_POLL).
+ Failure (raising the value needs CAP_NET_ADMIN) is reported, not fatal.
+ */
+void udp_busy_poll(int sockfd, unsigned int usecs);
+
+/*
+ Lets the kernel set DF on every datagram from 'sockfd' that fits the path
+ MTU it knows towards the destination, and fragment only those that do not
+ (IP_PMTUDISC_WANT), whatever net.ipv4.ip_no_pmtu_disc says. Failure is
+ reported, not fatal.
+ */
+void udp_pmtu_discover(int sockfd);
+
+/*
+ Returns the path MTU the kernel currently knows towards 'dst' (the MTU of
+ the route, lowered by any "fragmentation needed" it has heard of), or -1 on
+ error.
+ */
+int udp_path_mtu(const struct sockaddr_in *dst);
+
+static inline char *mmsg_ring_buf(const struct mmsg_ring_t *ring, unsigned int slot)
+{
+  return ring->frames ? ring->frames[slot]->data : NULL;
+}
+
+/*
+ Returns the descriptor of the frame in 'slot', with its length set to that
+ of the datagram the slot last received.
+ */
+struct frame_desc_t *mmsg_ring_frame(const struct mmsg_ring_t *ring, unsigned int slot);
+
+#endif
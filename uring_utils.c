@@ -0,0 +1,226 @@
+/*
+ This file implements the raw io_uring binding declared in uring_utils.h.
+ */
+
+#include "uring_utils.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring_t *ring, unsigned int entries)
+{
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  // Only this thread submits, and completions are reaped when it enters the
+  // kernel anyway, so task work need not interrupt it (both flags are 5.19+)
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  int fd = uring_setup(entries, &params);
+  if (fd < 0 && errno == EINVAL)
+  {
+    memset(&params, 0, sizeof(params));
+    fd = uring_setup(entries, &params);
+  }
+  if (fd < 0)
+  {
+    return -1;
+  }
+  ring->fd = fd;
+
+  ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    ring->sq_ring_sz = ring->cq_ring_sz = ring->sq_ring_sz > ring->cq_ring_sz ? ring->sq_ring_sz : ring->cq_ring_sz;
+  }
+  ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+  {
+    goto fail;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    ring->cq_ring = ring->sq_ring;
+  }
+  else
+  {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+    {
+      goto fail;
+    }
+  }
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    goto fail;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+  ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+  ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+  ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // SQ ring slots map one to one onto SQEs, so the array never changes
+  for (unsigned int i = 0; i <= ring->sq_mask; i++)
+  {
+    ring->sq_array[i] = i;
+  }
+  return 0;
+
+fail:
+  {
+    int err = errno;
+    uring_exit(ring);
+    errno = err;
+  }
+  return -1;
+}
+
+void uring_exit(struct uring_t *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+  {
+    munmap(ring->sqes, ring->sqes_sz);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+  {
+    munmap(ring->cq_ring, ring->cq_ring_sz);
+  }
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+  {
+    munmap(ring->sq_ring, ring->sq_ring_sz);
+  }
+  if (ring->fd >= 0)
+  {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+int uring_register_buffers(struct uring_t *ring, const struct iovec *iovs, unsigned int n)
+{
+  return uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, n) < 0 ? -1 : 0;
+}
+
+int uring_buf_ring_init(struct uring_t *ring, struct uring_buf_ring_t *bufring, uint16_t bgid,
+                        char *bufs, unsigned int n, size_t bufsz)
+{
+  unsigned int entries = 1;
+  while (entries < n)
+  {
+    entries <<= 1;
+  }
+
+  // The ring must be page aligned; an anonymous mapping always is
+  size_t ringsz = entries * sizeof(struct io_uring_buf);
+  void *br = mmap(NULL, ringsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+  if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    int err = errno;
+    munmap(br, ringsz);
+    errno = err;
+    return -1;
+  }
+
+  bufring->br = br;
+  bufring->entries = entries;
+  bufring->tail = 0;
+  bufring->bgid = bgid;
+  bufring->bufs = bufs;
+  bufring->bufsz = bufsz;
+  for (unsigned int bid = 0; bid < n; bid++)
+  {
+    uring_buf_ring_recycle(bufring, bid);
+  }
+  return 0;
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring_t *bufring, uint16_t bid)
+{
+  struct io_uring_buf *buf = &bufring->br->bufs[bufring->tail & (bufring->entries - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(bufring->bufs + bid * bufring->bufsz);
+  buf->len = bufring->bufsz;
+  buf->bid = bid;
+
+  // Make the buffer visible to the kernel before moving the tail past it
+  bufring->tail++;
+  __atomic_store_n(&bufring->br->tail, bufring->tail, __ATOMIC_RELEASE);
+}
+
+int uring_submit_and_wait(struct uring_t *ring, unsigned int wait_nr)
+{
+  if (ring->sq_pending > 0)
+  {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+  }
+
+  // Also covers SQEs a previous call published but the kernel did not consume
+  unsigned int to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (to_submit == 0 && wait_nr == 0)
+  {
+    return 0;
+  }
+
+  int ret;
+  do
+  {
+    ret = uring_enter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring)
+{
+  unsigned int tail = *ring->sq_tail + ring->sq_pending;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+  {
+    uring_submit_and_wait(ring, 0);
+    tail = *ring->sq_tail;
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_pending++;
+  return sqe;
+}
@@ -0,0 +1,160 @@
+/*
+ This header provides a minimal io_uring binding built directly on the
+ io_uring_setup/io_uring_enter/io_uring_register system calls, so the
+ event-loop datapath needs no external library. It covers what the datapath
+ uses: submission and completion rings, fixed (registered) buffers, and
+ provided buffer rings for multishot receives.
+ */
+
+#ifndef _URING_UTILS_H
+#define _URING_UTILS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+struct uring_t
+{
+  int fd;                          ///< io_uring instance
+  unsigned int *sq_head;           ///< Consumed by the kernel
+  unsigned int *sq_tail;           ///< Produced by us
+  unsigned int *sq_array;          ///< Indirection from SQ ring slots to SQEs
+  unsigned int sq_mask;            ///< SQ ring size - 1
+  unsigned int sq_pending;         ///< SQEs handed out but not yet published
+  struct io_uring_sqe *sqes;       ///< Submission queue entries
+  unsigned int *cq_head;           ///< Consumed by us
+  unsigned int *cq_tail;           ///< Produced by the kernel
+  unsigned int cq_mask;            ///< CQ ring size - 1
+  struct io_uring_cqe *cqes;       ///< Completion queue entries
+  void *sq_ring;                   ///< Mapping of the SQ ring (and CQ ring with IORING_FEAT_SINGLE_MMAP)
+  size_t sq_ring_sz;
+  void *cq_ring;                   ///< Mapping of the CQ ring
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+};
+
+/*
+ A provided buffer ring: the kernel picks a free buffer for each received
+ datagram and reports its ID in the completion, and the application hands
+ the buffer back with uring_buf_ring_recycle() once it is done with it.
+ */
+struct uring_buf_ring_t
+{
+  struct io_uring_buf_ring *br;    ///< Ring shared with the kernel
+  unsigned int entries;            ///< Ring size (a power of two)
+  uint16_t tail;                   ///< Next ring slot to fill
+  uint16_t bgid;                   ///< Buffer group ID used in SQEs
+  char *bufs;                      ///< Buffer storage (owned by the caller)
+  size_t bufsz;                    ///< Size of each buffer
+};
+
+/*
+ Creates an io_uring with at least 'entries' SQ entries and maps its rings.
+ Returns 0 on success, or -1 with errno set (e.g. ENOSYS on old kernels or
+ EPERM where io_uring is disabled) so that callers can fall back to epoll.
+ */
+int uring_init(struct uring_t *ring, unsigned int entries);
+
+/*
+ Unmaps the rings and closes the io_uring, releasing every registration.
+ */
+void uring_exit(struct uring_t *ring);
+
+/*
+ Registers 'n' buffers for IORING_OP_READ_FIXED/WRITE_FIXED, which saves the
+ kernel from pinning and mapping user pages on every operation.
+ Returns 0 on success, or -1 with errno set.
+ */
+int uring_register_buffers(struct uring_t *ring, const struct iovec *iovs, unsigned int n);
+
+/*
+ Sets up buffer group 'bgid' from 'n' buffers of 'bufsz' bytes at 'bufs' and
+ registers it with the kernel. Returns 0 on success, or -1 with errno set.
+ */
+int uring_buf_ring_init(struct uring_t *ring, struct uring_buf_ring_t *bufring, uint16_t bgid,
+                        char *bufs, unsigned int n, size_t bufsz);
+
+/*
+ Returns buffer 'bid' of a buffer group to the kernel.
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring_t *bufring, uint16_t bid);
+
+/*
+ Publishes all pending SQEs and, if 'wait_nr' > 0, waits for that many
+ completions. Returns the number of SQEs submitted, or -1 with errno set.
+ */
+int uring_submit_and_wait(struct uring_t *ring, unsigned int wait_nr);
+
+/*
+ Returns a zeroed SQE, submitting pending ones first if the SQ ring is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+
+/*
+ Returns the oldest unseen completion, or NULL if there is none.
+ */
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring)
+{
+  unsigned int head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+/*
+ Marks the completion returned by uring_peek_cqe() as consumed.
+ */
+static inline void uring_cqe_seen(struct uring_t *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned int len,
+                                 uint64_t user_data)
+{
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = len;
+  sqe->user_data = user_data;
+}
+
+static inline void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned int len,
+                                         uint16_t buf_index, uint64_t user_data)
+{
+  uring_prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, len, user_data);
+  sqe->off = (uint64_t)-1;  // Current file position, as read() would use
+  sqe->buf_index = buf_index;
+}
+
+static inline void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned int len,
+                                   uint64_t user_data)
+{
+  uring_prep_rw(sqe, IORING_OP_READ, fd, buf, len, user_data);
+  sqe->off = (uint64_t)-1;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                                      uint64_t user_data)
+{
+  uring_prep_rw(sqe, IORING_OP_SENDMSG, fd, msg, 1, user_data);
+}
+
+/*
+ Prepares a multishot receive that keeps posting one completion per datagram,
+ each in a buffer taken from buffer group 'bgid', until it runs out of buffers.
+ */
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t bgid, uint64_t user_data)
+{
+  uring_prep_rw(sqe, IORING_OP_RECV, fd, NULL, 0, user_data);
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bgid;
+}
+
+#endif
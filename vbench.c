@@ -0,0 +1,628 @@
+/*
+ VBench is a synthetic load generator for the VSwitch datapath. It speaks the
+ VPort UDP protocol directly, without TAP devices or the kernel network stack
+ in the way, and emulates a number of VPorts:
+
+ 1. Every emulated VPort has a UDP socket of its own and a set of MACs
+ 2. It first sends one frame from each of its MACs so the switch learns them
+ 3. Then it sends frames of a size mix to random MACs of the other VPorts,
+    and a share of broadcasts, as fast as it can or at a given rate
+ 4. Every frame carries a sequence number and the time it was sent; the
+    receiving VPorts count what arrives and record one-way latency
+
+ The report gives the offered and delivered packet rates, the delivered
+ Ethernet bit rate, and the p50/p99/p99.9 latency. The same run works
+ against the native VSwitch and vswitch.py, and with -k against an encrypted
+ switch, where it includes the cost of sealing and opening on both ends.
+ With -D the emulated VPorts send straight to each other, like VPorts on a
+ direct path (vport -p), which gives the floor set by the UDP path itself.
+
+ With -t N, N sender/receiver thread pairs each drive every Nth VPort.
+ */
+
+#include "sys_utils.h"
+#include "ether_utils.h"
+#include "udp_utils.h"
+#include "crypt_utils.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+
+#define VBENCH_ETHERTYPE 0x88b5         ///< IEEE 802 local experimental EtherType
+#define VBENCH_MAGIC 0x76626e68         ///< "vbnh": a measured frame
+#define VBENCH_WARMUP_MAGIC 0x76626e77  ///< "vbnw": a frame that only teaches the switch a MAC
+#define VBENCH_WARMUP_DST 0x02bbffffffffULL  ///< Unicast MAC nobody has: warm-up frames are dropped or flooded, and never measured
+#define VBENCH_MAC_BASE 0x02bb00000000ULL    ///< Locally administered; VPort index and MAC index follow
+#define VBENCH_MAX_VPORTS 4096
+#define VBENCH_MAX_MACS 65536
+#define VBENCH_MAX_SIZES 16
+#define VBENCH_MAX_THREADS 64
+#define VBENCH_BATCH 32                 ///< Frames per sendmmsg/recvmmsg
+#define VBENCH_BUFSZ 2048               ///< Fits any frame sent plus the crypt overhead
+#define VBENCH_DRAIN_NS 200000000ULL    ///< How long receivers wait for frames after the last send
+#define VBENCH_HIST_BUCKETS (61 * 16)   ///< 16 sub-buckets per power of two up to 2^63 ns
+#define VBENCH_DEFAULT_SIZES "60:7,590:4,1514:1"  ///< Simple IMIX, without FCS
+
+struct vbench_payload_t
+{
+  uint32_t magic;    ///< VBENCH_MAGIC or VBENCH_WARMUP_MAGIC
+  uint32_t vport;    ///< Index of the sending VPort
+  uint64_t seq;      ///< Frames sent by the sender thread before this one
+  uint64_t sent_ns;  ///< CLOCK_MONOTONIC when the frame was built
+} __attribute__((packed));
+
+struct vbench_size_t
+{
+  unsigned int size;    ///< Ethernet frame size without FCS
+  unsigned int weight;  ///< Share of frames of that size
+};
+
+struct vbench_vport_t
+{
+  int sockfd;
+  struct sockaddr_in addr;   ///< Where the VPort receives in direct mode
+  struct crypt_tx_t tx;      ///< Used by the sender thread of the VPort only
+  struct crypt_rx_t rx;      ///< Used by the receiver thread of the VPort only
+};
+
+/*
+ Log-linear latency histogram: values below 16 ns have a bucket each, every
+ power of two above that is split into 16 buckets, so a percentile read from
+ it is within about 6% of the true value.
+ */
+struct vbench_hist_t
+{
+  uint64_t counts[VBENCH_HIST_BUCKETS];
+  uint64_t total;
+};
+
+struct vbench_thread_t
+{
+  struct vbench_t *bench;
+  unsigned int index;
+  pthread_t sender;
+  pthread_t receiver;
+  struct mmsg_ring_t tx_ring;
+  struct mmsg_ring_t rx_ring;
+  uint64_t rand;             ///< xorshift64 state of the sender
+  // Sender counters
+  uint64_t sent_unicast;
+  uint64_t sent_broadcast;
+  uint64_t sent_bytes;
+  uint64_t send_ns;          ///< Time spent sending after the warm-up
+  // Receiver counters
+  uint64_t received;
+  uint64_t received_bytes;
+  uint64_t rejected;         ///< Datagrams that did not authenticate
+  struct vbench_hist_t hist;
+};
+
+struct vbench_t
+{
+  struct vbench_vport_t *vports;
+  unsigned int nvports;
+  unsigned int nmacs;                 ///< MACs per VPort
+  struct vbench_size_t sizes[VBENCH_MAX_SIZES];
+  unsigned int nsizes;
+  unsigned int total_weight;
+  unsigned int broadcast_pct;
+  uint64_t rate;                      ///< Frames per second over all threads, 0 for as fast as possible
+  unsigned int duration;              ///< Seconds
+  bool direct;                        ///< Send to the destination VPort instead of the VSwitch
+  struct sockaddr_in vswitch_addr;
+  const struct crypt_key_t *crypt_key;
+  struct vbench_thread_t *threads;
+  unsigned int nthreads;
+  _Atomic unsigned int warm;          ///< Sender threads done with the warm-up
+  _Atomic bool stop_senders;
+  _Atomic bool stop_receivers;
+};
+
+static inline uint64_t vbench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t vbench_rand(struct vbench_thread_t *thread)
+{
+  uint64_t x = thread->rand;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return thread->rand = x;
+}
+
+static inline uint64_t vbench_mac(unsigned int vport, unsigned int mac)
+{
+  return VBENCH_MAC_BASE | ((uint64_t)vport << 16) | mac;
+}
+
+static inline unsigned int vbench_hist_index(uint64_t value)
+{
+  if (value < 16)
+  {
+    return (unsigned int)value;
+  }
+  unsigned int msb = 63 - __builtin_clzll(value);
+  return (msb - 3) * 16 + ((value >> (msb - 4)) & 15);
+}
+
+static inline uint64_t vbench_hist_lower(unsigned int index)
+{
+  if (index < 16)
+  {
+    return index;
+  }
+  unsigned int msb = index / 16 + 3;
+  return (uint64_t)(16 + index % 16) << (msb - 4);
+}
+
+/*
+ Returns the smallest value that at least 'fraction' of the samples do not
+ exceed, as the upper bound of its bucket.
+ */
+static uint64_t vbench_hist_percentile(const struct vbench_hist_t *hist, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * hist->total + 0.5);
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < VBENCH_HIST_BUCKETS; i++)
+  {
+    seen += hist->counts[i];
+    if (seen >= rank && seen > 0)
+    {
+      return i + 1 < VBENCH_HIST_BUCKETS ? vbench_hist_lower(i + 1) : vbench_hist_lower(i);
+    }
+  }
+  return 0;
+}
+
+/*
+ Parses a size mix such as "60:7,590:4,1514:1" (size:weight, weight 1 if
+ left out). Exits on a malformed mix.
+ */
+static void vbench_parse_sizes(struct vbench_t *bench, const char *mix)
+{
+  char *copy = strdup(mix);
+  char *save = NULL;
+  bench->nsizes = 0;
+  bench->total_weight = 0;
+  for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+  {
+    unsigned int size = 0, weight = 1;
+    if (bench->nsizes == VBENCH_MAX_SIZES || sscanf(item, "%u:%u", &size, &weight) < 1 || size < ETH_ZLEN ||
+        size > ETH_FRAME_LEN || weight < 1)
+    {
+      ERROR_PRINT_THEN_EXIT("bad frame size mix: %s (sizes %d-%d, at most %d of them)\n", mix, ETH_ZLEN,
+                            ETH_FRAME_LEN, VBENCH_MAX_SIZES);
+    }
+    bench->sizes[bench->nsizes].size = size;
+    bench->sizes[bench->nsizes].weight = weight;
+    bench->nsizes++;
+    bench->total_weight += weight;
+  }
+  free(copy);
+  if (bench->nsizes == 0)
+  {
+    ERROR_PRINT_THEN_EXIT("bad frame size mix: %s\n", mix);
+  }
+}
+
+static unsigned int vbench_pick_size(struct vbench_thread_t *thread)
+{
+  struct vbench_t *bench = thread->bench;
+  unsigned int pick = vbench_rand(thread) % bench->total_weight;
+  for (unsigned int i = 0;; i++)
+  {
+    if (pick < bench->sizes[i].weight)
+    {
+      return bench->sizes[i].size;
+    }
+    pick -= bench->sizes[i].weight;
+  }
+}
+
+/*
+ Builds a frame from MAC 'src_mac' of VPort 'src' to 'dst_mac' into 'slot' of
+ the sender's ring, sealing it in encrypted mode, and addresses the slot to
+ 'to'.
+ */
+static void vbench_build(struct vbench_thread_t *thread, unsigned int slot, unsigned int src, uint64_t src_mac,
+                         uint64_t dst_mac, const struct sockaddr_in *to, unsigned int size, uint32_t magic)
+{
+  struct vbench_t *bench = thread->bench;
+  struct mmsg_ring_t *ring = &thread->tx_ring;
+  char *buf = mmsg_ring_buf(ring, slot);
+  char *frame = buf + (bench->crypt_key ? CRYPT_HDR_LEN : 0);
+
+  mac_from_u64(dst_mac, (uint8_t *)frame);
+  mac_from_u64(src_mac, (uint8_t *)frame + ETH_ALEN);
+  frame[12] = (char)(VBENCH_ETHERTYPE >> 8);
+  frame[13] = (char)(VBENCH_ETHERTYPE & 0xff);
+  struct vbench_payload_t payload = {.magic = magic, .vport = src,
+                                     .seq = thread->sent_unicast + thread->sent_broadcast,
+                                     .sent_ns = vbench_now_ns()};
+  memcpy(frame + ETH_HLEN, &payload, sizeof(payload));
+
+  ring->iovs[slot].iov_base = frame;
+  ring->iovs[slot].iov_len = size;
+  if (bench->crypt_key)
+  {
+    struct iovec plain = {.iov_base = frame, .iov_len = size};
+    ring->iovs[slot].iov_base = buf;
+    ring->iovs[slot].iov_len = crypt_seal(&bench->vports[src].tx, buf, &plain, 1);
+  }
+  ring->addrs[slot] = *to;
+}
+
+/*
+ Sends one frame from every MAC of the thread's VPorts to a MAC nobody has,
+ so the switch learns them all before the measurement starts. Paced so that
+ a slow switch is not overrun.
+ */
+static void vbench_warmup(struct vbench_thread_t *thread)
+{
+  struct vbench_t *bench = thread->bench;
+  struct mmsg_ring_t *ring = &thread->tx_ring;
+  for (unsigned int v = thread->index; v < bench->nvports; v += bench->nthreads)
+  {
+    for (unsigned int m = 0; m < bench->nmacs; m += VBENCH_BATCH)
+    {
+      unsigned int count = bench->nmacs - m < VBENCH_BATCH ? bench->nmacs - m : VBENCH_BATCH;
+      for (unsigned int i = 0; i < count; i++)
+      {
+        vbench_build(thread, i, v, vbench_mac(v, m + i), VBENCH_WARMUP_DST, &bench->vswitch_addr, ETH_ZLEN,
+                     VBENCH_WARMUP_MAGIC);
+      }
+      mmsg_send(bench->vports[v].sockfd, ring->msgs, count);
+      usleep(1000);
+    }
+  }
+}
+
+static void *vbench_sender(void *arg)
+{
+  struct vbench_thread_t *thread = arg;
+  struct vbench_t *bench = thread->bench;
+  struct mmsg_ring_t *ring = &thread->tx_ring;
+
+  if (!bench->direct)
+  {
+    vbench_warmup(thread);
+  }
+  atomic_fetch_add(&bench->warm, 1);
+  while (atomic_load(&bench->warm) < bench->nthreads)
+  {
+    usleep(1000);
+  }
+  usleep(100000);  // Let the switch drain the warm-up frames
+
+  uint64_t interval = bench->rate ? 1000000000ULL * bench->nthreads / bench->rate : 0;  // ns per frame
+  uint64_t start = vbench_now_ns();
+  unsigned int v = thread->index;
+  while (!atomic_load_explicit(&bench->stop_senders, memory_order_relaxed))
+  {
+    for (unsigned int slot = 0; slot < VBENCH_BATCH; slot++)
+    {
+      unsigned int size = vbench_pick_size(thread);
+      uint64_t src_mac = vbench_mac(v, vbench_rand(thread) % bench->nmacs);
+      if (vbench_rand(thread) % 100 < bench->broadcast_pct)
+      {
+        vbench_build(thread, slot, v, src_mac, MAC_BROADCAST, &bench->vswitch_addr, size, VBENCH_MAGIC);
+        thread->sent_broadcast++;
+      }
+      else
+      {
+        unsigned int dst = (v + 1 + vbench_rand(thread) % (bench->nvports - 1)) % bench->nvports;
+        uint64_t dst_mac = vbench_mac(dst, vbench_rand(thread) % bench->nmacs);
+        const struct sockaddr_in *to = bench->direct ? &bench->vports[dst].addr : &bench->vswitch_addr;
+        vbench_build(thread, slot, v, src_mac, dst_mac, to, size, VBENCH_MAGIC);
+        thread->sent_unicast++;
+      }
+      thread->sent_bytes += size;
+    }
+    mmsg_send(bench->vports[v].sockfd, ring->msgs, VBENCH_BATCH);
+
+    v += bench->nthreads;
+    if (v >= bench->nvports)
+    {
+      v = thread->index;
+    }
+    if (interval)
+    {
+      // Sleep until the frames sent so far are due, so the offered rate stays steady
+      uint64_t due = start + (thread->sent_unicast + thread->sent_broadcast) * interval;
+      uint64_t now = vbench_now_ns();
+      if (due > now)
+      {
+        struct timespec ts = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+    }
+  }
+  thread->send_ns = vbench_now_ns() - start;
+  return NULL;
+}
+
+static void *vbench_receiver(void *arg)
+{
+  struct vbench_thread_t *thread = arg;
+  struct vbench_t *bench = thread->bench;
+  struct mmsg_ring_t *ring = &thread->rx_ring;
+
+  int epfd = epoll_create1(0);
+  if (epfd < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to epoll_create1: %s\n", strerror(errno));
+  }
+  for (unsigned int v = thread->index; v < bench->nvports; v += bench->nthreads)
+  {
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = v};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, bench->vports[v].sockfd, &ev) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to epoll_ctl: %s\n", strerror(errno));
+    }
+  }
+
+  struct epoll_event events[64];
+  while (!atomic_load_explicit(&bench->stop_receivers, memory_order_relaxed))
+  {
+    int nevents = epoll_wait(epfd, events, 64, 50);
+    for (int e = 0; e < nevents; e++)
+    {
+      unsigned int v = events[e].data.u32;
+      int count = recvmmsg(bench->vports[v].sockfd, ring->msgs, ring->capacity, MSG_DONTWAIT, NULL);
+      uint64_t now = vbench_now_ns();
+      for (int i = 0; i < count; i++)
+      {
+        char *data = mmsg_ring_buf(ring, i);
+        int len = ring->msgs[i].msg_len;
+        if (bench->crypt_key)
+        {
+          len = crypt_is_sealed(data, len) ? crypt_open(&bench->vports[v].rx, data, len, 0) : -1;
+          if (len < 0)
+          {
+            thread->rejected++;
+            continue;
+          }
+          data += CRYPT_HDR_LEN;
+        }
+
+        struct vbench_payload_t payload;
+        if (len < (int)(ETH_HLEN + sizeof(payload)) || (uint8_t)data[12] != (VBENCH_ETHERTYPE >> 8) ||
+            (uint8_t)data[13] != (VBENCH_ETHERTYPE & 0xff))
+        {
+          continue;
+        }
+        memcpy(&payload, data + ETH_HLEN, sizeof(payload));
+        if (payload.magic != VBENCH_MAGIC || payload.vport == v)
+        {
+          continue;  // Warm-up frames and broadcasts echoed to their sender are not measured
+        }
+        thread->received++;
+        thread->received_bytes += len;
+        thread->hist.counts[vbench_hist_index(now > payload.sent_ns ? now - payload.sent_ns : 0)]++;
+        thread->hist.total++;
+      }
+      mmsg_ring_reset(ring);
+    }
+  }
+  close(epfd);
+  return NULL;
+}
+
+/*
+ Opens the sockets of the emulated VPorts and the rings of the threads.
+ */
+static void vbench_init(struct vbench_t *bench)
+{
+  bench->vports = calloc(bench->nvports, sizeof(*bench->vports));
+  bench->threads = calloc(bench->nthreads, sizeof(*bench->threads));
+  if (bench->vports == NULL || bench->threads == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+
+  for (unsigned int v = 0; v < bench->nvports; v++)
+  {
+    struct vbench_vport_t *vport = &bench->vports[v];
+    if ((vport->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY)};
+    socklen_t addrlen = sizeof(addr);
+    if (bind(vport->sockfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+        getsockname(vport->sockfd, (struct sockaddr *)&addr, &addrlen) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to bind: %s\n", strerror(errno));
+    }
+    vport->addr = addr;
+    vport->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bench->crypt_key)
+    {
+      crypt_tx_init(&vport->tx, bench->crypt_key);
+      crypt_rx_init(&vport->rx, bench->crypt_key, CRYPT_DEFAULT_SESSIONS);
+    }
+  }
+
+  for (unsigned int t = 0; t < bench->nthreads; t++)
+  {
+    struct vbench_thread_t *thread = &bench->threads[t];
+    thread->bench = bench;
+    thread->index = t;
+    mmsg_ring_init(&thread->tx_ring, VBENCH_BATCH, VBENCH_BUFSZ, 0);
+    mmsg_ring_init(&thread->rx_ring, VBENCH_BATCH, VBENCH_BUFSZ, 0);
+    if (getrandom(&thread->rand, sizeof(thread->rand), 0) != sizeof(thread->rand) || thread->rand == 0)
+    {
+      thread->rand = 0x9e3779b97f4a7c15ULL + t;
+    }
+  }
+}
+
+/*
+ Runs the senders for the configured duration, lets the receivers drain and
+ prints the report.
+ */
+static void vbench_run(struct vbench_t *bench)
+{
+  for (unsigned int t = 0; t < bench->nthreads; t++)
+  {
+    if (pthread_create(&bench->threads[t].receiver, NULL, vbench_receiver, &bench->threads[t]) != 0 ||
+        pthread_create(&bench->threads[t].sender, NULL, vbench_sender, &bench->threads[t]) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+  }
+  while (atomic_load(&bench->warm) < bench->nthreads)
+  {
+    usleep(1000);
+  }
+  sleep(bench->duration);
+  atomic_store(&bench->stop_senders, true);
+  for (unsigned int t = 0; t < bench->nthreads; t++)
+  {
+    pthread_join(bench->threads[t].sender, NULL);
+  }
+  struct timespec drain = {.tv_sec = 0, .tv_nsec = VBENCH_DRAIN_NS};
+  nanosleep(&drain, NULL);
+  atomic_store(&bench->stop_receivers, true);
+
+  uint64_t sent = 0, expected = 0, sent_bytes = 0, send_ns = 0, received = 0, received_bytes = 0, rejected = 0;
+  static struct vbench_hist_t hist;
+  for (unsigned int t = 0; t < bench->nthreads; t++)
+  {
+    struct vbench_thread_t *thread = &bench->threads[t];
+    pthread_join(thread->receiver, NULL);
+    sent += thread->sent_unicast + thread->sent_broadcast;
+    expected += thread->sent_unicast + thread->sent_broadcast * (bench->nvports - 1);
+    sent_bytes += thread->sent_bytes;
+    send_ns = thread->send_ns > send_ns ? thread->send_ns : send_ns;
+    received += thread->received;
+    received_bytes += thread->received_bytes;
+    rejected += thread->rejected;
+    for (unsigned int i = 0; i < VBENCH_HIST_BUCKETS; i++)
+    {
+      hist.counts[i] += thread->hist.counts[i];
+    }
+    hist.total += thread->hist.total;
+  }
+
+  double secs = send_ns ? send_ns / 1e9 : 1;
+  printf("[VBench] sent %llu frames (%.0f pps, %.3f Gbit/s), received %llu (%.0f pps, %.3f Gbit/s), "
+         "delivered %.2f%%\n", (unsigned long long)sent, sent / secs, sent_bytes * 8 / secs / 1e9,
+         (unsigned long long)received, received / secs, received_bytes * 8 / secs / 1e9,
+         expected ? 100.0 * received / expected : 0);
+  printf("[VBench] latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n", vbench_hist_percentile(&hist, 0.5) / 1e3,
+         vbench_hist_percentile(&hist, 0.99) / 1e3, vbench_hist_percentile(&hist, 0.999) / 1e3);
+  if (rejected)
+  {
+    printf("[VBench] %llu datagrams did not authenticate\n", (unsigned long long)rejected);
+  }
+}
+
+int main(int argc, char const *argv[])
+{
+  // Parse command line options
+  static struct vbench_t bench;
+  bench.nvports = 4;
+  bench.nmacs = 1;
+  bench.duration = 5;
+  bench.nthreads = 1;
+  const char *sizes = VBENCH_DEFAULT_SIZES;
+  const char *key_file = NULL;  // Encrypted mode: pre-shared tunnel key
+  int broadcast_pct = 0;
+  long long rate = 0;
+  int opt;
+  while ((opt = getopt(argc, (char *const *)argv, "n:m:s:B:r:d:t:k:D")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      bench.nvports = atoi(optarg);
+      break;
+    case 'm':
+      bench.nmacs = atoi(optarg);
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'B':
+      broadcast_pct = atoi(optarg);
+      break;
+    case 'r':
+      rate = atoll(optarg);
+      break;
+    case 'd':
+      bench.duration = atoi(optarg);
+      break;
+    case 't':
+      bench.nthreads = atoi(optarg);
+      break;
+    case 'k':
+      key_file = optarg;
+      break;
+    case 'D':
+      bench.direct = true;  // VPort to VPort, no switch in between
+      break;
+    default:
+      ERROR_PRINT_THEN_EXIT("Usage: vbench [-n vports] [-m macs] [-s size[:weight],...] [-B broadcast%%] [-r pps] [-d seconds] [-t threads] [-k keyfile] {-D | VSWITCH_IP VSWITCH_PORT}\n");
+    }
+  }
+
+  // Validate command line arguments
+  if (argc - optind != (bench.direct ? 0 : 2) || bench.nvports < 2 || bench.nvports > VBENCH_MAX_VPORTS ||
+      bench.nmacs < 1 || bench.nmacs > VBENCH_MAX_MACS || broadcast_pct < 0 || broadcast_pct > 100 || rate < 0 ||
+      bench.duration < 1 || bench.nthreads < 1 || bench.nthreads > VBENCH_MAX_THREADS ||
+      bench.nthreads > bench.nvports)
+  {
+    ERROR_PRINT_THEN_EXIT("Usage: vbench [-n vports] [-m macs] [-s size[:weight],...] [-B broadcast%%] [-r pps] [-d seconds] [-t threads] [-k keyfile] {-D | VSWITCH_IP VSWITCH_PORT}\n");
+  }
+  if (bench.direct && broadcast_pct)
+  {
+    ERROR_PRINT_THEN_EXIT("-B needs a switch to flood broadcasts; it cannot be used with -D\n");
+  }
+  vbench_parse_sizes(&bench, sizes);
+  bench.broadcast_pct = broadcast_pct;
+  bench.rate = rate;
+
+  if (!bench.direct)
+  {
+    bench.vswitch_addr.sin_family = AF_INET;
+    bench.vswitch_addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &bench.vswitch_addr.sin_addr) != 1)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to inet_pton: %s\n", argv[optind]);
+    }
+  }
+
+  struct crypt_key_t crypt_key;
+  if (key_file)
+  {
+    crypt_key_load(&crypt_key, key_file);
+    bench.crypt_key = &crypt_key;
+  }
+  vbench_init(&bench);
+
+  char rate_str[32] = "unlimited";
+  if (rate)
+  {
+    snprintf(rate_str, sizeof(rate_str), "%lld pps", rate);
+  }
+  printf("[VBench] %s: %u VPorts x %u MACs, sizes: %s, broadcast: %u%%, rate: %s, %u s, threads: %u, "
+         "encryption: %s\n", bench.direct ? "direct" : argv[optind], bench.nvports, bench.nmacs, sizes,
+         bench.broadcast_pct, rate_str, bench.duration, bench.nthreads,
+         key_file ? crypt_cipher_name(bench.vports[0].tx.cipher) : "off");
+  fflush(stdout);
+  vbench_run(&bench);
+
+  return 0;
+}
@@ -0,0 +1,920 @@
+/*
+ This file implements the vhost-user backend declared in vhost_utils.h: the
+ control thread that speaks the vhost-user protocol with QEMU, and the split
+ virtqueue accesses of the forwarder threads.
+ */
+
+#include "vhost_utils.h"
+#include "log_utils.h"
+#include "sys_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <endian.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_config.h>
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY 0x4
+#define VHOST_USER_HDR_LEN 12
+#define VHOST_USER_MAX_FDS 8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_MQ 0
+#define VHOST_VRING_INDEX_MASK 0xff     ///< SET_VRING_KICK/CALL/ERR: the virtqueue, in the low byte
+#define VHOST_VRING_NOFD (1ULL << 8)    ///< ... and no file descriptor comes with the message
+
+#define VHOST_LEGACY_HDR_LEN sizeof(struct virtio_net_hdr)
+#define VHOST_MRG_HDR_LEN sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+// What every device offers, and what offload devices add: what the TAP device takes in each direction
+#define VHOST_FEATURES ((1ULL << VIRTIO_NET_F_MRG_RXBUF) | (1ULL << VIRTIO_NET_F_MQ) | \
+                        (1ULL << VIRTIO_F_ANY_LAYOUT) | (1ULL << VIRTIO_F_VERSION_1) | \
+                        (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+#define VHOST_HOST_OFFLOADS ((1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_HOST_TSO4) | \
+                             (1ULL << VIRTIO_NET_F_HOST_TSO6) | (1ULL << VIRTIO_NET_F_HOST_ECN))
+#define VHOST_GUEST_OFFLOADS ((1ULL << VIRTIO_NET_F_GUEST_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_TSO4) | \
+                              (1ULL << VIRTIO_NET_F_GUEST_TSO6) | (1ULL << VIRTIO_NET_F_GUEST_ECN))
+
+enum vhost_user_request_t
+{
+  VHOST_USER_GET_FEATURES = 1,
+  VHOST_USER_SET_FEATURES = 2,
+  VHOST_USER_SET_OWNER = 3,
+  VHOST_USER_RESET_OWNER = 4,
+  VHOST_USER_SET_MEM_TABLE = 5,
+  VHOST_USER_SET_VRING_NUM = 8,
+  VHOST_USER_SET_VRING_ADDR = 9,
+  VHOST_USER_SET_VRING_BASE = 10,
+  VHOST_USER_GET_VRING_BASE = 11,
+  VHOST_USER_SET_VRING_KICK = 12,
+  VHOST_USER_SET_VRING_CALL = 13,
+  VHOST_USER_SET_VRING_ERR = 14,
+  VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+  VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+  VHOST_USER_GET_QUEUE_NUM = 17,
+  VHOST_USER_SET_VRING_ENABLE = 18,
+};
+
+/*
+ A vhost-user message as it travels on the socket: a 12-byte header, then
+ 'size' bytes of payload.
+ */
+struct vhost_user_msg_t
+{
+  uint32_t request;
+  uint32_t flags;              ///< Protocol version, and VHOST_USER_REPLY on replies
+  uint32_t size;
+  union
+  {
+    uint64_t u64;
+    struct
+    {
+      uint32_t index;
+      uint32_t num;
+    } state;
+    struct
+    {
+      uint32_t index;
+      uint32_t flags;
+      uint64_t desc;           ///< All three in QEMU's address space
+      uint64_t used;
+      uint64_t avail;
+      uint64_t log;
+    } addr;
+    struct
+    {
+      uint32_t nregions;
+      uint32_t padding;
+      struct
+      {
+        uint64_t gpa;
+        uint64_t size;
+        uint64_t qva;
+        uint64_t mmap_offset;  ///< Where the region starts in the file descriptor
+      } regions[VHOST_MAX_REGIONS];
+    } memory;
+  } payload;
+} __attribute__((packed));
+
+static inline size_t vhost_min(size_t a, size_t b)
+{
+  return a < b ? a : b;
+}
+
+/*
+ Returns where 'len' bytes at guest physical address 'gpa' are mapped, or
+ NULL unless they lie in one region.
+ */
+static void *vhost_gpa(const struct vhost_dev_t *dev, uint64_t gpa, uint64_t len)
+{
+  for (unsigned int i = 0; i < dev->nregions; i++)
+  {
+    const struct vhost_region_t *region = &dev->regions[i];
+    if (gpa >= region->gpa && gpa - region->gpa < region->size && len <= region->size - (gpa - region->gpa))
+    {
+      return region->va + (gpa - region->gpa);
+    }
+  }
+  return NULL;
+}
+
+/*
+ Like vhost_gpa(), for an address in QEMU's address space.
+ */
+static void *vhost_qva(const struct vhost_dev_t *dev, uint64_t qva, uint64_t len)
+{
+  for (unsigned int i = 0; i < dev->nregions; i++)
+  {
+    const struct vhost_region_t *region = &dev->regions[i];
+    if (qva >= region->qva && qva - region->qva < region->size && len <= region->size - (qva - region->qva))
+    {
+      return region->va + (qva - region->qva);
+    }
+  }
+  return NULL;
+}
+
+static inline uint16_t vhost_avail_idx(const struct vhost_vring_t *vq)
+{
+  return le16toh(__atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE));
+}
+
+static inline void vhost_used_add(struct vhost_vring_t *vq, uint16_t slot, uint32_t id, uint32_t len)
+{
+  struct vring_used_elem *elem = &vq->used->ring[slot & (vq->num - 1)];
+  elem->id = htole32(id);
+  elem->len = htole32(len);
+}
+
+/*
+ Makes the used entries filled so far visible to the guest, and interrupts
+ it unless it asked not to be.
+ */
+static void vhost_publish(struct vhost_vring_t *vq)
+{
+  if (vq->used == NULL || le16toh(vq->used->idx) == vq->used_idx)
+  {
+    return;
+  }
+  __atomic_store_n(&vq->used->idx, htole16(vq->used_idx), __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);  // Read the guest's flags only once it can see the entries
+  uint64_t one = 1;
+  uint16_t flags = le16toh(__atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED));
+  if (vq->callfd >= 0 && !(flags & VRING_AVAIL_F_NO_INTERRUPT) && write(vq->callfd, &one, sizeof(one)) < 0)
+  {
+    fprintf(stderr, "fail to signal the guest: %s\n", strerror(errno));
+  }
+}
+
+static inline void vhost_set_notify(struct vhost_vring_t *vq, bool notify)
+{
+  __atomic_store_n(&vq->used->flags, htole16(notify ? 0 : VRING_USED_F_NO_NOTIFY), __ATOMIC_RELAXED);
+}
+
+/*
+ Translates the ring addresses of virtqueue 'index' into the current memory
+ table, and decides whether the ring runs. Receive queues never need kicks:
+ the VPort looks for buffers whenever it has a frame.
+ */
+static void vhost_vring_update(struct vhost_dev_t *dev, unsigned int index)
+{
+  struct vhost_vring_t *vq = &dev->vrings[index];
+  vq->desc = NULL;
+  vq->avail = NULL;
+  vq->used = NULL;
+  if (vq->num > 0 && vq->desc_qva != 0)
+  {
+    vq->desc = vhost_qva(dev, vq->desc_qva, sizeof(struct vring_desc) * vq->num);
+    vq->avail = vhost_qva(dev, vq->avail_qva, sizeof(struct vring_avail) + sizeof(uint16_t) * (vq->num + 1));
+    vq->used = vhost_qva(dev, vq->used_qva,
+                         sizeof(struct vring_used) + sizeof(struct vring_used_elem) * vq->num + sizeof(uint16_t));
+  }
+  bool mapped = vq->desc != NULL && vq->avail != NULL && vq->used != NULL;
+  bool was_ready = vq->ready;
+  vq->ready = mapped && vq->started && vq->enabled;
+  if (vq->ready != was_ready)
+  {
+    LOG_PRINT(LOG_INFO, "[VPort] vhost-user virtqueue %u %s, %u descriptors\n", index,
+              vq->ready ? "running" : "stopped", vq->num);
+  }
+  if (vq->ready && index % 2 == 0)
+  {
+    vhost_set_notify(vq, false);
+  }
+}
+
+/*
+ Stops a virtqueue, handing back to the guest whatever it used so far.
+ */
+static void vhost_vring_stop(struct vhost_vring_t *vq)
+{
+  if (vq->ready)
+  {
+    vhost_publish(vq);
+  }
+  vq->ready = false;
+  vq->started = false;
+  if (vq->kickfd >= 0)
+  {
+    close(vq->kickfd);
+    vq->kickfd = -1;
+  }
+}
+
+/*
+ The control thread takes a ring's lock only after raising 'control', which
+ makes a forwarder that polls the ring (e.g. in busy-poll mode) stay off it
+ instead of taking the lock right back every time it lets go.
+ */
+static void vhost_control_lock(struct vhost_vring_t *vq)
+{
+  atomic_store_explicit(&vq->control, true, memory_order_relaxed);
+  pthread_mutex_lock(&vq->lock);
+}
+
+static void vhost_control_unlock(struct vhost_vring_t *vq)
+{
+  pthread_mutex_unlock(&vq->lock);
+  atomic_store_explicit(&vq->control, false, memory_order_relaxed);
+}
+
+/*
+ Takes a ring's lock for a forwarder, unless the control thread wants it.
+ */
+static inline bool vhost_forwarder_lock(struct vhost_vring_t *vq)
+{
+  if (atomic_load_explicit(&vq->control, memory_order_relaxed))
+  {
+    return false;
+  }
+  pthread_mutex_lock(&vq->lock);
+  return true;
+}
+
+static void vhost_lock_all(struct vhost_dev_t *dev)
+{
+  for (unsigned int i = 0; i < 2 * dev->queues; i++)
+  {
+    vhost_control_lock(&dev->vrings[i]);
+  }
+}
+
+static void vhost_unlock_all(struct vhost_dev_t *dev)
+{
+  for (unsigned int i = 0; i < 2 * dev->queues; i++)
+  {
+    vhost_control_unlock(&dev->vrings[i]);
+  }
+}
+
+static void vhost_unmap(struct vhost_dev_t *dev)
+{
+  for (unsigned int i = 0; i < dev->nregions; i++)
+  {
+    munmap(dev->regions[i].map, dev->regions[i].mapsz);
+  }
+  dev->nregions = 0;
+}
+
+/*
+ Forgets everything QEMU set up: after a disconnect, or VHOST_USER_RESET_OWNER.
+ */
+static void vhost_reset(struct vhost_dev_t *dev)
+{
+  vhost_lock_all(dev);
+  for (unsigned int i = 0; i < 2 * dev->queues; i++)
+  {
+    struct vhost_vring_t *vq = &dev->vrings[i];
+    vhost_vring_stop(vq);
+    if (vq->callfd >= 0)
+    {
+      close(vq->callfd);
+    }
+    vq->callfd = -1;
+    vq->enabled = false;
+    vq->num = 0;
+    vq->desc_qva = vq->avail_qva = vq->used_qva = 0;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->last_avail = 0;
+    vq->used_idx = 0;
+  }
+  vhost_unmap(dev);
+  dev->features = 0;
+  dev->hdr_len = VHOST_MRG_HDR_LEN;
+  vhost_unlock_all(dev);
+}
+
+/*
+ Maps the memory regions of a VHOST_USER_SET_MEM_TABLE message, whose file
+ descriptors are 'fds'. A region that fails to map is left out, so rings and
+ buffers in it are refused.
+ */
+static void vhost_set_mem_table(struct vhost_dev_t *dev, const struct vhost_user_msg_t *msg, const int *fds,
+                                unsigned int nfds)
+{
+  unsigned int nregions = msg->payload.memory.nregions;
+  if (nregions > VHOST_MAX_REGIONS || nregions > nfds)
+  {
+    fprintf(stderr, "vhost-user: bad memory table of %u regions\n", nregions);
+    return;
+  }
+
+  vhost_lock_all(dev);
+  vhost_unmap(dev);
+  for (unsigned int i = 0; i < nregions; i++)
+  {
+    struct vhost_region_t *region = &dev->regions[dev->nregions];
+    region->gpa = msg->payload.memory.regions[i].gpa;
+    region->size = msg->payload.memory.regions[i].size;
+    region->qva = msg->payload.memory.regions[i].qva;
+    uint64_t offset = msg->payload.memory.regions[i].mmap_offset;
+
+    // Huge page backed memory can only be mapped in whole pages
+    struct stat st;
+    size_t align = fstat(fds[i], &st) == 0 && st.st_blksize > 0 ? (size_t)st.st_blksize : 4096;
+    region->mapsz = (offset + region->size + align - 1) / align * align;
+    region->map = mmap(NULL, region->mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+    if (region->map == MAP_FAILED)
+    {
+      fprintf(stderr, "vhost-user: fail to mmap guest memory region %u: %s\n", i, strerror(errno));
+      continue;
+    }
+    region->va = (uint8_t *)region->map + offset;
+    dev->nregions++;
+  }
+  for (unsigned int i = 0; i < 2 * dev->queues; i++)
+  {
+    vhost_vring_update(dev, i);
+  }
+  vhost_unlock_all(dev);
+}
+
+static int vhost_reply(struct vhost_dev_t *dev, struct vhost_user_msg_t *msg, uint32_t size)
+{
+  msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+  msg->size = size;
+  size_t len = VHOST_USER_HDR_LEN + size;
+  return send(dev->connfd, msg, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ Returns the virtqueue a message is about, or NULL (after complaining) if
+ the device has no such queue.
+ */
+static struct vhost_vring_t *vhost_msg_vring(struct vhost_dev_t *dev, uint32_t index)
+{
+  if (index >= 2 * dev->queues)
+  {
+    fprintf(stderr, "vhost-user: no virtqueue %u (the VPort has %u queues)\n", index, dev->queues);
+    return NULL;
+  }
+  return &dev->vrings[index];
+}
+
+/*
+ Handles one message. Every file descriptor it came with is either kept or
+ closed. Returns -1 when the connection has to go.
+ */
+static int vhost_handle(struct vhost_dev_t *dev, struct vhost_user_msg_t *msg, int *fds, unsigned int nfds)
+{
+  struct vhost_vring_t *vq;
+  uint32_t index = msg->payload.state.index;
+  switch (msg->request)
+  {
+  case VHOST_USER_GET_FEATURES:
+    msg->payload.u64 = VHOST_FEATURES | (dev->offload ? VHOST_HOST_OFFLOADS | VHOST_GUEST_OFFLOADS : 0);
+    return vhost_reply(dev, msg, sizeof(msg->payload.u64));
+  case VHOST_USER_SET_FEATURES:
+    vhost_lock_all(dev);
+    dev->features = msg->payload.u64;
+    dev->hdr_len = dev->features & ((1ULL << VIRTIO_NET_F_MRG_RXBUF) | (1ULL << VIRTIO_F_VERSION_1))
+                     ? VHOST_MRG_HDR_LEN : VHOST_LEGACY_HDR_LEN;
+    vhost_unlock_all(dev);
+    break;
+  case VHOST_USER_GET_PROTOCOL_FEATURES:
+    msg->payload.u64 = 1ULL << VHOST_USER_PROTOCOL_F_MQ;
+    return vhost_reply(dev, msg, sizeof(msg->payload.u64));
+  case VHOST_USER_GET_QUEUE_NUM:
+    msg->payload.u64 = dev->queues;
+    return vhost_reply(dev, msg, sizeof(msg->payload.u64));
+  case VHOST_USER_SET_OWNER:
+  case VHOST_USER_SET_PROTOCOL_FEATURES:
+    break;
+  case VHOST_USER_RESET_OWNER:
+    vhost_reset(dev);
+    break;
+  case VHOST_USER_SET_MEM_TABLE:
+    vhost_set_mem_table(dev, msg, fds, nfds);
+    break;
+  case VHOST_USER_SET_VRING_NUM:
+    if ((vq = vhost_msg_vring(dev, index)) == NULL)
+    {
+      break;
+    }
+    if (msg->payload.state.num == 0 || msg->payload.state.num > VHOST_MAX_RING_SIZE ||
+        (msg->payload.state.num & (msg->payload.state.num - 1)) != 0)
+    {
+      fprintf(stderr, "vhost-user: bad size %u for virtqueue %u\n", msg->payload.state.num, index);
+      break;
+    }
+    vhost_control_lock(vq);
+    vq->num = msg->payload.state.num;
+    vhost_vring_update(dev, index);
+    vhost_control_unlock(vq);
+    break;
+  case VHOST_USER_SET_VRING_ADDR:
+    if ((vq = vhost_msg_vring(dev, msg->payload.addr.index)) == NULL)
+    {
+      break;
+    }
+    vhost_control_lock(vq);
+    vq->desc_qva = msg->payload.addr.desc;
+    vq->avail_qva = msg->payload.addr.avail;
+    vq->used_qva = msg->payload.addr.used;
+    vhost_vring_update(dev, msg->payload.addr.index);
+    if (vq->used != NULL && le16toh(vq->used->idx) != vq->last_avail)
+    {
+      // The guest already took back buffers this base does not know about: go on from there
+      vq->last_avail = le16toh(vq->used->idx);
+    }
+    if (vq->used != NULL)
+    {
+      vq->used_idx = le16toh(vq->used->idx);
+    }
+    vhost_control_unlock(vq);
+    break;
+  case VHOST_USER_SET_VRING_BASE:
+    if ((vq = vhost_msg_vring(dev, index)) == NULL)
+    {
+      break;
+    }
+    vhost_control_lock(vq);
+    vq->last_avail = msg->payload.state.num;
+    vq->used_idx = msg->payload.state.num;
+    vhost_control_unlock(vq);
+    break;
+  case VHOST_USER_GET_VRING_BASE:
+    if ((vq = vhost_msg_vring(dev, index)) == NULL)
+    {
+      return -1;  // QEMU waits for the reply
+    }
+    vhost_control_lock(vq);
+    vhost_vring_stop(vq);
+    msg->payload.state.num = vq->last_avail;
+    vhost_control_unlock(vq);
+    return vhost_reply(dev, msg, sizeof(msg->payload.state));
+  case VHOST_USER_SET_VRING_KICK:
+  case VHOST_USER_SET_VRING_CALL:
+  case VHOST_USER_SET_VRING_ERR:
+  {
+    index = msg->payload.u64 & VHOST_VRING_INDEX_MASK;
+    int fd = -1;
+    if (!(msg->payload.u64 & VHOST_VRING_NOFD) && nfds > 0)
+    {
+      fd = fds[0];
+      fds[0] = -1;
+    }
+    if ((vq = vhost_msg_vring(dev, index)) == NULL || msg->request == VHOST_USER_SET_VRING_ERR)
+    {
+      if (fd >= 0)
+      {
+        close(fd);  // Errors are not reported
+      }
+      break;
+    }
+    vhost_control_lock(vq);
+    int *slot = msg->request == VHOST_USER_SET_VRING_KICK ? &vq->kickfd : &vq->callfd;
+    if (*slot >= 0)
+    {
+      close(*slot);
+    }
+    *slot = fd;
+    if (msg->request == VHOST_USER_SET_VRING_KICK)
+    {
+      vq->started = true;
+      if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+      {
+        vq->enabled = true;  // Without protocol features, rings start enabled
+      }
+      vhost_vring_update(dev, index);
+    }
+    vhost_control_unlock(vq);
+    break;
+  }
+  case VHOST_USER_SET_VRING_ENABLE:
+    if ((vq = vhost_msg_vring(dev, index)) == NULL)
+    {
+      break;
+    }
+    vhost_control_lock(vq);
+    vq->enabled = msg->payload.state.num != 0;
+    vhost_vring_update(dev, index);
+    vhost_control_unlock(vq);
+    break;
+  default:
+    fprintf(stderr, "vhost-user: ignoring request %u\n", msg->request);
+    break;
+  }
+  return 0;
+}
+
+/*
+ Reads one message, with the file descriptors that came with it, from QEMU.
+ Returns the number of descriptors, or -1 once the connection is gone.
+ */
+static int vhost_read_msg(struct vhost_dev_t *dev, struct vhost_user_msg_t *msg, int *fds)
+{
+  char control[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+  struct iovec iov = {.iov_base = msg, .iov_len = VHOST_USER_HDR_LEN};
+  struct msghdr hdr = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+  if (recvmsg(dev->connfd, &hdr, MSG_WAITALL | MSG_CMSG_CLOEXEC) != VHOST_USER_HDR_LEN)
+  {
+    return -1;
+  }
+
+  int nfds = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+  }
+  if ((msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION || msg->size > sizeof(msg->payload) ||
+      (msg->size > 0 && recv(dev->connfd, &msg->payload, msg->size, MSG_WAITALL) != (ssize_t)msg->size))
+  {
+    for (int i = 0; i < nfds; i++)
+    {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return nfds;
+}
+
+static void *vhost_serve(void *raw_dev)
+{
+  struct vhost_dev_t *dev = (struct vhost_dev_t *)raw_dev;
+  while (true)
+  {
+    if ((dev->connfd = accept(dev->listenfd, NULL, NULL)) < 0)
+    {
+      fprintf(stderr, "fail to accept on %s: %s\n", dev->path, strerror(errno));
+      sleep(1);
+      continue;
+    }
+    LOG_PRINT(LOG_INFO, "[VPort] vhost-user front-end connected on %s\n", dev->path);
+
+    struct vhost_user_msg_t msg;
+    int fds[VHOST_USER_MAX_FDS];
+    int nfds;
+    while ((nfds = vhost_read_msg(dev, &msg, fds)) >= 0)
+    {
+      memset((char *)&msg.payload + msg.size, 0, sizeof(msg.payload) - msg.size);
+      int err = vhost_handle(dev, &msg, fds, nfds);
+      for (int i = 0; i < nfds; i++)
+      {
+        if (fds[i] >= 0)
+        {
+          close(fds[i]);  // Not kept by the handler; guest memory stays mapped without its descriptor
+        }
+      }
+      if (err < 0)
+      {
+        break;
+      }
+    }
+
+    vhost_reset(dev);
+    close(dev->connfd);
+    dev->connfd = -1;
+    LOG_PRINT(LOG_INFO, "[VPort] vhost-user front-end on %s went away\n", dev->path);
+  }
+  return NULL;
+}
+
+int vhost_dev_open(struct vhost_dev_t *dev, const char *path, unsigned int queues, bool offload)
+{
+  struct sockaddr_un un = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(un.sun_path) || queues == 0 || queues > VHOST_MAX_QUEUE_PAIRS)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  memset(dev, 0, sizeof(*dev));
+  strcpy(dev->path, path);
+  strcpy(un.sun_path, path);
+  dev->connfd = -1;
+  dev->queues = queues;
+  dev->offload = offload;
+  dev->hdr_len = VHOST_MRG_HDR_LEN;
+  for (unsigned int i = 0; i < 2 * queues; i++)
+  {
+    pthread_mutex_init(&dev->vrings[i].lock, NULL);
+    dev->vrings[i].kickfd = -1;
+    dev->vrings[i].callfd = -1;
+  }
+
+  unlink(path);  // Left over from an earlier run
+  if ((dev->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+      bind(dev->listenfd, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(dev->listenfd, 1) < 0)
+  {
+    return -1;
+  }
+  if (pthread_create(&dev->thread, NULL, vhost_serve, dev) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+  }
+  pthread_detach(dev->thread);
+  return 0;
+}
+
+bool vhost_guest_offloads(const struct vhost_dev_t *dev)
+{
+  return (__atomic_load_n(&dev->features, __ATOMIC_RELAXED) & VHOST_GUEST_OFFLOADS) == VHOST_GUEST_OFFLOADS;
+}
+
+/*
+ vhost_dequeue() with the ring locked.
+ */
+static ssize_t vhost_pop(struct vhost_dev_t *dev, struct vhost_vring_t *vq, char *buf, size_t bufsz)
+{
+  if (!vq->ready || vq->last_avail == vhost_avail_idx(vq))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  uint16_t head = le16toh(vq->avail->ring[vq->last_avail & (vq->num - 1)]);
+  vq->last_avail++;
+
+  // The chain holds the guest's header, then the frame, laid out over the descriptors in any way
+  uint8_t hdr[VHOST_MRG_HDR_LEN];
+  size_t vnet = dev->offload ? VHOST_LEGACY_HDR_LEN : 0;
+  size_t hdr_got = 0;
+  size_t out = vnet;
+  int err = 0;
+  unsigned int index = head;
+  for (unsigned int hops = 0; err == 0; hops++)
+  {
+    if (index >= vq->num || hops == vq->num)
+    {
+      err = EFAULT;  // Out of the table, or a loop
+      break;
+    }
+    const struct vring_desc *desc = &vq->desc[index];
+    uint16_t flags = le16toh(desc->flags);
+    uint32_t len = le32toh(desc->len);
+    const uint8_t *data = vhost_gpa(dev, le64toh(desc->addr), len);
+    if (data == NULL || (flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)))
+    {
+      err = EFAULT;  // Outside guest memory, indirect, or meant for the device to write: no frame to send
+      break;
+    }
+    size_t skip = vhost_min(len, dev->hdr_len - hdr_got);
+    memcpy(hdr + hdr_got, data, skip);
+    hdr_got += skip;
+    if (len - skip > bufsz - out)
+    {
+      err = EMSGSIZE;
+      break;
+    }
+    memcpy(buf + out, data + skip, len - skip);
+    out += len - skip;
+    if (!(flags & VRING_DESC_F_NEXT))
+    {
+      break;
+    }
+    index = le16toh(desc->next);
+  }
+
+  // The guest gets its buffer back whatever became of the frame
+  vhost_used_add(vq, vq->used_idx++, head, 0);
+  if (err == 0 && hdr_got < dev->hdr_len)
+  {
+    err = EFAULT;
+  }
+  if (err != 0)
+  {
+    errno = err;
+    return -1;
+  }
+  memcpy(buf, hdr, vnet);
+  return out;
+}
+
+ssize_t vhost_dequeue(struct vhost_dev_t *dev, unsigned int queue, char *buf, size_t bufsz)
+{
+  struct vhost_vring_t *vq = &dev->vrings[2 * queue + 1];
+  if (!vhost_forwarder_lock(vq))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  ssize_t len = vhost_pop(dev, vq, buf, bufsz);
+  pthread_mutex_unlock(&vq->lock);
+  return len;
+}
+
+void vhost_tx_done(struct vhost_dev_t *dev, unsigned int queue)
+{
+  struct vhost_vring_t *vq = &dev->vrings[2 * queue + 1];
+  pthread_mutex_lock(&vq->lock);
+  if (vq->ready)
+  {
+    vhost_publish(vq);
+  }
+  pthread_mutex_unlock(&vq->lock);
+}
+
+/*
+ Turns guest kicks on or off for a running ring and returns true if it has
+ entries to take.
+ */
+static bool vhost_pending(struct vhost_vring_t *vq, bool notify, int *kickfd)
+{
+  pthread_mutex_lock(&vq->lock);
+  bool pending = false;
+  if (vq->ready)
+  {
+    vhost_set_notify(vq, notify);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);  // A frame added before the guest saw the flag is found here
+    pending = vq->last_avail != vhost_avail_idx(vq);
+  }
+  *kickfd = vq->ready ? vq->kickfd : -1;
+  pthread_mutex_unlock(&vq->lock);
+  return pending;
+}
+
+bool vhost_tx_wait(struct vhost_dev_t *dev, unsigned int queue, const struct timespec *timeout)
+{
+  struct vhost_vring_t *vq = &dev->vrings[2 * queue + 1];
+  int kickfd;
+  if (!vhost_pending(vq, true, &kickfd))
+  {
+    // Without a kick file descriptor (or a running ring), this is just a sleep
+    struct timespec idle = {.tv_sec = 0, .tv_nsec = VHOST_IDLE_POLL_MS * 1000000L};
+    struct pollfd pfd = {.fd = kickfd, .events = POLLIN};
+    if (ppoll(&pfd, 1, timeout ? timeout : &idle, NULL) > 0 && (pfd.revents & POLLIN))
+    {
+      uint64_t kicks;
+      pthread_mutex_lock(&vq->lock);
+      if (vq->kickfd == kickfd && read(kickfd, &kicks, sizeof(kicks)) < 0)
+      {
+        fprintf(stderr, "fail to read guest kick: %s\n", strerror(errno));
+      }
+      pthread_mutex_unlock(&vq->lock);
+    }
+  }
+  return vhost_pending(vq, false, &kickfd);
+}
+
+/*
+ Copies 'len' bytes from 'iov' at '*index', '*offset' (advanced past them)
+ to 'dst'.
+ */
+static void vhost_gather(const struct iovec *iov, int *index, size_t *offset, uint8_t *dst, size_t len)
+{
+  while (len > 0)
+  {
+    size_t n = vhost_min(len, iov[*index].iov_len - *offset);
+    memcpy(dst, (const uint8_t *)iov[*index].iov_base + *offset, n);
+    dst += n;
+    len -= n;
+    *offset += n;
+    if (*offset == iov[*index].iov_len)
+    {
+      (*index)++;
+      *offset = 0;
+    }
+  }
+}
+
+/*
+ vhost_enqueue() with the ring locked. Nothing is taken from the ring until
+ the whole frame is in: a frame that does not fit leaves it as it was.
+ */
+static ssize_t vhost_push(struct vhost_dev_t *dev, struct vhost_vring_t *vq, const struct iovec *iov, int iovcnt)
+{
+  if (!vq->ready)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+  {
+    total += iov[i].iov_len;
+  }
+  size_t vnet = dev->offload ? VHOST_LEGACY_HDR_LEN : 0;
+  if (total < vnet)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct virtio_net_hdr_mrg_rxbuf hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  int iov_index = 0;
+  size_t iov_offset = 0;
+  vhost_gather(iov, &iov_index, &iov_offset, (uint8_t *)&hdr.hdr, vnet);
+  size_t left = total - vnet;
+
+  bool mergeable = dev->features & (1ULL << VIRTIO_NET_F_MRG_RXBUF);
+  uint16_t avail_idx = vhost_avail_idx(vq);
+  uint16_t last_avail = vq->last_avail;
+  uint16_t used_idx = vq->used_idx;
+  uint8_t *hdr_at = NULL;
+  uint16_t nbufs = 0;
+  while (hdr_at == NULL || left > 0)
+  {
+    if (last_avail == avail_idx || (nbufs > 0 && !mergeable))
+    {
+      errno = last_avail == avail_idx ? EAGAIN : EMSGSIZE;
+      return -1;
+    }
+    uint16_t head = le16toh(vq->avail->ring[last_avail & (vq->num - 1)]);
+    last_avail++;
+
+    // Fill one buffer (descriptor chain); only the first one starts with the header
+    uint32_t written = 0;
+    unsigned int index = head;
+    for (unsigned int hops = 0;; hops++)
+    {
+      if (index >= vq->num || hops == vq->num)
+      {
+        errno = EFAULT;
+        return -1;
+      }
+      const struct vring_desc *desc = &vq->desc[index];
+      uint16_t flags = le16toh(desc->flags);
+      uint32_t len = le32toh(desc->len);
+      uint8_t *data = vhost_gpa(dev, le64toh(desc->addr), len);
+      if (data == NULL || !(flags & VRING_DESC_F_WRITE) || (flags & VRING_DESC_F_INDIRECT) ||
+          (hdr_at == NULL && len < dev->hdr_len))
+      {
+        errno = EFAULT;
+        return -1;
+      }
+      if (hdr_at == NULL)
+      {
+        hdr_at = data;
+        data += dev->hdr_len;
+        len -= dev->hdr_len;
+        written += dev->hdr_len;
+      }
+      size_t n = vhost_min(len, left);
+      vhost_gather(iov, &iov_index, &iov_offset, data, n);
+      left -= n;
+      written += n;
+      if (left == 0 || !(flags & VRING_DESC_F_NEXT))
+      {
+        break;
+      }
+      index = le16toh(desc->next);
+    }
+    vhost_used_add(vq, used_idx++, head, written);
+    nbufs++;
+  }
+
+  hdr.num_buffers = htole16(nbufs);
+  memcpy(hdr_at, &hdr, dev->hdr_len);
+  vq->last_avail = last_avail;
+  vq->used_idx = used_idx;
+  return total;
+}
+
+ssize_t vhost_enqueue(struct vhost_dev_t *dev, unsigned int queue, const struct iovec *iov, int iovcnt)
+{
+  struct vhost_vring_t *vq = &dev->vrings[2 * queue];
+  if (!vhost_forwarder_lock(vq))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  ssize_t len = vhost_push(dev, vq, iov, iovcnt);
+  pthread_mutex_unlock(&vq->lock);
+  return len;
+}
+
+void vhost_rx_done(struct vhost_dev_t *dev, unsigned int queue)
+{
+  struct vhost_vring_t *vq = &dev->vrings[2 * queue];
+  pthread_mutex_lock(&vq->lock);
+  if (vq->ready)
+  {
+    vhost_publish(vq);
+  }
+  pthread_mutex_unlock(&vq->lock);
+}
@@ -0,0 +1,152 @@
+/*
+ This header declares the vhost-user backend (vport -V): instead of a TAP
+ device, the VPort serves a QEMU virtio-net device over a Unix socket, and
+ moves frames straight between the guest's virtqueues, which it maps from
+ the guest memory QEMU shares with it, and its own up and down rings. A
+ frame costs one copy on each side of the VPort instead of a read() or
+ write() through the kernel's TAP driver on top of the guest's own copy.
+
+ The VPort listens on the socket and QEMU connects to it as a client
+ (-chardev socket,path=...), then sets up the device with the vhost-user
+ protocol: the features both sides support, the guest memory regions (as
+ file descriptors to map), and for every virtqueue its size, the guest
+ addresses of its three parts and the eventfds the guest kicks and the VPort
+ signals through. A control thread answers those messages; the forwarder
+ threads only touch a virtqueue while its lock is free, so QEMU can remap
+ memory or stop a ring at any time. When QEMU goes away the device is reset
+ and the socket waits for the next connection, e.g. a restarted VM.
+
+ Queue pair 'q' of the device (virtqueue 2q receives, 2q + 1 transmits, from
+ the guest's point of view) belongs to VPort queue 'q', so the guest sees a
+ multi-queue virtio-net device with as many queues as the VPort has (-q).
+ Only split rings with direct descriptors are supported, with mergeable
+ receive buffers. In offload mode (-o), the device offers the checksum and
+ TSO offloads the TAP device would take, and frames cross the VPort with
+ the guest's own virtio_net_hdr.
+
+ The up thread keeps guest kicks off while it drains the transmit queue and
+ only turns them back on before it blocks; the guest is signalled once per
+ batch, and only if it has not turned interrupts off itself (NAPI polling).
+ */
+
+#ifndef _VHOST_UTILS_H
+#define _VHOST_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/virtio_ring.h>
+
+#define VHOST_MAX_QUEUE_PAIRS 64    ///< Queue pairs one device can have, VPORT_MAX_QUEUES
+#define VHOST_MAX_REGIONS 8         ///< Guest memory regions QEMU shares at most
+#define VHOST_MAX_RING_SIZE 32768   ///< Largest virtqueue the virtio spec allows
+#define VHOST_IDLE_POLL_MS 100      ///< A thread waiting on a ring looks at it again this often
+
+/*
+ One guest memory region, mapped into the VPort.
+ */
+struct vhost_region_t
+{
+  uint64_t gpa;                  ///< Guest physical address of the region
+  uint64_t size;
+  uint64_t qva;                  ///< Where QEMU has it mapped, for ring addresses
+  uint8_t *va;                   ///< Where the VPort has it mapped
+  void *map;                     ///< The whole mapping, which starts mmap_offset bytes ahead of 'va'
+  size_t mapsz;
+};
+
+struct vhost_vring_t
+{
+  pthread_mutex_t lock;          ///< Held by the forwarder using the ring, and by the control thread changing it
+  _Atomic bool control;          ///< The control thread wants the lock or holds it
+  bool ready;                    ///< Addresses, kick and enable all set: the forwarder may use the ring
+  bool started;                  ///< A kick was set (maybe none at all: then the ring is polled)
+  bool enabled;                  ///< VHOST_USER_SET_VRING_ENABLE, or started by a kick without protocol features
+  unsigned int num;              ///< Descriptors in the ring, a power of 2
+  uint64_t desc_qva;             ///< Ring addresses as QEMU gave them, translated again on every memory change
+  uint64_t avail_qva;
+  uint64_t used_qva;
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  struct vring_used *used;
+  uint16_t last_avail;           ///< Next available entry to take
+  uint16_t used_idx;             ///< Next used entry to fill; published to the guest at the end of a batch
+  int kickfd;                    ///< Eventfd the guest writes to when it adds buffers, -1 if none
+  int callfd;                    ///< Eventfd that interrupts the guest, -1 if none
+};
+
+struct vhost_dev_t
+{
+  char path[108];                ///< Unix socket the VPort listens on (sun_path)
+  int listenfd;
+  int connfd;                    ///< QEMU, -1 while nobody is connected
+  unsigned int queues;           ///< Queue pairs
+  bool offload;                  ///< Offer checksum and TSO offloads, and pass virtio_net_hdr through
+  uint64_t features;             ///< Features QEMU acknowledged for the guest
+  size_t hdr_len;                ///< Size of the guest's virtio-net header: 12, or 10 for legacy guests
+  struct vhost_region_t regions[VHOST_MAX_REGIONS];
+  unsigned int nregions;
+  struct vhost_vring_t vrings[2 * VHOST_MAX_QUEUE_PAIRS];
+  pthread_t thread;              ///< Control thread
+};
+
+/*
+ Creates the Unix socket 'path' (replacing any stale one) for a device with
+ 'queues' queue pairs, and starts the control thread that serves QEMU on it.
+ Returns 0 on success, or -1 with errno set.
+ */
+int vhost_dev_open(struct vhost_dev_t *dev, const char *path, unsigned int queues, bool offload);
+
+/*
+ Returns true once the guest has acknowledged every offload the device
+ offers, i.e. it takes the GSO super-frames and partial checksums that
+ offload VPorts send.
+ */
+bool vhost_guest_offloads(const struct vhost_dev_t *dev);
+
+/*
+ Takes the next frame the guest transmitted on queue pair 'queue' and copies
+ it into 'buf' as a TAP device would hand it over: behind a virtio_net_hdr in
+ offload mode, bare otherwise. The buffer goes back to the guest with
+ vhost_tx_done(), which must follow any call that did not fail with EAGAIN.
+ Returns the number of bytes stored, or -1 with errno set to EAGAIN if there
+ is none, or to EMSGSIZE (or EFAULT) for a frame that is dropped for being
+ larger than 'bufsz' (or for pointing outside guest memory, or into
+ device-writable descriptors).
+ */
+ssize_t vhost_dequeue(struct vhost_dev_t *dev, unsigned int queue, char *buf, size_t bufsz);
+
+/*
+ Hands the buffers of the frames dequeued from queue pair 'queue' back to
+ the guest, and signals it if it wants to know.
+ */
+void vhost_tx_done(struct vhost_dev_t *dev, unsigned int queue);
+
+/*
+ Blocks until the guest kicks the transmit queue of queue pair 'queue', at
+ most for 'timeout' (for VHOST_IDLE_POLL_MS if NULL, so that ring changes are
+ noticed). Returns true if the queue has frames.
+ */
+bool vhost_tx_wait(struct vhost_dev_t *dev, unsigned int queue, const struct timespec *timeout);
+
+/*
+ Copies the frame held by 'iov' ('iovcnt' entries, laid out as a TAP device
+ takes it: behind a virtio_net_hdr in offload mode) into receive buffers of
+ queue pair 'queue'. The guest sees it at the next vhost_rx_done(). Returns
+ the number of bytes taken from 'iov', or -1 with errno set to EAGAIN if the
+ guest has not posted enough buffers (or the ring is not running), or to
+ EMSGSIZE or EFAULT.
+ */
+ssize_t vhost_enqueue(struct vhost_dev_t *dev, unsigned int queue, const struct iovec *iov, int iovcnt);
+
+/*
+ Signals the guest, if it wants to know, that frames arrived on queue pair
+ 'queue'.
+ */
+void vhost_rx_done(struct vhost_dev_t *dev, unsigned int queue);
+
+#endif
@@ -1,204 +1,2539 @@
-/* 
- VPort acts as a bridge between a TAP device (Linux network interface) and
- a VSwitch over UDP. It creates a virtual network port that:
- 
- 1. Creates a TAP device visible to the Linux kernel
- 2. Establishes UDP communication with a VSwitch
- 3. Forwards Ethernet frames bidirectionally between TAP and VSwitch
- 4. Enables multiple VMs/containers to connect through a virtual switch
-
- */
-
-#include "tap_utils.h"
-#include "sys_utils.h"
-#include <stdbool.h>
-#include <assert.h>
-#include <stdint.h>
-#include <arpa/inet.h>      // Internet address manipulation
-#include <net/ethernet.h>   // Ethernet protocol definitions
-#include <pthread.h>        // POSIX threads
-
-
-struct vport_t
-{
-  int tapfd;                       ///< TAP device file descriptor for kernel network stack communication
-  int vport_sockfd;                ///< UDP socket file descriptor for VSwitch communication  
-  struct sockaddr_in vswitch_addr; ///< VSwitch IP address and port for UDP communication
-};
-
-// Function declarations
-void vport_init(struct vport_t *vport, const char *server_ip_str, int server_port);
-void *forward_ether_data_to_vswitch(void *raw_vport);
-void *forward_ether_data_to_tap(void *raw_vport);
-
-int main(int argc, char const *argv[])
-{
-  // Validate command line arguments
-  if (argc != 3)
-  {
-    ERROR_PRINT_THEN_EXIT("Usage: vport {server_ip} {server_port}\n");
-  }
-  
-  // Parse command line arguments
-  const char *server_ip_str = argv[1];  // VSwitch IP address
-  int server_port = atoi(argv[2]);      // VSwitch UDP port
-
-  // Initialize VPort instance with VSwitch connection details
-  struct vport_t vport;
-  vport_init(&vport, server_ip_str, server_port);
-
-  // Create uplink forwarder thread (TAP -> VSwitch)
-  // This thread reads Ethernet frames from TAP device and sends them to VSwitch
-  pthread_t up_forwarder;
-  if (pthread_create(&up_forwarder, NULL, forward_ether_data_to_vswitch, &vport) != 0)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
-  }
-
-  // Create downlink forwarder thread (VSwitch -> TAP)  
-  // This thread receives Ethernet frames from VSwitch and writes them to TAP device
-  pthread_t down_forwarder;
-  if (pthread_create(&down_forwarder, NULL, forward_ether_data_to_tap, &vport) != 0)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
-  }
-
-  // Wait for both forwarder threads to complete
-  // In normal operation, these threads run indefinitely, so this blocks forever
-  if (pthread_join(up_forwarder, NULL) != 0 || pthread_join(down_forwarder, NULL) != 0)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to pthread_join: %s\n", strerror(errno));
-  }
-
-  return 0;
-}
-
-void vport_init(struct vport_t *vport, const char *server_ip_str, int server_port)
-{
-  // Create TAP device with specific naming convention
-  char ifname[IFNAMSIZ] = "tapyuan";  // Base name for TAP device
-  int tapfd = tap_alloc(ifname);      // Create the TAP device
-  if (tapfd < 0)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to tap_alloc: %s\n", strerror(errno));
-  }
-
-  // Create UDP socket for VSwitch communication
-  // AF_INET: IPv4, SOCK_DGRAM: UDP protocol
-  int vport_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (vport_sockfd < 0)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
-  }
-
-  // Configure VSwitch address structure for UDP communication
-  struct sockaddr_in vswitch_addr;
-  memset(&vswitch_addr, 0, sizeof(vswitch_addr));
-  vswitch_addr.sin_family = AF_INET;                    // IPv4
-  vswitch_addr.sin_port = htons(server_port);           // Port in network byte order
-  
-  // Convert IP address string to binary format
-  if (inet_pton(AF_INET, server_ip_str, &vswitch_addr.sin_addr) != 1)
-  {
-    ERROR_PRINT_THEN_EXIT("fail to inet_pton: %s\n", strerror(errno));
-  }
-
-  // Populate VPort structure with initialized components
-  vport->tapfd = tapfd;
-  vport->vport_sockfd = vport_sockfd;
-  vport->vswitch_addr = vswitch_addr;
-
-  printf("[VPort] TAP device name: %s, VSwitch: %s:%d\n", ifname, server_ip_str, server_port);
-}
-
-
-void *forward_ether_data_to_vswitch(void *raw_vport)
-{
-  struct vport_t *vport = (struct vport_t *)raw_vport;
-  char ether_data[ETHER_MAX_LEN];  // Buffer for Ethernet frame (max 1518 bytes)
-  
-  while (true)
-  {
-    // Read Ethernet frame from TAP device (blocks until data available)
-    // The TAP device provides complete Ethernet frames including headers
-    int ether_datasz = read(vport->tapfd, ether_data, sizeof(ether_data));
-    
-    if (ether_datasz > 0)
-    {
-      // Validate minimum Ethernet frame size (14 bytes for header)
-      assert(ether_datasz >= 14);
-      
-      // Parse Ethernet header for logging and debugging
-      const struct ether_header *hdr = (const struct ether_header *)ether_data;
-
-      // Forward complete Ethernet frame to VSwitch via UDP
-      ssize_t sendsz = sendto(vport->vport_sockfd, ether_data, ether_datasz, 0, 
-                             (struct sockaddr *)&vport->vswitch_addr, sizeof(vport->vswitch_addr));
-      
-      // Verify that the entire frame was sent
-      if (sendsz != ether_datasz)
-      {
-        fprintf(stderr, "sendto size mismatch: ether_datasz=%d, sendsz=%d\n", ether_datasz, (int)sendsz);
-      }
-
-      // Log frame details for monitoring and debugging
-      // Shows source/destination MAC addresses, EtherType, and frame size
-      printf("[VPort] Sent to VSwitch:"
-             " dhost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Destination MAC
-             " shost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Source MAC  
-             " type<%04x>"                                 // EtherType (IP, ARP, etc.)
-             " datasz=<%d>\n",                            // Frame size
-             hdr->ether_dhost[0], hdr->ether_dhost[1], hdr->ether_dhost[2], 
-             hdr->ether_dhost[3], hdr->ether_dhost[4], hdr->ether_dhost[5],
-             hdr->ether_shost[0], hdr->ether_shost[1], hdr->ether_shost[2], 
-             hdr->ether_shost[3], hdr->ether_shost[4], hdr->ether_shost[5],
-             ntohs(hdr->ether_type),  // Convert from network to host byte order
-             ether_datasz);
-    }
-  }
-}
-
-void *forward_ether_data_to_tap(void *raw_vport)
-{
-  struct vport_t *vport = (struct vport_t *)raw_vport;
-  char ether_data[ETHER_MAX_LEN];  // Buffer for Ethernet frame
-  
-  while (true)
-  {
-    // Receive Ethernet frame from VSwitch via UDP (blocks until data available)
-    socklen_t vswitch_addrlen = sizeof(vport->vswitch_addr);
-    int ether_datasz = recvfrom(vport->vport_sockfd, ether_data, sizeof(ether_data), 0,
-                                (struct sockaddr *)&vport->vswitch_addr, &vswitch_addrlen);
-    
-    if (ether_datasz > 0)
-    {
-      // Validate minimum Ethernet frame size
-      assert(ether_datasz >= 14);
-      
-      // Parse Ethernet header for logging
-      const struct ether_header *hdr = (const struct ether_header *)ether_data;
-
-      // Forward Ethernet frame to TAP device (inject into Linux network stack)
-      ssize_t sendsz = write(vport->tapfd, ether_data, ether_datasz);
-      
-      // Verify that the entire frame was written
-      if (sendsz != ether_datasz)
-      {
-        fprintf(stderr, "write size mismatch: ether_datasz=%d, sendsz=%d\n", ether_datasz, (int)sendsz);
-      }
-
-      // Log frame details for monitoring and debugging
-      printf("[VPort] Forward to TAP device:"
-             " dhost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Destination MAC
-             " shost<%02x:%02x:%02x:%02x:%02x:%02x>"      // Source MAC
-             " type<%04x>"                                 // EtherType
-             " datasz=<%d>\n",                            // Frame size
-             hdr->ether_dhost[0], hdr->ether_dhost[1], hdr->ether_dhost[2], 
-             hdr->ether_dhost[3], hdr->ether_dhost[4], hdr->ether_dhost[5],
-             hdr->ether_shost[0], hdr->ether_shost[1], hdr->ether_shost[2], 
-             hdr->ether_shost[3], hdr->ether_shost[4], hdr->ether_shost[5],
-             ntohs(hdr->ether_type),
-             ether_datasz);
-    }
-  }
+/*
+ VPort acts as a bridge between a TAP device (Linux network interface) and
+ a VSwitch over UDP. It creates a virtual network port that:
+
+ 1. Creates a TAP device visible to the Linux kernel
+ 2. Establishes UDP communication with a VSwitch
+ 3. Forwards Ethernet frames bidirectionally between TAP and VSwitch
+ 4. Enables multiple VMs/containers to connect through a virtual switch
+
+ With -p, unicast frames for MACs the VSwitch has pointed out go straight to
+ the VPort behind them (see p2p_utils.h).
+
+ With -k, every datagram is sealed with a key derived from a pre-shared one
+ (see crypt_utils.h). Frames are encrypted in place in the up ring, which
+ leaves room for the header in front of each datagram and for the tag behind
+ it, and decrypted in place in the buffer they were received into.
+
+ With -C, small frames read in one batch are sent to the same destination as
+ a bundle (see coalesce_utils.h), assembled in the up ring slot of the first
+ of them. When the TAP runs dry, a batch holding a bundle that could still
+ grow waits up to the given number of microseconds for more frames; this
+ blocks the thread, so in event-loop and daemon mode it also delays the other
+ devices it drives. Bundles from the VSwitch are unpacked in one pass.
+
+ With -W, every datagram starts with the wire header (see wire_utils.h)
+ instead of a port tag or offload magic. Its sequence numbers are shared by
+ all queues of the VPort, or count per daemon port. -n puts the VPort on a
+ network of its own, which the VSwitch keeps apart from every other one;
+ datagrams that arrive for another network are dropped here as well. Daemon
+ ports may each be on a network of their own, given in the config file.
+
+ With -M, the counters of every queue (or daemon port) are served to
+ Prometheus (see stats_utils.h). Each thread counts into blocks of its own.
+ -T adds histograms of the time spent reading the TAP, sending a batch and
+ writing the TAP (not in io_uring mode, where the kernel does all three).
+
+ Busy-poll mode (-S) trades CPU for latency: once a forwarder thread runs out
+ of traffic, it keeps polling the (non-blocking) TAP or socket for the given
+ number of microseconds before it blocks again, so frames arriving in a
+ burst never pay for a wakeup. The socket gets SO_BUSY_POLL as well. -A pins
+ the forwarder threads to a list of CPUs, ideally ones kept free of other
+ work with isolcpus=.
+
+ -m sets the MTU of the TAP device, up to jumbo frames, and sizes the frame
+ buffers to match. Frames go out with DF set wherever they fit the path MTU
+ towards the VSwitch; one that no longer fits is answered with the ICMP
+ error a router would send, so its sender shrinks its packets instead of
+ the tunnel fragmenting them (see pmtu_utils.h).
+
+ -r shapes what the VPort sends to a rate in Mbit/s, split evenly between
+ its queues: once a queue has sent more than its token bucket holds, its
+ uplink thread sleeps off the debt, and the frames behind it wait in the TAP
+ queue. -P sends every batch read from the TAP in priority order, so that
+ the latency-sensitive frames in it go out ahead of bulk traffic (see
+ qos_utils.h).
+
+ -U moves the datagrams to and from the VSwitch from the UDP socket to a
+ pair of packet rings on the given interface, with outer headers the VPort
+ builds itself (see packet_utils.h). It takes a single queue in threaded
+ mode and CAP_NET_RAW. Received datagrams are delivered to the TAP where the
+ kernel put them in the RX ring, which hands them over a block at a time,
+ after PACKET_RX_RETIRE_MS at the latest: lightly loaded links trade up to
+ that much latency for not waking the down thread per datagram.
+
+ -V replaces the TAP device with a vhost-user socket that QEMU attaches a
+ VM's virtio-net device to (see vhost_utils.h): the forwarders copy frames
+ straight out of the guest's transmit queues and into its receive buffers.
+ Queue pair 'q' of the device is served by VPort queue 'q'; the guest's MTU
+ should be set to match -m. Not in event-loop or daemon mode.
+
+ -K probes the VSwitch, and the standbys listed with -F, every given number
+ of milliseconds from a health thread of its own (see health_utils.h). Once
+ the switch in use stops answering, the up threads move to the first one of
+ the list that still does with their next batch, and back once it recovers.
+ The interval is at most HEALTH_MAX_INTERVAL_MS, a third of the silence
+ after which the VSwitch forgets a VPort by default; a switch run with a
+ shorter vswitch -K needs a correspondingly shorter interval. Threaded mode
+ only, without -U.
+ */
+
+#include "tap_utils.h"
+#include "udp_utils.h"
+#include "offload_utils.h"
+#include "log_utils.h"
+#include "uring_utils.h"
+#include "tag_utils.h"
+#include "p2p_utils.h"
+#include "crypt_utils.h"
+#include "coalesce_utils.h"
+#include "wire_utils.h"
+#include "stats_utils.h"
+#include "ether_utils.h"
+#include "pmtu_utils.h"
+#include "qos_utils.h"
+#include "packet_utils.h"
+#include "health_utils.h"
+#include "vhost_utils.h"
+#include "sys_utils.h"
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>      // Internet address manipulation
+#include <net/ethernet.h>   // Ethernet protocol definitions
+#include <pthread.h>        // POSIX threads
+#include <sched.h>          // CPU affinity
+#include <sys/epoll.h>      // Event-loop mode fallback
+#include <linux/filter.h>   // Classic BPF for SO_ATTACH_REUSEPORT_CBPF
+
+#define VPORT_DEFAULT_BATCH 1   ///< Frames per syscall unless overridden with -b
+#define VPORT_LOOP_DEFAULT_BATCH 32  ///< Event-loop mode: frames in flight per direction and queue
+#define VPORT_MAX_BATCH 1024    ///< Upper bound accepted for -b (UIO_MAXIOV)
+#define VPORT_MAX_QUEUES 64     ///< Upper bound accepted for -q
+#define VPORT_DAEMON_DEFAULT_WORKERS 2  ///< Daemon mode: worker threads unless overridden with -w
+#define VPORT_DAEMON_MAX_WORKERS 64     ///< Upper bound accepted for -w
+#define VPORT_MAX_RATE 100000        ///< Upper bound accepted for -r, in Mbit/s
+#define VPORT_DAEMON_SOCKET_EVENT UINT64_MAX  ///< epoll data of the shared socket in daemon workers
+#define VPORT_SEG_SPACE (2 * OFFLOAD_MAX_DATAGRAM)  ///< Offload mode: room for the segments of one super-frame
+#define VPORT_SEG_BUF_SIZE (VPORT_SEG_SPACE + OFFLOAD_MAX_DATAGRAM)  ///< ... plus room to seal one segment
+
+/*
+ One vport_t serves one TAP queue. In multi-queue mode main() creates an array
+ of them that share the TAP interface and the UDP source port, and each one
+ gets its own pair of forwarder threads, unless a single event loop (-e)
+ drives all of them.
+ */
+struct vport_t
+{
+  int tapfd;                       ///< TAP device file descriptor for kernel network stack communication
+  int vport_sockfd;                ///< UDP socket file descriptor for VSwitch communication
+  struct sockaddr_in vswitch_addr; ///< VSwitch IP address and port for UDP communication
+  unsigned int batch;              ///< Maximum number of frames moved per sendmmsg/recvmmsg call
+  struct mmsg_ring_t up_ring;      ///< Preallocated TAP -> VSwitch batch (up forwarder only)
+  struct mmsg_ring_t down_ring;    ///< Preallocated VSwitch -> TAP batch (down forwarder only)
+  unsigned int queue;              ///< Index of the TAP queue (and CPU) this instance serves
+  bool offload;                    ///< TAP uses TAP_OPT_VNET_HDR; frames travel with an offload_hdr_t
+  uint8_t *seg_buf;                ///< Offload mode: scratch space for segmenting oversized super-frames
+  uint16_t port_id;                ///< Daemon mode: port ID tagged onto every datagram, else 0
+  size_t tap_offset;               ///< Where TAP data goes in a datagram: after the wire header, or the port tag and offload magic
+  struct p2p_cache_t *p2p;         ///< Direct paths to other VPorts (-p), shared by all queues, else NULL
+  size_t headroom;                 ///< Bytes in front of each up ring datagram, for the crypt header
+  size_t tailroom;                 ///< Bytes behind each up ring datagram, for the crypt tag
+  struct crypt_tx_t *crypt_tx;     ///< Encrypted mode (-k): this VPort's sending session, else NULL
+  struct crypt_rx_t *crypt_rx;     ///< Encrypted mode, standalone VPorts: sessions heard from, else NULL
+  uint64_t coalesce_ns;            ///< Coalescing (-C): how long a bundle may wait for more frames, 0 if off
+  uint32_t wire_sender;            ///< Wire header (-W): sender ID of this process, else 0
+  uint16_t net_id;                 ///< Wire header: network (-n) of this VPort, 0 for the default one
+  _Atomic uint32_t *wire_seq;      ///< Wire header: sequence number of the next datagram, shared by all queues
+  struct stats_t *stats_up;        ///< Counters of the thread reading the TAP
+  struct stats_t *stats_down;      ///< Counters of the thread writing the TAP; per worker for daemon VPorts
+  uint64_t spin_ns;                ///< Busy-poll mode (-S): how long a forwarder polls after the last traffic, 0 if off
+  unsigned int mtu;                ///< MTU of the TAP device (-m)
+  int path_mtu;                    ///< Path MTU towards the VSwitch, as last read by the TAP reader
+  uint32_t path_mtu_read;          ///< Time path_mtu was read
+  uint64_t shape_rate;             ///< Shaping (-r): bytes per second this queue may send, 0 if off
+  struct qos_bucket_t shaper;      ///< Shaping: bytes this queue may still send before it has to wait
+  bool prio;                       ///< Priority queueing (-P) of every batch read from the TAP
+  uint8_t *up_class;               ///< Priority queueing: class of each up ring slot, else NULL
+  struct mmsghdr *up_sorted;       ///< Priority queueing: the up batch in the order it is sent
+  struct packet_ring_t *underlay;  ///< Packet ring underlay (-U), else NULL
+  uint32_t underlay_read;          ///< Time the next hop of the underlay was last looked up
+  struct vhost_dev_t *vhost;       ///< vhost-user backend (-V): queue pair 'queue' replaces the TAP, else NULL
+  struct health_t *health;         ///< Keepalives (-K): the VSwitches, shared by all queues, else NULL
+  uint32_t vswitch_index;          ///< Keepalives: the switch in vswitch_addr, which the up thread follows
+};
+
+/*
+ Daemon mode (-c): one process serves every TAP device listed in a config
+ file. All of them share one UDP socket and tag their datagrams with their
+ port ID, and a small pool of workers drives them: each TAP belongs to one
+ worker, while datagrams from the VSwitch go to whichever worker epoll wakes
+ (EPOLLEXCLUSIVE) and are demultiplexed by port ID. VPorts of one worker share
+ its up ring and segment buffer, since vport_pump_up() always empties the
+ ring before returning; so memory grows with workers, not with TAP devices.
+ In encrypted mode the workers share one set of sessions under a lock: any
+ of them may take any datagram, so a replay must meet the one window that
+ has seen the original.
+ */
+struct vport_daemon_t
+{
+  int sockfd;                      ///< UDP socket shared by every VPort
+  struct sockaddr_in vswitch_addr; ///< VSwitch IP address and port
+  struct vport_t *vports;          ///< One per configured TAP device
+  unsigned int nvports;
+  struct vport_t **by_port_id;     ///< Port ID -> VPort, PORT_TAG_MAX_ID + 1 entries
+  unsigned int nworkers;
+  bool prio;                       ///< Priority queueing (-P) of the workers' up batches
+  struct crypt_rx_t *crypt_rx;     ///< Encrypted mode: sessions heard from on the shared socket, else NULL
+  pthread_mutex_t crypt_lock;      ///< Held by the worker opening a datagram with crypt_rx
+};
+
+struct vport_worker_t
+{
+  struct vport_daemon_t *daemon;
+  unsigned int index;              ///< Worker number; serves TAP devices index, index + nworkers, ...
+  struct mmsg_ring_t up_ring;      ///< Shared by this worker's VPorts
+  struct mmsg_ring_t down_ring;    ///< Receive batch for the shared socket
+  uint8_t *seg_buf;                ///< Shared by this worker's VPorts (offload mode)
+  uint8_t *up_class;               ///< Shared by this worker's VPorts (priority queueing)
+  struct mmsghdr *up_sorted;       ///< Shared by this worker's VPorts (priority queueing)
+  struct stats_t *stats;           ///< Drops of datagrams that belong to no VPort
+  struct stats_t **port_stats;     ///< Counters of the datagrams this worker delivers, one block per VPort
+};
+
+// Function declarations
+void vport_init(struct vport_t *vports, unsigned int queues, const char *server_ip_str, int server_port,
+                unsigned int batch, bool offload, bool p2p, const struct crypt_key_t *crypt_key,
+                unsigned int coalesce_usecs, uint32_t wire_sender, uint16_t net_id, unsigned int mtu,
+                unsigned int shape_mbits, bool prio, const char *underlay, const char *vhost_path);
+void *forward_ether_data_to_vswitch(void *raw_vport);
+void *forward_ether_data_to_tap(void *raw_vport);
+static void vport_pin_thread(pthread_t thread, unsigned int cpu);
+static unsigned int vport_parse_cpus(const char *list, unsigned int *cpus, unsigned int max);
+static void vport_busy_poll(struct vport_t *vport, unsigned int spin_usecs);
+static void vport_start_health(struct vport_t *vports, unsigned int queues, const char *standbys,
+                               unsigned int interval_ms, const struct crypt_key_t *crypt_key);
+static void vport_health_metrics(FILE *out, void *ctx);
+static ssize_t vport_write_tap(struct vport_t *vport, char *datagram, int datagramsz, ssize_t *expectsz);
+static void vport_run_loop(struct vport_t *vports, unsigned int queues, const char *mode);
+static void vport_daemon_init(struct vport_daemon_t *daemon, const char *config, const char *server_ip_str,
+                              int server_port, unsigned int batch, bool offload, unsigned int nworkers,
+                              const struct crypt_key_t *crypt_key, unsigned int coalesce_usecs,
+                              uint32_t wire_sender, uint16_t net_id, unsigned int mtu, bool prio);
+static void vport_daemon_run(struct vport_daemon_t *daemon, unsigned int batch, const struct crypt_key_t *crypt_key);
+
+int main(int argc, char const *argv[])
+{
+  // Parse command line options
+  unsigned int batch = 0;                    // Frames per syscall, trades latency for throughput
+  unsigned int queues = 1;                   // TAP queues, each with its own forwarder pair
+  bool offload = false;                      // Carry GSO super-frames and partial checksums end to end
+  bool p2p = false;                          // Send unicast frames straight to the peer VPort when known
+  const char *loop = NULL;                   // Event-loop mode ("uring" or "epoll") instead of threads
+  const char *config = NULL;                 // Daemon mode: serve the TAP devices listed in this file
+  unsigned int workers = VPORT_DAEMON_DEFAULT_WORKERS;
+  const char *key_file = NULL;               // Encrypted mode: pre-shared tunnel key
+  int coalesce_usecs = 0;                    // Bundle small frames, waiting this long for more
+  bool wire = false;                         // Put the wire header in front of every datagram
+  int net_id = 0;                            // Network of the VPort, in the wire header
+  const char *metrics = NULL;                // Serve counters on this address
+  int spin_usecs = 0;                        // Busy-poll mode: spin this long before blocking
+  const char *cpu_list = NULL;               // Pin the forwarder threads to these CPUs
+  int mtu = TAP_DEFAULT_MTU;                 // MTU of the TAP device(s)
+  int shape_mbits = 0;                       // Shape what the VPort sends to this rate
+  bool prio = false;                         // Send each batch in priority order
+  const char *underlay = NULL;               // Reach the VSwitch through packet rings on this interface
+  const char *vhost_path = NULL;             // Serve a VM over this vhost-user socket instead of a TAP
+  int keepalive_ms = 0;                      // Probe the VSwitch this often, and fail over when it stops answering
+  const char *standbys = NULL;               // VSwitches to fail over to
+  int opt;
+  while ((opt = getopt(argc, (char *const *)argv, "b:q:ope:c:w:k:C:Wn:M:TS:A:m:r:PU:V:K:F:Hv")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      batch = atoi(optarg);
+      break;
+    case 'q':
+      queues = atoi(optarg);
+      break;
+    case 'o':
+      offload = true;
+      break;
+    case 'p':
+      p2p = true;
+      break;
+    case 'e':
+      loop = optarg;
+      break;
+    case 'c':
+      config = optarg;
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'k':
+      key_file = optarg;
+      break;
+    case 'C':
+      coalesce_usecs = atoi(optarg);
+      break;
+    case 'W':
+      wire = true;
+      break;
+    case 'n':
+      net_id = atoi(optarg);
+      break;
+    case 'M':
+      metrics = optarg;
+      break;
+    case 'T':
+      stats_timing_start();  // Before any thread starts, so that all of them leave SIGUSR1 to its own
+      break;
+    case 'S':
+      spin_usecs = atoi(optarg);
+      break;
+    case 'A':
+      cpu_list = optarg;
+      break;
+    case 'm':
+      mtu = atoi(optarg);
+      break;
+    case 'r':
+      shape_mbits = atoi(optarg);
+      break;
+    case 'P':
+      prio = true;
+      break;
+    case 'U':
+      underlay = optarg;
+      break;
+    case 'V':
+      vhost_path = optarg;
+      break;
+    case 'K':
+      keepalive_ms = atoi(optarg);
+      break;
+    case 'F':
+      standbys = optarg;
+      break;
+    case 'H':
+      frame_pool_options |= FRAME_POOL_HUGEPAGES;  // Frame buffers on huge pages
+      break;
+    case 'v':
+      log_level++;  // -v: info, -vv: trace every frame
+      break;
+    default:
+      ERROR_PRINT_THEN_EXIT("Usage: vport [-b batch] [-q queues | -c config [-w workers]] [-o] [-p] [-k keyfile] [-C usecs] [-W [-n net]] [-M [ip:]port|path] [-T] [-S usecs] [-A cpus] [-m mtu] [-r mbits] [-P] [-U ifname] [-V path] [-K msecs] [-F ip[:port],...] [-e uring|epoll] [-H] [-v] {server_ip} {server_port}\n"
+                            "  -K msecs is at most %d; vswitch -K secs must allow %d intervals\n",
+                            HEALTH_MAX_INTERVAL_MS, HEALTH_DEAD_PROBES);
+    }
+  }
+
+  // Validate command line arguments
+  if (batch == 0)
+  {
+    batch = loop || config || coalesce_usecs ? VPORT_LOOP_DEFAULT_BATCH : VPORT_DEFAULT_BATCH;
+  }
+  if (standbys && keepalive_ms == 0)
+  {
+    keepalive_ms = HEALTH_DEFAULT_INTERVAL_MS;  // Standbys are only of use with keepalives
+  }
+  if (argc - optind != 2 || batch > VPORT_MAX_BATCH || queues < 1 || queues > VPORT_MAX_QUEUES ||
+      (loop && strcmp(loop, "uring") != 0 && strcmp(loop, "epoll") != 0) ||
+      (config && (queues > 1 || loop || p2p)) || workers < 1 || workers > VPORT_DAEMON_MAX_WORKERS ||
+      ((p2p || coalesce_usecs) && loop && strcmp(loop, "uring") == 0) || coalesce_usecs < 0 || spin_usecs < 0 ||
+      ((spin_usecs || cpu_list) && (loop || config)) || mtu < TAP_MIN_MTU || mtu > TAP_MAX_MTU ||
+      net_id < 0 || net_id > WIRE_MAX_NET_ID || (net_id && !wire) || shape_mbits < 0 ||
+      shape_mbits > VPORT_MAX_RATE || (shape_mbits && (loop || config)) ||
+      (prio && loop && strcmp(loop, "uring") == 0) || (underlay && (loop || config || queues > 1 || spin_usecs)) ||
+      (vhost_path && (loop || config)) || keepalive_ms < 0 || keepalive_ms > HEALTH_MAX_INTERVAL_MS ||
+      (keepalive_ms && (loop || config || underlay)))
+  {
+    ERROR_PRINT_THEN_EXIT("Usage: vport [-b batch] [-q queues | -c config [-w workers]] [-o] [-p] [-k keyfile] [-C usecs] [-W [-n net]] [-M [ip:]port|path] [-T] [-S usecs] [-A cpus] [-m mtu] [-r mbits] [-P] [-U ifname] [-V path] [-K msecs] [-F ip[:port],...] [-e uring|epoll] [-H] [-v] {server_ip} {server_port}\n"
+                          "  -K msecs is at most %d; vswitch -K secs must allow %d intervals\n",
+                          HEALTH_MAX_INTERVAL_MS, HEALTH_DEAD_PROBES);
+  }
+
+  // Parse command line arguments
+  const char *server_ip_str = argv[optind];      // VSwitch IP address
+  int server_port = atoi(argv[optind + 1]);      // VSwitch UDP port
+
+  struct crypt_key_t crypt_key;
+  if (key_file)
+  {
+    crypt_key_load(&crypt_key, key_file);
+  }
+
+  // A random sender ID lets the VSwitch recognize this VPort wherever its datagrams come from
+  uint32_t wire_sender = WIRE_SENDER_VSWITCH;
+  while (wire && wire_sender == WIRE_SENDER_VSWITCH)
+  {
+    if (getrandom(&wire_sender, sizeof(wire_sender), 0) != sizeof(wire_sender))
+    {
+      ERROR_PRINT_THEN_EXIT("fail to getrandom: %s\n", strerror(errno));
+    }
+  }
+
+  // Daemon mode: many TAP devices, one socket, a pool of workers
+  if (config)
+  {
+    struct vport_daemon_t daemon;
+    vport_daemon_init(&daemon, config, server_ip_str, server_port, batch, offload, workers,
+                      key_file ? &crypt_key : NULL, coalesce_usecs, wire_sender, net_id, mtu, prio);
+    if (log_level >= LOG_FRAMES)
+    {
+      trace_start();
+    }
+    if (metrics)
+    {
+      stats_serve(metrics, "vport", NULL, NULL);
+    }
+    vport_daemon_run(&daemon, batch, key_file ? &crypt_key : NULL);
+    return 0;
+  }
+
+  // Initialize one VPort instance per TAP queue with VSwitch connection details
+  struct vport_t vports[VPORT_MAX_QUEUES];
+  vport_init(vports, queues, server_ip_str, server_port, batch, offload, p2p, key_file ? &crypt_key : NULL,
+             coalesce_usecs, wire_sender, net_id, mtu, shape_mbits, prio, underlay, vhost_path);
+  if (keepalive_ms)
+  {
+    vport_start_health(vports, queues, standbys, keepalive_ms, key_file ? &crypt_key : NULL);
+  }
+
+  for (unsigned int q = 0; spin_usecs && q < queues; q++)
+  {
+    vport_busy_poll(&vports[q], spin_usecs);
+  }
+  unsigned int cpus[2 * VPORT_MAX_QUEUES];
+  unsigned int ncpus = cpu_list ? vport_parse_cpus(cpu_list, cpus, 2 * VPORT_MAX_QUEUES) : 0;
+
+  // Frame records are formatted off the forwarding threads
+  if (log_level >= LOG_FRAMES)
+  {
+    trace_start();
+  }
+  if (metrics)
+  {
+    stats_serve(metrics, "vport", vports[0].health ? vport_health_metrics : NULL, vports[0].health);
+  }
+
+  // Event-loop mode: this thread drives every queue in both directions
+  if (loop)
+  {
+    vport_run_loop(vports, queues, loop);
+    return 0;
+  }
+
+  pthread_t up_forwarders[VPORT_MAX_QUEUES];
+  pthread_t down_forwarders[VPORT_MAX_QUEUES];
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    // Create uplink forwarder thread (TAP -> VSwitch)
+    // This thread reads Ethernet frames from TAP device and sends them to VSwitch
+    if (pthread_create(&up_forwarders[q], NULL, forward_ether_data_to_vswitch, &vports[q]) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+
+    // Create downlink forwarder thread (VSwitch -> TAP)
+    // This thread receives Ethernet frames from VSwitch and writes them to TAP device
+    if (pthread_create(&down_forwarders[q], NULL, forward_ether_data_to_tap, &vports[q]) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+
+    // With -A, the forwarders take the listed CPUs in turn; otherwise, with several
+    // queues, keep each queue's forwarder pair on its own core
+    if (ncpus > 0)
+    {
+      vport_pin_thread(up_forwarders[q], cpus[(2 * q) % ncpus]);
+      vport_pin_thread(down_forwarders[q], cpus[(2 * q + 1) % ncpus]);
+    }
+    else if (queues > 1)
+    {
+      vport_pin_thread(up_forwarders[q], q % sysconf(_SC_NPROCESSORS_ONLN));
+      vport_pin_thread(down_forwarders[q], q % sysconf(_SC_NPROCESSORS_ONLN));
+    }
+  }
+
+  // Wait for the forwarder threads to complete
+  // In normal operation, these threads run indefinitely, so this blocks forever
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    if (pthread_join(up_forwarders[q], NULL) != 0 || pthread_join(down_forwarders[q], NULL) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_join: %s\n", strerror(errno));
+    }
+  }
+
+  return 0;
+}
+
+/*
+ Pins a forwarder thread to a CPU. Failure is not fatal: the thread simply
+ keeps running wherever the scheduler puts it.
+ */
+static void vport_pin_thread(pthread_t thread, unsigned int cpu)
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+  {
+    fprintf(stderr, "fail to pthread_setaffinity_np for CPU %u\n", cpu);
+  }
+}
+
+/*
+ Parses a CPU list such as "2,3" or "4-7,12" into 'cpus'. Returns the number
+ of CPUs. Exits on a malformed list.
+ */
+static unsigned int vport_parse_cpus(const char *list, unsigned int *cpus, unsigned int max)
+{
+  unsigned int ncpus = 0;
+  const char *p = list;
+  while (*p != '\0')
+  {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end != p && *end == '-')
+    {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+    }
+    if (end == p || (*end != ',' && *end != '\0') || first < 0 || last < first || last >= CPU_SETSIZE)
+    {
+      ERROR_PRINT_THEN_EXIT("bad CPU list: %s (expected e.g. 2,3 or 4-7)\n", list);
+    }
+    for (long cpu = first; cpu <= last && ncpus < max; cpu++)
+    {
+      cpus[ncpus++] = (unsigned int)cpu;
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (ncpus == 0)
+  {
+    ERROR_PRINT_THEN_EXIT("bad CPU list: %s (expected e.g. 2,3 or 4-7)\n", list);
+  }
+  return ncpus;
+}
+
+/*
+ Turns on busy-poll mode for a VPort queue: its TAP becomes non-blocking, so
+ that the uplink thread can poll it, and its socket busy-polls the device.
+ */
+static void vport_busy_poll(struct vport_t *vport, unsigned int spin_usecs)
+{
+  vport->spin_ns = spin_usecs * 1000ULL;
+  if (vport->tapfd >= 0 && fcntl(vport->tapfd, F_SETFL, fcntl(vport->tapfd, F_GETFL) | O_NONBLOCK) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to fcntl: %s\n", strerror(errno));
+  }
+  udp_busy_poll(vport->vport_sockfd, spin_usecs);
+}
+
+/*
+ Keepalives (-K): what the health thread needs besides the VPort's shared
+ health state.
+ */
+struct vport_prober_t
+{
+  struct vport_t *vport;           ///< Queue 0, whose socket sends the probes
+  struct crypt_tx_t *crypt_tx;     ///< Encrypted mode: a sending session of the prober's own, else NULL
+};
+
+/*
+ Probes every VSwitch of the list once per interval and judges the replies
+ the down threads recorded. A probe carries the wire header without taking a
+ sequence number, since control messages do not count towards loss.
+ */
+static void *vport_health_thread(void *raw_prober)
+{
+  struct vport_prober_t *prober = (struct vport_prober_t *)raw_prober;
+  struct vport_t *vport = prober->vport;
+  struct health_t *health = vport->health;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (true)
+  {
+    char plain[WIRE_HDR_LEN + HEALTH_PROBE_LEN];
+    size_t plainsz = 0;
+    if (vport->wire_sender)
+    {
+      wire_hdr_set(plain, 0, vport->wire_sender, 0, vport->net_id, 0);
+      plainsz = WIRE_HDR_LEN;
+    }
+    uint64_t now = health_clock();
+    health_probe_set(health, (struct health_probe_t *)(plain + plainsz), now);
+    plainsz += HEALTH_PROBE_LEN;
+
+    for (unsigned int i = 0; i < health->nswitches; i++)
+    {
+      char sealed[sizeof(plain) + CRYPT_OVERHEAD];
+      struct iovec iov = {.iov_base = plain, .iov_len = plainsz};
+      if (prober->crypt_tx)
+      {
+        iov.iov_len = crypt_seal(prober->crypt_tx, sealed, &iov, 1);
+        iov.iov_base = sealed;
+      }
+      const struct sockaddr_in *addr = &health->switches[i].addr;
+      if (sendto(vport->vport_sockfd, iov.iov_base, iov.iov_len, 0, (const struct sockaddr *)addr,
+                 sizeof(*addr)) < 0)
+      {
+        LOG_PRINT(LOG_INFO, "[VPort] Fail to probe VSwitch %s:%d: %s\n", inet_ntoa(addr->sin_addr),
+                  ntohs(addr->sin_port), strerror(errno));
+      }
+    }
+    health_check(health, now);
+
+    next.tv_nsec += health->interval % 1000000000ULL;
+    next.tv_sec += health->interval / 1000000000ULL + next.tv_nsec / 1000000000L;
+    next.tv_nsec %= 1000000000L;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+/*
+ Keepalives (-K): shares one health state between the 'queues' VPorts, with
+ the VSwitch they were set up for as the primary and the 'standbys' (a list
+ for health_parse_switches(), or NULL) behind it, and starts the health
+ thread, which probes every 'interval_ms' milliseconds.
+ */
+static void vport_start_health(struct vport_t *vports, unsigned int queues, const char *standbys,
+                               unsigned int interval_ms, const struct crypt_key_t *crypt_key)
+{
+  struct sockaddr_in addrs[HEALTH_MAX_SWITCHES] = {vports[0].vswitch_addr};
+  int nswitches = 1;
+  if (standbys && (nswitches = health_parse_switches(standbys, ntohs(addrs[0].sin_port), addrs, 1)) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("bad VSwitch list: %s (expected up to %d ip[:port], comma-separated)\n", standbys,
+                          HEALTH_MAX_SWITCHES - 1);
+  }
+
+  struct health_t *health = malloc(sizeof(*health));
+  struct vport_prober_t *prober = malloc(sizeof(*prober));
+  if (health == NULL || prober == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+  }
+  health_init(health, addrs, nswitches, interval_ms);
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    vports[q].health = health;
+  }
+  prober->vport = &vports[0];
+  prober->crypt_tx = NULL;
+  if (crypt_key)
+  {
+    if ((prober->crypt_tx = malloc(sizeof(*prober->crypt_tx))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    crypt_tx_init(prober->crypt_tx, crypt_key);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, vport_health_thread, prober) != 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+  }
+  printf("[VPort] Keepalives every %u ms, VSwitches: %d (%d standby)\n", interval_ms, nswitches, nswitches - 1);
+}
+
+/*
+ Keepalives: serves the state of every VSwitch of the list next to the
+ counters (-M).
+ */
+static void vport_health_metrics(FILE *out, void *ctx)
+{
+  const struct health_t *health = ctx;
+  uint32_t active = atomic_load_explicit(&health->active, memory_order_relaxed);
+  static const char *const names[] = {"up", "active", "rtt_seconds"};
+  static const char *const helps[] = {"1 while the VSwitch answers keepalives",
+                                      "1 for the VSwitch the VPort sends to",
+                                      "Smoothed round-trip time of keepalives to the VSwitch"};
+  for (int i = 0; i < 3; i++)
+  {
+    fprintf(out, "# HELP vport_vswitch_%s %s\n# TYPE vport_vswitch_%s gauge\n", names[i], helps[i], names[i]);
+    for (unsigned int n = 0; n < health->nswitches; n++)
+    {
+      const struct health_switch_t *s = &health->switches[n];
+      double values[] = {atomic_load_explicit(&s->up, memory_order_relaxed), n == active,
+                         atomic_load_explicit(&s->rtt, memory_order_relaxed) / 1e9};
+      char ip[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &s->addr.sin_addr, ip, sizeof(ip));
+      fprintf(out, "vport_vswitch_%s{vswitch=\"%s:%d\"} %g\n", names[i], ip, ntohs(s->addr.sin_port), values[i]);
+    }
+  }
+  fprintf(out, "# HELP vport_failovers_total Times traffic moved to another VSwitch\n"
+               "# TYPE vport_failovers_total counter\nvport_failovers_total %llu\n",
+          (unsigned long long)atomic_load_explicit(&health->failovers, memory_order_relaxed));
+}
+
+/*
+ Creates 'queues' UDP sockets that share one local port through SO_REUSEPORT,
+ so the VSwitch sees a single VPort endpoint whichever queue a frame leaves
+ from. A classic BPF program spreads datagrams arriving from the VSwitch over
+ the sockets by the inner frame's source MAC, keeping each remote host on one
+ queue (all datagrams share the same outer 4-tuple, so the default reuseport
+ hash would put every one of them on the same socket). 'steer_offset' is where
+ the four bytes that pick the socket lie in the UDP payload; sealed datagrams
+ are spread by the sender's session instead, as their frames are unreadable.
+ */
+static void vport_open_sockets(int *sockfds, unsigned int queues, unsigned int steer_offset)
+{
+  struct sockaddr_in local_addr;
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  local_addr.sin_port = 0;  // The first bind picks an ephemeral port, the rest reuse it
+
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    int one = 1;
+    if ((sockfds[q] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
+    }
+    if (setsockopt(sockfds[q], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+    }
+    if (bind(sockfds[q], (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to bind: %s\n", strerror(errno));
+    }
+    udp_pmtu_discover(sockfds[q]);
+
+    socklen_t addrlen = sizeof(local_addr);
+    if (q == 0 && getsockname(sockfds[q], (struct sockaddr *)&local_addr, &addrlen) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to getsockname: %s\n", strerror(errno));
+    }
+  }
+
+  // Reuseport programs run with the packet positioned at the UDP payload and
+  // return the index of the socket (in bind order) that receives it
+  struct sock_filter steer_code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, steer_offset),  // A = e.g. inner source MAC bytes 2..5
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, queues),        // A %= queues
+    BPF_STMT(BPF_RET | BPF_A, 0),                       // Deliver to socket A
+  };
+  struct sock_fprog steer_prog = {.len = sizeof(steer_code) / sizeof(steer_code[0]), .filter = steer_code};
+  if (setsockopt(sockfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &steer_prog, sizeof(steer_prog)) < 0)
+  {
+    fprintf(stderr, "fail to attach reuseport steering program: %s\n", strerror(errno));
+  }
+}
+
+/*
+ Fills in one VPort. 'port_id' is non-zero for a daemon VPort, which gets no
+ rings of its own (vport_daemon_run() supplies them).
+ */
+static void vport_setup(struct vport_t *vport, int tapfd, int sockfd, const struct sockaddr_in *vswitch_addr,
+                        unsigned int batch, unsigned int queue, bool offload, uint16_t port_id,
+                        const struct crypt_key_t *crypt_key, unsigned int coalesce_usecs, uint32_t wire_sender,
+                        uint16_t net_id, unsigned int mtu, uint64_t shape_rate, bool prio)
+{
+  // With batching, TAP reads must not block once a frame is queued, so that a
+  // partially filled batch is flushed instead of waiting for more traffic.
+  // Timed reads must not block either, or they would time the wait too.
+  if (tapfd >= 0 && (batch > 1 || stats_timing) && fcntl(tapfd, F_SETFL, fcntl(tapfd, F_GETFL) | O_NONBLOCK) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to fcntl: %s\n", strerror(errno));
+  }
+
+  // Populate VPort structure with initialized components
+  vport->tapfd = tapfd;
+  vport->vport_sockfd = sockfd;
+  vport->vswitch_addr = *vswitch_addr;
+  vport->batch = batch;
+  vport->queue = queue;
+  vport->offload = offload;
+  vport->seg_buf = NULL;
+  vport->port_id = port_id;
+  vport->tap_offset = (port_id ? PORT_TAG_LEN : 0) + (offload ? OFFLOAD_MAGIC_LEN : 0);
+  if (wire_sender)
+  {
+    vport->tap_offset = WIRE_HDR_LEN;
+  }
+  vport->p2p = NULL;
+  vport->headroom = crypt_key ? CRYPT_HDR_LEN : 0;
+  vport->tailroom = crypt_key ? CRYPT_TAG_LEN : 0;
+  vport->crypt_tx = NULL;
+  vport->crypt_rx = NULL;
+  vport->coalesce_ns = coalesce_usecs * 1000ULL;
+  vport->wire_sender = wire_sender;
+  vport->net_id = net_id;
+  vport->wire_seq = NULL;
+  vport->stats_up = NULL;
+  vport->stats_down = NULL;
+  vport->spin_ns = 0;
+  vport->mtu = mtu;
+  vport->path_mtu = udp_path_mtu(vswitch_addr);
+  vport->path_mtu_read = p2p_clock();
+  vport->shape_rate = shape_rate;
+  memset(&vport->shaper, 0, sizeof(vport->shaper));
+  vport->prio = prio;
+  vport->up_class = NULL;
+  vport->up_sorted = NULL;
+  vport->underlay = NULL;
+  vport->underlay_read = 0;
+  vport->vhost = NULL;
+  vport->health = NULL;
+  vport->vswitch_index = 0;
+  if (wire_sender && (vport->wire_seq = calloc(1, sizeof(*vport->wire_seq))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  if (crypt_key)
+  {
+    if ((vport->crypt_tx = malloc(sizeof(*vport->crypt_tx))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    crypt_tx_init(vport->crypt_tx, crypt_key);
+  }
+  if (port_id != 0)
+  {
+    return;
+  }
+  if (crypt_key)
+  {
+    if ((vport->crypt_rx = malloc(sizeof(*vport->crypt_rx))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    crypt_rx_init(vport->crypt_rx, crypt_key, CRYPT_DEFAULT_SESSIONS);
+  }
+
+  if (offload)
+  {
+    // Super-frames need 64 KB buffers; segmenting one adds a copy of the headers per segment
+    mmsg_ring_init(&vport->up_ring, batch, OFFLOAD_MAX_DATAGRAM, 0);
+    mmsg_ring_init(&vport->down_ring, batch, OFFLOAD_MAX_DATAGRAM, 0);
+    if ((vport->seg_buf = malloc(VPORT_SEG_BUF_SIZE)) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+  }
+  else
+  {
+    // Leave room for an offload header on frames that an offload peer did not need to segment
+    size_t overhead = (crypt_key ? CRYPT_OVERHEAD : 0) + (wire_sender ? WIRE_HDR_LEN : 0);
+    mmsg_ring_init(&vport->up_ring, batch, tap_frame_len(mtu) + overhead, 0);
+    mmsg_ring_init(&vport->down_ring, batch, tap_frame_len(mtu) + OFFLOAD_HDR_LEN + overhead, 0);
+  }
+  if (prio && ((vport->up_class = calloc(batch, sizeof(*vport->up_class))) == NULL ||
+               (vport->up_sorted = calloc(batch, sizeof(*vport->up_sorted))) == NULL))
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+
+  // Every frame sent from the up ring goes to the VSwitch, unless vport_route() finds a direct path
+  for (unsigned int i = 0; i < batch; i++)
+  {
+    vport->up_ring.msgs[i].msg_hdr.msg_name = &vport->vswitch_addr;
+  }
+}
+
+/*
+ Packet ring underlay (-U): binds the VPort's socket to a port of its own,
+ which the ring filter then matches, opens the rings on 'ifname' and leaves
+ the socket only the datagrams that arrive in fragments.
+ */
+static void vport_open_underlay(struct vport_t *vport, const char *ifname)
+{
+  struct sockaddr_in local_addr;
+  memset(&local_addr, 0, sizeof(local_addr));
+  local_addr.sin_family = AF_INET;
+  local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  socklen_t addrlen = sizeof(local_addr);
+  if (bind(vport->vport_sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0 ||
+      getsockname(vport->vport_sockfd, (struct sockaddr *)&local_addr, &addrlen) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to bind: %s\n", strerror(errno));
+  }
+
+  if ((vport->underlay = malloc(sizeof(*vport->underlay))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+  }
+  if (packet_ring_open(vport->underlay, ifname, local_addr.sin_port, &vport->vswitch_addr) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to open packet rings on %s: %s\n", ifname, strerror(errno));
+  }
+  if (packet_socket_filter(vport->underlay, vport->vport_sockfd) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to attach socket filter: %s\n", strerror(errno));
+  }
+  if (!packet_path_resolve(vport->underlay))
+  {
+    fprintf(stderr, "no next hop towards the VSwitch on %s yet: sending through the socket\n", ifname);
+  }
+  vport->underlay_read = p2p_clock();
+}
+
+void vport_init(struct vport_t *vports, unsigned int queues, const char *server_ip_str, int server_port,
+                unsigned int batch, bool offload, bool p2p, const struct crypt_key_t *crypt_key,
+                unsigned int coalesce_usecs, uint32_t wire_sender, uint16_t net_id, unsigned int mtu,
+                unsigned int shape_mbits, bool prio, const char *underlay, const char *vhost_path)
+{
+  int tapfds[VPORT_MAX_QUEUES];
+  int sockfds[VPORT_MAX_QUEUES];
+
+  // Create TAP device with specific naming convention
+  char ifname[IFNAMSIZ] = "tapyuan";  // Base name for TAP device
+  struct vhost_dev_t *vhost = NULL;
+  if (vhost_path)
+  {
+    // vhost-user: the VM's virtqueues take the place of the TAP queues
+    if ((vhost = malloc(sizeof(*vhost))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    if (vhost_dev_open(vhost, vhost_path, queues, offload) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to open vhost-user socket %s: %s\n", vhost_path, strerror(errno));
+    }
+    for (unsigned int q = 0; q < queues; q++)
+    {
+      tapfds[q] = -1;
+    }
+  }
+  else
+  {
+    if (tap_alloc_mq(ifname, queues, tapfds, offload ? TAP_OPT_VNET_HDR : 0) < 0)  // One fd per queue
+    {
+      ERROR_PRINT_THEN_EXIT("fail to tap_alloc: %s\n", strerror(errno));
+    }
+    if (tap_set_mtu(ifname, mtu) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to set the MTU of %s to %u: %s\n", ifname, mtu, strerror(errno));
+    }
+
+    // Keep super-frames small enough to cross the tunnel as a single datagram.
+    // Older kernels cannot change this; oversized frames are then segmented here.
+    if (offload && tap_set_gso_max_size(ifname, OFFLOAD_GSO_MAX_SIZE) < 0)
+    {
+      fprintf(stderr, "fail to set gso_max_size on %s: %s\n", ifname, strerror(errno));
+    }
+  }
+
+  // Create UDP socket for VSwitch communication
+  // AF_INET: IPv4, SOCK_DGRAM: UDP protocol
+  if (queues == 1)
+  {
+    if ((sockfds[0] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
+    }
+    udp_pmtu_discover(sockfds[0]);
+  }
+  else
+  {
+    size_t steer_offset = crypt_key ? offsetof(struct crypt_hdr_t, session) + CRYPT_SESSION_LEN - 4
+                                    : (wire_sender ? WIRE_HDR_LEN + (offload ? WIRE_VNET_LEN : 0)
+                                                   : (offload ? OFFLOAD_HDR_LEN : 0)) + ETH_ALEN + 2;
+    vport_open_sockets(sockfds, queues, steer_offset);
+  }
+
+  // Configure VSwitch address structure for UDP communication
+  struct sockaddr_in vswitch_addr;
+  memset(&vswitch_addr, 0, sizeof(vswitch_addr));
+  vswitch_addr.sin_family = AF_INET;                    // IPv4
+  vswitch_addr.sin_port = htons(server_port);           // Port in network byte order
+
+  // Convert IP address string to binary format
+  if (inet_pton(AF_INET, server_ip_str, &vswitch_addr.sin_addr) != 1)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to inet_pton: %s\n", strerror(errno));
+  }
+
+  struct p2p_cache_t *p2p_cache = NULL;
+  if (p2p)
+  {
+    if ((p2p_cache = malloc(sizeof(*p2p_cache))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    p2p_cache_init(p2p_cache);
+  }
+
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    vport_setup(&vports[q], tapfds[q], sockfds[q], &vswitch_addr, batch, q, offload, 0, crypt_key, coalesce_usecs,
+                wire_sender, net_id, mtu, shape_mbits * 125000ULL / queues, prio);  // Mbit/s to bytes per second
+    vports[q].p2p = p2p_cache;
+    vports[q].wire_seq = vports[0].wire_seq;  // One sequence for the whole VPort
+    vports[q].vhost = vhost;
+
+    // The up and down threads of a queue count separately and are summed into one series
+    char labels[STATS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "port=\"%s\",queue=\"%u\"", vhost_path ? vhost_path : ifname, q);
+    vports[q].stats_up = stats_create(labels);
+    vports[q].stats_down = stats_create(labels);
+  }
+  if (underlay)
+  {
+    vport_open_underlay(&vports[0], underlay);
+  }
+
+  printf("[VPort] TAP device name: %s, VSwitch: %s:%d, batch: %u, queues: %u, offload: %s, p2p: %s, "
+         "encryption: %s, coalescing: %s, wire header: %s, network: %u, MTU: %u, path MTU: %d, rate: %u Mbit/s, "
+         "priority queueing: %s, underlay: %s, vhost-user: %s\n", vhost_path ? "none" : ifname, server_ip_str,
+         server_port, batch, queues, offload ? "on" : "off", p2p ? "on" : "off",
+         crypt_key ? crypt_cipher_name(vports[0].crypt_tx->cipher) : "off", coalesce_usecs ? "on" : "off",
+         wire_sender ? "on" : "off", net_id, mtu, vports[0].path_mtu, shape_mbits, prio ? "on" : "off",
+         underlay ? underlay : "udp", vhost_path ? vhost_path : "off");
+}
+
+/*
+ Writes what goes in front of every datagram the VPort sends, ahead of any
+ offload header: the wire header with the next sequence number (-W), or the
+ port tag of a daemon VPort. Returns its length, 0 for a plain VPort.
+ */
+static size_t vport_prefix(struct vport_t *vport, char *out, uint8_t wire_flags)
+{
+  if (vport->wire_sender)
+  {
+    uint32_t seq = atomic_fetch_add_explicit(vport->wire_seq, 1, memory_order_relaxed);
+    wire_hdr_set(out, wire_flags, vport->wire_sender, vport->port_id, vport->net_id, seq);
+    return WIRE_HDR_LEN;
+  }
+  if (vport->port_id)
+  {
+    port_tag_set(out, vport->port_id);
+    return PORT_TAG_LEN;
+  }
+  return 0;
+}
+
+/*
+ Where the Ethernet frame starts in a datagram read from the TAP.
+ */
+static inline size_t vport_ether_offset(const struct vport_t *vport)
+{
+  return vport->tap_offset + (vport->offload ? WIRE_VNET_LEN : 0);
+}
+
+/*
+ Segments a super-frame that does not fit in one UDP datagram and sends each
+ segment to the VSwitch as a plain Ethernet frame. This only happens when the
+ TAP's gso_max_size could not be lowered to OFFLOAD_GSO_MAX_SIZE.
+ */
+static void vport_send_segmented(struct vport_t *vport, char *datagram, int datagramsz)
+{
+  struct offload_hdr_t *offload_hdr = (struct offload_hdr_t *)datagram;
+  uint8_t *frame = (uint8_t *)datagram + OFFLOAD_HDR_LEN;
+  struct iovec segs[OFFLOAD_MAX_SEGS];
+
+  int nsegs = offload_segment(frame, datagramsz - OFFLOAD_HDR_LEN, &offload_hdr->vnet,
+                              vport->seg_buf, VPORT_SEG_SPACE, segs, OFFLOAD_MAX_SEGS);
+  if (nsegs < 0)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Dropped oversized frame: datagramsz=%d\n", datagramsz);
+    stats_inc(vport->stats_up, STATS_DROP_OVERSIZE);
+    return;
+  }
+
+  // Every segment gets the port tag or wire header of its own
+  char prefix[WIRE_HDR_LEN];
+  for (int i = 0; i < nsegs; i++)
+  {
+    size_t prefixlen = vport_prefix(vport, prefix, 0);
+    struct iovec iov[2] = {{.iov_base = prefix, .iov_len = prefixlen}, segs[i]};
+    struct msghdr msg = {.msg_name = &vport->vswitch_addr, .msg_namelen = sizeof(vport->vswitch_addr),
+                         .msg_iov = prefixlen ? iov : iov + 1, .msg_iovlen = prefixlen ? 2 : 1};
+    ssize_t expectsz = segs[i].iov_len + prefixlen;
+    if (vport->crypt_tx)
+    {
+      // Sealed behind the segments, in the last part of seg_buf
+      char *sealed = (char *)vport->seg_buf + VPORT_SEG_SPACE;
+      iov[0].iov_len = crypt_seal(vport->crypt_tx, sealed, msg.msg_iov, msg.msg_iovlen);
+      iov[0].iov_base = sealed;
+      msg.msg_iov = iov;
+      msg.msg_iovlen = 1;
+      expectsz = iov[0].iov_len;
+    }
+    ssize_t sendsz = sendmsg(vport->vport_sockfd, &msg, 0);
+    if (sendsz != expectsz)
+    {
+      LOG_PRINT(LOG_FRAMES, "[VPort] sendto size mismatch: ether_datasz=%d, sendsz=%d\n", (int)expectsz,
+                (int)sendsz);
+      stats_inc(vport->stats_up, STATS_DROP_SEND);
+      continue;
+    }
+    stats_inc(vport->stats_up, STATS_TX_FRAMES);
+    stats_add(vport->stats_up, STATS_TX_BYTES, segs[i].iov_len);
+  }
+}
+
+/*
+ Checks a frame read from the TAP, which goes out in a datagram of
+ 'datagramsz' bytes, against the path MTU towards the VSwitch, reading that
+ again every PMTU_CHECK_INTERVAL seconds while large frames flow. Returns
+ true if the frame does not fit and was answered with an ICMP error instead
+ (see pmtu_utils.h).
+ */
+static bool vport_too_big(struct vport_t *vport, const char *ether_data, int ether_datasz, int datagramsz)
+{
+  int wiresz = datagramsz + (int)(vport->headroom + vport->tailroom) + PMTU_UDP_OVERHEAD;
+  if (wiresz <= PMTU_MIN_CHECKED)
+  {
+    return false;
+  }
+  uint32_t now = p2p_clock();
+  if (now - vport->path_mtu_read >= PMTU_CHECK_INTERVAL)
+  {
+    int path_mtu = udp_path_mtu(&vport->vswitch_addr);
+    vport->path_mtu = path_mtu > 0 ? path_mtu : vport->path_mtu;
+    vport->path_mtu_read = now;
+  }
+  if (vport->path_mtu <= 0 || wiresz <= vport->path_mtu)
+  {
+    return false;
+  }
+
+  // The largest IP packet that still fits: the path MTU less the tunnel's headers and the inner Ethernet header
+  uint32_t mtu = vport->path_mtu - (wiresz - ether_datasz) - ETHER_HDR_LEN;
+  char reply[PMTU_REPLY_MAX];
+  size_t replysz = pmtu_build_too_big((const uint8_t *)ether_data, ether_datasz, mtu, (uint8_t *)reply);
+  if (replysz == 0)
+  {
+    return false;  // Not something its sender could shrink: let the kernel fragment it
+  }
+  ssize_t expectsz;
+  if (vport_write_tap(vport, reply, replysz, &expectsz) != expectsz)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Failed to write ICMP error to TAP: %s\n", strerror(errno));
+  }
+  stats_inc(vport->stats_up, STATS_DROP_OVERSIZE);
+  LOG_PRINT(LOG_FRAMES, "[VPort] Frame of %d bytes exceeds the path MTU %d: told its sender to stay below %u\n",
+            ether_datasz, vport->path_mtu, mtu);
+  return true;
+}
+
+/*
+ Turns the 'tap_datasz' bytes that were read from the TAP into 'datagram' into
+ the datagram that goes to the VSwitch. In offload mode the TAP delivers a
+ virtio_net_hdr followed by the frame, which is read in place behind the
+ offload magic, so the datagram is sent as read. Returns the datagram size, or
+ 0 if there is nothing left to send (the frame was segmented and sent already,
+ or did not fit the path MTU).
+ */
+static int vport_frame_from_tap(struct vport_t *vport, char *datagram, int tap_datasz)
+{
+  size_t ether_offset = vport_ether_offset(vport);
+  int datagramsz = tap_datasz + vport->tap_offset;
+  char *ether_data = datagram + ether_offset;
+  int ether_datasz = datagramsz - ether_offset;
+
+  // Validate minimum Ethernet frame size (14 bytes for header)
+  assert(ether_datasz >= 14);
+
+  bool gso = false;
+  if (vport->offload)
+  {
+    // The virtio_net_hdr is read right behind where the offload magic goes
+    char *offload_hdr = datagram + vport->tap_offset - OFFLOAD_MAGIC_LEN;
+    offload_set_magic(offload_hdr);
+    gso = offload_needs_segmentation(&((struct offload_hdr_t *)offload_hdr)->vnet);
+    if (datagramsz + vport->headroom + vport->tailroom > OFFLOAD_MAX_UDP_PAYLOAD)
+    {
+      vport_send_segmented(vport, offload_hdr, datagramsz - (offload_hdr - datagram));
+      return 0;
+    }
+  }
+  // Super-frames are fragmented on the way anyway; their segments are sized by the sender's MSS
+  if (!gso && vport_too_big(vport, ether_data, ether_datasz, datagramsz))
+  {
+    return 0;
+  }
+  vport_prefix(vport, datagram, vport->offload ? WIRE_F_VNET : 0);
+  stats_inc(vport->stats_up, STATS_TX_FRAMES);
+  stats_add(vport->stats_up, STATS_TX_BYTES, ether_datasz);
+
+  // Record frame details (MAC addresses, EtherType, size) for the trace log
+  if (log_level >= LOG_FRAMES)
+  {
+    trace_frame(TRACE_TAP_TO_VSWITCH, vport->queue, ether_data, ether_datasz, NULL);
+  }
+  return datagramsz;
+}
+
+/*
+ Picks the destination of the datagram in up ring slot 'slot': the peer VPort
+ if the VSwitch has hinted a direct path to the destination MAC, otherwise
+ the VSwitch. While it has traffic, a P2P VPort also says hello to the
+ VSwitch every P2P_HELLO_INTERVAL seconds, from whichever queue gets there
+ first.
+ */
+static void vport_route(struct vport_t *vport, struct mmsg_ring_t *ring, unsigned int slot)
+{
+  struct msghdr *msg = &ring->msgs[slot].msg_hdr;
+  msg->msg_name = &vport->vswitch_addr;
+  if (vport->p2p == NULL)
+  {
+    return;
+  }
+
+  uint32_t now = p2p_clock();
+  uint32_t sent = atomic_load_explicit(&vport->p2p->hello_sent, memory_order_relaxed);
+  if ((sent == 0 || now - sent >= P2P_HELLO_INTERVAL) &&
+      atomic_compare_exchange_strong(&vport->p2p->hello_sent, &sent, now))
+  {
+    char hello[CRYPT_HDR_LEN + WIRE_HDR_LEN + P2P_HELLO_LEN + CRYPT_TAG_LEN];
+    struct iovec iov = {.iov_base = hello + CRYPT_HDR_LEN, .iov_len = 0};
+    iov.iov_len = vport_prefix(vport, iov.iov_base, 0);
+    p2p_set_header((char *)iov.iov_base + iov.iov_len, P2P_MSG_HELLO);
+    iov.iov_len += P2P_HELLO_LEN;
+    if (vport->crypt_tx)
+    {
+      iov.iov_len = crypt_seal(vport->crypt_tx, hello, &iov, 1);
+      iov.iov_base = hello;
+    }
+    if (sendto(vport->vport_sockfd, iov.iov_base, iov.iov_len, 0, (struct sockaddr *)&vport->vswitch_addr,
+               sizeof(vport->vswitch_addr)) < 0)
+    {
+      fprintf(stderr, "fail to send hello: %s\n", strerror(errno));
+    }
+  }
+
+  const char *ether_data = mmsg_ring_buf(ring, slot) + vport->headroom + vport_ether_offset(vport);
+  const struct ether_header *hdr = (const struct ether_header *)ether_data;
+  if (p2p_cache_lookup(vport->p2p, mac_to_u64(hdr->ether_dhost), now, &ring->addrs[slot]))
+  {
+    msg->msg_name = &ring->addrs[slot];
+  }
+}
+
+/*
+ Encrypted mode: seals the datagram in up ring slot 'slot' in place, its
+ header going into the headroom and its tag behind it.
+ */
+static void vport_seal_slot(struct vport_t *vport, struct mmsg_ring_t *ring, unsigned int slot)
+{
+  if (vport->crypt_tx)
+  {
+    char *buf = mmsg_ring_buf(ring, slot);
+    struct iovec plain = {.iov_base = buf + CRYPT_HDR_LEN, .iov_len = ring->iovs[slot].iov_len};
+    ring->iovs[slot].iov_len = crypt_seal(vport->crypt_tx, buf, &plain, 1);
+  }
+}
+
+static inline bool vport_same_dest(const struct msghdr *a, const struct msghdr *b)
+{
+  const struct sockaddr_in *x = (const struct sockaddr_in *)a->msg_name;
+  const struct sockaddr_in *y = (const struct sockaddr_in *)b->msg_name;
+  return x->sin_addr.s_addr == y->sin_addr.s_addr && x->sin_port == y->sin_port;
+}
+
+/*
+ Coalescing mode: adds the datagram just read into up ring slot 'slot' to
+ the bundle '*bundle' is building for the same destination, if it fits.
+ Returns true if it was added, which frees the slot again. Otherwise a
+ datagram small enough to share a bundle is wrapped into one of its own,
+ which later ones may join: even a lone small frame travels in a bundle, so
+ the VSwitch learns from this VPort's first ARP or ACK that it takes them.
+ */
+static bool vport_coalesce(struct vport_t *vport, struct mmsg_ring_t *ring, unsigned int slot, int *bundle)
+{
+  size_t limit = COALESCE_MAX_PAYLOAD - vport->headroom - vport->tailroom;
+  struct iovec datagram = {.iov_base = mmsg_ring_buf(ring, slot) + vport->headroom,
+                           .iov_len = ring->iovs[slot].iov_len};
+  bool same = *bundle >= 0 && vport_same_dest(&ring->msgs[*bundle].msg_hdr, &ring->msgs[slot].msg_hdr);
+
+  if (same && coalesce_fits(ring->iovs[*bundle].iov_len, datagram.iov_len, limit))
+  {
+    char *open = mmsg_ring_buf(ring, *bundle) + vport->headroom;
+    ring->iovs[*bundle].iov_len = coalesce_append(open, ring->iovs[*bundle].iov_len, &datagram, 1);
+    return true;
+  }
+
+  // Worth a bundle if at least a minimal frame could join it
+  if (coalesce_fits(COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN + datagram.iov_len, ETHER_HDR_LEN, limit))
+  {
+    ring->iovs[slot].iov_len = coalesce_wrap(datagram.iov_base, datagram.iov_len);
+    *bundle = slot;
+  }
+  else if (same)
+  {
+    *bundle = -1;  // Later datagrams must not overtake this one
+  }
+  return false;
+}
+
+static inline uint64_t vport_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ Busy-poll mode: returns true while a forwarder thread that found nothing to
+ do should poll again rather than block, i.e. for spin_ns after it first
+ found nothing. '*idle_since' is the time that happened, 0 while there is
+ traffic.
+ */
+static inline bool vport_spin(const struct vport_t *vport, uint64_t *idle_since)
+{
+  if (vport->spin_ns == 0)
+  {
+    return false;
+  }
+  uint64_t now = vport_now_ns();
+  if (*idle_since == 0)
+  {
+    *idle_since = now;
+  }
+  return now - *idle_since < vport->spin_ns;
+}
+
+/*
+ Coalescing mode: waits for the TAP to queue another frame, at most until
+ '*deadline' (CLOCK_MONOTONIC nanoseconds, set on the first call of a batch).
+ Returns false once the deadline has passed.
+ */
+static bool vport_coalesce_wait(struct vport_t *vport, uint64_t *deadline)
+{
+  uint64_t now = vport_now_ns();
+  if (*deadline == 0)
+  {
+    *deadline = now + vport->coalesce_ns;
+  }
+  if (now >= *deadline)
+  {
+    return false;
+  }
+
+  uint64_t left = *deadline - now;
+  struct timespec timeout = {.tv_sec = left / 1000000000ULL, .tv_nsec = left % 1000000000ULL};
+  if (vport->vhost != NULL)
+  {
+    return vhost_tx_wait(vport->vhost, vport->queue, &timeout);
+  }
+  struct pollfd pfd = {.fd = vport->tapfd, .events = POLLIN};
+  return ppoll(&pfd, 1, &timeout, NULL) > 0;
+}
+
+/*
+ Packet ring underlay: kicks the TX ring, then sends the 'count' datagrams
+ 'msgs' through the socket, so that they go out after the '*queued'
+ datagrams of the batch queued before them. Returns the number of datagrams
+ of both that went out in full.
+ */
+static int vport_underlay_flush(struct vport_t *vport, struct mmsghdr *msgs, unsigned int count,
+                                unsigned int *queued)
+{
+  struct packet_ring_t *underlay = vport->underlay;
+  unsigned int refused = packet_tx_kick(underlay);
+  if (refused > 0)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Failed to send on %s: %s, dropped %u frames\n", underlay->ifname,
+              strerror(errno), refused);  // Counted as send drops by the caller, as 'sent' leaves them out
+  }
+  int sent = (int)(*queued - refused);
+  *queued = 0;
+  return sent + mmsg_send(vport->vport_sockfd, msgs, count);
+}
+
+/*
+ Packet ring underlay: queues every datagram of a batch that goes to the
+ VSwitch and fits the interface and the path MTU in the TX ring, and sends
+ the rest (to peer VPorts, or too large) through the socket, as it does the
+ whole batch while the next hop is unknown. The ring is kicked before each
+ run of datagrams for the socket, so the batch leaves in order. Looks the
+ next hop up again every PMTU_CHECK_INTERVAL seconds. Returns the number of
+ datagrams sent in full.
+ */
+static int vport_send_underlay(struct vport_t *vport, struct mmsghdr *msgs, unsigned int count)
+{
+  struct packet_ring_t *underlay = vport->underlay;
+  uint32_t now = p2p_clock();
+  if (now - vport->underlay_read >= PMTU_CHECK_INTERVAL)
+  {
+    packet_path_resolve(underlay);
+    vport->underlay_read = now;
+  }
+  if (!underlay->path.resolved)
+  {
+    return mmsg_send(vport->vport_sockfd, msgs, count);
+  }
+
+  int mtu = vport->path_mtu > 0 && vport->path_mtu < (int)underlay->mtu ? vport->path_mtu : (int)underlay->mtu;
+  int sent = 0;
+  unsigned int queued = 0;  // Datagrams queued in the TX ring since the last kick
+  unsigned int run = 0;     // First of the datagrams since the last queued one, which go through the socket
+  for (unsigned int i = 0; i < count; i++)
+  {
+    const struct msghdr *msg = &msgs[i].msg_hdr;
+    size_t len = 0;
+    for (size_t j = 0; j < msg->msg_iovlen; j++)
+    {
+      len += msg->msg_iov[j].iov_len;
+    }
+    if (msg->msg_name != &vport->vswitch_addr || len + PMTU_UDP_OVERHEAD > (size_t)mtu)
+    {
+      continue;
+    }
+    if (run < i)
+    {
+      sent += vport_underlay_flush(vport, msgs + run, i - run, &queued);
+      run = i;
+    }
+    if (packet_tx_queue(underlay, msg->msg_iov, msg->msg_iovlen, len))
+    {
+      queued++;
+      run = i + 1;
+    }
+  }
+  return sent + vport_underlay_flush(vport, msgs + run, count - run, &queued);
+}
+
+/*
+ Sends the sealed up batch, in priority order if it mixes classes (-P), and
+ through the packet ring underlay (-U) if there is one. Returns the number of
+ datagrams sent in full.
+ */
+static int vport_send_up(struct vport_t *vport, struct mmsg_ring_t *ring, unsigned int classes)
+{
+  unsigned int count = ring->count;
+  struct mmsghdr *msgs = ring->msgs;
+  if (classes & (classes - 1))
+  {
+    qos_order(ring->msgs, vport->up_class, count, vport->up_sorted);
+    msgs = vport->up_sorted;
+  }
+  ring->count = 0;
+  return vport->underlay != NULL ? vport_send_underlay(vport, msgs, count)
+                                 : mmsg_send(vport->vport_sockfd, msgs, count);
+}
+
+/*
+ Shaping: charges the up batch just sent ('count' datagrams) to the queue's
+ token bucket and sleeps off any debt, leaving further frames in the TAP.
+ */
+static void vport_shape(struct vport_t *vport, const struct mmsg_ring_t *ring, unsigned int count)
+{
+  size_t bytes = 0;
+  for (unsigned int i = 0; i < count; i++)
+  {
+    bytes += ring->iovs[i].iov_len;
+  }
+  uint64_t wait = qos_shape(&vport->shaper, vport->shape_rate, bytes, vport_now_ns());
+  if (wait > 0)
+  {
+    struct timespec ts = {.tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    {
+    }
+  }
+}
+
+/*
+ Reads one frame from the TAP device, or with -V from the guest's transmit
+ queue, in the same layout. Like read(), returns -1 with errno EAGAIN once
+ nothing is queued (on a non-blocking TAP); guest frames shorter than an
+ Ethernet header fail with EINVAL.
+ */
+static ssize_t vport_read_host(struct vport_t *vport, char *buf, size_t len)
+{
+  if (vport->vhost == NULL)
+  {
+    return read(vport->tapfd, buf, len);
+  }
+  ssize_t datasz = vhost_dequeue(vport->vhost, vport->queue, buf, len);
+  if (datasz >= 0 && (size_t)datasz < (vport->offload ? sizeof(struct virtio_net_hdr) : 0) + ETHER_HDR_LEN)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  return datasz;
+}
+
+/*
+ Keepalives (-K): points the queue's datagrams at the VSwitch the health
+ thread picked, once it moved. Only the up thread writes vswitch_addr; a P2P
+ VPort says hello to its new switch with the next frame.
+ */
+static inline void vport_follow_vswitch(struct vport_t *vport)
+{
+  if (vport->health == NULL)
+  {
+    return;
+  }
+  uint32_t active = atomic_load_explicit(&vport->health->active, memory_order_acquire);
+  if (active == vport->vswitch_index)
+  {
+    return;
+  }
+  vport->vswitch_index = active;
+  vport->vswitch_addr = vport->health->switches[active].addr;
+  int path_mtu = udp_path_mtu(&vport->vswitch_addr);
+  vport->path_mtu = path_mtu > 0 ? path_mtu : vport->path_mtu;
+  vport->path_mtu_read = p2p_clock();
+  if (vport->p2p != NULL)
+  {
+    atomic_store_explicit(&vport->p2p->hello_sent, 0, memory_order_relaxed);
+  }
+}
+
+/*
+ Reads up to 'vport->batch' frames from the TAP device and sends them to the
+ VSwitch with a single sendmmsg(). Reads stop early once the TAP has nothing
+ queued (on a non-blocking TAP), so a batch never waits for traffic that has
+ not arrived, unless coalescing mode holds it back to grow a bundle. Returns
+ the number of frames read.
+ */
+static unsigned int vport_pump_up(struct vport_t *vport)
+{
+  struct mmsg_ring_t *ring = &vport->up_ring;
+  unsigned int nread = 0;
+  int bundle = -1;  // Coalescing mode: up ring slot of the bundle later frames may join
+  uint64_t deadline = 0;
+  unsigned int classes = 0;  // Priority queueing: bit mask of the classes in the batch
+
+  vport_follow_vswitch(vport);
+  while (ring->count < ring->capacity)
+  {
+    // Read Ethernet frame from TAP device
+    // The TAP device provides complete Ethernet frames including headers
+    char *datagram = mmsg_ring_buf(ring, ring->count) + vport->headroom;
+    uint64_t start = stats_start(vport->stats_up);
+    int tap_datasz = vport_read_host(vport, datagram + vport->tap_offset,
+                                     ring->bufsz - vport->headroom - vport->tap_offset - vport->tailroom);
+
+    if (tap_datasz < 0 && errno != EAGAIN && vport->vhost != NULL)
+    {
+      stats_inc(vport->stats_up, errno == EINVAL   ? STATS_DROP_SHORT
+                                 : errno == EFAULT ? STATS_DROP_MALFORMED
+                                                   : STATS_DROP_OVERSIZE);
+      nread++;
+      continue;  // A frame the guest sent is dropped, its buffer handed back all the same
+    }
+    if (tap_datasz < 0 && errno == EAGAIN)
+    {
+      if (bundle >= 0 && vport_coalesce_wait(vport, &deadline))
+      {
+        continue;  // More frames arrived in time to join the bundle
+      }
+      break;  // Nothing else queued: flush what we have
+    }
+
+    if (tap_datasz > 0)
+    {
+      stats_time(vport->stats_up, STATS_STAGE_TAP_READ, start);
+      nread++;
+      int datagramsz = vport_frame_from_tap(vport, datagram, tap_datasz);
+      if (datagramsz > 0)
+      {
+        ring->iovs[ring->count].iov_len = datagramsz;
+        vport_route(vport, ring, ring->count);
+        uint8_t class = 0;
+        if (vport->up_class != NULL)
+        {
+          size_t ether_offset = vport_ether_offset(vport);
+          class = qos_classify((const uint8_t *)datagram + ether_offset, datagramsz - ether_offset);
+          classes |= 1u << class;
+        }
+        if (vport->coalesce_ns == 0 || !vport_coalesce(vport, ring, ring->count, &bundle))
+        {
+          if (vport->up_class != NULL)
+          {
+            vport->up_class[ring->count] = class;
+          }
+          ring->count++;
+        }
+        else if (vport->up_class != NULL && class < vport->up_class[bundle])
+        {
+          vport->up_class[bundle] = class;  // A bundle goes out with its most urgent frame
+        }
+      }
+    }
+  }
+
+  // The guest may reuse its buffers as soon as the batch is copied out
+  if (vport->vhost != NULL && nread > 0)
+  {
+    vhost_tx_done(vport->vhost, vport->queue);
+  }
+
+  // Bundles are only complete now, so sealing waits for the whole batch
+  uint64_t start = stats_start(vport->stats_up);
+  for (unsigned int i = 0; i < ring->count; i++)
+  {
+    vport_seal_slot(vport, ring, i);
+  }
+
+  // Forward the batch of Ethernet frames to VSwitch via UDP
+  // (mmsg_send verifies that every frame was sent in full)
+  if (ring->count > 0)
+  {
+    unsigned int count = ring->count;
+    int sent = vport_send_up(vport, ring, classes);
+    stats_add(vport->stats_up, STATS_DROP_SEND, count - sent);
+    stats_time(vport->stats_up, STATS_STAGE_SEND, start);
+    if (vport->shape_rate)
+    {
+      vport_shape(vport, ring, count);
+    }
+  }
+  return nread;
+}
+
+/*
+ Uplink forwarder thread (TAP -> VSwitch). The first read of a batch blocks
+ (directly, or in poll() when the TAP is non-blocking), unless busy-poll mode
+ is still spinning.
+ */
+void *forward_ether_data_to_vswitch(void *raw_vport)
+{
+  struct vport_t *vport = (struct vport_t *)raw_vport;
+  struct pollfd pfd = {.fd = vport->tapfd, .events = POLLIN};
+  uint64_t idle_since = 0;
+
+  while (true)
+  {
+    if (vport_pump_up(vport) > 0)
+    {
+      idle_since = 0;
+    }
+    else if (vport_spin(vport, &idle_since))
+    {
+      continue;
+    }
+    else if (vport->vhost != NULL)
+    {
+      vhost_tx_wait(vport->vhost, vport->queue, NULL);  // Transmit queue is empty: wait for the guest's kick
+    }
+    else
+    {
+      poll(&pfd, 1, -1);  // TAP is empty: block until it has a frame
+    }
+  }
+}
+
+/*
+ Writes one frame to the TAP device, or with -V into the guest's receive
+ queue.
+ */
+static ssize_t vport_write_host(struct vport_t *vport, const struct iovec *iov, int iovcnt)
+{
+  if (vport->vhost != NULL)
+  {
+    return vhost_enqueue(vport->vhost, vport->queue, iov, iovcnt);
+  }
+  return writev(vport->tapfd, iov, iovcnt);
+}
+
+/*
+ Writes one received datagram to the TAP device, adapting it to the TAP mode:
+ an offload TAP takes the virtio_net_hdr that came with the frame (or an empty
+ one for plain frames), a plain TAP needs any pending checksum completed first.
+ A guest behind an offload VPort is treated like a plain TAP until it has
+ acknowledged the offloads, but still takes the header.
+ Returns the result of the write and stores the expected size in 'expectsz'.
+ */
+static ssize_t vport_write_tap(struct vport_t *vport, char *datagram, int datagramsz, ssize_t *expectsz)
+{
+  bool encapsulated = offload_is_encapsulated(datagram, datagramsz);
+  struct offload_hdr_t *offload_hdr = (struct offload_hdr_t *)datagram;
+  struct virtio_net_hdr vnet;
+  memset(&vnet, 0, sizeof(vnet));  // No offloads: checksums are complete
+  struct iovec iov[2] = {{.iov_base = &vnet, .iov_len = sizeof(vnet)}, {.iov_base = datagram, .iov_len = datagramsz}};
+
+  if (vport->offload && encapsulated && (vport->vhost == NULL || vhost_guest_offloads(vport->vhost)))
+  {
+    // virtio_net_hdr + frame are laid out exactly as the TAP expects them
+    iov[1].iov_base = datagram + OFFLOAD_MAGIC_LEN;
+    iov[1].iov_len = datagramsz - OFFLOAD_MAGIC_LEN;
+    *expectsz = iov[1].iov_len;
+    return vport_write_host(vport, &iov[1], 1);
+  }
+  if (encapsulated)
+  {
+    // The VSwitch segments super-frames for peers without offload, so only checksums remain
+    if (offload_needs_segmentation(&offload_hdr->vnet))
+    {
+      LOG_PRINT(LOG_FRAMES, "[VPort] Dropped GSO frame: %s\n",
+                vport->offload ? "the guest takes no offloads" : "TAP is not in offload mode");
+      *expectsz = -1;
+      return -1;
+    }
+    offload_complete_csum((uint8_t *)datagram + OFFLOAD_HDR_LEN, datagramsz - OFFLOAD_HDR_LEN, &offload_hdr->vnet);
+    iov[1].iov_base = datagram + OFFLOAD_HDR_LEN;
+    iov[1].iov_len = datagramsz - OFFLOAD_HDR_LEN;
+  }
+  *expectsz = (vport->offload ? sizeof(vnet) : 0) + iov[1].iov_len;
+  return vport->offload ? vport_write_host(vport, iov, 2) : vport_write_host(vport, &iov[1], 1);
+}
+
+/*
+ Returns true if 'from' is the VSwitch, or with keepalives (-K) any switch
+ of the list: the down thread leaves vswitch_addr to the up thread.
+ */
+static inline bool vport_from_vswitch(const struct vport_t *vport, const struct sockaddr_in *from)
+{
+  if (vport->health != NULL)
+  {
+    return health_is_switch(vport->health, from);
+  }
+  return from->sin_addr.s_addr == vport->vswitch_addr.sin_addr.s_addr &&
+         from->sin_port == vport->vswitch_addr.sin_port;
+}
+
+/*
+ Handles a P2P control message: a keepalive reply, or a hint. Hints are only
+ taken from the VSwitch, so nobody else can redirect this VPort's traffic.
+ */
+static void vport_p2p_control(struct vport_t *vport, const char *datagram, int datagramsz,
+                              const struct sockaddr_in *from)
+{
+  if (from != NULL && vport->health != NULL && health_is_probe(datagram, datagramsz, HEALTH_MSG_REPLY))
+  {
+    health_reply(vport->health, from, (const struct health_probe_t *)datagram, health_clock());
+    return;
+  }
+  if (vport->p2p == NULL || from == NULL || p2p_msg_type(datagram) != P2P_MSG_HINT ||
+      datagramsz < (int)sizeof(struct p2p_hint_t) || !vport_from_vswitch(vport, from))
+  {
+    return;
+  }
+  p2p_cache_put(vport->p2p, (const struct p2p_hint_t *)datagram, p2p_clock());
+
+  if (log_level >= LOG_INFO)
+  {
+    const struct p2p_hint_t *hint = (const struct p2p_hint_t *)datagram;
+    struct in_addr addr = {.s_addr = hint->addr};
+    LOG_PRINT(LOG_INFO, "[VPort] Direct path: %012llx -> %s:%d\n", (unsigned long long)mac_to_u64(hint->mac),
+              inet_ntoa(addr), ntohs(hint->port));
+  }
+}
+
+/*
+ Encrypted mode: authenticates and decrypts a received datagram in place,
+ moving '*datagram' and '*datagramsz' to the plaintext. 'from' is where it
+ came from, NULL if unknown. Returns false if the datagram has to be
+ dropped, counting it in 'stats'. Without a key every datagram passes as is.
+ */
+static bool vport_open(struct crypt_rx_t *rx, struct stats_t *stats, char **datagram, int *datagramsz,
+                       const struct sockaddr_in *from)
+{
+  if (rx == NULL)
+  {
+    return true;
+  }
+  uint32_t source = from != NULL ? from->sin_addr.s_addr : 0;
+  int plainsz = crypt_is_sealed(*datagram, *datagramsz) ? crypt_open(rx, *datagram, *datagramsz, source) : -1;
+  if (plainsz < 0)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Dropped unauthenticated datagram: datagramsz=%d\n", *datagramsz);
+    stats_inc(stats, STATS_DROP_AUTH);
+    return false;
+  }
+  *datagram += CRYPT_HDR_LEN;
+  *datagramsz = plainsz;
+  return true;
+}
+
+/*
+ Delivers one datagram received from the VSwitch (or, with -p, from a peer
+ VPort) to the TAP device, counting it in 'stats'. 'from' is the sender, or
+ NULL if unknown.
+ */
+static void vport_deliver_frame(struct vport_t *vport, struct stats_t *stats, char *datagram, int datagramsz,
+                                const struct sockaddr_in *from)
+{
+  struct wire_info_t wire;
+  bool wired = wire_parse(datagram, datagramsz, &wire);
+  if (wired)
+  {
+    datagram += wire.offset;
+    datagramsz -= wire.offset;
+  }
+  if (p2p_is_msg(datagram, datagramsz))
+  {
+    vport_p2p_control(vport, datagram, datagramsz, from);
+    return;
+  }
+  if (vport->port_id == 0 && (wired ? wire.net_id : 0) != vport->net_id)
+  {
+    stats_inc(stats, STATS_DROP_UNKNOWN_PORT);
+    return;  // A frame of another network never reaches the TAP
+  }
+
+  int ether_offset = offload_is_encapsulated(datagram, datagramsz) ? OFFLOAD_HDR_LEN : 0;
+  char *ether_data = datagram + ether_offset;
+  int ether_datasz = datagramsz - ether_offset;
+
+  // Validate minimum Ethernet frame size
+  if (ether_datasz < ETHER_HDR_LEN)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Dropped short frame: datagramsz=%d\n", datagramsz);
+    stats_inc(stats, STATS_DROP_SHORT);
+    return;
+  }
+
+  // Forward Ethernet frame to TAP device (inject into Linux network stack)
+  ssize_t expectsz;
+  uint64_t start = stats_start(stats);
+  ssize_t sendsz = vport_write_tap(vport, datagram, datagramsz, &expectsz);
+  stats_time(stats, STATS_STAGE_TAP_WRITE, start);
+
+  // Verify that the entire frame was written
+  if (expectsz < 0)
+  {
+    stats_inc(stats, STATS_DROP_OVERSIZE);
+    return;
+  }
+  if (sendsz < 0 && errno == EAGAIN)
+  {
+    stats_inc(stats, STATS_DROP_SEND);
+    return;  // vhost-user: the guest has no receive buffers posted, or is not running yet
+  }
+  if (sendsz != expectsz)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] write size mismatch: ether_datasz=%d, sendsz=%d\n", (int)expectsz, (int)sendsz);
+    stats_inc(stats, STATS_DROP_SEND);
+    return;
+  }
+  stats_inc(stats, STATS_RX_FRAMES);
+  stats_add(stats, STATS_RX_BYTES, ether_datasz);
+
+  // Record frame details for the trace log
+  if (log_level >= LOG_FRAMES)
+  {
+    trace_frame(TRACE_VSWITCH_TO_TAP, vport->queue, ether_data, ether_datasz, from ? from : &vport->vswitch_addr);
+  }
+}
+
+/*
+ Delivers a received datagram, or every datagram of a bundle, to the TAP
+ device.
+ */
+static void vport_deliver(struct vport_t *vport, char *datagram, int datagramsz, const struct sockaddr_in *from)
+{
+  if (!coalesce_is_bundle(datagram, datagramsz))
+  {
+    vport_deliver_frame(vport, vport->stats_down, datagram, datagramsz, from);
+    return;
+  }
+  size_t offset = 0;
+  int recordsz;
+  char *record;
+  while ((record = coalesce_next(datagram, datagramsz, &offset, &recordsz)) != NULL)
+  {
+    if (recordsz < ETHER_HDR_LEN)
+    {
+      stats_inc(vport->stats_down, STATS_DROP_SHORT);
+      continue;
+    }
+    vport_deliver_frame(vport, vport->stats_down, record, recordsz, from);
+  }
+}
+
+/*
+ Receives up to 'vport->batch' datagrams from the VSwitch with a single
+ recvmmsg() and writes each frame to the TAP device. 'flags' selects how the
+ call waits: MSG_WAITFORONE blocks only until the first datagram has arrived,
+ MSG_DONTWAIT takes only what is already queued. Returns the number of
+ datagrams received.
+ */
+static int vport_pump_down(struct vport_t *vport, int flags)
+{
+  struct mmsg_ring_t *ring = &vport->down_ring;
+
+  // Receive Ethernet frames from VSwitch via UDP
+  // The sender lands in ring->addrs, not in vswitch_addr: peer VPorts may send too
+  mmsg_ring_reset(ring);
+  int nmsgs = recvmmsg(vport->vport_sockfd, ring->msgs, ring->capacity, flags, NULL);
+
+  for (int i = 0; i < nmsgs; i++)
+  {
+    if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      LOG_PRINT(LOG_FRAMES, "[VPort] Dropped truncated datagram: bufsz=%d\n", (int)ring->bufsz);
+      stats_inc(vport->stats_down, STATS_DROP_OVERSIZE);
+      continue;
+    }
+    char *datagram = mmsg_ring_buf(ring, i);
+    int datagramsz = ring->msgs[i].msg_len;
+    if (vport_open(vport->crypt_rx, vport->stats_down, &datagram, &datagramsz, &ring->addrs[i]))
+    {
+      vport_deliver(vport, datagram, datagramsz, &ring->addrs[i]);
+    }
+  }
+  if (vport->vhost != NULL && nmsgs > 0)
+  {
+    vhost_rx_done(vport->vhost, vport->queue);
+  }
+  return nmsgs;
+}
+
+/*
+ Packet ring underlay: delivers every datagram the RX ring has ready, then
+ what reached the socket in fragments, and blocks in poll() while both are
+ empty.
+ */
+static void vport_underlay_down(struct vport_t *vport)
+{
+  struct pollfd pfds[2] = {{.fd = vport->underlay->fd, .events = POLLIN},
+                           {.fd = vport->vport_sockfd, .events = POLLIN}};
+  while (true)
+  {
+    int ndatagrams = 0;
+    char *datagram;
+    int datagramsz;
+    struct sockaddr_in from;
+    while (packet_rx_next(vport->underlay, &datagram, &datagramsz, &from))
+    {
+      ndatagrams++;
+      if (vport_open(vport->crypt_rx, vport->stats_down, &datagram, &datagramsz, &from))
+      {
+        vport_deliver(vport, datagram, datagramsz, &from);
+      }
+    }
+    if (vport->vhost != NULL && ndatagrams > 0)
+    {
+      vhost_rx_done(vport->vhost, vport->queue);
+    }
+    if (vport_pump_down(vport, MSG_DONTWAIT) <= 0 && ndatagrams == 0)
+    {
+      poll(pfds, 2, -1);
+    }
+  }
+}
+
+/*
+ Downlink forwarder thread (VSwitch -> TAP). Busy-poll mode only takes what
+ is queued until it has spun for spin_ns without traffic.
+ */
+void *forward_ether_data_to_tap(void *raw_vport)
+{
+  struct vport_t *vport = (struct vport_t *)raw_vport;
+  uint64_t idle_since = 0;
+
+  if (vport->underlay != NULL)
+  {
+    vport_underlay_down(vport);
+  }
+
+  while (true)
+  {
+    int flags = vport_spin(vport, &idle_since) ? MSG_DONTWAIT : MSG_WAITFORONE;
+    if (vport_pump_down(vport, flags) > 0)
+    {
+      idle_since = 0;
+    }
+  }
+}
+
+static void vport_set_nonblocking(int fd, bool nonblocking)
+{
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to fcntl: %s\n", strerror(errno));
+  }
+}
+
+/*
+ Event loop on epoll: every TAP queue and socket is non-blocking and
+ level-triggered, and each readiness event moves at most one batch, so busy
+ queues cannot starve quiet ones.
+ */
+static void vport_run_epoll(struct vport_t *vports, unsigned int queues)
+{
+  int epfd = epoll_create1(0);
+  if (epfd < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to epoll_create1: %s\n", strerror(errno));
+  }
+
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    // Event data: queue index * 2, plus 1 for the socket
+    struct epoll_event tap_event = {.events = EPOLLIN, .data.u64 = q * 2};
+    struct epoll_event sock_event = {.events = EPOLLIN, .data.u64 = q * 2 + 1};
+    vport_set_nonblocking(vports[q].tapfd, true);
+    vport_set_nonblocking(vports[q].vport_sockfd, true);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, vports[q].tapfd, &tap_event) < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, vports[q].vport_sockfd, &sock_event) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to epoll_ctl: %s\n", strerror(errno));
+    }
+  }
+
+  printf("[VPort] Event loop: epoll\n");
+  struct epoll_event events[2 * VPORT_MAX_QUEUES];
+  while (true)
+  {
+    int nevents = epoll_wait(epfd, events, 2 * queues, -1);
+    if (nevents < 0 && errno != EINTR)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to epoll_wait: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < nevents; i++)
+    {
+      struct vport_t *vport = &vports[events[i].data.u64 / 2];
+      if (events[i].data.u64 % 2)
+      {
+        vport_pump_down(vport, MSG_DONTWAIT);
+      }
+      else
+      {
+        vport_pump_up(vport);
+      }
+    }
+  }
+}
+
+// io_uring user_data: queue index in the upper 32 bits, then the operation and the slot
+#define VPORT_OP_TAP_READ 1   ///< Read from the TAP into an up_ring slot
+#define VPORT_OP_SEND 2       ///< sendmsg() of an up_ring slot to the VSwitch
+#define VPORT_OP_RECV 3       ///< Multishot receive from the VSwitch into the queue's buffer group
+
+static inline uint64_t vport_op_data(unsigned int queue, unsigned int op, unsigned int slot)
+{
+  return ((uint64_t)queue << 32) | (op << 24) | slot;
+}
+
+static void vport_uring_read(struct uring_t *uring, struct vport_t *vport, unsigned int slot, bool fixed)
+{
+  struct mmsg_ring_t *ring = &vport->up_ring;
+  char *buf = mmsg_ring_buf(ring, slot) + vport->headroom + vport->tap_offset;
+  size_t len = ring->bufsz - vport->headroom - vport->tap_offset - vport->tailroom;
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+  uint64_t user_data = vport_op_data(vport->queue, VPORT_OP_TAP_READ, slot);
+
+  if (fixed)
+  {
+    uring_prep_read_fixed(sqe, vport->tapfd, buf, len, vport->queue * ring->capacity + slot, user_data);
+  }
+  else
+  {
+    uring_prep_read(sqe, vport->tapfd, buf, len, user_data);
+  }
+}
+
+static void vport_uring_recv(struct uring_t *uring, struct vport_t *vport)
+{
+  uring_prep_recv_multishot(uring_get_sqe(uring), vport->vport_sockfd, vport->queue,
+                            vport_op_data(vport->queue, VPORT_OP_RECV, 0));
+}
+
+/*
+ Event loop on io_uring. Each queue keeps one read in flight per up_ring slot;
+ a completed read turns into a sendmsg() of the same slot, and a completed
+ send into the next read, so the slot buffers (registered as fixed buffers)
+ are never copied. Datagrams from the VSwitch arrive through one multishot
+ receive per queue, in buffers the kernel takes from a provided buffer ring
+ over the down_ring frame pool; each is written to the TAP right away and its
+ buffer recycled. Returns false, having changed nothing, if the kernel lacks
+ the io_uring features this needs.
+ */
+static bool vport_run_uring(struct vport_t *vports, unsigned int queues)
+{
+  unsigned int depth = vports[0].up_ring.capacity;
+  struct uring_t uring;
+  struct uring_buf_ring_t bufrings[VPORT_MAX_QUEUES];
+
+  // Worst case every slot has a read or send in flight plus one receive per queue
+  if (uring_init(&uring, queues * (depth + 1)) < 0)
+  {
+    fprintf(stderr, "fail to io_uring_setup: %s\n", strerror(errno));
+    return false;
+  }
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    struct mmsg_ring_t *ring = &vports[q].down_ring;
+    if (uring_buf_ring_init(&uring, &bufrings[q], q, ring->pool.base, ring->capacity, ring->pool.stride) < 0)
+    {
+      fprintf(stderr, "fail to register provided buffer ring: %s\n", strerror(errno));
+      uring_exit(&uring);
+      return false;
+    }
+  }
+
+  // Fixed buffers are an optimization only (registration can hit RLIMIT_MEMLOCK)
+  struct iovec *fixed_iovs = calloc(queues * depth, sizeof(*fixed_iovs));
+  if (fixed_iovs == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    for (unsigned int slot = 0; slot < depth; slot++)
+    {
+      fixed_iovs[q * depth + slot].iov_base = mmsg_ring_buf(&vports[q].up_ring, slot);
+      fixed_iovs[q * depth + slot].iov_len = vports[q].up_ring.bufsz;
+    }
+  }
+  bool fixed = uring_register_buffers(&uring, fixed_iovs, queues * depth) == 0;
+  if (!fixed)
+  {
+    fprintf(stderr, "fail to register fixed buffers, using plain reads: %s\n", strerror(errno));
+  }
+  free(fixed_iovs);
+  printf("[VPort] Event loop: io_uring, fixed buffers: %s\n", fixed ? "on" : "off");
+
+  // io_uring waits for readiness itself; a non-blocking TAP would fail reads with EAGAIN
+  for (unsigned int q = 0; q < queues; q++)
+  {
+    vport_set_nonblocking(vports[q].tapfd, false);
+    for (unsigned int slot = 0; slot < depth; slot++)
+    {
+      vport_uring_read(&uring, &vports[q], slot, fixed);
+    }
+    vport_uring_recv(&uring, &vports[q]);
+  }
+
+  while (true)
+  {
+    if (uring_submit_and_wait(&uring, 1) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to io_uring_enter: %s\n", strerror(errno));
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&uring)) != NULL)
+    {
+      struct vport_t *vport = &vports[cqe->user_data >> 32];
+      unsigned int op = (cqe->user_data >> 24) & 0xff;
+      unsigned int slot = cqe->user_data & 0xffffff;
+      struct mmsg_ring_t *ring = &vport->up_ring;
+
+      if (op == VPORT_OP_TAP_READ)
+      {
+        int datagramsz = 0;
+        if (cqe->res > 0)
+        {
+          datagramsz = vport_frame_from_tap(vport, mmsg_ring_buf(ring, slot) + vport->headroom, cqe->res);
+        }
+        else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
+        {
+          ERROR_PRINT_THEN_EXIT("fail to read TAP: %s\n", strerror(-cqe->res));
+        }
+
+        if (datagramsz > 0)
+        {
+          ring->iovs[slot].iov_len = datagramsz;
+          vport_route(vport, ring, slot);
+          vport_seal_slot(vport, ring, slot);
+          uring_prep_sendmsg(uring_get_sqe(&uring), vport->vport_sockfd, &ring->msgs[slot].msg_hdr,
+                             vport_op_data(vport->queue, VPORT_OP_SEND, slot));
+        }
+        else
+        {
+          vport_uring_read(&uring, vport, slot, fixed);
+        }
+      }
+      else if (op == VPORT_OP_SEND)
+      {
+        if (cqe->res != (int)ring->iovs[slot].iov_len)
+        {
+          LOG_PRINT(LOG_FRAMES, "[VPort] sendto size mismatch: ether_datasz=%d, sendsz=%d\n",
+                    (int)ring->iovs[slot].iov_len, cqe->res);
+          stats_inc(vport->stats_up, STATS_DROP_SEND);
+        }
+        vport_uring_read(&uring, vport, slot, fixed);
+      }
+      else if (op == VPORT_OP_RECV)
+      {
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+        {
+          uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+          struct uring_buf_ring_t *bufring = &bufrings[vport->queue];
+          char *datagram = bufring->bufs + bid * bufring->bufsz;
+          int datagramsz = cqe->res;
+          if (vport_open(vport->crypt_rx, vport->stats_down, &datagram, &datagramsz, NULL))
+          {
+            vport_deliver(vport, datagram, datagramsz, NULL);
+          }
+          uring_buf_ring_recycle(bufring, bid);
+        }
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+        {
+          fprintf(stderr, "fail to recv: %s\n", strerror(-cqe->res));
+        }
+
+        // The receive stops when it runs out of buffers; they are all back by now
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+          vport_uring_recv(&uring, vport);
+        }
+      }
+      uring_cqe_seen(&uring);
+    }
+  }
+}
+
+/*
+ Runs the datapath of all 'queues' VPorts on the calling thread. "uring"
+ falls back to epoll when io_uring is unavailable. Never returns.
+ */
+static void vport_run_loop(struct vport_t *vports, unsigned int queues, const char *mode)
+{
+  if (strcmp(mode, "uring") == 0)
+  {
+    if (vport_run_uring(vports, queues))
+    {
+      return;
+    }
+    fprintf(stderr, "[VPort] io_uring unavailable, falling back to epoll\n");
+  }
+  vport_run_epoll(vports, queues);
+}
+/*
+ Creates the TAP devices listed in 'config', one "<tap name> <port ID>" pair
+ per line ('#' starts a comment), and the UDP socket they share. A third
+ field puts the device on a network other than 'net_id'.
+ */
+static void vport_daemon_init(struct vport_daemon_t *daemon, const char *config, const char *server_ip_str,
+                              int server_port, unsigned int batch, bool offload, unsigned int nworkers,
+                              const struct crypt_key_t *crypt_key, unsigned int coalesce_usecs,
+                              uint32_t wire_sender, uint16_t net_id, unsigned int mtu, bool prio)
+{
+  FILE *file = fopen(config, "r");
+  if (file == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to open %s: %s\n", config, strerror(errno));
+  }
+
+  memset(daemon, 0, sizeof(*daemon));
+  daemon->nworkers = nworkers;
+  daemon->prio = prio;
+  daemon->by_port_id = calloc(PORT_TAG_MAX_ID + 1, sizeof(*daemon->by_port_id));
+  if (daemon->by_port_id == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+
+  if ((daemon->sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
+  }
+  vport_set_nonblocking(daemon->sockfd, true);
+  udp_pmtu_discover(daemon->sockfd);
+
+  memset(&daemon->vswitch_addr, 0, sizeof(daemon->vswitch_addr));
+  daemon->vswitch_addr.sin_family = AF_INET;
+  daemon->vswitch_addr.sin_port = htons(server_port);
+  if (inet_pton(AF_INET, server_ip_str, &daemon->vswitch_addr.sin_addr) != 1)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to inet_pton: %s\n", strerror(errno));
+  }
+
+  char line[256];
+  unsigned int lineno = 0;
+  unsigned int capacity = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    lineno++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+
+    char ifname[IFNAMSIZ];
+    unsigned int port_id;
+    unsigned int port_net_id = net_id;
+    char extra;
+    int fields = sscanf(line, "%15s %u %u %c", ifname, &port_id, &port_net_id, &extra);
+    if (fields <= 0)
+    {
+      continue;  // Blank line
+    }
+    if (fields < 2 || fields > 3 || port_id < PORT_TAG_MIN_ID || port_id > PORT_TAG_MAX_ID ||
+        port_net_id > WIRE_MAX_NET_ID || (port_net_id && !wire_sender))
+    {
+      ERROR_PRINT_THEN_EXIT("%s:%u: expected \"<tap name> <port ID %d-%d> [network ID, with -W]\"\n", config, lineno,
+                            PORT_TAG_MIN_ID, PORT_TAG_MAX_ID);
+    }
+    if (daemon->by_port_id[port_id] != NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("%s:%u: duplicate port ID %u\n", config, lineno, port_id);
+    }
+
+    int tapfd;
+    if (tap_alloc_mq(ifname, 1, &tapfd, offload ? TAP_OPT_VNET_HDR : 0) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to tap_alloc %s: %s\n", ifname, strerror(errno));
+    }
+    if (tap_set_mtu(ifname, mtu) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to set the MTU of %s to %u: %s\n", ifname, mtu, strerror(errno));
+    }
+    if (offload && tap_set_gso_max_size(ifname, OFFLOAD_GSO_MAX_SIZE) < 0)
+    {
+      fprintf(stderr, "fail to set gso_max_size on %s: %s\n", ifname, strerror(errno));
+    }
+
+    if (daemon->nvports == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      struct vport_t *vports = realloc(daemon->vports, capacity * sizeof(*vports));
+      if (vports == NULL)
+      {
+        ERROR_PRINT_THEN_EXIT("fail to realloc: %s\n", strerror(errno));
+      }
+      daemon->vports = vports;
+    }
+    vport_setup(&daemon->vports[daemon->nvports], tapfd, daemon->sockfd, &daemon->vswitch_addr, batch,
+                daemon->nvports, offload, port_id, crypt_key, coalesce_usecs, wire_sender, port_net_id, mtu, 0, prio);
+    char labels[STATS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "port=\"%s\"", ifname);
+    daemon->vports[daemon->nvports].stats_up = stats_create(labels);
+    daemon->nvports++;
+    printf("[VPort] TAP device name: %s, port ID: %u, network: %u\n", ifname, port_id, port_net_id);
+  }
+  fclose(file);
+
+  if (daemon->nvports == 0)
+  {
+    ERROR_PRINT_THEN_EXIT("%s: no TAP devices configured\n", config);
+  }
+  // The array is final now, so the lookup table can point into it
+  for (unsigned int v = 0; v < daemon->nvports; v++)
+  {
+    daemon->by_port_id[daemon->vports[v].port_id] = &daemon->vports[v];
+  }
+
+  printf("[VPort] Daemon: %u TAP devices, VSwitch: %s:%d, batch: %u, workers: %u, offload: %s, encryption: %s, "
+         "coalescing: %s, wire header: %s, MTU: %u, path MTU: %d, priority queueing: %s\n", daemon->nvports,
+         server_ip_str, server_port, batch, nworkers, offload ? "on" : "off",
+         crypt_key ? crypt_cipher_name(daemon->vports[0].crypt_tx->cipher) : "off", coalesce_usecs ? "on" : "off",
+         wire_sender ? "on" : "off", mtu, daemon->vports[0].path_mtu, prio ? "on" : "off");
+}
+
+/*
+ Hands a datagram to the VPort its port tag or wire header names.
+ */
+static void vport_daemon_deliver(struct vport_worker_t *worker, char *datagram, int datagramsz,
+                                 const struct sockaddr_in *from)
+{
+  struct vport_daemon_t *daemon = worker->daemon;
+  struct wire_info_t wire;
+  int port_id = -1;
+  int net_id = 0;
+  int offset = 0;
+  if (wire_parse(datagram, datagramsz, &wire))
+  {
+    port_id = wire.port_id;
+    net_id = wire.net_id;
+    offset = wire.offset;
+  }
+  else if (port_tag_present(datagram, datagramsz))
+  {
+    port_id = port_tag_id(datagram);
+    offset = PORT_TAG_LEN;
+  }
+
+  struct vport_t *vport = port_id >= 0 && port_id <= PORT_TAG_MAX_ID ? daemon->by_port_id[port_id] : NULL;
+  if (vport == NULL || net_id != vport->net_id)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VPort] Dropped datagram for unknown port: datagramsz=%d\n", datagramsz);
+    stats_inc(worker->stats, STATS_DROP_UNKNOWN_PORT);
+    return;
+  }
+  vport_deliver_frame(vport, worker->port_stats[vport - daemon->vports], datagram + offset, datagramsz - offset,
+                      from);
+}
+
+/*
+ Receives a batch of datagrams on the shared socket and hands each one to the
+ VPort its port tag names. The datagrams of a bundle may be for different
+ VPorts, so bundles are unpacked first.
+ */
+static void vport_daemon_pump_down(struct vport_worker_t *worker)
+{
+  struct vport_daemon_t *daemon = worker->daemon;
+  struct mmsg_ring_t *ring = &worker->down_ring;
+
+  mmsg_ring_reset(ring);
+  int nmsgs = recvmmsg(daemon->sockfd, ring->msgs, ring->capacity, MSG_DONTWAIT, NULL);
+
+  for (int i = 0; i < nmsgs; i++)
+  {
+    char *datagram = mmsg_ring_buf(ring, i);
+    int datagramsz = ring->msgs[i].msg_len;
+    if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+    {
+      LOG_PRINT(LOG_FRAMES, "[VPort] Dropped truncated datagram: bufsz=%d\n", (int)ring->bufsz);
+      stats_inc(worker->stats, STATS_DROP_OVERSIZE);
+      continue;
+    }
+    if (daemon->crypt_rx != NULL)
+    {
+      pthread_mutex_lock(&daemon->crypt_lock);
+      bool opened = vport_open(daemon->crypt_rx, worker->stats, &datagram, &datagramsz, &ring->addrs[i]);
+      pthread_mutex_unlock(&daemon->crypt_lock);
+      if (!opened)
+      {
+        continue;
+      }
+    }
+    if (!coalesce_is_bundle(datagram, datagramsz))
+    {
+      vport_daemon_deliver(worker, datagram, datagramsz, &ring->addrs[i]);
+      continue;
+    }
+    size_t offset = 0;
+    int recordsz;
+    char *record;
+    while ((record = coalesce_next(datagram, datagramsz, &offset, &recordsz)) != NULL)
+    {
+      vport_daemon_deliver(worker, record, recordsz, &ring->addrs[i]);
+    }
+  }
+}
+
+static void *vport_daemon_worker(void *raw_worker)
+{
+  struct vport_worker_t *worker = (struct vport_worker_t *)raw_worker;
+  struct vport_daemon_t *daemon = worker->daemon;
+
+  int epfd = epoll_create1(0);
+  if (epfd < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to epoll_create1: %s\n", strerror(errno));
+  }
+
+  // This worker's TAP devices, each moved at most one batch per event
+  for (unsigned int v = worker->index; v < daemon->nvports; v += daemon->nworkers)
+  {
+    struct vport_t *vport = &daemon->vports[v];
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = v};
+    vport->up_ring = worker->up_ring;
+    vport->seg_buf = worker->seg_buf;
+    vport->up_class = worker->up_class;
+    vport->up_sorted = worker->up_sorted;
+    vport_set_nonblocking(vport->tapfd, true);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, vport->tapfd, &event) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to epoll_ctl: %s\n", strerror(errno));
+    }
+  }
+
+  // Every worker waits on the shared socket, but each datagram wakes only one
+  struct epoll_event sock_event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.u64 = VPORT_DAEMON_SOCKET_EVENT};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, daemon->sockfd, &sock_event) < 0)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to epoll_ctl: %s\n", strerror(errno));
+  }
+
+  struct epoll_event events[64];
+  while (true)
+  {
+    int nevents = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (nevents < 0 && errno != EINTR)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to epoll_wait: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < nevents; i++)
+    {
+      if (events[i].data.u64 == VPORT_DAEMON_SOCKET_EVENT)
+      {
+        vport_daemon_pump_down(worker);
+      }
+      else
+      {
+        vport_pump_up(&daemon->vports[events[i].data.u64]);
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ Starts the worker pool and waits for it (forever, in normal operation).
+ */
+static void vport_daemon_run(struct vport_daemon_t *daemon, unsigned int batch, const struct crypt_key_t *crypt_key)
+{
+  bool offload = daemon->vports[0].offload;
+  size_t overhead = crypt_key ? CRYPT_OVERHEAD : 0;
+  size_t prefix = daemon->vports[0].wire_sender ? WIRE_HDR_LEN : PORT_TAG_LEN;
+  size_t frame_len = tap_frame_len(daemon->vports[0].mtu);
+  size_t up_bufsz = offload ? OFFLOAD_MAX_DATAGRAM : prefix + frame_len + overhead;
+  size_t down_bufsz = offload ? OFFLOAD_MAX_DATAGRAM : prefix + OFFLOAD_HDR_LEN + frame_len + overhead;
+  struct vport_worker_t workers[VPORT_DAEMON_MAX_WORKERS];
+  pthread_t threads[VPORT_DAEMON_MAX_WORKERS];
+
+  daemon->crypt_rx = NULL;
+  pthread_mutex_init(&daemon->crypt_lock, NULL);
+  if (crypt_key)
+  {
+    if ((daemon->crypt_rx = malloc(sizeof(*daemon->crypt_rx))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    crypt_rx_init(daemon->crypt_rx, crypt_key, CRYPT_DEFAULT_SESSIONS);
+  }
+
+  for (unsigned int w = 0; w < daemon->nworkers; w++)
+  {
+    struct vport_worker_t *worker = &workers[w];
+    worker->daemon = daemon;
+    worker->index = w;
+    worker->seg_buf = NULL;
+    worker->up_class = NULL;
+    worker->up_sorted = NULL;
+
+    // Any worker may deliver to any VPort, so each keeps counters of its own for every one
+    char labels[STATS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "worker=\"%u\"", w);
+    worker->stats = stats_create(labels);
+    if ((worker->port_stats = calloc(daemon->nvports, sizeof(*worker->port_stats))) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+    }
+    for (unsigned int v = 0; v < daemon->nvports; v++)
+    {
+      worker->port_stats[v] = stats_create(daemon->vports[v].stats_up->labels);
+    }
+    mmsg_ring_init(&worker->up_ring, batch, up_bufsz, 0);
+    mmsg_ring_init(&worker->down_ring, batch, down_bufsz, 0);
+    for (unsigned int i = 0; i < batch; i++)
+    {
+      worker->up_ring.msgs[i].msg_hdr.msg_name = &daemon->vswitch_addr;
+    }
+    if (offload && (worker->seg_buf = malloc(VPORT_SEG_BUF_SIZE)) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+    if (daemon->prio && ((worker->up_class = calloc(batch, sizeof(*worker->up_class))) == NULL ||
+                         (worker->up_sorted = calloc(batch, sizeof(*worker->up_sorted))) == NULL))
+    {
+      ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+    }
+
+    if (pthread_create(&threads[w], NULL, vport_daemon_worker, worker) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+    if (daemon->nworkers > 1)
+    {
+      vport_pin_thread(threads[w], w);
+    }
+  }
+
+  for (unsigned int w = 0; w < daemon->nworkers; w++)
+  {
+    if (pthread_join(threads[w], NULL) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_join: %s\n", strerror(errno));
+    }
+  }
 }
\ No newline at end of file
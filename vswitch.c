@@ -0,0 +1,2419 @@
+/*
+ VSwitch is the native implementation of the learning Ethernet switch that
+ vswitch.py provides. It speaks the same UDP protocol (one raw Ethernet frame
+ per datagram) so existing VPorts connect to it unchanged:
+
+ 1. Receives Ethernet frames from VPorts over UDP
+ 2. Learns which VPort (UDP endpoint) each source MAC address lives behind
+ 3. Forwards unicast frames to the VPort that owns the destination MAC
+ 4. Floods broadcast frames to every known VPort except the source VPort, and
+    multicast frames to the VPorts that subscribed to the group (mcast_utils.h)
+ 5. Floods unicast frames for unknown destinations as well, up to -u frames
+    per second from each VPort (a token bucket), so that the reply teaches
+    it a MAC that aged out or was never seen within one round trip; frames
+    over the limit are discarded
+ 6. Ages out MAC table entries that have not been seen for a while
+ 7. Points P2P VPorts at each other so known unicast can bypass the switch
+ 8. Answers ARP requests and IPv6 neighbour solicitations for addresses it
+    has seen, instead of flooding them (neigh_utils.h; disabled with -N)
+ 9. With -k, only accepts sealed datagrams and seals everything it sends
+    (crypt_utils.h)
+10. Unpacks bundles of small frames from VPorts that coalesce (vport -C), and
+    bundles small frames for them in turn (coalesce_utils.h)
+11. Understands the wire header (vport -W, wire_utils.h): it knows such
+    VPorts by their sender ID, follows them to a new address, counts the
+    datagrams they lost on the way, and talks to them with the header too
+12. With -M, serves its counters, per worker and per VPort, to Prometheus
+    (stats_utils.h); with -T, also histograms of the time each worker
+    spends switching a datagram and sending a batch
+13. With -f, saves its MAC table to a snapshot file every few seconds and
+    restores it on startup (snap_utils.h), so it forwards unicast right
+    away after a restart; restored entries age like any other unless
+    traffic confirms them, and move as soon as a MAC shows up elsewhere
+14. Keeps tenant networks apart: a VPort belongs to the network its wire
+    header names (vport -n), and every network has a MAC table, flood list,
+    multicast groups and neighbour table of its own, so a frame never leaves
+    its network and flooding costs as much as the network has VPorts; -n
+    caps the number of networks, as any datagram may name a new one
+15. With -r, polices every VPort to a rate (a token bucket per VPort, kept
+    by the worker that receives from it), and with -P, sends each TX batch
+    in priority order (qos_utils.h), so that a bulk sender neither eats the
+    switch nor delays the short packets of everyone else
+16. With -X, attaches an XDP program to the given interfaces that switches
+    plain unicast frames between known VPorts of the default network in the
+    driver, before the kernel's UDP stack (xdp_utils.h); the MAC table
+    change callback keeps its map in step, and everything else still comes
+    up to the workers
+17. Answers keepalive probes (vport -K, health_utils.h) straight away, and
+    forgets the MACs of a VPort whose probes stop for -K seconds (which must
+    span HEALTH_DEAD_PROBES intervals of vport -K), so that a VPort that
+    failed over to a standby switch, or died, is looked for by flooding
+    again; a VPort that probes is on the flood list from its first probe,
+    so the standby finds it at once
+
+ MAC addresses are kept packed in a uint64_t and looked up in an
+ open-addressed hash table (mac_utils.h), so the hot path never formats
+ strings or allocates; the table only allocates when learning makes it grow.
+
+ Workers switch in two passes over each RX batch: the first takes the
+ tunnel headers apart and queues the frames, the second classifies all
+ their Ethernet headers at once (class_utils.h, with AVX2 or NEON where
+ available), prefetches the MAC table slots they will touch, and only then
+ learns and forwards them one by one, in arrival order.
+
+ Received frames go from the RX ring to the TX ring by reference: each queued
+ send holds a reference to the frame descriptor (pool_utils.h), and the RX
+ ring only reuses buffers nobody holds any more.
+
+ Frames from VPorts in offload mode arrive with an offload_hdr_t and may be
+ GSO super-frames. They are passed through untouched to other offload VPorts
+ and segmented (or have their checksum completed) for everyone else.
+
+ A VPort daemon serves many TAP devices from one UDP endpoint and tags each
+ datagram with a port ID (see tag_utils.h); every (endpoint, port ID) pair
+ is a VPort of its own.
+
+ With -w N, N workers each receive on their own SO_REUSEPORT socket and are
+ pinned to their own core. In busy-poll mode (-S) a worker that runs out of
+ datagrams keeps polling its socket for a while before it blocks again. The
+ kernel keeps every VPort endpoint on one socket, so frames from a VPort are
+ switched in order by a single worker. In encrypted mode it is every session
+ instead, as each worker keeps the replay windows of the sessions it hears.
+ Workers share the MAC tables, which they read without locking, and the peer
+ array, which never moves; each keeps a private cache of the peers it has
+ looked up.
+
+ In encrypted mode each worker opens datagrams in place in its RX buffers
+ and seals the whole TX batch at flush time, into a buffer of its own: one
+ received frame may go to many VPorts, so it cannot be sealed where it lies.
+
+ Each datagram of a bundle is switched on its own, referencing the RX frame
+ like any other. A VPort that sends bundles is taken to accept them: at
+ flush time, small datagrams queued for the same coalescing endpoint are
+ copied into shared bundles in bundle_buf, next to the one kept in place for
+ the first of them, before any sealing.
+ */
+
+#include "sys_utils.h"
+#include "ether_utils.h"
+#include "udp_utils.h"
+#include "offload_utils.h"
+#include "log_utils.h"
+#include "tag_utils.h"
+#include "mac_utils.h"
+#include "p2p_utils.h"
+#include "mcast_utils.h"
+#include "neigh_utils.h"
+#include "crypt_utils.h"
+#include "coalesce_utils.h"
+#include "wire_utils.h"
+#include "stats_utils.h"
+#include "snap_utils.h"
+#include "qos_utils.h"
+#include "xdp_utils.h"
+#include "class_utils.h"
+#include "health_utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>      // Internet address manipulation
+#include <linux/filter.h>   // Classic BPF for reuseport steering
+
+#define U64_MAP_EMPTY 0                 ///< Marks an unused slot in a u64_map_t
+#define U64_MAP_USED (1ULL << 63)       ///< Set on every stored key so that key 0 stays usable
+#define U64_MAP_MIN_CAPACITY 64
+
+#define VSWITCH_DEFAULT_BATCH 64   ///< Datagrams per recvmmsg/sendmmsg unless overridden with -b
+#define VSWITCH_MAX_BATCH 1024     ///< Upper bound accepted for -b (UIO_MAXIOV)
+#define VSWITCH_SEG_BUF_SIZE (4 * OFFLOAD_MAX_DATAGRAM)  ///< Per-batch space for segmented super-frames
+#define VSWITCH_DEFAULT_MAC_AGE 300     ///< Seconds before an unseen MAC is forgotten, unless overridden with -a
+#define VSWITCH_DEFAULT_MAX_MACS 65536  ///< MAC table entry limit of each network unless overridden with -m
+#define VSWITCH_DEFAULT_MAX_NETS 64     ///< Networks created at most unless overridden with -n
+#define VSWITCH_DEFAULT_FLOOD_RATE 100  ///< Unknown unicast frames flooded per second and VPort unless overridden with -u
+#define VSWITCH_MAX_WORKERS 64          ///< Upper bound accepted for -w
+#define VSWITCH_MAX_PEERS 65536         ///< VPorts tracked at once; the peer array is never reallocated
+#define VSWITCH_PEER_NONE UINT32_MAX    ///< No peer (the peer array or the network limit is full)
+#define VSWITCH_HINT_SLOTS 1024         ///< Per-worker record of recent P2P hints, a power of two
+#define VSWITCH_CRYPT_BUF_SIZE (4 * OFFLOAD_MAX_DATAGRAM)  ///< Per-worker space for sealing a TX batch
+#define VSWITCH_CRYPT_SESSIONS 4096     ///< Receive sessions (VPorts) cached per worker, a power of two
+#define VSWITCH_BUNDLE_BUF_SIZE (4 * OFFLOAD_MAX_DATAGRAM)  ///< Per-worker space for bundling a TX batch
+#define VSWITCH_SNAPSHOT_INTERVAL 5     ///< Seconds between MAC table snapshots (-f)
+#define VSWITCH_MAX_RATE 100000         ///< Upper bound accepted for -r, in Mbit/s
+#define VSWITCH_CLASS_BATCH 64          ///< Frames classified and switched together; bundles may take several rounds
+#define VSWITCH_XDP_QUEUE 4096          ///< MAC changes waiting for the XDP map, a power of two
+#define VSWITCH_MAC_LOG 1024            ///< MAC changes per network waiting to be logged (-v), a power of two
+
+enum vswitch_steering_t
+{
+  VSWITCH_STEER_HASH,     ///< Default reuseport hash of the 4-tuple: one socket per VPort endpoint
+  VSWITCH_STEER_CPU,      ///< Socket of the worker pinned to the CPU that received the datagram
+  VSWITCH_STEER_SESSION,  ///< Encrypted mode: socket picked by the sender's session ID, whatever its endpoint
+};
+
+/*
+ Open-addressed (linear probing) hash map from a 63-bit key to a 32-bit value.
+ The capacity is always a power of two and the table is grown once it is half
+ full, which keeps probe sequences short.
+ */
+struct u64_map_t
+{
+  uint64_t *keys;      ///< Stored keys (with U64_MAP_USED set), U64_MAP_EMPTY if the slot is free
+  uint32_t *values;    ///< Value for the key in the same slot
+  uint32_t capacity;   ///< Number of slots, always a power of two
+  uint32_t size;       ///< Number of occupied slots
+};
+
+/*
+ One tenant network, named by the network ID of the wire header (0 for VPorts
+ without it): a broadcast domain of its own, whose tables only hold its own
+ hosts and whose flood list only its own VPorts. A network is created when
+ its first VPort shows up and never goes away, so its tables keep their
+ address.
+ */
+struct vswitch_mac_change_t
+{
+  uint64_t mac;
+  uint32_t peer;                 ///< Where the MAC lives now, MAC_PEER_NONE if it aged out or was forgotten
+};
+
+struct vswitch_net_t
+{
+  struct vswitch_t *vswitch;     ///< Owner, for the MAC table change callback
+  uint16_t id;                   ///< Network ID
+  struct mac_table_t mac_table;  ///< Packed MAC address -> index into peers
+  struct mcast_table_t mcast;    ///< Multicast group MAC -> subscribed peers
+  struct neigh_table_t neigh;    ///< IP address -> MAC, for the ARP/ND proxy
+  _Atomic uint32_t *flood_peers; ///< Peers with at least one MAC or sending keepalives: the broadcast destinations
+  _Atomic uint32_t nflood;       ///< Number of entries in flood_peers
+  struct vswitch_mac_change_t *changes;  ///< With -v: VSWITCH_MAC_LOG changes to log after the write section
+  _Atomic uint32_t changes_head;  ///< Next slot of 'changes' to write, under the MAC table's writer lock
+  _Atomic uint32_t changes_tail;  ///< Next slot of 'changes' to log, under changes_lock
+  _Atomic uint32_t changes_lost;  ///< Changes that found 'changes' full and were not logged
+  pthread_mutex_t changes_lock;
+};
+
+/*
+ A VPort endpoint. 'port_id' and 'net' never change once the peer is
+ registered, and 'endpoint' only for a VPort that sends the wire header,
+ when it shows up at a new address; 'mac_count' and 'flood_pos' only change
+ under the writer lock of the network's MAC table, mostly in its change
+ callback. 'loss', the unknown unicast bucket and the policer belong to the
+ worker that receives from the VPort.
+ */
+struct vswitch_peer_t
+{
+  uint64_t key;             ///< Key the peer is registered under, see peer_key() and peer_wire_key()
+  _Atomic uint64_t endpoint; ///< UDP endpoint of the VPort: IPv4 address << 16 | port, network byte order
+  uint16_t port_id;         ///< Port ID within a VPort daemon, 0 for a standalone VPort
+  struct vswitch_net_t *net; ///< Network the VPort belongs to
+  _Atomic bool wire;        ///< The VPort sends (and accepts) the wire header
+  _Atomic uint32_t tx_seq;  ///< Wire header: sequence number of the next datagram to the VPort
+  struct wire_loss_t loss;  ///< Wire header: datagrams from the VPort that never arrived
+  uint32_t loss_logged;     ///< Time loss was last logged
+  uint32_t flood_tokens;    ///< Unknown unicast frames the VPort may still have flooded
+  uint32_t flood_refill;    ///< Time flood_tokens was last refilled
+  struct qos_bucket_t police; ///< Bytes the VPort may still send under the rate limit (-r)
+  _Atomic bool offload;     ///< The VPort sends (and accepts) offload-encapsulated frames
+  _Atomic bool coalesce;    ///< The VPort sends (and so accepts) bundles
+  uint32_t mac_count;       ///< MAC table entries pointing at this VPort, plus one while it sends keepalives
+  uint32_t flood_pos;       ///< Position in flood_peers while mac_count > 0
+  _Atomic uint32_t hello;   ///< Time of the last P2P hello, 0 if the VPort never sent one
+  _Atomic uint32_t queried; ///< Time of the last IGMP/MLD query from the VPort, 0 if none
+  _Atomic uint32_t probed;  ///< Time of the last keepalive probe, 0 if none since the VPort was last forgotten
+};
+
+/*
+ State shared by all workers.
+ */
+struct vswitch_t
+{
+  struct vswitch_net_t **nets;   ///< Network ID -> network, NULL until a VPort joins it; under peers_lock
+  struct vswitch_net_t **net_list;  ///< The networks in the order they were created
+  _Atomic uint32_t nnets;        ///< Number of entries in net_list
+  uint32_t max_nets;             ///< Networks that may be created (-n)
+  uint32_t max_macs;             ///< MAC table entry limit of each network
+  bool neigh_proxy;              ///< Answer ARP requests and neighbour solicitations for known addresses
+  const struct crypt_key_t *crypt_key;  ///< Tunnel key (-k), NULL if datagrams travel in plaintext
+  struct u64_map_t peer_index;   ///< Packed (ip, port, port ID) -> index into peers, under peers_lock
+  pthread_mutex_t peers_lock;    ///< Serializes the registration of new peers
+  struct vswitch_peer_t *peers;  ///< VSWITCH_MAX_PEERS entries, of which npeers are in use
+  uint32_t npeers;               ///< Number of registered peers, under peers_lock
+  uint32_t mac_age;              ///< Seconds before an unseen MAC is removed
+  uint32_t flood_rate;           ///< Unknown unicast frames flooded per second and VPort (-u), 0 to discard them
+  uint64_t police_rate;          ///< Bytes per second each VPort may send (-r), 0 for no limit
+  bool prio;                     ///< Send TX batches in priority order (-P)
+  struct xdp_fastpath_t *xdp;    ///< XDP fast path (-X), NULL if off
+  uint64_t *xdp_queue;           ///< VSWITCH_XDP_QUEUE MACs whose map entry may be stale, under the MAC table lock
+  _Atomic uint32_t xdp_head;     ///< Next slot of xdp_queue to write
+  _Atomic uint32_t xdp_tail;     ///< Next slot of xdp_queue to apply, under xdp_lock
+  _Atomic bool xdp_resync;       ///< xdp_queue overflowed: every map entry needs a check
+  pthread_mutex_t xdp_lock;      ///< Serializes the bpf() calls that bring the map up to date
+  uint64_t *xdp_macs;            ///< Under xdp_lock: room for listing every MAC of the map or the table...
+  uint64_t *xdp_seen;            ///< ...and for when the XDP program last saw each
+  uint32_t xdp_capacity;         ///< Entries xdp_macs and xdp_seen have room for
+  uint32_t xdp_resync_count;     ///< Under xdp_lock: MACs of the table listed in xdp_macs so far
+  uint32_t xdp_refreshed;        ///< Worker 0: time the MAC table was last refreshed from the map
+  uint64_t xdp_refreshed_ns;     ///< The same, on the clock of the XDP program
+  unsigned int nworkers;         ///< Number of workers (and sockets)
+  uint64_t spin_ns;              ///< Busy-poll mode (-S): how long a worker polls after the last datagram, 0 if off
+  const char *snapshot;          ///< MAC table snapshot file (-f), NULL if none
+  uint32_t peer_timeout;         ///< Seconds after its last probe that a VPort with keepalives is forgotten (-K)
+  _Atomic uint64_t expired;      ///< VPorts forgotten for going silent
+  struct vswitch_worker_t *workers;  ///< The workers, for the metrics endpoint
+};
+
+/*
+ What one worker switched from and to one VPort. Only that worker writes
+ the counters; the metrics endpoint sums them over all workers.
+ */
+struct vswitch_peer_stats_t
+{
+  _Atomic uint64_t rx_frames;
+  _Atomic uint64_t rx_bytes;
+  _Atomic uint64_t tx_frames;
+  _Atomic uint64_t tx_bytes;
+};
+
+/*
+ A P2P hint recently sent by a worker, so that a flow which keeps hairpinning
+ (e.g. while the hint is on its way) triggers at most one hint per second.
+ */
+struct vswitch_hint_slot_t
+{
+  uint64_t key;    ///< Source peer << 48 | destination MAC
+  uint32_t sent;   ///< Time the hint was sent
+};
+
+/*
+ A frame whose datagram headers vswitch_parse() took apart, waiting for the
+ rest of its batch so that all of them are classified and switched in one
+ pass (class_utils.h).
+ */
+struct vswitch_pending_t
+{
+  struct frame_desc_t *frame;    ///< RX frame the datagram lies in
+  char *datagram;                ///< Past the wire header or port tag, at the offload header if encapsulated
+  int datagramsz;
+  const struct sockaddr_in *vport_addr;
+  uint64_t key;                  ///< Key of the sending VPort, see peer_key() and peer_wire_key()
+  uint16_t port_id;
+  uint16_t net_id;
+  bool wired;
+  bool bundled;
+  bool encapsulated;
+  struct wire_info_t wire;       ///< With 'wired': the parsed wire header
+  uint32_t src_peer;             ///< Filled in by vswitch_switch_pending()
+  uint64_t start;                ///< Stage timing: when the datagram began to be switched
+};
+
+/*
+ One switching thread with its own socket, rings and peer cache.
+ */
+struct vswitch_worker_t
+{
+  struct vswitch_t *vswitch;     ///< Shared state
+  unsigned int index;            ///< Position of the worker (and its socket) in bind order
+  int sockfd;                    ///< UDP socket bound to the service port
+  uint32_t now;                  ///< Coarse monotonic time in seconds, updated once per batch
+  uint64_t now_ns;               ///< Rate limiting (-r): monotonic time in nanoseconds, updated once per batch
+  uint32_t swept;                ///< Time of the last aging sweep (worker 0 only)
+  struct u64_map_t peer_cache;   ///< Peers this worker has looked up: packed key -> index into peers
+  struct mmsg_ring_t rx_ring;    ///< Preallocated receive batch
+  struct mmsg_ring_t tx_ring;    ///< Pending sends; iovecs point into rx_ring buffers or seg_buf
+  struct frame_desc_t **tx_frames;  ///< RX frame referenced by each TX slot, NULL for segments
+  bool *tx_coalesce;             ///< TX slot goes to a VPort that accepts bundles
+  unsigned int tx_coalescable;   ///< Number of TX slots with tx_coalesce set
+  uint8_t *tx_class;             ///< Priority mode (-P): class of each TX slot, else NULL
+  unsigned int tx_classes;       ///< Priority mode: bit mask of the classes queued
+  struct mmsghdr *tx_sorted;     ///< Priority mode: the TX batch in the order it is sent
+  char *bundle_buf;              ///< Bundles built at flush time
+  struct iovec *tx_iovs;         ///< Two iovecs per TX slot: port tag or wire header (if any) and datagram
+  char *tx_hdrs;                 ///< WIRE_HDR_LEN bytes per TX slot for its port tag or wire header
+  uint8_t *seg_buf;              ///< Segments of super-frames for peers without offload
+  size_t seg_used;               ///< Bytes of seg_buf referenced by tx_ring
+  struct vswitch_hint_slot_t *hints;  ///< VSWITCH_HINT_SLOTS recently sent hints
+  struct crypt_tx_t crypt_tx;    ///< Encrypted mode: this worker's sending session
+  struct crypt_rx_t crypt_rx;    ///< Encrypted mode: sessions of the VPorts this worker hears from
+  char *crypt_buf;               ///< Encrypted mode: sealed copies of the TX batch, else NULL
+  struct stats_t *stats;         ///< Counters of this worker
+  struct vswitch_peer_stats_t *peer_stats;  ///< Counters of this worker per peer, VSWITCH_MAX_PEERS entries
+  struct vswitch_pending_t *pending;  ///< Frames parsed but not yet switched, VSWITCH_CLASS_BATCH entries
+  const uint8_t **pending_ether; ///< Their Ethernet headers, for frame_classify()
+  uint32_t *pending_len;         ///< Their Ethernet frame lengths
+  struct frame_class_t *pending_class;  ///< What frame_classify() made of them
+  unsigned int npending;
+};
+
+// Function declarations
+void vswitch_init(struct vswitch_t *vswitch, unsigned int nworkers, uint32_t max_macs, uint32_t max_nets,
+                  uint32_t mac_age, bool neigh_proxy, const struct crypt_key_t *crypt_key, unsigned int spin_usecs,
+                  uint32_t flood_rate, unsigned int police_mbits, bool prio, uint32_t peer_timeout);
+void vswitch_run(struct vswitch_t *vswitch, int server_port, unsigned int batch, enum vswitch_steering_t steering,
+                 const char *metrics, const char *snapshot);
+static void vswitch_xdp_start(struct vswitch_t *vswitch, char *ifaces, int server_port);
+
+int main(int argc, char const *argv[])
+{
+  // Parse command line options
+  unsigned int batch = VSWITCH_DEFAULT_BATCH;  // Datagrams per syscall
+  int mac_age = VSWITCH_DEFAULT_MAC_AGE;
+  int max_macs = VSWITCH_DEFAULT_MAX_MACS;
+  int max_nets = VSWITCH_DEFAULT_MAX_NETS;
+  int flood_rate = VSWITCH_DEFAULT_FLOOD_RATE;
+  int nworkers = 1;
+  enum vswitch_steering_t steering = VSWITCH_STEER_HASH;
+  bool neigh_proxy = true;
+  const char *key_file = NULL;  // Encrypted mode: pre-shared tunnel key
+  const char *metrics = NULL;   // Serve counters on this address
+  int spin_usecs = 0;           // Busy-poll mode: spin this long before blocking
+  const char *snapshot = NULL;  // Save the MAC table here, and start from it
+  int police_mbits = 0;         // Rate limit of every VPort
+  bool prio = false;            // Priority queueing of TX batches
+  char *xdp_ifaces = NULL;      // Attach the XDP fast path to these interfaces
+  int peer_timeout = HEALTH_PEER_TIMEOUT;  // Forget VPorts that stop sending keepalives this long
+  int opt;
+  while ((opt = getopt(argc, (char *const *)argv, "b:w:s:a:m:n:u:Nk:M:TS:f:r:PX:K:Hv")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      batch = atoi(optarg);
+      break;
+    case 'w':
+      nworkers = atoi(optarg);
+      break;
+    case 's':
+      if (strcmp(optarg, "cpu") == 0)
+      {
+        steering = VSWITCH_STEER_CPU;
+      }
+      else if (strcmp(optarg, "hash") != 0)
+      {
+        ERROR_PRINT_THEN_EXIT("unknown steering: %s (expected hash or cpu)\n", optarg);
+      }
+      break;
+    case 'a':
+      mac_age = atoi(optarg);
+      break;
+    case 'm':
+      max_macs = atoi(optarg);
+      break;
+    case 'n':
+      max_nets = atoi(optarg);
+      break;
+    case 'u':
+      flood_rate = atoi(optarg);
+      break;
+    case 'N':
+      neigh_proxy = false;  // Flood ARP requests and neighbour solicitations like any broadcast
+      break;
+    case 'k':
+      key_file = optarg;
+      break;
+    case 'M':
+      metrics = optarg;
+      break;
+    case 'T':
+      stats_timing_start();  // Before any thread starts, so that all of them leave SIGUSR1 to its own
+      break;
+    case 'S':
+      spin_usecs = atoi(optarg);
+      break;
+    case 'f':
+      snapshot = optarg;
+      break;
+    case 'r':
+      police_mbits = atoi(optarg);
+      break;
+    case 'P':
+      prio = true;
+      break;
+    case 'X':
+      xdp_ifaces = optarg;
+      break;
+    case 'K':
+      peer_timeout = atoi(optarg);
+      break;
+    case 'H':
+      frame_pool_options |= FRAME_POOL_HUGEPAGES;  // Frame buffers on huge pages
+      break;
+    case 'v':
+      log_level++;  // -v: MAC learning, -vv: trace every frame
+      break;
+    default:
+      ERROR_PRINT_THEN_EXIT("Usage: vswitch [-b batch] [-w workers [-s hash|cpu]] [-a mac_age] [-m max_macs] [-n max_nets] [-u flood_rate] [-N] [-k keyfile] [-M [ip:]port|path] [-T] [-S usecs] [-f snapshot] [-r mbits] [-P] [-X ifaces] [-K secs] [-H] [-v] {VSWITCH_PORT}\n"
+                            "  -K secs must allow %d probe intervals of every VPort (vport -K)\n"
+                            "  -k steers workers by session and is refused with -s cpu\n",
+                            HEALTH_DEAD_PROBES);
+    }
+  }
+
+  // Validate command line arguments
+  if (argc - optind != 1 || batch < 1 || batch > VSWITCH_MAX_BATCH || mac_age < 1 || max_macs < 1 || flood_rate < 0 ||
+      max_nets < 1 || max_nets > WIRE_MAX_NET_ID + 1 || nworkers < 1 || nworkers > VSWITCH_MAX_WORKERS ||
+      spin_usecs < 0 || police_mbits < 0 || police_mbits > VSWITCH_MAX_RATE ||
+      (xdp_ifaces && (key_file || police_mbits)) || (key_file && steering == VSWITCH_STEER_CPU) || peer_timeout < 1)
+  {
+    ERROR_PRINT_THEN_EXIT("Usage: vswitch [-b batch] [-w workers [-s hash|cpu]] [-a mac_age] [-m max_macs] [-n max_nets] [-u flood_rate] [-N] [-k keyfile] [-M [ip:]port|path] [-T] [-S usecs] [-f snapshot] [-r mbits] [-P] [-X ifaces] [-K secs] [-H] [-v] {VSWITCH_PORT}\n"
+                          "  -K secs must allow %d probe intervals of every VPort (vport -K)\n"
+                          "  -k steers workers by session and is refused with -s cpu\n",
+                          HEALTH_DEAD_PROBES);
+  }
+  if (key_file)
+  {
+    steering = VSWITCH_STEER_SESSION;  // A session's replay window lives in one worker
+  }
+
+  int server_port = atoi(argv[optind]);
+
+  struct vswitch_t vswitch;
+  struct crypt_key_t crypt_key;
+  if (key_file)
+  {
+    crypt_key_load(&crypt_key, key_file);
+  }
+  vswitch_init(&vswitch, nworkers, max_macs, max_nets, mac_age, neigh_proxy, key_file ? &crypt_key : NULL, spin_usecs,
+               flood_rate, police_mbits, prio, peer_timeout);
+  if (xdp_ifaces)
+  {
+    vswitch_xdp_start(&vswitch, xdp_ifaces, server_port);
+  }
+
+  // Frame records are formatted off the switching thread
+  if (log_level >= LOG_FRAMES)
+  {
+    trace_start();
+  }
+  vswitch_run(&vswitch, server_port, batch, steering, metrics, snapshot);
+
+  return 0;
+}
+
+static inline uint32_t u64_hash(uint64_t key)
+{
+  // Fibonacci hashing: multiply by 2^64 / phi and keep the high bits
+  return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static void u64_map_init(struct u64_map_t *map, uint32_t capacity)
+{
+  map->keys = calloc(capacity, sizeof(*map->keys));
+  map->values = calloc(capacity, sizeof(*map->values));
+  if (map->keys == NULL || map->values == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  map->capacity = capacity;
+  map->size = 0;
+}
+
+/*
+ Returns the slot holding 'key', or the empty slot where it would be inserted.
+ */
+static uint32_t u64_map_slot(const struct u64_map_t *map, uint64_t key)
+{
+  uint32_t mask = map->capacity - 1;
+  uint32_t slot = u64_hash(key) & mask;
+  uint64_t stored = key | U64_MAP_USED;
+
+  while (map->keys[slot] != U64_MAP_EMPTY && map->keys[slot] != stored)
+  {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static bool u64_map_get(const struct u64_map_t *map, uint64_t key, uint32_t *value)
+{
+  uint32_t slot = u64_map_slot(map, key);
+  if (map->keys[slot] == U64_MAP_EMPTY)
+  {
+    return false;
+  }
+  *value = map->values[slot];
+  return true;
+}
+
+static void u64_map_put(struct u64_map_t *map, uint64_t key, uint32_t value)
+{
+  // Grow and rehash before the table gets more than half full
+  if ((map->size + 1) * 2 > map->capacity)
+  {
+    struct u64_map_t grown;
+    u64_map_init(&grown, map->capacity * 2);
+    for (uint32_t i = 0; i < map->capacity; i++)
+    {
+      if (map->keys[i] != U64_MAP_EMPTY)
+      {
+        uint32_t slot = u64_map_slot(&grown, map->keys[i] & ~U64_MAP_USED);
+        grown.keys[slot] = map->keys[i];
+        grown.values[slot] = map->values[i];
+        grown.size++;
+      }
+    }
+    free(map->keys);
+    free(map->values);
+    *map = grown;
+  }
+
+  uint32_t slot = u64_map_slot(map, key);
+  if (map->keys[slot] == U64_MAP_EMPTY)
+  {
+    map->keys[slot] = key | U64_MAP_USED;
+    map->size++;
+  }
+  map->values[slot] = value;
+}
+
+static inline uint64_t endpoint_pack(const struct sockaddr_in *addr)
+{
+  return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static inline uint64_t peer_key(const struct sockaddr_in *addr, uint16_t port_id)
+{
+  return ((uint64_t)port_id << 48) | endpoint_pack(addr);
+}
+
+/*
+ Key of a VPort that sends the wire header: its sender ID stands in for the
+ address, and the port number 0, which no datagram arrives from, keeps it
+ apart from every key peer_key() makes.
+ */
+static inline uint64_t peer_wire_key(uint32_t sender, uint16_t port_id)
+{
+  return ((uint64_t)port_id << 48) | ((uint64_t)sender << 16);
+}
+
+static inline struct sockaddr_in vswitch_peer_addr(const struct vswitch_peer_t *p)
+{
+  uint64_t endpoint = atomic_load_explicit(&p->endpoint, memory_order_relaxed);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = (in_port_t)(endpoint & 0xffff),
+                             .sin_addr.s_addr = (in_addr_t)(endpoint >> 16)};
+  return addr;
+}
+
+static inline uint32_t vswitch_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)ts.tv_sec;
+}
+
+static inline uint64_t vswitch_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ Busy-poll mode: returns true while a worker that found no datagrams should
+ poll again rather than block, i.e. for spin_ns after it first found none.
+ '*idle_since' is the time that happened, 0 while there is traffic.
+ */
+static inline bool vswitch_spin(const struct vswitch_t *vswitch, uint64_t *idle_since)
+{
+  if (vswitch->spin_ns == 0)
+  {
+    return false;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (*idle_since == 0)
+  {
+    *idle_since = now;
+  }
+  return now - *idle_since < vswitch->spin_ns;
+}
+
+static void vswitch_mac_changed(void *ctx, uint64_t mac, uint32_t old_peer, uint32_t new_peer);
+
+void vswitch_init(struct vswitch_t *vswitch, unsigned int nworkers, uint32_t max_macs, uint32_t max_nets,
+                  uint32_t mac_age, bool neigh_proxy, const struct crypt_key_t *crypt_key, unsigned int spin_usecs,
+                  uint32_t flood_rate, unsigned int police_mbits, bool prio, uint32_t peer_timeout)
+{
+  atomic_init(&vswitch->nnets, 0);
+  vswitch->max_nets = max_nets;
+  vswitch->max_macs = max_macs;
+  vswitch->neigh_proxy = neigh_proxy;
+  vswitch->crypt_key = crypt_key;
+  u64_map_init(&vswitch->peer_index, U64_MAP_MIN_CAPACITY);
+  pthread_mutex_init(&vswitch->peers_lock, NULL);
+  vswitch->npeers = 0;
+  vswitch->mac_age = mac_age;
+  vswitch->flood_rate = flood_rate;
+  vswitch->police_rate = police_mbits * 125000ULL;  // Mbit/s to bytes per second
+  vswitch->prio = prio;
+  vswitch->xdp = NULL;
+  atomic_init(&vswitch->xdp_head, 0);
+  atomic_init(&vswitch->xdp_tail, 0);
+  atomic_init(&vswitch->xdp_resync, false);
+  pthread_mutex_init(&vswitch->xdp_lock, NULL);
+  vswitch->nworkers = nworkers;
+  vswitch->spin_ns = spin_usecs * 1000ULL;
+  vswitch->snapshot = NULL;
+  vswitch->peer_timeout = peer_timeout;
+  atomic_init(&vswitch->expired, 0);
+  vswitch->workers = NULL;
+
+  // Workers index the peer array without locking, so it is allocated once at its final size
+  vswitch->peers = calloc(VSWITCH_MAX_PEERS, sizeof(*vswitch->peers));
+  vswitch->nets = calloc(WIRE_MAX_NET_ID + 1, sizeof(*vswitch->nets));
+  vswitch->net_list = calloc(WIRE_MAX_NET_ID + 1, sizeof(*vswitch->net_list));
+  if (vswitch->peers == NULL || vswitch->nets == NULL || vswitch->net_list == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+}
+
+/*
+ Creates the workers' UDP sockets, bound to the service port on all
+ interfaces. Several workers share the port through SO_REUSEPORT; by default
+ the kernel picks their socket by hashing the 4-tuple, so each VPort endpoint
+ sticks to one worker. VSWITCH_STEER_CPU attaches a classic BPF program that
+ picks the socket of the worker pinned to the receiving CPU instead, which
+ keeps a datagram on the core that took it off the network (and in order as
+ long as each VPort's traffic is received on one CPU). VSWITCH_STEER_SESSION
+ picks it by the session ID of a sealed datagram: each worker keeps its own
+ replay windows, so a session must reach the same one from wherever it is
+ sent, or a datagram replayed from another endpoint would pass.
+ */
+static void vswitch_open_sockets(int *sockfds, unsigned int nworkers, int server_port,
+                                 enum vswitch_steering_t steering)
+{
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  for (unsigned int w = 0; w < nworkers; w++)
+  {
+    int one = 1;
+    if ((sockfds[w] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to socket: %s\n", strerror(errno));
+    }
+    if (nworkers > 1 && setsockopt(sockfds[w], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+    }
+    if (bind(sockfds[w], (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to bind: %s\n", strerror(errno));
+    }
+
+    // Wake up at least once a second so MAC entries age even when nothing arrives
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    if (setsockopt(sockfds[w], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to setsockopt SO_RCVTIMEO: %s\n", strerror(errno));
+    }
+  }
+
+  if (nworkers > 1 && steering != VSWITCH_STEER_HASH)
+  {
+    // Reuseport programs run with the packet positioned at the UDP payload and return the index of the socket
+    // (in bind order) that receives it. A datagram too short to hold the session ID goes to the first one.
+    uint32_t load = steering == VSWITCH_STEER_CPU ? SKF_AD_OFF + SKF_AD_CPU
+                                                  : offsetof(struct crypt_hdr_t, session) + CRYPT_SESSION_LEN - 4;
+    struct sock_filter steer_code[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, load),        // A = receiving CPU, or session ID bytes 4..7
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nworkers),   // A %= workers
+      BPF_STMT(BPF_RET | BPF_A, 0),                    // Deliver to socket A
+    };
+    struct sock_fprog steer_prog = {.len = sizeof(steer_code) / sizeof(steer_code[0]), .filter = steer_code};
+    if (setsockopt(sockfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &steer_prog, sizeof(steer_prog)) < 0)
+    {
+      fprintf(stderr, "fail to attach reuseport steering program: %s\n", strerror(errno));
+    }
+  }
+}
+
+static void vswitch_worker_init(struct vswitch_worker_t *worker, struct vswitch_t *vswitch, unsigned int index,
+                                int sockfd, unsigned int batch)
+{
+  worker->vswitch = vswitch;
+  worker->index = index;
+  worker->sockfd = sockfd;
+  udp_pmtu_discover(sockfd);  // Jumbo frames cross in one piece wherever the path carries them
+  if (vswitch->spin_ns > 0)
+  {
+    udp_busy_poll(sockfd, vswitch->spin_ns / 1000);
+  }
+  worker->now = vswitch_clock();
+  worker->now_ns = vswitch_clock_ns();
+  worker->swept = worker->now;
+  u64_map_init(&worker->peer_cache, U64_MAP_MIN_CAPACITY);
+
+  // The TX ring has no buffers of its own: queued sends reference received frames.
+  // It is sized at twice the batch (plus one segmented super-frame) so that a
+  // flood rarely forces a mid-batch flush.
+  // Receive buffers take any datagram, as offload VPorts send super-frames.
+  // The spare RX buffers cover a whole batch whose frames are still queued for TX.
+  mmsg_ring_init(&worker->rx_ring, batch, OFFLOAD_MAX_DATAGRAM, batch);
+  mmsg_ring_init(&worker->tx_ring, batch * 2 + OFFLOAD_MAX_SEGS, 0, 0);
+  worker->tx_iovs = calloc(worker->tx_ring.capacity * 2, sizeof(*worker->tx_iovs));
+  worker->tx_hdrs = malloc(worker->tx_ring.capacity * WIRE_HDR_LEN);
+  worker->tx_frames = calloc(worker->tx_ring.capacity, sizeof(*worker->tx_frames));
+  worker->tx_coalesce = calloc(worker->tx_ring.capacity, sizeof(*worker->tx_coalesce));
+  worker->bundle_buf = malloc(VSWITCH_BUNDLE_BUF_SIZE);
+  worker->tx_coalescable = 0;
+  worker->tx_class = NULL;
+  worker->tx_classes = 0;
+  worker->tx_sorted = NULL;
+  if (vswitch->prio)
+  {
+    worker->tx_class = calloc(worker->tx_ring.capacity, sizeof(*worker->tx_class));
+    worker->tx_sorted = calloc(worker->tx_ring.capacity, sizeof(*worker->tx_sorted));
+  }
+  if ((vswitch->prio && (worker->tx_class == NULL || worker->tx_sorted == NULL)) || worker->tx_iovs == NULL ||
+      worker->tx_hdrs == NULL || worker->tx_frames == NULL || worker->tx_coalesce == NULL || worker->bundle_buf == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to allocate TX ring: %s\n", strerror(errno));
+  }
+  for (unsigned int i = 0; i < worker->tx_ring.capacity; i++)
+  {
+    worker->tx_ring.msgs[i].msg_hdr.msg_iov = &worker->tx_iovs[i * 2];
+  }
+  if ((worker->seg_buf = malloc(VSWITCH_SEG_BUF_SIZE)) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+  }
+  worker->seg_used = 0;
+  if ((worker->hints = calloc(VSWITCH_HINT_SLOTS, sizeof(*worker->hints))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  worker->crypt_buf = NULL;
+  if (vswitch->crypt_key != NULL)
+  {
+    crypt_tx_init(&worker->crypt_tx, vswitch->crypt_key);
+    crypt_rx_init(&worker->crypt_rx, vswitch->crypt_key, VSWITCH_CRYPT_SESSIONS);
+    if ((worker->crypt_buf = malloc(VSWITCH_CRYPT_BUF_SIZE)) == NULL)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+    }
+  }
+
+  char labels[STATS_LABELS_LEN];
+  snprintf(labels, sizeof(labels), "worker=\"%u\"", index);
+  worker->stats = stats_create(labels);
+  if ((worker->peer_stats = calloc(VSWITCH_MAX_PEERS, sizeof(*worker->peer_stats))) == NULL ||
+      (worker->pending = calloc(VSWITCH_CLASS_BATCH, sizeof(*worker->pending))) == NULL ||
+      (worker->pending_ether = calloc(VSWITCH_CLASS_BATCH, sizeof(*worker->pending_ether))) == NULL ||
+      (worker->pending_len = calloc(VSWITCH_CLASS_BATCH, sizeof(*worker->pending_len))) == NULL ||
+      (worker->pending_class = calloc(VSWITCH_CLASS_BATCH, sizeof(*worker->pending_class))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  worker->npending = 0;
+}
+
+/*
+ Returns network 'net_id', creating it if no VPort joined it before, or NULL
+ if that would exceed max_nets. Must be called with peers_lock held.
+ */
+static struct vswitch_net_t *vswitch_net_get(struct vswitch_t *vswitch, uint16_t net_id)
+{
+  struct vswitch_net_t *net = vswitch->nets[net_id];
+  if (net != NULL)
+  {
+    return net;
+  }
+  if (atomic_load_explicit(&vswitch->nnets, memory_order_relaxed) == vswitch->max_nets)
+  {
+    LOG_PRINT(LOG_INFO, "[VSwitch] Network %u refused: %u networks exist already\n", net_id, vswitch->max_nets);
+    return NULL;
+  }
+  net = calloc(1, sizeof(*net));
+  if (net == NULL || (net->flood_peers = calloc(VSWITCH_MAX_PEERS, sizeof(*net->flood_peers))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  net->vswitch = vswitch;
+  net->id = net_id;
+  mac_table_init(&net->mac_table, vswitch->max_macs, vswitch_mac_changed, net);
+  mcast_table_init(&net->mcast);
+  neigh_table_init(&net->neigh);
+  atomic_init(&net->nflood, 0);
+  net->changes = NULL;
+  atomic_init(&net->changes_head, 0);
+  atomic_init(&net->changes_tail, 0);
+  atomic_init(&net->changes_lost, 0);
+  pthread_mutex_init(&net->changes_lock, NULL);
+  if (log_level >= LOG_INFO && (net->changes = calloc(VSWITCH_MAC_LOG, sizeof(*net->changes))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+
+  // The aging sweep, the snapshot and the metrics walk net_list without the lock
+  vswitch->nets[net_id] = net;
+  uint32_t nnets = atomic_load_explicit(&vswitch->nnets, memory_order_relaxed);
+  vswitch->net_list[nnets] = net;
+  atomic_store_explicit(&vswitch->nnets, nnets + 1, memory_order_release);
+  LOG_PRINT(LOG_INFO, "[VSwitch] Network %u created\n", net_id);
+  return net;
+}
+
+/*
+ Returns the index of the peer with key 'key' in the shared registry,
+ registering it at 'addr' on network 'net_id' if it is new, or
+ VSWITCH_PEER_NONE if the peer array is full or the network cannot be
+ created.
+ */
+static uint32_t vswitch_peer_register(struct vswitch_t *vswitch, uint64_t key, const struct sockaddr_in *addr,
+                                      uint16_t port_id, uint16_t net_id)
+{
+  uint32_t peer;
+  pthread_mutex_lock(&vswitch->peers_lock);
+  if (!u64_map_get(&vswitch->peer_index, key, &peer))
+  {
+    struct vswitch_net_t *net = NULL;
+    if (vswitch->npeers == VSWITCH_MAX_PEERS || (net = vswitch_net_get(vswitch, net_id)) == NULL)
+    {
+      pthread_mutex_unlock(&vswitch->peers_lock);
+      return VSWITCH_PEER_NONE;
+    }
+    peer = vswitch->npeers++;
+    vswitch->peers[peer].key = key;
+    atomic_init(&vswitch->peers[peer].endpoint, endpoint_pack(addr));
+    vswitch->peers[peer].port_id = port_id;
+    vswitch->peers[peer].net = net;
+    vswitch->peers[peer].mac_count = 0;
+    memset(&vswitch->peers[peer].police, 0, sizeof(vswitch->peers[peer].police));
+    atomic_init(&vswitch->peers[peer].offload, false);
+    atomic_init(&vswitch->peers[peer].coalesce, false);
+    atomic_init(&vswitch->peers[peer].wire, false);
+    atomic_init(&vswitch->peers[peer].tx_seq, 0);
+    memset(&vswitch->peers[peer].loss, 0, sizeof(vswitch->peers[peer].loss));
+    atomic_init(&vswitch->peers[peer].hello, 0);
+    atomic_init(&vswitch->peers[peer].queried, 0);
+    atomic_init(&vswitch->peers[peer].probed, 0);
+    u64_map_put(&vswitch->peer_index, key, peer);
+  }
+  pthread_mutex_unlock(&vswitch->peers_lock);
+  return peer;
+}
+
+/*
+ Returns the index of the peer with key 'key' (see peer_key() and
+ peer_wire_key()), registering it at 'addr' on network 'net_id' on first
+ sight, or VSWITCH_PEER_NONE if the peer array is full.
+ */
+static uint32_t vswitch_peer_get(struct vswitch_worker_t *worker, uint64_t key, const struct sockaddr_in *addr,
+                                 uint16_t port_id, uint16_t net_id)
+{
+  uint32_t peer;
+  if (u64_map_get(&worker->peer_cache, key, &peer))
+  {
+    return peer;
+  }
+
+  // First frame from this VPort on this worker: consult (or extend) the shared registry
+  peer = vswitch_peer_register(worker->vswitch, key, addr, port_id, net_id);
+  if (peer != VSWITCH_PEER_NONE)
+  {
+    u64_map_put(&worker->peer_cache, key, peer);
+  }
+  return peer;
+}
+
+/*
+ Adjusts the number of MACs behind 'peer', keeping the flood list of its
+ network (the peers with at least one MAC) up to date so broadcasts never
+ scan idle peers. Broadcasts read the list without locking; one that races a
+ change may miss or repeat the peer being moved, like a frame racing a MAC
+ move.
+ */
+static void vswitch_count_mac(struct vswitch_net_t *net, uint32_t peer, int delta)
+{
+  struct vswitch_peer_t *p = &net->vswitch->peers[peer];
+  uint32_t nflood = atomic_load_explicit(&net->nflood, memory_order_relaxed);
+  if (delta > 0 && p->mac_count++ == 0)
+  {
+    p->flood_pos = nflood;
+    atomic_store_explicit(&net->flood_peers[nflood], peer, memory_order_relaxed);
+    atomic_store_explicit(&net->nflood, nflood + 1, memory_order_release);
+  }
+  else if (delta < 0 && --p->mac_count == 0)
+  {
+    // Swap the last entry into the gap
+    uint32_t last = atomic_load_explicit(&net->flood_peers[nflood - 1], memory_order_relaxed);
+    atomic_store_explicit(&net->flood_peers[p->flood_pos], last, memory_order_relaxed);
+    net->vswitch->peers[last].flood_pos = p->flood_pos;
+    atomic_store_explicit(&net->nflood, nflood - 1, memory_order_release);
+  }
+}
+
+/*
+ XDP fast path: points the map entry of a MAC of the default network at
+ 'peer' if the program can forward to it, a standalone VPort without the
+ wire header, and removes the entry otherwise, so that such frames keep
+ coming up to the workers. Under xdp_lock.
+ */
+static void vswitch_xdp_update(struct vswitch_t *vswitch, uint64_t mac, uint32_t peer)
+{
+  const struct vswitch_peer_t *p = peer != MAC_PEER_NONE ? &vswitch->peers[peer] : NULL;
+  if (p != NULL && p->port_id == 0 && !atomic_load_explicit(&p->wire, memory_order_relaxed))
+  {
+    struct sockaddr_in addr = vswitch_peer_addr(p);
+    xdp_fastpath_set(vswitch->xdp, mac, &addr);
+  }
+  else
+  {
+    xdp_fastpath_set(vswitch->xdp, mac, NULL);
+  }
+}
+
+/*
+ XDP fast path: brings the map entry of 'mac' in line with the MAC table of
+ the default network as it is now. Under xdp_lock.
+ */
+static void vswitch_xdp_apply(struct vswitch_t *vswitch, uint64_t mac)
+{
+  // The default network exists: it was created before any of its MACs was queued
+  struct vswitch_net_t *net = vswitch->nets[0];
+  uint32_t peer;
+  if (net == NULL || !mac_table_lookup(&net->mac_table, mac, &peer))
+  {
+    peer = MAC_PEER_NONE;
+  }
+  vswitch_xdp_update(vswitch, mac, peer);
+}
+
+/*
+ XDP fast path: queues 'mac' for its map entry to be brought up to date
+ once the write section of the MAC table ends; a bpf() call inside it would
+ keep every lookup spinning. Called from the change callback, so with the
+ MAC table's writer lock held, which makes this the only producer. A full
+ queue has the whole map checked instead.
+ */
+static void vswitch_xdp_queue(struct vswitch_t *vswitch, uint64_t mac)
+{
+  uint32_t head = atomic_load_explicit(&vswitch->xdp_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&vswitch->xdp_tail, memory_order_acquire) == VSWITCH_XDP_QUEUE)
+  {
+    atomic_store_explicit(&vswitch->xdp_resync, true, memory_order_release);
+    return;
+  }
+  vswitch->xdp_queue[head & (VSWITCH_XDP_QUEUE - 1)] = mac;
+  atomic_store_explicit(&vswitch->xdp_head, head + 1, memory_order_release);
+}
+
+static void vswitch_xdp_list_mac(void *ctx, uint64_t mac, uint32_t peer, uint32_t seen)
+{
+  (void)peer;
+  (void)seen;
+  struct vswitch_t *vswitch = ctx;
+  if (vswitch->xdp_resync_count < vswitch->xdp_capacity)
+  {
+    vswitch->xdp_macs[vswitch->xdp_resync_count++] = mac;
+  }
+}
+
+/*
+ XDP fast path: checks every entry of the map, and every MAC of the table,
+ after changes were lost to a full queue. Under xdp_lock.
+ */
+static void vswitch_xdp_resync(struct vswitch_t *vswitch)
+{
+  fprintf(stderr, "XDP map fell behind the MAC table, checking all of it\n");
+  uint32_t count = xdp_fastpath_walk(vswitch->xdp, vswitch->xdp_macs, vswitch->xdp_seen, vswitch->xdp_capacity);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    vswitch_xdp_apply(vswitch, vswitch->xdp_macs[i]);  // Moved or gone since
+  }
+  struct vswitch_net_t *net = vswitch->nets[0];
+  if (net != NULL)
+  {
+    vswitch->xdp_resync_count = 0;
+    mac_table_walk(&net->mac_table, vswitch_xdp_list_mac, vswitch);
+    for (uint32_t i = 0; i < vswitch->xdp_resync_count; i++)
+    {
+      vswitch_xdp_apply(vswitch, vswitch->xdp_macs[i]);  // Learned since
+    }
+  }
+}
+
+/*
+ XDP fast path: applies the MAC changes queued so far, unless another
+ worker is at it already. Called outside any MAC table write section.
+ */
+static void vswitch_xdp_sync(struct vswitch_t *vswitch)
+{
+  // Checked again after unlocking, for a change queued while the previous round was finishing
+  while ((atomic_load_explicit(&vswitch->xdp_head, memory_order_acquire) !=
+              atomic_load_explicit(&vswitch->xdp_tail, memory_order_relaxed) ||
+          atomic_load_explicit(&vswitch->xdp_resync, memory_order_relaxed)) &&
+         pthread_mutex_trylock(&vswitch->xdp_lock) == 0)
+  {
+    if (atomic_exchange_explicit(&vswitch->xdp_resync, false, memory_order_acquire))
+    {
+      vswitch_xdp_resync(vswitch);
+    }
+    uint32_t head = atomic_load_explicit(&vswitch->xdp_head, memory_order_acquire);
+    for (uint32_t tail = atomic_load_explicit(&vswitch->xdp_tail, memory_order_relaxed); tail != head; tail++)
+    {
+      uint64_t mac = vswitch->xdp_queue[tail & (VSWITCH_XDP_QUEUE - 1)];
+      atomic_store_explicit(&vswitch->xdp_tail, tail + 1, memory_order_release);
+      vswitch_xdp_apply(vswitch, mac);
+    }
+    pthread_mutex_unlock(&vswitch->xdp_lock);
+  }
+}
+
+/*
+ XDP fast path: refreshes the MAC table entries of the source MACs the
+ program forwarded frames from since the last refresh, so that they do not
+ age out while their frames bypass the workers. Every quarter of the age
+ limit is enough, as the program stamps active MACs every second. Worker 0.
+ */
+static void vswitch_xdp_refresh(struct vswitch_worker_t *worker)
+{
+  struct vswitch_t *vswitch = worker->vswitch;
+  struct vswitch_net_t *net = vswitch->nets[0];
+  if (net == NULL || worker->now - vswitch->xdp_refreshed < vswitch->mac_age / 4)
+  {
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t since = vswitch->xdp_refreshed_ns;
+  vswitch->xdp_refreshed = worker->now;
+  vswitch->xdp_refreshed_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+  pthread_mutex_lock(&vswitch->xdp_lock);
+  uint32_t count = xdp_fastpath_walk(vswitch->xdp, vswitch->xdp_macs, vswitch->xdp_seen, vswitch->xdp_capacity);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (vswitch->xdp_seen[i] >= since && vswitch->xdp_seen[i] != 0)
+    {
+      mac_table_touch(&net->mac_table, vswitch->xdp_macs[i], worker->now);
+    }
+  }
+  pthread_mutex_unlock(&vswitch->xdp_lock);
+}
+
+/*
+ With -v: logs the MAC changes of 'net' queued so far, unless another thread
+ is at it already. Called outside any MAC table write section, as a printf()
+ blocked on a full stdout would keep every lookup in it spinning.
+ */
+static void vswitch_log_changes(struct vswitch_net_t *net)
+{
+  while (net->changes != NULL &&
+         atomic_load_explicit(&net->changes_head, memory_order_acquire) !=
+             atomic_load_explicit(&net->changes_tail, memory_order_relaxed) &&
+         pthread_mutex_trylock(&net->changes_lock) == 0)
+  {
+    uint32_t head = atomic_load_explicit(&net->changes_head, memory_order_acquire);
+    for (uint32_t tail = atomic_load_explicit(&net->changes_tail, memory_order_relaxed); tail != head; tail++)
+    {
+      struct vswitch_mac_change_t change = net->changes[tail & (VSWITCH_MAC_LOG - 1)];
+      atomic_store_explicit(&net->changes_tail, tail + 1, memory_order_release);
+      if (change.peer == MAC_PEER_NONE)
+      {
+        LOG_PRINT(LOG_INFO, "[VSwitch] MAC aged out: %012llx network %u\n", (unsigned long long)change.mac,
+                  net->id);
+        continue;
+      }
+      struct vswitch_peer_t *p = &net->vswitch->peers[change.peer];
+      struct sockaddr_in addr = vswitch_peer_addr(p);
+      LOG_PRINT(LOG_INFO, "[VSwitch] MAC learned: %012llx -> %s:%d port %u network %u\n",
+                (unsigned long long)change.mac, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), p->port_id,
+                net->id);
+    }
+    uint32_t lost = atomic_exchange_explicit(&net->changes_lost, 0, memory_order_relaxed);
+    if (lost > 0)
+    {
+      LOG_PRINT(LOG_INFO, "[VSwitch] %u MAC changes not logged on network %u, the queue was full\n", lost, net->id);
+    }
+    pthread_mutex_unlock(&net->changes_lock);
+  }
+}
+
+/*
+ Called by the MAC table, with its writer lock held and inside its write
+ section, whenever an entry is added, moves to another peer or ages out.
+ Anything slow is queued for after the section: the XDP map update and,
+ with -v, the log line.
+ */
+static void vswitch_mac_changed(void *ctx, uint64_t mac, uint32_t old_peer, uint32_t new_peer)
+{
+  struct vswitch_net_t *net = (struct vswitch_net_t *)ctx;
+  if (net->vswitch->xdp != NULL && net->id == 0)
+  {
+    vswitch_xdp_queue(net->vswitch, mac);
+  }
+  if (net->changes != NULL)
+  {
+    uint32_t head = atomic_load_explicit(&net->changes_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&net->changes_tail, memory_order_acquire) == VSWITCH_MAC_LOG)
+    {
+      atomic_fetch_add_explicit(&net->changes_lost, 1, memory_order_relaxed);
+    }
+    else
+    {
+      net->changes[head & (VSWITCH_MAC_LOG - 1)] = (struct vswitch_mac_change_t){.mac = mac, .peer = new_peer};
+      atomic_store_explicit(&net->changes_head, head + 1, memory_order_release);
+    }
+  }
+  if (old_peer != MAC_PEER_NONE)
+  {
+    vswitch_count_mac(net, old_peer, -1);
+  }
+  if (new_peer != MAC_PEER_NONE)
+  {
+    vswitch_count_mac(net, new_peer, 1);
+  }
+}
+
+/*
+ Inserts or updates the entry for 'mac', of mac_hash() 'hash', in the MAC
+ table of the network of 'peer' so that it points at 'peer'.
+ */
+static void vswitch_learn(struct vswitch_worker_t *worker, uint64_t mac, uint32_t hash, uint32_t peer)
+{
+  struct vswitch_net_t *net = worker->vswitch->peers[peer].net;
+  enum mac_learn_t result = mac_table_learn_hashed(&net->mac_table, mac, hash, peer, worker->now);
+  if (result == MAC_LEARN_FULL)
+  {
+    LOG_PRINT(LOG_INFO, "[VSwitch] MAC table of network %u full, not learned: %012llx\n", net->id,
+              (unsigned long long)mac);
+  }
+  else if (result != MAC_LEARN_KNOWN)
+  {
+    vswitch_log_changes(net);
+    if (worker->vswitch->xdp != NULL)
+    {
+      vswitch_xdp_sync(worker->vswitch);
+    }
+  }
+}
+
+/*
+ Encrypted mode: seals the 'count' datagrams of 'msgs' (the TX batch) into
+ crypt_buf, pointing each message at its sealed copy, and sends them. A
+ batch that does not fit in crypt_buf goes out in several sendmmsg() runs.
+ Returns the number of datagrams sent in full.
+ */
+static int vswitch_seal_and_send(struct vswitch_worker_t *worker, struct mmsghdr *msgs, unsigned int count)
+{
+  unsigned int start = 0;
+  size_t used = 0;
+  int sent = 0;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    struct msghdr *msg = &msgs[i].msg_hdr;
+    size_t len = CRYPT_OVERHEAD;
+    for (size_t j = 0; j < msg->msg_iovlen; j++)
+    {
+      len += msg->msg_iov[j].iov_len;
+    }
+    if (used + len > VSWITCH_CRYPT_BUF_SIZE)
+    {
+      sent += mmsg_send(worker->sockfd, msgs + start, i - start);
+      start = i;
+      used = 0;
+    }
+
+    char *sealed = worker->crypt_buf + used;
+    msg->msg_iov[0].iov_len = crypt_seal(&worker->crypt_tx, sealed, msg->msg_iov, msg->msg_iovlen);
+    msg->msg_iov[0].iov_base = sealed;
+    msg->msg_iovlen = 1;
+    used += len;
+  }
+  sent += mmsg_send(worker->sockfd, msgs + start, count - start);
+  return sent;
+}
+
+static inline size_t vswitch_msg_len(const struct msghdr *msg)
+{
+  size_t len = 0;
+  for (size_t j = 0; j < msg->msg_iovlen; j++)
+  {
+    len += msg->msg_iov[j].iov_len;
+  }
+  return len;
+}
+
+/*
+ Packs the small datagrams queued for each coalescing VPort endpoint into
+ bundles, compacting the TX ring. A datagram only joins the newest datagram
+ queued for its endpoint, so none overtakes another on the way to a VPort.
+ Once bundle_buf is used up, the rest of the batch goes out as it is.
+ */
+static void vswitch_coalesce(struct vswitch_worker_t *worker)
+{
+  struct mmsg_ring_t *tx = &worker->tx_ring;
+  size_t limit = COALESCE_MAX_PAYLOAD - (worker->crypt_buf != NULL ? CRYPT_OVERHEAD : 0);
+  size_t used = 0;          // Bytes of bundle_buf taken by finished and open bundles
+  int open = -1;            // Compacted slot that later datagrams to its endpoint may join
+  char *bundle = NULL;      // Bundle the open slot was turned into, NULL while it is a single datagram
+  size_t bundlesz = 0;
+  unsigned int out = 0;
+
+  for (unsigned int i = 0; i < tx->count; i++)
+  {
+    struct msghdr *msg = &tx->msgs[i].msg_hdr;
+    size_t len = vswitch_msg_len(msg);
+    bool small = worker->tx_coalesce[i] && coalesce_fits(COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN + len,
+                                                         ETHER_HDR_LEN, limit);
+    bool same = open >= 0 && tx->addrs[open].sin_addr.s_addr == tx->addrs[i].sin_addr.s_addr &&
+                tx->addrs[open].sin_port == tx->addrs[i].sin_port;
+
+    if (same && small)
+    {
+      struct msghdr *open_msg = &tx->msgs[open].msg_hdr;
+      size_t opensz = bundle != NULL ? bundlesz : COALESCE_HDR_LEN + COALESCE_REC_HDR_LEN + vswitch_msg_len(open_msg);
+      if (coalesce_fits(opensz, len, limit) && (bundle != NULL || used + limit <= VSWITCH_BUNDLE_BUF_SIZE))
+      {
+        if (bundle == NULL)
+        {
+          bundle = worker->bundle_buf + used;
+          bundlesz = coalesce_append(bundle, coalesce_start(bundle), open_msg->msg_iov, open_msg->msg_iovlen);
+          used += limit;
+          open_msg->msg_iovlen = 1;
+        }
+        bundlesz = coalesce_append(bundle, bundlesz, msg->msg_iov, msg->msg_iovlen);
+        open_msg->msg_iov[0].iov_base = bundle;
+        open_msg->msg_iov[0].iov_len = bundlesz;
+        if (worker->tx_class != NULL && worker->tx_class[i] < worker->tx_class[open])
+        {
+          worker->tx_class[open] = worker->tx_class[i];  // A bundle goes out with its most urgent datagram
+        }
+        continue;
+      }
+    }
+
+    // Keeps datagram i as slot 'out', copying the contents of the slot rather than its pointers
+    if (out != i)
+    {
+      struct msghdr *out_msg = &tx->msgs[out].msg_hdr;
+      tx->addrs[out] = tx->addrs[i];
+      memcpy(out_msg->msg_iov, msg->msg_iov, msg->msg_iovlen * sizeof(*msg->msg_iov));
+      out_msg->msg_iovlen = msg->msg_iovlen;
+      if (worker->tx_class != NULL)
+      {
+        worker->tx_class[out] = worker->tx_class[i];
+      }
+    }
+    if (small)
+    {
+      open = out;
+      bundle = NULL;
+    }
+    else if (same)
+    {
+      open = -1;
+    }
+    out++;
+  }
+  tx->count = out;
+}
+
+/*
+ Sends everything queued on the TX ring and drops the references it held.
+ In priority mode, a batch that mixes classes goes out in the order
+ qos_order() gives it.
+ */
+static void vswitch_flush(struct vswitch_worker_t *worker)
+{
+  struct mmsg_ring_t *tx = &worker->tx_ring;
+  unsigned int count = tx->count;
+
+  uint64_t start = stats_start(worker->stats);
+  if (worker->tx_coalescable > 1)
+  {
+    vswitch_coalesce(worker);
+  }
+  unsigned int datagrams = tx->count;  // Bundles count as one
+  struct mmsghdr *msgs = tx->msgs;
+  if (worker->tx_classes & (worker->tx_classes - 1))
+  {
+    qos_order(tx->msgs, worker->tx_class, datagrams, worker->tx_sorted);
+    msgs = worker->tx_sorted;
+  }
+  int sent = worker->crypt_buf != NULL ? vswitch_seal_and_send(worker, msgs, datagrams)
+                                       : mmsg_send(worker->sockfd, msgs, datagrams);
+  tx->count = 0;
+  stats_add(worker->stats, STATS_DROP_SEND, datagrams - sent);
+  if (count > 0)
+  {
+    stats_time(worker->stats, STATS_STAGE_SEND, start);
+  }
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (worker->tx_frames[i] != NULL)
+    {
+      frame_put(&worker->rx_ring.pool, worker->tx_frames[i]);
+      worker->tx_frames[i] = NULL;
+    }
+    worker->tx_coalesce[i] = false;
+  }
+  worker->seg_used = 0;
+  worker->tx_coalescable = 0;
+  worker->tx_classes = 0;
+}
+
+/*
+ Queues 'ether_datasz' bytes at 'ether_data' for 'peer' on the TX ring. The
+ data is referenced, not copied: it lies in RX frame 'frame', which the TX
+ slot holds a reference to, or in seg_buf when 'frame' is NULL. Peers that
+ use the wire header get one in front, which takes the place of the
+ offload magic of an encapsulated datagram.
+ */
+static void vswitch_send(struct vswitch_worker_t *worker, struct frame_desc_t *frame, char *ether_data,
+                         int ether_datasz, uint32_t peer)
+{
+  struct vswitch_peer_t *p = &worker->vswitch->peers[peer];
+  struct mmsg_ring_t *tx = &worker->tx_ring;
+  if (tx->count == tx->capacity)
+  {
+    vswitch_flush(worker);
+  }
+
+  if (frame != NULL)
+  {
+    frame_ref(frame);
+  }
+  worker->tx_frames[tx->count] = frame;
+  if (atomic_load_explicit(&p->coalesce, memory_order_relaxed))
+  {
+    worker->tx_coalesce[tx->count] = true;
+    worker->tx_coalescable++;
+  }
+
+  struct vswitch_peer_stats_t *peer_stats = &worker->peer_stats[peer];
+  size_t ether_offset = offload_is_encapsulated(ether_data, ether_datasz) ? OFFLOAD_HDR_LEN : 0;
+  size_t framesz = ether_datasz - ether_offset;
+  if (worker->tx_class != NULL)
+  {
+    uint8_t class = qos_classify((const uint8_t *)ether_data + ether_offset, framesz);
+    worker->tx_class[tx->count] = class;
+    worker->tx_classes |= 1u << class;
+  }
+  stats_inc(worker->stats, STATS_TX_FRAMES);
+  stats_add(worker->stats, STATS_TX_BYTES, framesz);
+  stats_counter_add(&peer_stats->tx_frames, 1);
+  stats_counter_add(&peer_stats->tx_bytes, framesz);
+
+  tx->addrs[tx->count] = vswitch_peer_addr(p);
+  struct iovec *iov = tx->msgs[tx->count].msg_hdr.msg_iov;
+  char *prefix = worker->tx_hdrs + tx->count * WIRE_HDR_LEN;
+  if (atomic_load_explicit(&p->wire, memory_order_relaxed))
+  {
+    bool encapsulated = offload_is_encapsulated(ether_data, ether_datasz);
+    uint32_t seq = atomic_fetch_add_explicit(&p->tx_seq, 1, memory_order_relaxed);
+    wire_hdr_set(prefix, encapsulated ? WIRE_F_VNET : 0, WIRE_SENDER_VSWITCH, p->port_id, p->net->id, seq);
+    ether_data += encapsulated ? OFFLOAD_MAGIC_LEN : 0;
+    ether_datasz -= encapsulated ? OFFLOAD_MAGIC_LEN : 0;
+    iov->iov_base = prefix;
+    iov->iov_len = WIRE_HDR_LEN;
+    iov++;
+  }
+  else if (p->port_id != 0)
+  {
+    port_tag_set(prefix, p->port_id);
+    iov->iov_base = prefix;
+    iov->iov_len = PORT_TAG_LEN;
+    iov++;
+  }
+  iov->iov_base = ether_data;
+  iov->iov_len = ether_datasz;
+  tx->msgs[tx->count].msg_hdr.msg_iovlen = iov + 1 - tx->msgs[tx->count].msg_hdr.msg_iov;
+  tx->count++;
+}
+
+/*
+ Queues a received datagram for 'peer' in the form that peer understands.
+ Offload peers and plain frames need no work; for other peers the offload
+ header is dropped after completing the checksum or segmenting the frame.
+ */
+static void vswitch_forward(struct vswitch_worker_t *worker, struct frame_desc_t *frame, char *datagram,
+                            int datagramsz, bool encapsulated, uint32_t peer)
+{
+  if (!encapsulated || atomic_load_explicit(&worker->vswitch->peers[peer].offload, memory_order_relaxed))
+  {
+    vswitch_send(worker, frame, datagram, datagramsz, peer);
+    return;
+  }
+
+  struct offload_hdr_t *offload_hdr = (struct offload_hdr_t *)datagram;
+  uint8_t *ether_frame = (uint8_t *)datagram + OFFLOAD_HDR_LEN;
+  size_t framesz = datagramsz - OFFLOAD_HDR_LEN;
+
+  if (!offload_needs_segmentation(&offload_hdr->vnet))
+  {
+    // Completing the checksum in place is harmless for offload peers sharing this buffer
+    offload_complete_csum(ether_frame, framesz, &offload_hdr->vnet);
+    vswitch_send(worker, frame, (char *)ether_frame, framesz, peer);
+    return;
+  }
+
+  // Segments are queued back to back, so make sure a whole super-frame fits in the TX ring
+  struct mmsg_ring_t *tx = &worker->tx_ring;
+  if (tx->capacity - tx->count < OFFLOAD_MAX_SEGS)
+  {
+    vswitch_flush(worker);
+  }
+
+  struct iovec segs[OFFLOAD_MAX_SEGS];
+  int nsegs = offload_segment(ether_frame, framesz, &offload_hdr->vnet, worker->seg_buf + worker->seg_used,
+                              VSWITCH_SEG_BUF_SIZE - worker->seg_used, segs, OFFLOAD_MAX_SEGS);
+  if (nsegs < 0 && worker->seg_used > 0)
+  {
+    // Out of segment space: send what is queued so the space can be reused
+    vswitch_flush(worker);
+    nsegs = offload_segment(ether_frame, framesz, &offload_hdr->vnet, worker->seg_buf, VSWITCH_SEG_BUF_SIZE,
+                            segs, OFFLOAD_MAX_SEGS);
+  }
+  if (nsegs < 0)
+  {
+    LOG_PRINT(LOG_FRAMES, "[VSwitch] Dropped unsegmentable frame: datagramsz=%d\n", datagramsz);
+    stats_inc(worker->stats, STATS_DROP_OVERSIZE);
+    return;
+  }
+
+  for (int i = 0; i < nsegs; i++)
+  {
+    worker->seg_used += segs[i].iov_len;
+    vswitch_send(worker, NULL, segs[i].iov_base, segs[i].iov_len, peer);
+  }
+}
+
+static inline bool vswitch_p2p_capable(const struct vswitch_worker_t *worker, const struct vswitch_peer_t *p)
+{
+  uint32_t hello = atomic_load_explicit(&p->hello, memory_order_relaxed);
+  return p->port_id == 0 && hello != 0 && (int32_t)(worker->now - hello) <= P2P_HELLO_TIMEOUT;
+}
+
+_Static_assert(HEALTH_PROBE_LEN <= sizeof(struct p2p_hint_t), "hints are the largest control messages");
+
+/*
+ Sends the control message 'msg' of 'msgsz' bytes (at most a hint's) to
+ 'addr' right away, sealed in encrypted mode. 'what' names it in errors.
+ */
+static void vswitch_send_control(struct vswitch_worker_t *worker, const void *msg, size_t msgsz,
+                                 const struct sockaddr_in *addr, const char *what)
+{
+  char sealed[sizeof(struct p2p_hint_t) + CRYPT_OVERHEAD];
+  if (worker->crypt_buf != NULL)
+  {
+    struct iovec iov = {.iov_base = (void *)msg, .iov_len = msgsz};
+    msgsz = crypt_seal(&worker->crypt_tx, sealed, &iov, 1);
+    msg = sealed;
+  }
+  if (sendto(worker->sockfd, msg, msgsz, 0, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+  {
+    fprintf(stderr, "fail to send %s: %s\n", what, strerror(errno));
+  }
+}
+
+/*
+ Handles a P2P control message from a VPort: a hello, or a keepalive probe,
+ which goes straight back to where it came from.
+ */
+static void vswitch_p2p_control(struct vswitch_worker_t *worker, const char *datagram, int datagramsz, uint64_t key,
+                                const struct sockaddr_in *vport_addr, uint16_t net_id)
+{
+  bool probe = health_is_probe(datagram, datagramsz, HEALTH_MSG_PROBE);
+  if (!probe && p2p_msg_type(datagram) != P2P_MSG_HELLO)
+  {
+    return;
+  }
+  uint32_t peer = vswitch_peer_get(worker, key, vport_addr, 0, net_id);
+  if (peer == VSWITCH_PEER_NONE)
+  {
+    return;
+  }
+  if (!probe)
+  {
+    atomic_store_explicit(&worker->vswitch->peers[peer].hello, worker->now, memory_order_relaxed);
+    return;
+  }
+  // A VPort with keepalives receives floods even before any of its MACs is known, so that it can be found at
+  // once when it fails over to this switch
+  struct vswitch_peer_t *p = &worker->vswitch->peers[peer];
+  uint32_t never = 0;
+  if (atomic_load_explicit(&p->probed, memory_order_relaxed) == 0 &&
+      atomic_compare_exchange_strong(&p->probed, &never, worker->now))
+  {
+    pthread_mutex_lock(&p->net->mac_table.lock);
+    vswitch_count_mac(p->net, peer, 1);
+    pthread_mutex_unlock(&p->net->mac_table.lock);
+  }
+  atomic_store_explicit(&p->probed, worker->now, memory_order_relaxed);
+  struct health_probe_t reply;
+  memcpy(&reply, datagram, sizeof(reply));
+  reply.type = HEALTH_MSG_REPLY;
+  vswitch_send_control(worker, &reply, sizeof(reply), vport_addr, "keepalive reply");
+}
+
+/*
+ Having just relayed a unicast frame for 'mac' from 'src_peer' to 'dst_peer',
+ tells the source VPort where the MAC lives if both ends take direct frames.
+ Sources in offload mode are only pointed at offload peers, since their
+ super-frames would otherwise need segmenting on the way.
+ */
+static void vswitch_hint(struct vswitch_worker_t *worker, uint32_t src_peer, uint32_t dst_peer, uint64_t mac)
+{
+  const struct vswitch_peer_t *src = &worker->vswitch->peers[src_peer];
+  const struct vswitch_peer_t *dst = &worker->vswitch->peers[dst_peer];
+  if (src_peer == dst_peer || !vswitch_p2p_capable(worker, src) || !vswitch_p2p_capable(worker, dst) ||
+      (atomic_load_explicit(&src->offload, memory_order_relaxed) &&
+       !atomic_load_explicit(&dst->offload, memory_order_relaxed)))
+  {
+    return;
+  }
+
+  uint64_t key = ((uint64_t)src_peer << 48) | mac;
+  struct vswitch_hint_slot_t *slot = &worker->hints[u64_hash(key) & (VSWITCH_HINT_SLOTS - 1)];
+  if (slot->key == key && slot->sent == worker->now)
+  {
+    return;
+  }
+  slot->key = key;
+  slot->sent = worker->now;
+
+  struct p2p_hint_t hint;
+  struct sockaddr_in dst_addr = vswitch_peer_addr(dst);
+  struct sockaddr_in src_addr = vswitch_peer_addr(src);
+  p2p_hint_set(&hint, mac, &dst_addr, P2P_HINT_TTL);
+  vswitch_send_control(worker, &hint, sizeof(hint), &src_addr, "hint");
+}
+
+/*
+ Learns the address bindings a frame from 'src_peer' carries and, if it is an
+ ARP request or neighbour solicitation for a known host behind another VPort,
+ answers it on the target's behalf. Returns false if the frame still has to
+ be switched.
+ */
+static bool vswitch_neigh_proxy(struct vswitch_worker_t *worker, const char *ether_data, int ether_datasz,
+                                uint32_t src_peer)
+{
+  struct vswitch_net_t *net = worker->vswitch->peers[src_peer].net;
+  uint8_t target[NEIGH_IP_LEN];
+  enum neigh_request_t kind = neigh_snoop(&net->neigh, (const uint8_t *)ether_data, ether_datasz, target);
+  uint64_t target_mac;
+  uint32_t target_peer;
+  if (kind == NEIGH_NO_REQUEST || !neigh_lookup(&net->neigh, target, &target_mac) ||
+      !mac_table_lookup(&net->mac_table, target_mac, &target_peer) || target_peer == src_peer)
+  {
+    return false;
+  }
+
+  // The reply is built in seg_buf, which the TX ring references until the next flush
+  if (VSWITCH_SEG_BUF_SIZE - worker->seg_used < NEIGH_REPLY_MAX)
+  {
+    vswitch_flush(worker);
+  }
+  char *reply = (char *)worker->seg_buf + worker->seg_used;
+  size_t replysz = neigh_build_reply(kind, (const uint8_t *)ether_data, target, target_mac, (uint8_t *)reply);
+  worker->seg_used += replysz;
+  vswitch_send(worker, NULL, reply, replysz, src_peer);
+  LOG_PRINT(LOG_FRAMES, "[VSwitch] %s answered for %012llx\n", kind == NEIGH_ARP_REQUEST ? "ARP request" : "Solicitation",
+            (unsigned long long)target_mac);
+  return true;
+}
+
+/*
+ Sends a datagram to every VPort of the source's network with a learned MAC
+ except the source, or, with 'routers_only', to those that recently sent an
+ IGMP/MLD query.
+ */
+static void vswitch_flood(struct vswitch_worker_t *worker, struct frame_desc_t *frame, char *datagram,
+                          int datagramsz, bool encapsulated, uint32_t src_peer, bool routers_only)
+{
+  struct vswitch_t *vswitch = worker->vswitch;
+  struct vswitch_net_t *net = vswitch->peers[src_peer].net;
+  uint32_t nflood = atomic_load_explicit(&net->nflood, memory_order_acquire);
+  stats_inc(worker->stats, STATS_FLOODED);
+  for (uint32_t i = 0; i < nflood; i++)
+  {
+    uint32_t peer = atomic_load_explicit(&net->flood_peers[i], memory_order_relaxed);
+    if (peer == src_peer)
+    {
+      continue;
+    }
+    if (routers_only)
+    {
+      uint32_t queried = atomic_load_explicit(&vswitch->peers[peer].queried, memory_order_relaxed);
+      if (queried == 0 || (int32_t)(worker->now - queried) > MCAST_MEMBERSHIP_TIMEOUT)
+      {
+        continue;
+      }
+    }
+    vswitch_forward(worker, frame, datagram, datagramsz, encapsulated, peer);
+  }
+}
+
+/*
+ Takes a token from the unknown unicast bucket of 'src', which holds up to a
+ second's worth of flood_rate and refills at flood_rate per second. Returns
+ false once the VPort has used it up, so a host that scans or sprays frames
+ at dead MACs cannot make the switch copy them to every VPort.
+ */
+static inline bool vswitch_flood_unknown(struct vswitch_worker_t *worker, struct vswitch_peer_t *src)
+{
+  uint32_t rate = worker->vswitch->flood_rate;
+  if (src->flood_refill != worker->now)
+  {
+    uint64_t tokens = src->flood_tokens + (uint64_t)rate * (worker->now - src->flood_refill);
+    src->flood_tokens = tokens < rate ? (uint32_t)tokens : rate;
+    src->flood_refill = worker->now;
+  }
+  if (src->flood_tokens == 0)
+  {
+    return false;
+  }
+  src->flood_tokens--;
+  return true;
+}
+
+/*
+ Forwards a multicast frame. IGMP/MLD messages are snooped first: queries
+ mark their sender as a multicast router and are flooded; reports go to the
+ routers only, so that hosts behind other VPorts do not suppress their own
+ reports (RFC 4541). Other frames go to the group's subscribers, or to
+ everyone if the group is not snooped.
+ */
+static void vswitch_multicast(struct vswitch_worker_t *worker, struct frame_desc_t *frame, char *datagram,
+                              int datagramsz, bool encapsulated, const char *ether_data, int ether_datasz,
+                              uint32_t src_peer, uint64_t eth_dst)
+{
+  struct vswitch_t *vswitch = worker->vswitch;
+  struct mcast_table_t *mcast = &vswitch->peers[src_peer].net->mcast;
+  switch (mcast_snoop(mcast, (const uint8_t *)ether_data, ether_datasz, src_peer, worker->now))
+  {
+  case MCAST_SNOOP_QUERY:
+    atomic_store_explicit(&vswitch->peers[src_peer].queried, worker->now, memory_order_relaxed);
+    vswitch_flood(worker, frame, datagram, datagramsz, encapsulated, src_peer, false);
+    return;
+  case MCAST_SNOOP_REPORT:
+    vswitch_flood(worker, frame, datagram, datagramsz, encapsulated, src_peer, true);
+    return;
+  case MCAST_SNOOP_NONE:
+    break;
+  }
+
+  uint32_t members[MCAST_MAX_MEMBERS];
+  int nmembers = mcast_is_control_group(eth_dst) ? -1 : mcast_lookup(mcast, eth_dst, members);
+  if (nmembers < 0)
+  {
+    vswitch_flood(worker, frame, datagram, datagramsz, encapsulated, src_peer, false);
+    return;
+  }
+  for (int i = 0; i < nmembers; i++)
+  {
+    if (members[i] != src_peer)
+    {
+      vswitch_forward(worker, frame, datagram, datagramsz, encapsulated, members[i]);
+    }
+  }
+}
+
+/*
+ Keeps track of a VPort that sends the wire header: follows it to a new
+ address, and counts the datagrams missing from its sequence, logging any
+ new loss at most once a second.
+ */
+static void vswitch_wire_account(struct vswitch_worker_t *worker, struct vswitch_peer_t *src,
+                                 const struct wire_info_t *wire, const struct sockaddr_in *vport_addr)
+{
+  if (!atomic_load_explicit(&src->wire, memory_order_relaxed))
+  {
+    atomic_store_explicit(&src->wire, true, memory_order_relaxed);
+  }
+  uint64_t endpoint = endpoint_pack(vport_addr);
+  if (atomic_load_explicit(&src->endpoint, memory_order_relaxed) != endpoint)
+  {
+    atomic_store_explicit(&src->endpoint, endpoint, memory_order_relaxed);
+    LOG_PRINT(LOG_INFO, "[VSwitch] VPort %08x port %u moved to %s:%d\n", wire->sender, wire->port_id,
+              inet_ntoa(vport_addr->sin_addr), ntohs(vport_addr->sin_port));
+  }
+
+  wire_loss_update(&src->loss, wire->seq);
+  uint64_t lost = wire_loss_count(&src->loss);
+  if (lost != src->loss.reported && worker->now != src->loss_logged)
+  {
+    src->loss.reported = lost;
+    src->loss_logged = worker->now;
+    LOG_PRINT(LOG_INFO, "[VSwitch] VPort %08x port %u: %llu of %llu datagrams lost\n", wire->sender,
+              wire->port_id, (unsigned long long)lost, (unsigned long long)src->loss.expected);
+  }
+}
+
+/*
+ Learns from and forwards one frame of a classified batch: 'f' as parsed by
+ vswitch_parse(), 'class' what frame_classify() found in its Ethernet
+ header.
+ */
+static void vswitch_switch(struct vswitch_worker_t *worker, struct vswitch_pending_t *f,
+                           const struct frame_class_t *class)
+{
+  struct vswitch_t *vswitch = worker->vswitch;
+  char *ether_data = f->encapsulated ? f->datagram + OFFLOAD_HDR_LEN : f->datagram;
+  int ether_datasz = f->encapsulated ? f->datagramsz - (int)OFFLOAD_HDR_LEN : f->datagramsz;
+
+  if (log_level >= LOG_FRAMES)
+  {
+    trace_frame(TRACE_VSWITCH_RX, worker->index, ether_data, ether_datasz, f->vport_addr);
+  }
+
+  // 3. Insert/update MAC table
+  uint32_t src_peer = f->src_peer;
+  if (src_peer == VSWITCH_PEER_NONE || vswitch->peers[src_peer].net->id != f->net_id)
+  {
+    stats_inc(worker->stats, STATS_DROP_UNKNOWN_PORT);
+    return;  // Too many VPorts to track another one, or one that claims another network than it joined
+  }
+  struct vswitch_peer_t *src = &vswitch->peers[src_peer];
+  struct vswitch_net_t *net = src->net;
+  if (vswitch->police_rate && !qos_police(&src->police, vswitch->police_rate, f->datagramsz, worker->now_ns))
+  {
+    stats_inc(worker->stats, STATS_DROP_RATE);
+    return;  // Over the VPort's rate: dropped before it costs any more work
+  }
+  stats_inc(worker->stats, STATS_RX_FRAMES);
+  stats_add(worker->stats, STATS_RX_BYTES, ether_datasz);
+  stats_counter_add(&worker->peer_stats[src_peer].rx_frames, 1);
+  stats_counter_add(&worker->peer_stats[src_peer].rx_bytes, ether_datasz);
+  if (f->wired)
+  {
+    vswitch_wire_account(worker, src, &f->wire, f->vport_addr);
+  }
+  if (atomic_load_explicit(&src->offload, memory_order_relaxed) != f->encapsulated)
+  {
+    atomic_store_explicit(&src->offload, f->encapsulated, memory_order_relaxed);  // Offload VPorts encapsulate every frame
+  }
+  if (f->bundled && !atomic_load_explicit(&src->coalesce, memory_order_relaxed))
+  {
+    atomic_store_explicit(&src->coalesce, true, memory_order_relaxed);
+  }
+  vswitch_learn(worker, class->src, class->src_hash, src_peer);
+
+  // 4. Answer address resolution for known hosts, and forward the Ethernet frame
+  uint32_t dst_peer;
+  if (vswitch->neigh_proxy && vswitch_neigh_proxy(worker, ether_data, ether_datasz, src_peer))
+  {
+    return;
+  }
+  if (class->action != FRAME_ACTION_SHORT &&
+      mac_table_lookup_hashed(&net->mac_table, class->dst, class->dst_hash, &dst_peer))
+  {
+    // Destination is known: forward to the VPort that owns it, and offer the source a direct path
+    vswitch_forward(worker, f->frame, f->datagram, f->datagramsz, f->encapsulated, dst_peer);
+    vswitch_hint(worker, src_peer, dst_peer, class->dst);
+    return;
+  }
+  switch (class->action)
+  {
+  case FRAME_ACTION_BROADCAST:
+    // Broadcast to every known VPort of the network except the source VPort
+    vswitch_flood(worker, f->frame, f->datagram, f->datagramsz, f->encapsulated, src_peer, false);
+    break;
+  case FRAME_ACTION_MULTICAST:
+    // Multicast to the group's subscribers
+    vswitch_multicast(worker, f->frame, f->datagram, f->datagramsz, f->encapsulated, ether_data, ether_datasz,
+                      src_peer, class->dst);
+    break;
+  default:
+    if (vswitch_flood_unknown(worker, src))
+    {
+      // Unknown unicast: flood it, so that the reply tells where the destination lives
+      stats_inc(worker->stats, STATS_FLOODED_UNKNOWN);
+      vswitch_flood(worker, f->frame, f->datagram, f->datagramsz, f->encapsulated, src_peer, false);
+    }
+    else
+    {
+      // Otherwise, the source used up its share of floods: discard the Ethernet frame
+      stats_inc(worker->stats, STATS_DROP_UNKNOWN_DST);
+    }
+    break;
+  }
+}
+
+/*
+ Classifies the pending frames in one pass, resolves their senders and
+ prefetches the MAC table slots of both their addresses, then switches them
+ in the order they arrived.
+ */
+static void vswitch_switch_pending(struct vswitch_worker_t *worker)
+{
+  unsigned int count = worker->npending;
+  worker->npending = 0;
+  frame_classify(worker->pending_ether, worker->pending_len, count, worker->pending_class);
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    struct vswitch_pending_t *f = &worker->pending[i];
+    f->src_peer = vswitch_peer_get(worker, f->key, f->vport_addr, f->port_id, f->net_id);
+    if (f->src_peer != VSWITCH_PEER_NONE)
+    {
+      const struct mac_table_t *table = &worker->vswitch->peers[f->src_peer].net->mac_table;
+      mac_table_prefetch(table, worker->pending_class[i].src_hash);
+      mac_table_prefetch(table, worker->pending_class[i].dst_hash);
+    }
+  }
+  for (unsigned int i = 0; i < count; i++)
+  {
+    vswitch_switch(worker, &worker->pending[i], &worker->pending_class[i]);
+    stats_time(worker->stats, STATS_STAGE_SWITCH, worker->pending[i].start);
+  }
+}
+
+/*
+ Takes apart the tunnel headers of one datagram of RX frame 'frame': the
+ whole plaintext, or one datagram of a bundle ('bundled'). Control messages
+ are handled at once; frames join the pending batch, which is switched once
+ it is full. 'start' is when switching the datagram began, for stage timing.
+ */
+static void vswitch_parse(struct vswitch_worker_t *worker, struct frame_desc_t *frame, char *datagram,
+                          int datagramsz, const struct sockaddr_in *vport_addr, bool bundled, uint64_t start)
+{
+  struct vswitch_pending_t *f = &worker->pending[worker->npending];
+  f->port_id = 0;
+  f->net_id = 0;
+  f->wired = wire_parse(datagram, datagramsz, &f->wire);
+  if (f->wired)
+  {
+    if (f->wire.sender == WIRE_SENDER_VSWITCH || f->wire.port_id > PORT_TAG_MAX_ID)
+    {
+      stats_inc(worker->stats, STATS_DROP_UNKNOWN_PORT);
+      return;  // Not something a VPort sends
+    }
+    f->port_id = f->wire.port_id;
+    f->net_id = f->wire.net_id;
+    datagram += f->wire.offset;
+    datagramsz -= f->wire.offset;
+  }
+  f->key = f->wired ? peer_wire_key(f->wire.sender, f->port_id) : 0;
+  if (p2p_is_msg(datagram, datagramsz))
+  {
+    if (worker->npending > 0)
+    {
+      vswitch_switch_pending(worker);  // Frames that arrived before the control message go first
+    }
+    vswitch_p2p_control(worker, datagram, datagramsz, f->wired ? f->key : peer_key(vport_addr, 0), vport_addr,
+                        f->net_id);
+    return;
+  }
+  if (!f->wired && port_tag_present(datagram, datagramsz))
+  {
+    f->port_id = port_tag_id(datagram);
+    if (f->port_id < PORT_TAG_MIN_ID || f->port_id > PORT_TAG_MAX_ID)
+    {
+      stats_inc(worker->stats, STATS_DROP_UNKNOWN_PORT);
+      return;  // Not a port ID any VPort daemon hands out
+    }
+    datagram += PORT_TAG_LEN;
+    datagramsz -= PORT_TAG_LEN;
+  }
+
+  f->encapsulated = offload_is_encapsulated(datagram, datagramsz);
+  int ether_offset = f->encapsulated ? (int)OFFLOAD_HDR_LEN : 0;
+  if (datagramsz - ether_offset < ETHER_HDR_LEN)
+  {
+    stats_inc(worker->stats, STATS_DROP_SHORT);
+    return;  // Truncated frame, nothing to switch on
+  }
+
+  // 2. Queue the Ethernet header for classification
+  f->frame = frame;
+  f->datagram = datagram;
+  f->datagramsz = datagramsz;
+  f->vport_addr = vport_addr;
+  f->key = f->wired ? f->key : peer_key(vport_addr, f->port_id);
+  f->bundled = bundled;
+  f->start = start;
+  worker->pending_ether[worker->npending] = (const uint8_t *)datagram + ether_offset;
+  worker->pending_len[worker->npending] = datagramsz - ether_offset;
+  if (++worker->npending == VSWITCH_CLASS_BATCH)
+  {
+    vswitch_switch_pending(worker);
+  }
+}
+
+/*
+ Opens a received datagram and queues it, or each datagram it bundles, for
+ switching. 'start' is when the datagram was taken up, for stage timing.
+ */
+static void vswitch_process(struct vswitch_worker_t *worker, struct frame_desc_t *frame,
+                            const struct sockaddr_in *vport_addr, uint64_t start)
+{
+  char *datagram = frame->data;
+  int datagramsz = frame->len;
+  if (worker->crypt_buf != NULL)
+  {
+    // Encrypted mode: anything that does not authenticate is dropped unseen
+    if (!crypt_is_sealed(datagram, datagramsz) ||
+        (datagramsz = crypt_open(&worker->crypt_rx, datagram, datagramsz, vport_addr->sin_addr.s_addr)) < 0)
+    {
+      stats_inc(worker->stats, STATS_DROP_AUTH);
+      return;
+    }
+    datagram += CRYPT_HDR_LEN;
+  }
+  if (!coalesce_is_bundle(datagram, datagramsz))
+  {
+    vswitch_parse(worker, frame, datagram, datagramsz, vport_addr, false, start);
+    return;
+  }
+
+  size_t offset = 0;
+  int recordsz;
+  char *record;
+  while ((record = coalesce_next(datagram, datagramsz, &offset, &recordsz)) != NULL)
+  {
+    vswitch_parse(worker, frame, record, recordsz, vport_addr, true, start);
+  }
+}
+
+/*
+ Forgets the MACs of every VPort that sent keepalives and then nothing for
+ longer than the peer timeout (-K), and takes it off the flood list, so that
+ frames for its MACs are flooded to wherever they turn up next instead of
+ going to an endpoint that is gone. The VPort stays registered and takes
+ part again with its next probe.
+ */
+static void vswitch_expire_peers(struct vswitch_worker_t *worker)
+{
+  struct vswitch_t *vswitch = worker->vswitch;
+  pthread_mutex_lock(&vswitch->peers_lock);
+  uint32_t npeers = vswitch->npeers;
+  pthread_mutex_unlock(&vswitch->peers_lock);
+
+  for (uint32_t peer = 0; peer < npeers; peer++)
+  {
+    struct vswitch_peer_t *p = &vswitch->peers[peer];
+    uint32_t probed = atomic_load_explicit(&p->probed, memory_order_relaxed);
+    // A probe that arrives meanwhile keeps the VPort alive
+    if (probed == 0 || (int32_t)(worker->now - probed) <= (int32_t)vswitch->peer_timeout ||
+        !atomic_compare_exchange_strong(&p->probed, &probed, 0))
+    {
+      continue;
+    }
+    uint32_t forgotten = mac_table_forget_peer(&p->net->mac_table, peer);
+    vswitch_log_changes(p->net);
+    pthread_mutex_lock(&p->net->mac_table.lock);
+    vswitch_count_mac(p->net, peer, -1);
+    pthread_mutex_unlock(&p->net->mac_table.lock);
+    atomic_fetch_add_explicit(&vswitch->expired, 1, memory_order_relaxed);
+    if (log_level >= LOG_INFO)
+    {
+      struct sockaddr_in addr = vswitch_peer_addr(p);
+      LOG_PRINT(LOG_INFO, "[VSwitch] VPort %s:%d (port %u) stopped sending keepalives: forgot its %u MACs\n",
+                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), p->port_id, forgotten);
+    }
+  }
+}
+
+static void *vswitch_worker(void *raw_worker)
+{
+  struct vswitch_worker_t *worker = (struct vswitch_worker_t *)raw_worker;
+  struct vswitch_t *vswitch = worker->vswitch;
+  struct mmsg_ring_t *rx = &worker->rx_ring;
+  uint64_t idle_since = 0;  // Busy-poll mode: when the socket ran dry
+
+  while (true)
+  {
+    // 1. Read a batch of Ethernet frames from VPorts (blocks until the first one arrives, unless
+    //    busy-poll mode is still spinning). Frames still queued for TX keep their buffers; the slots
+    //    get spares
+    if (!mmsg_ring_recycle(rx))
+    {
+      vswitch_flush(worker);
+      mmsg_ring_recycle(rx);
+    }
+    mmsg_ring_reset(rx);
+    int flags = vswitch_spin(vswitch, &idle_since) ? MSG_DONTWAIT : MSG_WAITFORONE;
+    int nmsgs = recvmmsg(worker->sockfd, rx->msgs, rx->capacity, flags, NULL);
+    worker->now = vswitch_clock();
+    worker->now_ns = vswitch->police_rate ? vswitch_clock_ns() : 0;
+    if (nmsgs > 0)
+    {
+      idle_since = 0;
+    }
+
+    for (int i = 0; i < nmsgs; i++)
+    {
+      vswitch_process(worker, mmsg_ring_frame(rx, i), &rx->addrs[i], stats_start(worker->stats));
+    }
+    vswitch_switch_pending(worker);
+
+    // Send everything the batch produced, so frames wait for at most one batch
+    vswitch_flush(worker);
+
+    // Once a second, the first worker sweeps enough of every MAC table to cover all of it within half the
+    // age limit, and expires multicast memberships and VPorts that stopped sending keepalives
+    if (worker->index == 0 && worker->now != worker->swept)
+    {
+      uint32_t nnets = atomic_load_explicit(&vswitch->nnets, memory_order_acquire);
+      worker->swept = worker->now;
+      for (uint32_t i = 0; i < nnets; i++)
+      {
+        struct vswitch_net_t *net = vswitch->net_list[i];
+        uint32_t budget = mac_table_capacity(&net->mac_table) / (vswitch->mac_age / 2 + 1) + 1;
+        mac_table_age(&net->mac_table, worker->now, vswitch->mac_age, budget);
+        vswitch_log_changes(net);
+        mcast_table_age(&net->mcast, worker->now);
+      }
+      vswitch_expire_peers(worker);
+      if (vswitch->xdp != NULL)
+      {
+        vswitch_xdp_refresh(worker);
+        vswitch_xdp_sync(vswitch);
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ Pins a worker to the CPU matching its index. Failure is not fatal: the
+ worker simply keeps running wherever the scheduler puts it.
+ */
+static void vswitch_pin_thread(pthread_t thread, unsigned int index)
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+  {
+    fprintf(stderr, "fail to pthread_setaffinity_np for worker %u\n", index);
+  }
+}
+
+/*
+ Learns the MACs of the snapshot file, with the VPorts they live behind,
+ keeping their age so that entries no traffic confirms expire on time.
+ */
+static void vswitch_restore(struct vswitch_t *vswitch)
+{
+  uint32_t count;
+  size_t mapsz;
+  const struct snap_entry_t *entries = snap_load(vswitch->snapshot, &count, &mapsz);
+  if (entries == NULL)
+  {
+    return;
+  }
+
+  uint32_t now = vswitch_clock();
+  uint32_t restored = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    struct snap_entry_t entry = snap_entry_host(&entries[i]);
+    bool wired = entry.flags & SNAP_F_WIRE;
+    if (entry.age >= vswitch->mac_age || entry.port_id > PORT_TAG_MAX_ID || (wired && entry.sender == 0))
+    {
+      continue;
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    memcpy(&addr.sin_addr.s_addr, entry.ip, sizeof(entry.ip));
+    memcpy(&addr.sin_port, entry.port, sizeof(entry.port));
+    uint64_t key = wired ? peer_wire_key(entry.sender, entry.port_id) : peer_key(&addr, entry.port_id);
+    uint32_t peer = vswitch_peer_register(vswitch, key, &addr, entry.port_id, wired ? entry.net_id : 0);
+    if (peer == VSWITCH_PEER_NONE)
+    {
+      break;
+    }
+    struct vswitch_peer_t *p = &vswitch->peers[peer];
+    if (p->net->id != entry.net_id)
+    {
+      continue;  // Saved by a VPort it cannot belong to
+    }
+    atomic_store_explicit(&p->wire, wired, memory_order_relaxed);
+    atomic_store_explicit(&p->offload, (entry.flags & SNAP_F_OFFLOAD) != 0, memory_order_relaxed);
+    atomic_store_explicit(&p->coalesce, (entry.flags & SNAP_F_COALESCE) != 0, memory_order_relaxed);
+    enum mac_learn_t result = mac_table_learn(&p->net->mac_table, mac_to_u64(entry.mac), peer, now - entry.age);
+    vswitch_log_changes(p->net);
+    if (result == MAC_LEARN_FULL)
+    {
+      continue;  // That network's table is full, others may not be
+    }
+    restored++;
+  }
+  snap_unload(entries, mapsz);
+  printf("[VSwitch] Restored %u of %u MACs from %s, behind %u VPorts\n", restored, count, vswitch->snapshot,
+         vswitch->npeers);
+}
+
+struct vswitch_snapshot_t
+{
+  struct vswitch_t *vswitch;
+  struct snap_entry_t *entries;  ///< Room for the MAC tables of every network
+  uint32_t capacity;             ///< Entries entries has room for
+  uint32_t count;
+  uint32_t now;
+  uint16_t net_id;               ///< Network of the table being walked
+};
+
+static void vswitch_snapshot_entry(void *ctx, uint64_t mac, uint32_t peer, uint32_t seen)
+{
+  struct vswitch_snapshot_t *snapshot = ctx;
+  if (snapshot->count == snapshot->capacity)
+  {
+    return;  // Learned since the tables were counted; in the next snapshot
+  }
+  const struct vswitch_peer_t *p = &snapshot->vswitch->peers[peer];
+  struct snap_entry_t *entry = &snapshot->entries[snapshot->count++];
+  struct sockaddr_in addr = vswitch_peer_addr(p);
+  bool wired = atomic_load_explicit(&p->wire, memory_order_relaxed);
+
+  memset(entry, 0, sizeof(*entry));
+  mac_from_u64(mac, entry->mac);
+  entry->port_id = p->port_id;
+  memcpy(entry->ip, &addr.sin_addr.s_addr, sizeof(entry->ip));
+  memcpy(entry->port, &addr.sin_port, sizeof(entry->port));
+  entry->flags = (wired ? SNAP_F_WIRE : 0) |
+                 (atomic_load_explicit(&p->offload, memory_order_relaxed) ? SNAP_F_OFFLOAD : 0) |
+                 (atomic_load_explicit(&p->coalesce, memory_order_relaxed) ? SNAP_F_COALESCE : 0);
+  entry->sender = wired ? (uint32_t)(p->key >> 16) : 0;  // See peer_wire_key()
+  entry->age = (int32_t)(snapshot->now - seen) > 0 ? snapshot->now - seen : 0;
+  entry->net_id = snapshot->net_id;
+}
+
+/*
+ Saves the MAC tables of all networks every VSWITCH_SNAPSHOT_INTERVAL
+ seconds, off the switching threads.
+ */
+static void *vswitch_snapshot_thread(void *arg)
+{
+  struct vswitch_t *vswitch = arg;
+  struct vswitch_snapshot_t snapshot = {.vswitch = vswitch};
+  while (true)
+  {
+    sleep(VSWITCH_SNAPSHOT_INTERVAL);
+    uint32_t nnets = atomic_load_explicit(&vswitch->nnets, memory_order_acquire);
+    uint32_t entries = 0;
+    for (uint32_t i = 0; i < nnets; i++)
+    {
+      entries += atomic_load_explicit(&vswitch->net_list[i]->mac_table.size, memory_order_relaxed);
+    }
+    if (entries > snapshot.capacity)
+    {
+      // With some slack, so that a growing table does not leave its last MACs out every time
+      uint32_t capacity = entries + entries / 8 + MAC_TABLE_MIN_ENTRIES;
+      free(snapshot.entries);
+      if ((snapshot.entries = calloc(capacity, sizeof(*snapshot.entries))) == NULL)
+      {
+        ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+      }
+      snapshot.capacity = capacity;
+    }
+    snapshot.count = 0;
+    snapshot.now = vswitch_clock();
+    for (uint32_t i = 0; i < nnets; i++)
+    {
+      snapshot.net_id = vswitch->net_list[i]->id;
+      mac_table_walk(&vswitch->net_list[i]->mac_table, vswitch_snapshot_entry, &snapshot);
+    }
+    snap_save(vswitch->snapshot, snapshot.entries, snapshot.count);
+  }
+  return NULL;
+}
+
+/*
+ Appends the state of the switch and the counters of every VPort that sent
+ or was sent anything to a metrics scrape.
+ */
+static void vswitch_metrics(FILE *out, void *ctx)
+{
+  struct vswitch_t *vswitch = ctx;
+  uint32_t nnets = atomic_load_explicit(&vswitch->nnets, memory_order_acquire);
+  uint32_t entries = 0;
+  for (uint32_t i = 0; i < nnets; i++)
+  {
+    entries += atomic_load_explicit(&vswitch->net_list[i]->mac_table.size, memory_order_relaxed);
+  }
+  fprintf(out, "# HELP vswitch_mac_table_entries MACs in the MAC tables of all networks\n"
+               "# TYPE vswitch_mac_table_entries gauge\nvswitch_mac_table_entries %u\n", entries);
+  fprintf(out, "# HELP vswitch_mac_table_capacity MAC table entry limit of each network\n"
+               "# TYPE vswitch_mac_table_capacity gauge\nvswitch_mac_table_capacity %u\n", vswitch->max_macs);
+  fprintf(out, "# HELP vswitch_networks Networks VPorts joined since startup\n# TYPE vswitch_networks gauge\n"
+               "vswitch_networks %u\n", nnets);
+  fprintf(out, "# HELP vswitch_network_mac_table_entries MACs in the MAC table of the network\n"
+               "# TYPE vswitch_network_mac_table_entries gauge\n");
+  for (uint32_t i = 0; i < nnets; i++)
+  {
+    const struct vswitch_net_t *net = vswitch->net_list[i];
+    fprintf(out, "vswitch_network_mac_table_entries{network=\"%u\"} %u\n", net->id,
+            atomic_load_explicit(&net->mac_table.size, memory_order_relaxed));
+  }
+  if (vswitch->xdp != NULL)
+  {
+    uint64_t frames, bytes;
+    xdp_fastpath_counters(vswitch->xdp, &frames, &bytes);
+    fprintf(out, "# HELP vswitch_xdp_forwarded_frames_total Frames the XDP fast path switched without the workers\n"
+                 "# TYPE vswitch_xdp_forwarded_frames_total counter\nvswitch_xdp_forwarded_frames_total %llu\n",
+            (unsigned long long)frames);
+    fprintf(out, "# HELP vswitch_xdp_forwarded_bytes_total Ethernet bytes the XDP fast path switched\n"
+                 "# TYPE vswitch_xdp_forwarded_bytes_total counter\nvswitch_xdp_forwarded_bytes_total %llu\n",
+            (unsigned long long)bytes);
+  }
+  pthread_mutex_lock(&vswitch->peers_lock);
+  uint32_t npeers = vswitch->npeers;
+  pthread_mutex_unlock(&vswitch->peers_lock);
+  fprintf(out, "# HELP vswitch_vports VPorts seen since startup\n# TYPE vswitch_vports gauge\nvswitch_vports %u\n",
+          npeers);
+  fprintf(out, "# HELP vswitch_vports_expired_total VPorts forgotten for no longer sending keepalives\n"
+               "# TYPE vswitch_vports_expired_total counter\nvswitch_vports_expired_total %llu\n",
+          (unsigned long long)atomic_load_explicit(&vswitch->expired, memory_order_relaxed));
+
+  static const char *const names[] = {"rx_frames", "rx_bytes", "tx_frames", "tx_bytes"};
+  static const char *const helps[] = {"Frames received from the VPort", "Ethernet bytes received from the VPort",
+                                      "Frames sent to the VPort", "Ethernet bytes sent to the VPort"};
+  for (int i = 0; i < 4; i++)
+  {
+    fprintf(out, "# HELP vswitch_vport_%s_total %s\n# TYPE vswitch_vport_%s_total counter\n", names[i], helps[i],
+            names[i]);
+    for (uint32_t peer = 0; peer < npeers; peer++)
+    {
+      uint64_t sums[4] = {0};
+      for (unsigned int w = 0; w < vswitch->nworkers; w++)
+      {
+        const struct vswitch_peer_stats_t *peer_stats = &vswitch->workers[w].peer_stats[peer];
+        sums[0] += atomic_load_explicit(&peer_stats->rx_frames, memory_order_relaxed);
+        sums[1] += atomic_load_explicit(&peer_stats->rx_bytes, memory_order_relaxed);
+        sums[2] += atomic_load_explicit(&peer_stats->tx_frames, memory_order_relaxed);
+        sums[3] += atomic_load_explicit(&peer_stats->tx_bytes, memory_order_relaxed);
+      }
+      if (sums[0] == 0 && sums[2] == 0)
+      {
+        continue;
+      }
+      struct sockaddr_in addr = vswitch_peer_addr(&vswitch->peers[peer]);
+      fprintf(out, "vswitch_vport_%s_total{vport=\"%s:%d\",port_id=\"%u\"} %llu\n", names[i],
+              inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), vswitch->peers[peer].port_id,
+              (unsigned long long)sums[i]);
+    }
+  }
+}
+
+/*
+ Loads the XDP fast path and attaches it to every interface in the comma
+ separated list 'ifaces'. A kernel that refuses the program leaves the switch
+ running without it; an interface it cannot attach to is fatal.
+ */
+static void vswitch_xdp_start(struct vswitch_t *vswitch, char *ifaces, int server_port)
+{
+  struct xdp_fastpath_t *xdp = malloc(sizeof(*xdp));
+  if (xdp == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to malloc: %s\n", strerror(errno));
+  }
+  if (xdp_fastpath_init(xdp, server_port, vswitch->max_macs) < 0)
+  {
+    fprintf(stderr, "fail to load the XDP program: %s, switching in userspace only\n", strerror(errno));
+    free(xdp);
+    return;
+  }
+  if (!xdp->fib_src)
+  {
+    fprintf(stderr, "the kernel's FIB lookup cannot pick source addresses (Linux 6.7), so the XDP fast path "
+                    "sends from the address each datagram was sent to\n");
+  }
+  vswitch->xdp_capacity = vswitch->max_macs > MAC_TABLE_MIN_ENTRIES ? vswitch->max_macs : MAC_TABLE_MIN_ENTRIES;
+  if ((vswitch->xdp_queue = calloc(VSWITCH_XDP_QUEUE, sizeof(*vswitch->xdp_queue))) == NULL ||
+      (vswitch->xdp_macs = calloc(vswitch->xdp_capacity, sizeof(*vswitch->xdp_macs))) == NULL ||
+      (vswitch->xdp_seen = calloc(vswitch->xdp_capacity, sizeof(*vswitch->xdp_seen))) == NULL)
+  {
+    ERROR_PRINT_THEN_EXIT("fail to calloc: %s\n", strerror(errno));
+  }
+  vswitch->xdp_refreshed = vswitch_clock();
+  vswitch->xdp_refreshed_ns = 0;
+
+  char *save = NULL;
+  for (char *ifname = strtok_r(ifaces, ",", &save); ifname != NULL; ifname = strtok_r(NULL, ",", &save))
+  {
+    if (xdp_fastpath_attach(xdp, ifname) < 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to attach the XDP program to %s: %s\n", ifname, strerror(errno));
+    }
+    printf("[VSwitch] XDP fast path attached to %s\n", ifname);
+
+    // The FIB lookup only answers for interfaces that forward
+    char path[128];
+    snprintf(path, sizeof(path), "/proc/sys/net/ipv4/conf/%s/forwarding", ifname);
+    FILE *file = fopen(path, "r");
+    if (file != NULL && fgetc(file) == '0')
+    {
+      fprintf(stderr, "IPv4 forwarding is off on %s, so its datagrams stay in userspace "
+                      "(sysctl net.ipv4.conf.%s.forwarding=1)\n", ifname, ifname);
+    }
+    if (file != NULL)
+    {
+      fclose(file);
+    }
+  }
+  vswitch->xdp = xdp;
+}
+
+/*
+ Opens the sockets, starts the workers and waits for them (forever, in
+ normal operation).
+ */
+void vswitch_run(struct vswitch_t *vswitch, int server_port, unsigned int batch, enum vswitch_steering_t steering,
+                 const char *metrics, const char *snapshot)
+{
+  int sockfds[VSWITCH_MAX_WORKERS];
+  struct vswitch_worker_t workers[VSWITCH_MAX_WORKERS];
+  pthread_t threads[VSWITCH_MAX_WORKERS];
+
+  vswitch_open_sockets(sockfds, vswitch->nworkers, server_port, steering);
+  for (unsigned int w = 0; w < vswitch->nworkers; w++)
+  {
+    vswitch_worker_init(&workers[w], vswitch, w, sockfds[w], batch);
+  }
+  vswitch->workers = workers;
+  if (metrics)
+  {
+    stats_serve(metrics, "vswitch", vswitch_metrics, vswitch);
+  }
+  if (snapshot)
+  {
+    vswitch->snapshot = snapshot;
+    vswitch_restore(vswitch);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, vswitch_snapshot_thread, vswitch) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+    pthread_detach(thread);
+  }
+
+  printf("[VSwitch] Started at 0.0.0.0:%d, batch: %u, workers: %u, MAC table: %u entries per network, aging: %us, "
+         "encryption: %s, rate limit: %llu Mbit/s, priority queueing: %s\n", server_port, batch, vswitch->nworkers,
+         vswitch->max_macs, vswitch->mac_age, vswitch->crypt_key ? crypt_cipher_name(workers[0].crypt_tx.cipher) : "off",
+         (unsigned long long)(vswitch->police_rate / 125000), vswitch->prio ? "on" : "off");
+
+  for (unsigned int w = 0; w < vswitch->nworkers; w++)
+  {
+    if (pthread_create(&threads[w], NULL, vswitch_worker, &workers[w]) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_create: %s\n", strerror(errno));
+    }
+    if (vswitch->nworkers > 1)
+    {
+      vswitch_pin_thread(threads[w], w);
+    }
+  }
+
+  for (unsigned int w = 0; w < vswitch->nworkers; w++)
+  {
+    if (pthread_join(threads[w], NULL) != 0)
+    {
+      ERROR_PRINT_THEN_EXIT("fail to pthread_join: %s\n", strerror(errno));
+    }
+  }
+}
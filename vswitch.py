@@ -1,58 +1,164 @@
-#!/usr/bin/env python3
-# -*- coding: utf-8 -*-
-
-import socket
-import sys
-
-# parse parameters
-server_port = None
-if len(sys.argv) != 2:
-  print("Usage: python3 vswitch.py {VSWITCH_PORT}")
-  sys.exit(1)
-else:
-  server_port = int(sys.argv[1])
-server_addr = ("0.0.0.0", server_port)
-
-# 0. create UDP socket, bind to service port
-vserver_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-vserver_sock.bind(server_addr)
-print(f"[VSwitch] Started at {server_addr[0]}:{server_addr[1]}")
-
-mac_table = {}
-
-while True:
-  # 1. read ethernet frame from VPort
-  data, vport_addr = vserver_sock.recvfrom(1518)
-
-  # 2. parse ethernet frame
-  eth_header = data[:14]
-  #    ethernet destination hardware address (MAC)
-  eth_dst = ":".join("{:02x}".format(x) for x in eth_header[0:6])
-  #    ethernet source hardware address (MAC)
-  eth_src = ":".join("{:02x}".format(x) for x in eth_header[6:12])
-
-  print(f"[VSwitch] vport_addr<{vport_addr}> "
-        f"src<{eth_src}> dst<{eth_dst}> datasz<{len(data)}>")
-  
-  # 3. insert/update mac table
-  if (eth_src not in mac_table or mac_table[eth_src] != vport_addr):
-    mac_table[eth_src] = vport_addr
-    print(f"    ARP Cache: {mac_table}")
-
-  # 4. forward ethernet frame
-  #    if dest in mac table, forward ethernet frame to it
-  if eth_dst in mac_table:
-    vserver_sock.sendto(data, mac_table[eth_dst])
-    print(f"    Forwarded to: {eth_dst}")
-  #    if dest is broadcast address, 
-  #    broadcast ethernet frame to every known VPort except source VPort
-  elif eth_dst == "ff:ff:ff:ff:ff:ff":
-    brd_dst_macs = list(mac_table.keys())
-    brd_dst_macs.remove(eth_src)
-    brd_dst_vports = {mac_table[mac] for mac in brd_dst_macs}
-    print(f"    Broadcasted to: {brd_dst_vports}")
-    for brd_dst in brd_dst_vports:
-      vserver_sock.sendto(data, brd_dst)
-  #    otherwise, for simplicity, discard the ethernet frame
-  else:
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+import os
+import socket
+import struct
+import sys
+import time
+
+# MAC table snapshot, in the format of snap_utils.h
+SNAP_MAGIC = b"VSMT"
+SNAP_VERSION = 2
+SNAP_HDR = struct.Struct("<4sHHII")
+SNAP_ENTRY = struct.Struct("<6sH4s2sBBIIHH")
+SNAP_F_WIRE = 0x01
+SNAPSHOT_INTERVAL = 5
+
+# unknown unicast frames flooded per second from each VPort
+FLOOD_RATE = 100
+
+# receive whole datagrams whatever the MTU of the VPorts (up to jumbo frames)
+MAX_DATAGRAM = 65535
+
+
+def snap_load(path):
+  """Returns the MACs of a snapshot that live behind plain VPorts."""
+  try:
+    with open(path, "rb") as f:
+      data = f.read()
+  except FileNotFoundError:
+    return {}
+  if len(data) < SNAP_HDR.size:
+    print(f"[VSwitch] Ignoring {path}: not a MAC table snapshot")
+    return {}
+  magic, version, entry_size, count, _ = SNAP_HDR.unpack_from(data)
+  if (magic != SNAP_MAGIC or version != SNAP_VERSION or entry_size != SNAP_ENTRY.size
+      or len(data) != SNAP_HDR.size + count * SNAP_ENTRY.size):
+    print(f"[VSwitch] Ignoring {path}: not a MAC table snapshot")
+    return {}
+  table = {}
+  for i in range(count):
+    mac, port_id, ip, port, flags, _, _, _, net_id, _ = SNAP_ENTRY.unpack_from(data,
+                                                                               SNAP_HDR.size + i * SNAP_ENTRY.size)
+    if port_id == 0 and not flags & SNAP_F_WIRE and net_id == 0:
+      table[":".join("{:02x}".format(x) for x in mac)] = (socket.inet_ntoa(ip), int.from_bytes(port, "big"))
+  return table
+
+
+def snap_save(path, table):
+  """Writes the MAC table next to 'path', then renames it into place."""
+  data = bytearray(SNAP_HDR.pack(SNAP_MAGIC, SNAP_VERSION, SNAP_ENTRY.size, len(table), 0))
+  for mac, (ip, port) in table.items():
+    data += SNAP_ENTRY.pack(bytes.fromhex(mac.replace(":", "")), 0, socket.inet_aton(ip), port.to_bytes(2, "big"),
+                            0, 0, 0, 0, 0, 0)
+  try:
+    with open(path + ".tmp", "wb") as f:
+      f.write(data)
+    os.replace(path + ".tmp", path)
+  except OSError as e:
+    print(f"[VSwitch] Failed to save {path}: {e}", file=sys.stderr)
+
+
+# parse parameters: -v logs MAC learning, -vv also logs every frame,
+# -f FILE saves the MAC table to FILE and starts from it,
+# -u RATE floods up to RATE unknown unicast frames per second from each VPort
+args = sys.argv[1:]
+verbose = 0
+snapshot = None
+flood_rate = FLOOD_RATE
+while args and (args[0] in ("-v", "-vv") or (args[0] in ("-f", "-u") and len(args) > 1)):
+  opt = args.pop(0)
+  if opt == "-f":
+    snapshot = args.pop(0)
+  elif opt == "-u":
+    flood_rate = int(args.pop(0))
+  else:
+    verbose += len(opt) - 1
+server_port = None
+if len(args) != 1:
+  print("Usage: python3 vswitch.py [-v] [-f snapshot] [-u flood_rate] {VSWITCH_PORT}")
+  sys.exit(1)
+else:
+  server_port = int(args[0])
+server_addr = ("0.0.0.0", server_port)
+
+# 0. create UDP socket, bind to service port
+vserver_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+vserver_sock.bind(server_addr)
+print(f"[VSwitch] Started at {server_addr[0]}:{server_addr[1]}")
+
+mac_table = {}
+if snapshot:
+  mac_table = snap_load(snapshot)
+  print(f"[VSwitch] Restored {len(mac_table)} MACs from {snapshot}")
+  vserver_sock.settimeout(SNAPSHOT_INTERVAL)
+saved_at = time.monotonic()
+dirty = False
+
+# token bucket of every VPort: (tokens, last refill)
+flood_buckets = {}
+
+
+def flood_allowed(vport):
+  """Takes a token from the unknown unicast bucket of a VPort."""
+  now = time.monotonic()
+  tokens, last = flood_buckets.get(vport, (flood_rate, now))
+  tokens = min(flood_rate, tokens + (now - last) * flood_rate)
+  allowed = tokens >= 1
+  flood_buckets[vport] = (tokens - allowed, now)
+  return allowed
+
+
+while True:
+  # save the MAC table every few seconds if it changed
+  if snapshot and dirty and time.monotonic() - saved_at >= SNAPSHOT_INTERVAL:
+    snap_save(snapshot, mac_table)
+    saved_at = time.monotonic()
+    dirty = False
+
+  # 1. read ethernet frame from VPort
+  try:
+    data, vport_addr = vserver_sock.recvfrom(MAX_DATAGRAM)
+  except socket.timeout:
+    continue
+
+  # 2. parse ethernet frame
+  eth_header = data[:14]
+  #    ethernet destination hardware address (MAC)
+  eth_dst = ":".join("{:02x}".format(x) for x in eth_header[0:6])
+  #    ethernet source hardware address (MAC)
+  eth_src = ":".join("{:02x}".format(x) for x in eth_header[6:12])
+
+  if verbose >= 2:
+    print(f"[VSwitch] vport_addr<{vport_addr}> "
+          f"src<{eth_src}> dst<{eth_dst}> datasz<{len(data)}>")
+  
+  # 3. insert/update mac table
+  if (eth_src not in mac_table or mac_table[eth_src] != vport_addr):
+    mac_table[eth_src] = vport_addr
+    dirty = True
+    if verbose >= 1:
+      print(f"    MAC learned: {eth_src} -> {vport_addr}")
+
+  # 4. forward ethernet frame
+  #    if dest in mac table, forward ethernet frame to it
+  if eth_dst in mac_table:
+    vserver_sock.sendto(data, mac_table[eth_dst])
+    if verbose >= 2:
+      print(f"    Forwarded to: {eth_dst}")
+  #    if dest is broadcast address, or a unicast address not learned yet
+  #    (within the flood rate of the source), broadcast ethernet frame to
+  #    every known VPort except source VPort; the reply teaches us the MAC
+  elif (eth_dst == "ff:ff:ff:ff:ff:ff" or
+        (not eth_header[0] & 1 and flood_allowed(vport_addr))):
+    brd_dst_macs = list(mac_table.keys())
+    brd_dst_macs.remove(eth_src)
+    brd_dst_vports = {mac_table[mac] for mac in brd_dst_macs}
+    if verbose >= 2:
+      print(f"    Broadcasted to: {brd_dst_vports}")
+    for brd_dst in brd_dst_vports:
+      vserver_sock.sendto(data, brd_dst)
+  #    otherwise (multicast, or over the flood rate), discard the ethernet frame
+  elif verbose >= 2:
     print(f"    Discarded")
\ No newline at end of file
@@ -0,0 +1,157 @@
+/*
+ This header declares the wire header (vport -W), one fixed-size header in
+ front of every datagram in place of the port tag and offload magic:
+
+   | magic (2) | version | flags | sender (4) | port ID (2) | network ID (2) | sequence (4) | [virtio_net_hdr] | frame ... |
+
+ Multi-byte fields are big-endian. 'sender' is a random ID a VPort process
+ picks at startup (0 is the VSwitch), so the VSwitch can tell a VPort by who
+ it is rather than by the address it sends from and follow it when a NAT
+ rebinds its port. 'port ID' is the daemon port, 0 for a standalone VPort.
+ 'network ID' names the tenant network (vport -n) the frame belongs to, 0
+ being the default one: the VSwitch switches every network on its own, and a
+ VPort drops frames for any network but its own. 'sequence' counts the
+ datagrams of a sender (per port ID) so that receivers can measure loss; it
+ wraps. With WIRE_F_VNET the TAP's virtio_net_hdr follows, as in offload
+ mode.
+
+ Every field sits at a fixed offset and wire_parse() reads them without
+ branching on their values. Bundles (coalesce_utils.h) carry whole
+ datagrams, header included, and the encrypted mode seals one as a whole.
+ Datagrams without the header are still understood everywhere: ff:57 would
+ otherwise start a frame for a group address no station uses.
+ */
+
+#ifndef _WIRE_UTILS_H
+#define _WIRE_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include "offload_utils.h"
+
+#define WIRE_MAGIC0 0xff
+#define WIRE_MAGIC1 0x57
+#define WIRE_VERSION 1
+#define WIRE_F_VNET 0x01             ///< A virtio_net_hdr follows the header
+#define WIRE_SENDER_VSWITCH 0        ///< Sender ID of the VSwitch; VPorts pick non-zero ones
+#define WIRE_MAX_NET_ID 0xffff       ///< Highest network ID; 0 is the default network
+#define WIRE_VNET_LEN (OFFLOAD_HDR_LEN - OFFLOAD_MAGIC_LEN)
+
+struct wire_hdr_t
+{
+  uint8_t magic[2];   ///< WIRE_MAGIC0, WIRE_MAGIC1
+  uint8_t version;    ///< WIRE_VERSION
+  uint8_t flags;      ///< WIRE_F_*
+  uint32_t sender;    ///< Random ID of the sending VPort, WIRE_SENDER_VSWITCH from the VSwitch
+  uint16_t port_id;   ///< Daemon port ID, 0 for a standalone VPort
+  uint16_t net_id;    ///< Network of the frame, 0 for the default one
+  uint32_t seq;       ///< Datagram count of the sender and port ID
+} __attribute__((packed));
+
+#define WIRE_HDR_LEN sizeof(struct wire_hdr_t)
+_Static_assert(WIRE_HDR_LEN == 16, "wire_hdr_t must have no padding");
+
+/*
+ The fields of a parsed header, in host byte order.
+ */
+struct wire_info_t
+{
+  uint32_t sender;
+  uint32_t seq;
+  uint16_t port_id;
+  uint16_t net_id;
+  uint32_t offset;    ///< Where the payload starts, with an offload_hdr_t if WIRE_F_VNET was set
+};
+
+/*
+ What a receiver knows about the sequence numbers of one sender: how many
+ datagrams it should have seen since the first one, and how many it did.
+ Reordering does not count as loss; duplicates hide as much of it. Both
+ counts are 64-bit and grow from the distance each datagram moves 'top', so
+ they stay right however many times the sequence numbers wrap.
+ */
+struct wire_loss_t
+{
+  bool started;
+  uint32_t top;       ///< Highest sequence number seen
+  uint64_t expected;  ///< Sequence numbers from the first datagram seen to 'top'
+  uint64_t received;  ///< Datagrams seen
+  uint64_t reported;  ///< Loss at the last report
+};
+
+static inline void wire_hdr_set(char *datagram, uint8_t flags, uint32_t sender, uint16_t port_id, uint16_t net_id,
+                                uint32_t seq)
+{
+  struct wire_hdr_t hdr = {.magic = {WIRE_MAGIC0, WIRE_MAGIC1}, .version = WIRE_VERSION, .flags = flags,
+                           .sender = htobe32(sender), .port_id = htobe16(port_id), .net_id = htobe16(net_id),
+                           .seq = htobe32(seq)};
+  memcpy(datagram, &hdr, WIRE_HDR_LEN);
+}
+
+/*
+ Parses the header of a datagram of 'len' bytes, whose buffer must hold at
+ least WIRE_HDR_LEN bytes even if the datagram is shorter. Returns false if
+ the datagram has no (valid) header. With WIRE_F_VNET, the last two bytes of
+ the header are overwritten with the offload magic so that the payload at
+ 'info->offset' is laid out exactly as in offload mode; either way the
+ header must not be needed again.
+ */
+static inline bool wire_parse(char *datagram, size_t len, struct wire_info_t *info)
+{
+  struct wire_hdr_t hdr;
+  memcpy(&hdr, datagram, WIRE_HDR_LEN);
+  uint32_t vnet = hdr.flags & WIRE_F_VNET;
+  bool valid = (hdr.magic[0] == WIRE_MAGIC0) & (hdr.magic[1] == WIRE_MAGIC1) & (hdr.version == WIRE_VERSION) &
+               (len >= WIRE_HDR_LEN + vnet * WIRE_VNET_LEN);
+
+  info->sender = be32toh(hdr.sender);
+  info->seq = be32toh(hdr.seq);
+  info->port_id = be16toh(hdr.port_id);
+  info->net_id = be16toh(hdr.net_id);
+  info->offset = WIRE_HDR_LEN - vnet * OFFLOAD_MAGIC_LEN;
+
+  uint8_t magic0 = (valid & vnet) ? OFFLOAD_MAGIC0 : (uint8_t)datagram[WIRE_HDR_LEN - 2];
+  uint8_t magic1 = (valid & vnet) ? OFFLOAD_MAGIC1 : (uint8_t)datagram[WIRE_HDR_LEN - 1];
+  datagram[WIRE_HDR_LEN - 2] = (char)magic0;
+  datagram[WIRE_HDR_LEN - 1] = (char)magic1;
+  return valid;
+}
+
+/*
+ Accounts for a datagram with sequence number 'seq'.
+ */
+static inline void wire_loss_update(struct wire_loss_t *loss, uint32_t seq)
+{
+  if (!loss->started)
+  {
+    loss->started = true;
+    loss->top = seq;
+    loss->expected = 1;
+    loss->received = 0;
+    loss->reported = 0;
+  }
+  uint32_t ahead = seq - loss->top;
+  if ((int32_t)ahead > 0)
+  {
+    loss->top = seq;
+    loss->expected += ahead;
+  }
+  else if ((uint64_t)(loss->top - seq) >= loss->expected)
+  {
+    return;  // Sent before the first one seen: outside the window being measured
+  }
+  loss->received++;
+}
+
+/*
+ Returns the number of datagrams missing so far.
+ */
+static inline uint64_t wire_loss_count(const struct wire_loss_t *loss)
+{
+  return loss->expected > loss->received ? loss->expected - loss->received : 0;
+}
+
+#endif
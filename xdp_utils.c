@@ -0,0 +1,581 @@
+/*
+ This file implements the XDP fast path declared in xdp_utils.h: the eBPF
+ program, assembled in xdp_program(), and the bpf() calls that load it,
+ attach it and keep its MAC map up to date.
+ */
+
+#include "xdp_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <net/ethernet.h>   // Ethernet protocol definitions
+#include <linux/bpf.h>
+#include "ether_utils.h"
+
+#define XDP_PROG_MAX 256         ///< Instructions xdp_program() may emit
+#define XDP_LOG_SIZE (1 << 16)   ///< Verifier log kept when loading fails
+
+// Where the program finds things in a datagram: outer Ethernet, IPv4 without
+// options, UDP, then the inner Ethernet header
+#define XDP_OFF_IP ETHER_HDR_LEN
+#define XDP_OFF_UDP (XDP_OFF_IP + 20)
+#define XDP_OFF_INNER (XDP_OFF_UDP + 8)
+#define XDP_MIN_LEN (XDP_OFF_INNER + ETHER_HDR_LEN)
+
+// The program's stack frame, below r10: the two MAC keys, the key of the
+// counters and the FIB lookup parameters
+#define XDP_STACK_DST_KEY (-8)
+#define XDP_STACK_SRC_KEY (-16)
+#define XDP_STACK_STATS_KEY (-20)
+#define XDP_STACK_FIB (-88)
+#define XDP_FIB(field) (XDP_STACK_FIB + (int)offsetof(struct bpf_fib_lookup, field))
+
+// Registers, by the role they play in the program
+#define R0 BPF_REG_0   // Helper results
+#define R1 BPF_REG_1   // Helper arguments and scratch
+#define R2 BPF_REG_2
+#define R3 BPF_REG_3
+#define R4 BPF_REG_4
+#define RCTX BPF_REG_6   // struct xdp_md
+#define RDST BPF_REG_7   // Map value of the destination MAC: IPv4 address | port << 32
+#define RPKT BPF_REG_8   // Start of the packet, XDP_MIN_LEN bytes of it checked
+#define RLEN BPF_REG_9   // End of the packet, then the source MAC's map value, then the number of bytes forwarded
+#define RFP BPF_REG_10
+
+enum xdp_label_t
+{
+  XDP_LABEL_PASS,       ///< Hand the datagram to the socket unchanged
+  XDP_LABEL_COUNTED,    ///< The datagram is rewritten and counted; transmit it
+  XDP_LABEL_REDIRECT,   ///< The next hop lies behind another interface
+  XDP_LABEL_FRESH,      ///< The source MAC's timestamp is recent enough
+  XDP_LABELS
+};
+
+struct xdp_map_value_t
+{
+  uint32_t addr;   ///< IPv4 address of the VPort, network byte order
+  uint16_t port;   ///< UDP port of the VPort, network byte order
+  uint16_t zero;
+  uint64_t seen;   ///< CLOCK_MONOTONIC ns when the program last forwarded a frame from the MAC, 0 if never
+};
+
+struct xdp_counters_t
+{
+  uint64_t frames;
+  uint64_t bytes;
+};
+
+/*
+ A tiny assembler: instructions go into 'insns', and jumps to labels are
+ patched once every label is placed.
+ */
+struct xdp_asm_t
+{
+  struct bpf_insn insns[XDP_PROG_MAX];
+  unsigned int count;
+  int labels[XDP_LABELS];
+  unsigned int fixups[XDP_PROG_MAX];        ///< Jumps waiting for their label...
+  enum xdp_label_t fixup_labels[XDP_PROG_MAX];  ///< ...which is this one
+  unsigned int nfixups;
+};
+
+static void xdp_emit(struct xdp_asm_t *a, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+  struct bpf_insn insn = {.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm};
+  a->insns[a->count++] = insn;
+}
+
+static void xdp_jump(struct xdp_asm_t *a, uint8_t code, uint8_t dst, uint8_t src, int32_t imm,
+                     enum xdp_label_t label)
+{
+  a->fixups[a->nfixups] = a->count;
+  a->fixup_labels[a->nfixups++] = label;
+  xdp_emit(a, BPF_JMP | code, dst, src, 0, imm);
+}
+
+static void xdp_label(struct xdp_asm_t *a, enum xdp_label_t label)
+{
+  a->labels[label] = a->count;
+}
+
+static void xdp_load_map(struct xdp_asm_t *a, uint8_t dst, int map_fd)
+{
+  xdp_emit(a, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+  xdp_emit(a, 0, 0, 0, 0, 0);  // Upper half of the 64-bit immediate
+}
+
+/*
+ Copies 'len' bytes (even) from 'src_reg' + 'src_off' to 'dst_reg' +
+ 'dst_off' in 16-bit steps, which keeps stack accesses aligned.
+ */
+static void xdp_copy(struct xdp_asm_t *a, uint8_t dst_reg, int16_t dst_off, uint8_t src_reg, int16_t src_off,
+                     int len)
+{
+  for (int i = 0; i < len; i += 2)
+  {
+    xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, src_reg, src_off + i, 0);
+    xdp_emit(a, BPF_STX | BPF_H | BPF_MEM, dst_reg, R2, dst_off + i, 0);
+  }
+}
+
+/*
+ Writes the zero-padded 8-byte map key for the MAC at 'pkt_off' to the stack
+ at 'key_off'.
+ */
+static void xdp_mac_key(struct xdp_asm_t *a, int16_t key_off, int16_t pkt_off)
+{
+  xdp_copy(a, RFP, key_off, RPKT, pkt_off, ETH_ALEN);
+  xdp_emit(a, BPF_ST | BPF_H | BPF_MEM, RFP, 0, key_off + ETH_ALEN, 0);
+}
+
+/*
+ Looks up the map key at 'key_off' in 'map_fd'; R0 is the value, or the
+ datagram is passed if there is none.
+ */
+static void xdp_lookup(struct xdp_asm_t *a, int map_fd, int16_t key_off)
+{
+  xdp_load_map(a, R1, map_fd);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RFP, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, key_off);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  xdp_jump(a, BPF_JEQ | BPF_K, R0, 0, 0, XDP_LABEL_PASS);
+}
+
+/*
+ Folds the one's complement sum in R1 to 16 bits.
+ */
+static void xdp_fold(struct xdp_asm_t *a)
+{
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, R1, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_RSH | BPF_K, R2, 0, 0, 16);
+  xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, R1, 0, 0, 0xffff);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, R1, R2, 0, 0);
+}
+
+/*
+ Assembles the program into 'a'. Packet fields are loaded in network byte
+ order, so constants are compared in network byte order too. Without
+ 'fib_src', the FIB is not asked for a source address, and datagrams go out
+ from the address they were sent to.
+ */
+static void xdp_program(struct xdp_asm_t *a, int fdb_fd, int stats_fd, int port, bool fib_src)
+{
+  memset(a, 0, sizeof(*a));
+
+  // Enough of the packet for all headers, or it is none of ours
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, RCTX, R1, 0, 0);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, RPKT, RCTX, offsetof(struct xdp_md, data), 0);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, RLEN, RCTX, offsetof(struct xdp_md, data_end), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RPKT, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, XDP_MIN_LEN);
+  xdp_jump(a, BPF_JGT | BPF_X, R2, RLEN, 0, XDP_LABEL_PASS);
+
+  // IPv4 without options or fragmentation, UDP to the switch port
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, RPKT, 12, 0);
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, htons(ETHERTYPE_IP), XDP_LABEL_PASS);
+  xdp_emit(a, BPF_LDX | BPF_B | BPF_MEM, R2, RPKT, XDP_OFF_IP, 0);
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, 0x45, XDP_LABEL_PASS);
+  xdp_emit(a, BPF_LDX | BPF_B | BPF_MEM, R2, RPKT, XDP_OFF_IP + 9, 0);
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, IPPROTO_UDP, XDP_LABEL_PASS);
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, RPKT, XDP_OFF_IP + 6, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, R2, 0, 0, htons(0x3fff));  // More fragments, fragment offset
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, 0, XDP_LABEL_PASS);
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, RPKT, XDP_OFF_UDP + 2, 0);
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, htons(port), XDP_LABEL_PASS);
+
+  // A plain frame for a unicast MAC: every header of ours starts with a group address
+  xdp_emit(a, BPF_LDX | BPF_B | BPF_MEM, R2, RPKT, XDP_OFF_INNER, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, R2, 0, 0, 0x01);
+  xdp_jump(a, BPF_JNE | BPF_K, R2, 0, 0, XDP_LABEL_PASS);
+
+  // Both MACs known, the source one at this very endpoint, the destination one elsewhere
+  xdp_mac_key(a, XDP_STACK_DST_KEY, XDP_OFF_INNER);
+  xdp_mac_key(a, XDP_STACK_SRC_KEY, XDP_OFF_INNER + ETH_ALEN);
+  xdp_lookup(a, fdb_fd, XDP_STACK_DST_KEY);
+  xdp_emit(a, BPF_LDX | BPF_DW | BPF_MEM, RDST, R0, 0, 0);
+  xdp_lookup(a, fdb_fd, XDP_STACK_SRC_KEY);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, RLEN, R0, 0, 0);
+  xdp_emit(a, BPF_LDX | BPF_DW | BPF_MEM, R1, R0, 0, 0);
+  xdp_jump(a, BPF_JEQ | BPF_X, R1, RDST, 0, XDP_LABEL_PASS);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R2, RPKT, XDP_OFF_IP + 12, 0);
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R3, RPKT, XDP_OFF_UDP, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_LSH | BPF_K, R3, 0, 0, 32);
+  xdp_emit(a, BPF_ALU64 | BPF_OR | BPF_X, R2, R3, 0, 0);
+  xdp_jump(a, BPF_JNE | BPF_X, R1, R2, 0, XDP_LABEL_PASS);
+
+  // Next hop towards the destination VPort, and the source address to use
+  for (int off = 0; off < (int)sizeof(struct bpf_fib_lookup); off += 8)
+  {
+    xdp_emit(a, BPF_ST | BPF_DW | BPF_MEM, RFP, 0, XDP_STACK_FIB + off, 0);
+  }
+  xdp_emit(a, BPF_ST | BPF_B | BPF_MEM, RFP, 0, XDP_FIB(family), AF_INET);
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, RPKT, XDP_OFF_IP + 2, 0);
+  xdp_emit(a, BPF_ALU | BPF_END | BPF_TO_BE, R2, 0, 0, 16);  // tot_len, in host byte order
+  xdp_emit(a, BPF_STX | BPF_H | BPF_MEM, RFP, R2, XDP_FIB(tot_len), 0);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R2, RCTX, offsetof(struct xdp_md, ingress_ifindex), 0);
+  xdp_emit(a, BPF_STX | BPF_W | BPF_MEM, RFP, R2, XDP_FIB(ifindex), 0);
+  xdp_emit(a, BPF_STX | BPF_W | BPF_MEM, RFP, RDST, XDP_FIB(ipv4_dst), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R1, RCTX, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RFP, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, XDP_STACK_FIB);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, sizeof(struct bpf_fib_lookup));
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R4, 0, 0, fib_src ? BPF_FIB_LOOKUP_SRC : 0);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_fib_lookup);
+  xdp_jump(a, BPF_JNE | BPF_K, R0, 0, BPF_FIB_LKUP_RET_SUCCESS, XDP_LABEL_PASS);
+
+  // The workers never see the source MAC now, so stamp it for the aging sweep, at most once a second
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns);
+  xdp_emit(a, BPF_LDX | BPF_DW | BPF_MEM, R1, RLEN, offsetof(struct xdp_map_value_t, seen), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, R0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_SUB | BPF_X, R2, R1, 0, 0);
+  xdp_jump(a, BPF_JLT | BPF_K, R2, 0, 1000000000, XDP_LABEL_FRESH);
+  xdp_emit(a, BPF_STX | BPF_DW | BPF_MEM, RLEN, R0, offsetof(struct xdp_map_value_t, seen), 0);
+  xdp_label(a, XDP_LABEL_FRESH);
+
+  // From here on the datagram is ours: rewrite it as the switch socket would send it
+  xdp_copy(a, RPKT, 0, RFP, XDP_FIB(dmac), ETH_ALEN);
+  xdp_copy(a, RPKT, ETH_ALEN, RFP, XDP_FIB(smac), ETH_ALEN);
+  if (fib_src)
+  {
+    xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R2, RFP, XDP_FIB(ipv4_src), 0);
+  }
+  else
+  {
+    xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R2, RPKT, XDP_OFF_IP + 16, 0);
+  }
+  xdp_emit(a, BPF_STX | BPF_W | BPF_MEM, RPKT, R2, XDP_OFF_IP + 12, 0);
+  xdp_emit(a, BPF_STX | BPF_W | BPF_MEM, RPKT, RDST, XDP_OFF_IP + 16, 0);
+  xdp_emit(a, BPF_ST | BPF_B | BPF_MEM, RPKT, 0, XDP_OFF_IP + 8, IPDEFTTL);
+  xdp_emit(a, BPF_ST | BPF_H | BPF_MEM, RPKT, 0, XDP_OFF_IP + 10, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R1, 0, 0, 0);
+  for (int off = 0; off < 20; off += 2)
+  {
+    xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, R2, RPKT, XDP_OFF_IP + off, 0);
+    xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, R1, R2, 0, 0);
+  }
+  xdp_fold(a);
+  xdp_fold(a);
+  xdp_emit(a, BPF_ALU64 | BPF_XOR | BPF_K, R1, 0, 0, 0xffff);
+  xdp_emit(a, BPF_STX | BPF_H | BPF_MEM, RPKT, R1, XDP_OFF_IP + 10, 0);
+  xdp_copy(a, RPKT, XDP_OFF_UDP, RPKT, XDP_OFF_UDP + 2, 2);  // From the switch port...
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RDST, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_RSH | BPF_K, R2, 0, 0, 32);
+  xdp_emit(a, BPF_STX | BPF_H | BPF_MEM, RPKT, R2, XDP_OFF_UDP + 2, 0);  // ...to the VPort's
+  xdp_emit(a, BPF_ST | BPF_H | BPF_MEM, RPKT, 0, XDP_OFF_UDP + 6, 0);    // No UDP checksum
+
+  // Count it
+  xdp_emit(a, BPF_LDX | BPF_H | BPF_MEM, RLEN, RPKT, XDP_OFF_IP + 2, 0);
+  xdp_emit(a, BPF_ALU | BPF_END | BPF_TO_BE, RLEN, 0, 0, 16);
+  xdp_emit(a, BPF_ALU64 | BPF_SUB | BPF_K, RLEN, 0, 0, XDP_OFF_INNER - XDP_OFF_IP);  // Ethernet bytes, as the switch counts
+  xdp_emit(a, BPF_ST | BPF_W | BPF_MEM, RFP, 0, XDP_STACK_STATS_KEY, 0);
+  xdp_load_map(a, R1, stats_fd);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RFP, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, XDP_STACK_STATS_KEY);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  xdp_jump(a, BPF_JEQ | BPF_K, R0, 0, 0, XDP_LABEL_COUNTED);
+  xdp_emit(a, BPF_LDX | BPF_DW | BPF_MEM, R1, R0, offsetof(struct xdp_counters_t, frames), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R1, 0, 0, 1);
+  xdp_emit(a, BPF_STX | BPF_DW | BPF_MEM, R0, R1, offsetof(struct xdp_counters_t, frames), 0);
+  xdp_emit(a, BPF_LDX | BPF_DW | BPF_MEM, R1, R0, offsetof(struct xdp_counters_t, bytes), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, R1, RLEN, 0, 0);
+  xdp_emit(a, BPF_STX | BPF_DW | BPF_MEM, R0, R1, offsetof(struct xdp_counters_t, bytes), 0);
+
+  // Back out where it came in, or through the interface the FIB picked
+  xdp_label(a, XDP_LABEL_COUNTED);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R1, RFP, XDP_FIB(ifindex), 0);
+  xdp_emit(a, BPF_LDX | BPF_W | BPF_MEM, R2, RCTX, offsetof(struct xdp_md, ingress_ifindex), 0);
+  xdp_jump(a, BPF_JNE | BPF_X, R1, R2, 0, XDP_LABEL_REDIRECT);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_TX);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  xdp_label(a, XDP_LABEL_REDIRECT);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R2, 0, 0, 0);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  xdp_label(a, XDP_LABEL_PASS);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  for (unsigned int i = 0; i < a->nfixups; i++)
+  {
+    a->insns[a->fixups[i]].off = (int16_t)(a->labels[a->fixup_labels[i]] - (int)a->fixups[i] - 1);
+  }
+}
+
+static inline long xdp_bpf(int cmd, union bpf_attr *attr)
+{
+  return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_map_create(enum bpf_map_type type, const char *name, uint32_t key_size, uint32_t value_size,
+                          uint32_t max_entries)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+  return (int)xdp_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ Returns the number of possible CPUs, which is what per-CPU map lookups
+ return values for, from a list such as "0-7".
+ */
+static unsigned int xdp_possible_cpus(void)
+{
+  unsigned int last = 0;
+  FILE *file = fopen("/sys/devices/system/cpu/possible", "r");
+  if (file != NULL)
+  {
+    char list[64];
+    if (fgets(list, sizeof(list), file) != NULL)
+    {
+      const char *p = strrchr(list, '-');
+      p = p != NULL ? p + 1 : list;
+      last = (unsigned int)strtoul(p, NULL, 10);
+    }
+    fclose(file);
+  }
+  return last + 1;
+}
+
+/*
+ Loads the 'count' instructions 'insns' as an XDP program. Returns its file
+ descriptor, or -1 with errno set; a verifier log goes to 'log' if not NULL.
+ */
+static int xdp_prog_load(const struct bpf_insn *insns, unsigned int count, char *log)
+{
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (uint64_t)(uintptr_t)insns;
+  attr.insn_cnt = count;
+  attr.license = (uint64_t)(uintptr_t)"Dual MIT/GPL";  // The FIB lookup helper is GPL-only
+  if (log != NULL)
+  {
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = XDP_LOG_SIZE;
+    attr.log_level = 1;
+    log[0] = '\0';
+  }
+  strncpy(attr.prog_name, "vswitch_xdp", sizeof(attr.prog_name) - 1);
+  return (int)xdp_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/*
+ Returns true if the kernel's FIB lookup helper takes BPF_FIB_LOOKUP_SRC
+ (Linux 6.7 and later). The flag is checked when the helper runs, not when
+ the program is loaded, so a probe program calls it once in a test run;
+ older kernels fail the call with -EINVAL.
+ */
+static bool xdp_fib_src_supported(struct xdp_asm_t *a)
+{
+  memset(a, 0, sizeof(*a));
+  for (int off = 0; off < (int)sizeof(struct bpf_fib_lookup); off += 8)
+  {
+    xdp_emit(a, BPF_ST | BPF_DW | BPF_MEM, RFP, 0, XDP_STACK_FIB + off, 0);
+  }
+  xdp_emit(a, BPF_ST | BPF_B | BPF_MEM, RFP, 0, XDP_FIB(family), AF_INET);
+  xdp_emit(a, BPF_ST | BPF_W | BPF_MEM, RFP, 0, XDP_FIB(ifindex), 1);  // Loopback
+  xdp_emit(a, BPF_ST | BPF_W | BPF_MEM, RFP, 0, XDP_FIB(ipv4_dst), htonl(INADDR_LOOPBACK));
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, R2, RFP, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, XDP_STACK_FIB);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, sizeof(struct bpf_fib_lookup));
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, R4, 0, 0, BPF_FIB_LOOKUP_SRC);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_fib_lookup);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+  int fd = xdp_prog_load(a->insns, a->count, NULL);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  char packet[XDP_MIN_LEN] = {0};
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.test.prog_fd = fd;
+  attr.test.data_in = (uint64_t)(uintptr_t)packet;
+  attr.test.data_size_in = sizeof(packet);
+  attr.test.repeat = 1;
+  bool supported = xdp_bpf(BPF_PROG_TEST_RUN, &attr) == 0 && (int32_t)attr.test.retval >= 0;
+  close(fd);
+  return supported;
+}
+
+int xdp_fastpath_init(struct xdp_fastpath_t *xdp, int port, uint32_t max_entries)
+{
+  memset(xdp, 0, sizeof(*xdp));
+  xdp->ncpus = xdp_possible_cpus();
+  xdp->fdb_fd = xdp_map_create(BPF_MAP_TYPE_HASH, "vswitch_fdb", sizeof(uint64_t), sizeof(struct xdp_map_value_t),
+                               max_entries);
+  if (xdp->fdb_fd < 0)
+  {
+    return -1;
+  }
+  xdp->stats_fd = xdp_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, "vswitch_stats", sizeof(uint32_t),
+                                 sizeof(struct xdp_counters_t), 1);
+  if (xdp->stats_fd < 0)
+  {
+    int err = errno;
+    close(xdp->fdb_fd);
+    errno = err;
+    return -1;
+  }
+
+  struct xdp_asm_t *a = malloc(sizeof(*a));
+  char *log = malloc(XDP_LOG_SIZE);
+  if (a == NULL || log == NULL)
+  {
+    free(a);
+    free(log);
+    close(xdp->fdb_fd);
+    close(xdp->stats_fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  xdp->fib_src = xdp_fib_src_supported(a);
+  xdp_program(a, xdp->fdb_fd, xdp->stats_fd, port, xdp->fib_src);
+  xdp->prog_fd = xdp_prog_load(a->insns, a->count, log);
+  int err = errno;
+  if (xdp->prog_fd < 0 && log[0] != '\0')
+  {
+    fprintf(stderr, "XDP program rejected:\n%s\n", log);
+  }
+  free(a);
+  free(log);
+  if (xdp->prog_fd < 0)
+  {
+    close(xdp->fdb_fd);
+    close(xdp->stats_fd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int xdp_fastpath_attach(struct xdp_fastpath_t *xdp, const char *ifname)
+{
+  unsigned int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0)
+  {
+    return -1;
+  }
+  if (xdp->nifaces == XDP_MAX_IFACES)
+  {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = xdp->prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  int fd = (int)xdp_bpf(BPF_LINK_CREATE, &attr);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  xdp->link_fds[xdp->nifaces++] = fd;
+  return 0;
+}
+
+void xdp_fastpath_set(struct xdp_fastpath_t *xdp, uint64_t mac, const struct sockaddr_in *addr)
+{
+  uint8_t key[sizeof(uint64_t)] = {0};
+  mac_from_u64(mac, key);
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xdp->fdb_fd;
+  attr.key = (uint64_t)(uintptr_t)key;
+  if (addr == NULL)
+  {
+    if (xdp_bpf(BPF_MAP_DELETE_ELEM, &attr) < 0 && errno != ENOENT)
+    {
+      fprintf(stderr, "fail to remove %012llx from the XDP map: %s\n", (unsigned long long)mac, strerror(errno));
+    }
+    return;
+  }
+
+  struct xdp_map_value_t value = {.addr = addr->sin_addr.s_addr, .port = addr->sin_port, .zero = 0, .seen = 0};
+  attr.value = (uint64_t)(uintptr_t)&value;
+  attr.flags = BPF_ANY;
+  if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+  {
+    fprintf(stderr, "fail to add %012llx to the XDP map: %s\n", (unsigned long long)mac, strerror(errno));
+  }
+}
+
+void xdp_fastpath_counters(const struct xdp_fastpath_t *xdp, uint64_t *frames, uint64_t *bytes)
+{
+  *frames = 0;
+  *bytes = 0;
+  struct xdp_counters_t *values = calloc(xdp->ncpus, sizeof(*values));
+  if (values == NULL)
+  {
+    return;
+  }
+
+  uint32_t key = 0;
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xdp->stats_fd;
+  attr.key = (uint64_t)(uintptr_t)&key;
+  attr.value = (uint64_t)(uintptr_t)values;
+  if (xdp_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+  {
+    for (unsigned int cpu = 0; cpu < xdp->ncpus; cpu++)
+    {
+      *frames += values[cpu].frames;
+      *bytes += values[cpu].bytes;
+    }
+  }
+  free(values);
+}
+
+uint32_t xdp_fastpath_walk(const struct xdp_fastpath_t *xdp, uint64_t *macs, uint64_t *seen, uint32_t max)
+{
+  // Keys first, values after: entries changed meanwhile must not derail the iteration
+  uint8_t key[sizeof(uint64_t)];
+  uint8_t next[sizeof(uint64_t)];
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xdp->fdb_fd;
+  attr.next_key = (uint64_t)(uintptr_t)next;
+  uint32_t count = 0;
+  while (count < max && xdp_bpf(BPF_MAP_GET_NEXT_KEY, &attr) == 0)
+  {
+    macs[count++] = mac_to_u64(next);
+    memcpy(key, next, sizeof(key));
+    attr.key = (uint64_t)(uintptr_t)key;
+  }
+
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    struct xdp_map_value_t value;
+    memset(key, 0, sizeof(key));
+    mac_from_u64(macs[i], key);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->fdb_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    if (xdp_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+    {
+      macs[found] = macs[i];
+      seen[found++] = value.seen;
+    }
+  }
+  return found;
+}
@@ -0,0 +1,92 @@
+/*
+ This header declares the VSwitch's XDP fast path (vswitch -X): an eBPF
+ program, attached to the interfaces VPort traffic arrives on, that switches
+ the most common datagram before the kernel's IP and UDP stack ever sees it.
+ Like uring_utils.h, it is built directly on the bpf() system call, so the
+ switch needs neither a compiler for BPF nor libbpf: the program is
+ assembled here, instruction by instruction.
+
+ The program takes an IPv4/UDP datagram for the switch port, without IP
+ options or fragmentation, that carries a plain unicast Ethernet frame: no
+ port tag, offload, crypt, bundle, P2P or wire header, all of which start
+ with a group address. It looks both MACs up in a BPF hash map that the
+ userspace switch keeps in step with its MAC table for the default network:
+ when the source MAC lives at the very endpoint the datagram came from and
+ the destination MAC at another one, it asks the kernel's FIB for the next
+ hop towards that endpoint, rewrites the outer Ethernet, IP and UDP headers
+ as the switch's own socket would have sent them (UDP checksum 0), and
+ transmits the datagram straight back out (XDP_TX) or through the egress
+ interface (XDP_REDIRECT). Everything else, and anything the FIB cannot
+ resolve, goes up to the socket unchanged: learning, flooding, multicast,
+ the ARP/ND proxy and every control message stay in userspace.
+
+ Only standalone VPorts of the default network that send neither the wire
+ header nor port tags get map entries, as only their datagrams match what
+ the program forwards.
+
+ The workers never see the frames the program forwards, so the program
+ stamps the map entry of their source MAC (once a second at most) and the
+ aging sweep refreshes the MAC table from those stamps; an active host does
+ not age out and fall back to flooding. On kernels before 6.7 the FIB
+ cannot pick a source address (BPF_FIB_LOOKUP_SRC): the program then sends
+ from the address the datagram was sent to, which is the one the switch
+ socket would use unless the two VPorts reach the switch on different
+ addresses.
+ */
+
+#ifndef _XDP_UTILS_H
+#define _XDP_UTILS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#define XDP_MAX_IFACES 16   ///< Interfaces one fast path can be attached to
+
+struct xdp_fastpath_t
+{
+  int fdb_fd;                    ///< Hash map: 6-byte MAC (zero-padded to 8) -> VPort endpoint
+  int stats_fd;                  ///< Per-CPU array, one entry: frames and bytes forwarded
+  int prog_fd;
+  int link_fds[XDP_MAX_IFACES];  ///< BPF links; closing them (e.g. on exit) detaches the program
+  unsigned int nifaces;
+  unsigned int ncpus;            ///< Possible CPUs, the number of values per-CPU maps return
+  bool fib_src;                  ///< The FIB picks the source address (BPF_FIB_LOOKUP_SRC, Linux 6.7)
+};
+
+/*
+ Creates the maps, with room for 'max_entries' MACs, and loads the program
+ for datagrams to UDP port 'port'. Returns 0 on success, or -1 with errno set
+ (e.g. EPERM without CAP_BPF, or a verifier rejection, whose log goes to
+ stderr) so that the caller can run without the fast path.
+ */
+int xdp_fastpath_init(struct xdp_fastpath_t *xdp, int port, uint32_t max_entries);
+
+/*
+ Attaches the program to interface 'ifname', natively where the driver
+ supports XDP and in generic mode otherwise. Returns 0 on success, or -1 with
+ errno set.
+ */
+int xdp_fastpath_attach(struct xdp_fastpath_t *xdp, const char *ifname);
+
+/*
+ Points 'mac' at the VPort endpoint 'addr', or removes it ('addr' NULL).
+ Failures are reported on stderr; the datagrams for 'mac' then simply keep
+ going through userspace, or, for a stale entry, to where it still points.
+ */
+void xdp_fastpath_set(struct xdp_fastpath_t *xdp, uint64_t mac, const struct sockaddr_in *addr);
+
+/*
+ Lists up to 'max' MACs of the map in 'macs', with the CLOCK_MONOTONIC time
+ in nanoseconds the program last forwarded a frame from each in 'seen' (0
+ if never). Returns the number listed.
+ */
+uint32_t xdp_fastpath_walk(const struct xdp_fastpath_t *xdp, uint64_t *macs, uint64_t *seen, uint32_t max);
+
+/*
+ Reads the number of datagrams and bytes the program forwarded so far,
+ summed over all CPUs.
+ */
+void xdp_fastpath_counters(const struct xdp_fastpath_t *xdp, uint64_t *frames, uint64_t *bytes);
+
+#endif